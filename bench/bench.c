@@ -0,0 +1,310 @@
+// Microbenchmarks for the PAM module. This is part of the Google
+// Authenticator project.
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "config.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pwd.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/base32.h"
+#include "../src/hmac.h"
+#include "../src/sha1.h"
+
+#if !defined(PAM_BAD_ITEM)
+// FreeBSD does not know about PAM_BAD_ITEM. And PAM_SYMBOL_ERR is an "enum",
+// we can't test for it at compile-time.
+#define PAM_BAD_ITEM PAM_SYMBOL_ERR
+#endif
+
+// The module is linked into this program with -DTESTING, which exports the
+// same test-only API that the unittest uses.
+extern int pam_sm_authenticate(pam_handle_t *, int, int, const char **);
+extern void set_time(time_t t);
+extern int compute_code(const uint8_t *secret, int secretLen,
+                        unsigned long value);
+extern void reset_error_msg(void);
+
+static const uint8_t secret[] = "2SH3V3GDW7ZNMGYE";
+static char response[16];
+static const char *user;
+
+static int conversation(int num_msg, PAM_CONST struct pam_message **msg,
+                        struct pam_response **resp, void *appdata_ptr) {
+  if (num_msg == 1 && msg[0]->msg_style == PAM_PROMPT_ECHO_OFF) {
+    *resp = malloc(sizeof(struct pam_response));
+    assert(*resp);
+    (*resp)->resp = strdup(response);
+    (*resp)->resp_retcode = 0;
+    return PAM_SUCCESS;
+  }
+  return PAM_CONV_ERR;
+}
+
+int pam_get_user(pam_handle_t *pamh, PAM_CONST char **user_name,
+                 PAM_CONST char *prompt) {
+  *user_name = user;
+  return PAM_SUCCESS;
+}
+
+int pam_get_item(const pam_handle_t *pamh, int item_type,
+                 PAM_CONST void **item) {
+  switch (item_type) {
+    case PAM_SERVICE:
+      *item = "google_authenticator_bench";
+      return PAM_SUCCESS;
+    case PAM_USER:
+      *item = user;
+      return PAM_SUCCESS;
+    case PAM_CONV: {
+      static struct pam_conv conv = { .conv = conversation };
+      *item = &conv;
+      return PAM_SUCCESS;
+    }
+    case PAM_RHOST:
+      *item = "::1";
+      return PAM_SUCCESS;
+    default:
+      return PAM_BAD_ITEM;
+  }
+}
+
+int pam_set_item(pam_handle_t *pamh, int item_type, const void *item) {
+  return PAM_BAD_ITEM;
+}
+
+static enum { JSON, CSV } format = JSON;
+static double min_time = 0.5;
+static int num_results;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long iterations, double elapsed,
+                   long bytes_per_op) {
+  const double ns_per_op = elapsed * 1e9 / iterations;
+  const double ops_per_sec = iterations / elapsed;
+  const double mb_per_sec = bytes_per_op * ops_per_sec / (1024*1024);
+  if (format == CSV) {
+    if (!num_results) {
+      puts("name,iterations,ns_per_op,ops_per_sec,mb_per_sec");
+    }
+    printf("%s,%ld,%.1f,%.1f,%.2f\n", name, iterations, ns_per_op,
+           ops_per_sec, mb_per_sec);
+  } else {
+    printf("%s\n    { \"name\": \"%s\", \"iterations\": %ld, "
+           "\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, "
+           "\"mb_per_sec\": %.2f }",
+           num_results ? "," : "[", name, iterations, ns_per_op,
+           ops_per_sec, mb_per_sec);
+  }
+  ++num_results;
+  fflush(stdout);
+}
+
+// Runs "fn" with a doubling number of iterations, until one run takes at
+// least "min_time" seconds, and reports that run.
+static void run(const char *name, void (*fn)(long iterations),
+                long bytes_per_op) {
+  for (long iterations = 1;; iterations *= 2) {
+    const double start = now();
+    fn(iterations);
+    const double elapsed = now() - start;
+    if (elapsed >= min_time || iterations >= (1L << 40)) {
+      report(name, iterations, elapsed, bytes_per_op);
+      return;
+    }
+  }
+}
+
+// Keeps the compiler from optimizing away the benchmarked computations.
+static volatile unsigned sink;
+
+#define SHA1_BUF_SIZE 65536
+static uint8_t sha1_buf[SHA1_BUF_SIZE];
+
+static void bench_sha1(long iterations) {
+  SHA1_INFO ctx;
+  uint8_t digest[SHA1_DIGEST_LENGTH];
+  for (long i = 0; i < iterations; ++i) {
+    sha1_init(&ctx);
+    sha1_update(&ctx, sha1_buf, sizeof(sha1_buf));
+    sha1_final(&ctx, digest);
+    sink += digest[0];
+  }
+}
+
+static void bench_hmac_sha1(long iterations) {
+  uint8_t msg[8] = { 0 }, hash[SHA1_DIGEST_LENGTH];
+  for (long i = 0; i < iterations; ++i) {
+    msg[7] = i;
+    hmac_sha1(secret, 10, msg, sizeof(msg), hash, sizeof(hash));
+    sink += hash[0];
+  }
+}
+
+static void bench_compute_code(long iterations) {
+  for (long i = 0; i < iterations; ++i) {
+    sink += compute_code(secret, 10, 10000 + i);
+  }
+}
+
+static void bench_base32_decode(long iterations) {
+  uint8_t buf[sizeof(secret)];
+  for (long i = 0; i < iterations; ++i) {
+    sink += base32_decode(secret, buf, sizeof(buf));
+  }
+}
+
+static const char *targv[3];
+static int targc;
+
+static void authenticate(long iterations, int expected) {
+  for (long i = 0; i < iterations; ++i) {
+    const int rc = pam_sm_authenticate(NULL, 0, targc, targv);
+    if (rc != expected) {
+      fprintf(stderr, "Unexpected PAM result %d\n", rc);
+      exit(1);
+    }
+    // Failed attempts are logged. Don't let the log grow without bounds.
+    reset_error_msg();
+  }
+}
+
+static void bench_pam_success(long iterations) {
+  authenticate(iterations, PAM_SUCCESS);
+}
+
+static void bench_pam_skew_search(long iterations) {
+  authenticate(iterations, PAM_AUTH_ERR);
+}
+
+static void usage(void) {
+  puts(
+ "bench [<options>]\n"
+ " -h, --help                     Print this message\n"
+ " -f, --format={JSON,CSV}        Output format\n"
+ " -t, --min-time=SECONDS         Minimum run time of each benchmark");
+}
+
+int main(int argc, char *argv[]) {
+  for (;;) {
+    static const char optstring[] = "+hf:t:";
+    static struct option options[] = {
+      { "help",             0, 0, 'h' },
+      { "format",           1, 0, 'f' },
+      { "min-time",         1, 0, 't' },
+      { 0,                  0, 0,  0  }
+    };
+    const int c = getopt_long(argc, argv, optstring, options, NULL);
+    if (c < 0) {
+      break;
+    }
+    switch (c) {
+    case 'f':
+      if (!strcasecmp(optarg, "json")) {
+        format = JSON;
+      } else if (!strcasecmp(optarg, "csv")) {
+        format = CSV;
+      } else {
+        fprintf(stderr, "Invalid output format \"%s\"\n", optarg);
+        _exit(1);
+      }
+      break;
+    case 't': {
+      char *endptr;
+      min_time = strtod(optarg, &endptr);
+      if (*endptr || min_time <= 0) {
+        fprintf(stderr, "Invalid minimum run time \"%s\"\n", optarg);
+        _exit(1);
+      }
+      break;
+    }
+    case 'h':
+      usage();
+      exit(0);
+    default:
+      usage();
+      _exit(1);
+    }
+  }
+
+  // The module insists on reading the secret file of an existing user.
+  const struct passwd *pw = getpwuid(getuid());
+  if (!pw) {
+    fprintf(stderr, "Cannot look up own user name\n");
+    _exit(1);
+  }
+  user = strdup(pw->pw_name);
+
+  char fn[] = "/tmp/.google_authenticator_bench_XXXXXX";
+  const mode_t orig_umask = umask(S_IRWXG|S_IRWXO);
+  const int fd = mkstemp(fn);
+  umask(orig_umask);
+  assert(fd >= 0);
+  assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+  assert(write(fd, "\n\" TOTP_AUTH\n", 13) == 13);
+  close(fd);
+  char secret_arg[sizeof(fn) + 7];
+  snprintf(secret_arg, sizeof(secret_arg), "secret=%s", fn);
+  targv[targc++] = secret_arg;
+
+  for (int i = 0; i < SHA1_BUF_SIZE; ++i) {
+    sha1_buf[i] = i * 7;
+  }
+
+  run("sha1", bench_sha1, SHA1_BUF_SIZE);
+  run("hmac_sha1", bench_hmac_sha1, 8);
+  run("compute_code", bench_compute_code, 0);
+  run("base32_decode", bench_base32_decode, sizeof(secret)-1);
+
+  // A valid code is found at the center of the window, and does not
+  // rewrite the secret file, as there is neither DISALLOW_REUSE nor
+  // RATE_LIMIT.
+  uint8_t binary_secret[sizeof(secret)];
+  const int binary_secret_len = base32_decode(secret, binary_secret,
+                                              sizeof(binary_secret));
+  set_time(10000*30);
+  snprintf(response, sizeof(response), "%06d",
+           compute_code(binary_secret, binary_secret_len, 10000));
+  run("pam_authenticate", bench_pam_success, 0);
+
+  // An invalid code makes check_timebased_code() scan the entire window,
+  // and then search all candidate time skews.
+  snprintf(response, sizeof(response), "%06d",
+           (compute_code(binary_secret, binary_secret_len, 10000) + 1) %
+           1000000);
+  run("pam_authenticate_skew_search", bench_pam_skew_search, 0);
+
+  if (format == JSON) {
+    puts("\n]");
+  }
+  unlink(fn);
+  return 0;
+}
@@ -0,0 +1,568 @@
+// Load generator for the PAM module. This is part of the Google Authenticator
+// project.
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Every synthetic user has its own secret file, and its own thread that
+// calls pam_sm_authenticate() in a loop, with a mix of correct, wrong,
+// skewed, replayed and rate limited codes. The module runs against a
+// virtual clock, which advances at a configurable multiple of real time.
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/base32.h"
+
+#if !defined(PAM_BAD_ITEM)
+// FreeBSD does not know about PAM_BAD_ITEM. And PAM_SYMBOL_ERR is an "enum",
+// we can't test for it at compile-time.
+#define PAM_BAD_ITEM PAM_SYMBOL_ERR
+#endif
+
+// The module is linked into this program with -DTESTING, which exports the
+// same test-only API that the unittest uses.
+extern int pam_sm_authenticate(pam_handle_t *, int, int, const char **);
+extern void set_time(time_t t);
+extern int compute_code(const uint8_t *secret, int secretLen,
+                        unsigned long value);
+extern const char *get_error_msg(void);
+extern void reset_error_msg(void);
+
+#define STEP_SIZE     30
+#define WINDOW_SIZE   17  // Tolerates slow logins, even with a fast clock
+#define MAX_ARGS      32
+#define SECRET_LEN    10
+
+enum { CORRECT, WRONG, SKEWED, REPLAYED, RATE_LIMITED, NUM_KINDS };
+static const char *kind_names[NUM_KINDS] = {
+  "correct", "wrong", "skewed", "replayed", "rate_limited"
+};
+static int mix[NUM_KINDS] = { 70, 10, 10, 5, 5 };
+
+typedef struct User {
+  pthread_t       thread;
+  char            fn[64];
+  char            limited_fn[64];
+  const char      *argv[MAX_ARGS];
+  const char      *limited_argv[MAX_ARGS];
+  char            secret_arg[72];
+  char            limited_arg[72];
+  uint8_t         secret[SECRET_LEN];
+  struct pam_conv conv;
+  char            response[16];
+  uint64_t        rng;
+  long            last_step;  // Last time step used for a successful login
+  int             last_code;
+  uint64_t        *latencies;  // Nanoseconds per call
+  long            accepted[NUM_KINDS];
+  long            rejected[NUM_KINDS];
+} User;
+
+static const char *user_name;
+static int num_users = 8;
+static long num_requests = 1000;
+static double time_scale = 30000;
+static uint64_t seed = 1;
+static enum { JSON, CSV } format = JSON;
+static const char *module_args[MAX_ARGS];
+static int num_module_args;
+
+static long fsyncs;
+static time_t start_time = 10000 * STEP_SIZE;
+static time_t virtual_time;
+static int done;
+
+// Counts the fsync() calls of the module, which are the main cost of
+// rewriting secret files.
+int fsync(int fd) {
+  static int (*real_fsync)(int);
+  if (!real_fsync) {
+    real_fsync = (int (*)(int))dlsym(RTLD_NEXT, "fsync");
+    assert(real_fsync);
+  }
+  __atomic_fetch_add(&fsyncs, 1, __ATOMIC_RELAXED);
+  return real_fsync(fd);
+}
+
+static int conversation(int num_msg, PAM_CONST struct pam_message **msg,
+                        struct pam_response **resp, void *appdata_ptr) {
+  const User *user = (const User *)appdata_ptr;
+  if (num_msg == 1 && msg[0]->msg_style == PAM_PROMPT_ECHO_OFF) {
+    *resp = malloc(sizeof(struct pam_response));
+    assert(*resp);
+    (*resp)->resp = strdup(user->response);
+    (*resp)->resp_retcode = 0;
+    return PAM_SUCCESS;
+  }
+  return PAM_CONV_ERR;
+}
+
+// Each thread passes its User as the PAM handle.
+int pam_get_user(pam_handle_t *pamh, PAM_CONST char **user,
+                 PAM_CONST char *prompt) {
+  *user = user_name;
+  return PAM_SUCCESS;
+}
+
+int pam_get_item(const pam_handle_t *pamh, int item_type,
+                 PAM_CONST void **item) {
+  switch (item_type) {
+    case PAM_SERVICE:
+      *item = "google_authenticator_loadtest";
+      return PAM_SUCCESS;
+    case PAM_USER:
+      *item = user_name;
+      return PAM_SUCCESS;
+    case PAM_CONV:
+      *item = &((User *)pamh)->conv;
+      return PAM_SUCCESS;
+    case PAM_RHOST:
+      *item = "::1";
+      return PAM_SUCCESS;
+    default:
+      return PAM_BAD_ITEM;
+  }
+}
+
+int pam_set_item(pam_handle_t *pamh, int item_type, const void *item) {
+  return PAM_BAD_ITEM;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t random_number(User *user) {
+  // xorshift64*
+  user->rng ^= user->rng >> 12;
+  user->rng ^= user->rng << 25;
+  user->rng ^= user->rng >> 27;
+  return user->rng * 0x2545F4914F6CDD1Dull;
+}
+
+static void write_file(const char *fn, const char *contents) {
+  const int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+  if (fd < 0 || write(fd, contents, strlen(contents)) != strlen(contents) ||
+      close(fd)) {
+    fprintf(stderr, "Cannot write \"%s\": %s\n", fn, strerror(errno));
+    exit(1);
+  }
+}
+
+static void setup_user(User *user, int id, const char *dir) {
+  user->rng = seed * 0x9E3779B97F4A7C15ull + id + 1;
+  for (int i = 0; i < SECRET_LEN; ++i) {
+    user->secret[i] = random_number(user);
+  }
+  user->last_step = -1;
+  user->last_code = -1;
+  user->conv.conv = conversation;
+  user->conv.appdata_ptr = user;
+  user->latencies = calloc(num_requests, sizeof(*user->latencies));
+  assert(user->latencies);
+
+  // The regular secret file disallows reusing codes, so that replays are
+  // detected. The second one is permanently over its rate limit.
+  // With the default time scale, a time step lasts one millisecond. Users
+  // can then mostly find an unused code in the window.
+  char buf[256];
+  assert(base32_encode(user->secret, SECRET_LEN, (uint8_t *)buf,
+                       sizeof(buf)) > 0);
+  const size_t len = strlen(buf);
+  snprintf(user->fn, sizeof(user->fn), "%s/user%d", dir, id);
+  snprintf(buf + len, sizeof(buf) - len,
+           "\n\" TOTP_AUTH\n\" DISALLOW_REUSE\n\" WINDOW_SIZE %d\n",
+           WINDOW_SIZE);
+  write_file(user->fn, buf);
+  snprintf(user->limited_fn, sizeof(user->limited_fn), "%s/limited%d",
+           dir, id);
+  snprintf(buf + len, sizeof(buf) - len,
+           "\n\" TOTP_AUTH\n\" RATE_LIMIT 1 86400 %ld\n", (long)start_time);
+  write_file(user->limited_fn, buf);
+
+  snprintf(user->secret_arg, sizeof(user->secret_arg), "secret=%s", user->fn);
+  snprintf(user->limited_arg, sizeof(user->limited_arg), "secret=%s",
+           user->limited_fn);
+  user->argv[0] = user->secret_arg;
+  user->limited_argv[0] = user->limited_arg;
+  for (int i = 0; i < num_module_args; ++i) {
+    user->argv[i + 1] = user->limited_argv[i + 1] = module_args[i];
+  }
+}
+
+static void remove_users(User *users, const char *dir) {
+  for (int i = 0; i < num_users; ++i) {
+    unlink(users[i].fn);
+    unlink(users[i].limited_fn);
+    free(users[i].latencies);
+  }
+  free(users);
+  rmdir(dir);
+}
+
+static int pick_kind(User *user) {
+  int total = 0;
+  for (int i = 0; i < NUM_KINDS; ++i) {
+    total += mix[i];
+  }
+  int r = random_number(user) % total;
+  for (int i = 0; i < NUM_KINDS; ++i) {
+    if (r < mix[i]) {
+      return i;
+    }
+    r -= mix[i];
+  }
+  return CORRECT;
+}
+
+static void *user_thread(void *arg) {
+  User *user = (User *)arg;
+  for (long i = 0; i < num_requests; ++i) {
+    const int kind = pick_kind(user);
+    const long step = __atomic_load_n(&virtual_time, __ATOMIC_RELAXED) /
+                      STEP_SIZE;
+    const char **argv = user->argv;
+    long used_step = -1;
+    int code;
+    switch (kind) {
+    case CORRECT:
+      // Like a real token, use the oldest code in the window that has not
+      // been used yet.
+      used_step = step - WINDOW_SIZE/2 > user->last_step
+                  ? step - WINDOW_SIZE/2 : user->last_step + 1;
+      code = compute_code(user->secret, SECRET_LEN, used_step);
+      break;
+    case SKEWED: {
+      // Random skews outside of the window, so that the module does not
+      // adjust TIME_SKEW.
+      const long skew = WINDOW_SIZE + random_number(user) % 100;
+      code = compute_code(user->secret, SECRET_LEN,
+                          random_number(user) & 1 ? step + skew : step - skew);
+      break;
+    }
+    case REPLAYED:
+      if (user->last_code >= 0) {
+        code = user->last_code;
+        break;
+      }
+      // fall through
+    case WRONG:
+    default:
+      code = random_number(user) % 1000000;
+      break;
+    case RATE_LIMITED:
+      argv = user->limited_argv;
+      code = compute_code(user->secret, SECRET_LEN, step);
+      break;
+    }
+    snprintf(user->response, sizeof(user->response), "%06d", code);
+
+    const double start = now();
+    const int rc = pam_sm_authenticate((pam_handle_t *)user, 0,
+                                       num_module_args + 1, argv);
+    user->latencies[i] = (uint64_t)((now() - start) * 1e9);
+    // Failed attempts are logged. Don't let the log grow without bounds.
+    reset_error_msg();
+
+    if (rc == PAM_SUCCESS) {
+      ++user->accepted[kind];
+      if (used_step >= 0) {
+        user->last_step = used_step;
+        user->last_code = code;
+      }
+    } else {
+      ++user->rejected[kind];
+    }
+  }
+  return NULL;
+}
+
+// Advances the virtual clock, until all users are done.
+static void *clock_thread(void *arg) {
+  const double start = now();
+  while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+    const time_t t = start_time + (time_t)((now() - start) * time_scale);
+    set_time(t);
+    __atomic_store_n(&virtual_time, t, __ATOMIC_RELAXED);
+    const struct timespec ts = { 0, 1000 * 1000 };
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *sorted, long n, double p) {
+  long i = (long)(p * n + 0.999999) - 1;
+  if (i < 0) {
+    i = 0;
+  } else if (i >= n) {
+    i = n - 1;
+  }
+  return sorted[i] / 1e3;
+}
+
+static void report(User *users, double elapsed) {
+  const long total = num_users * num_requests;
+  uint64_t *all = malloc(total * sizeof(*all));
+  assert(all);
+  long accepted[NUM_KINDS] = { 0 }, rejected[NUM_KINDS] = { 0 };
+  for (int i = 0; i < num_users; ++i) {
+    memcpy(all + i * num_requests, users[i].latencies,
+           num_requests * sizeof(*all));
+    for (int j = 0; j < NUM_KINDS; ++j) {
+      accepted[j] += users[i].accepted[j];
+      rejected[j] += users[i].rejected[j];
+    }
+  }
+  qsort(all, total, sizeof(*all), compare_latencies);
+  const double p50 = percentile(all, total, 0.5);
+  const double p99 = percentile(all, total, 0.99);
+  const double p999 = percentile(all, total, 0.999);
+  free(all);
+
+  if (format == CSV) {
+    printf("users,requests,seconds,requests_per_sec,p50_us,p99_us,p999_us,"
+           "fsyncs");
+    for (int j = 0; j < NUM_KINDS; ++j) {
+      printf(",%s_accepted,%s_rejected", kind_names[j], kind_names[j]);
+    }
+    printf("\n%d,%ld,%.3f,%.1f,%.1f,%.1f,%.1f,%ld", num_users, total,
+           elapsed, total / elapsed, p50, p99, p999, fsyncs);
+    for (int j = 0; j < NUM_KINDS; ++j) {
+      printf(",%ld,%ld", accepted[j], rejected[j]);
+    }
+    puts("");
+  } else {
+    printf("{ \"users\": %d, \"requests\": %ld, \"seconds\": %.3f, "
+           "\"requests_per_sec\": %.1f,\n  \"p50_us\": %.1f, "
+           "\"p99_us\": %.1f, \"p999_us\": %.1f, \"fsyncs\": %ld,\n"
+           "  \"kinds\": [", num_users, total, elapsed, total / elapsed,
+           p50, p99, p999, fsyncs);
+    for (int j = 0; j < NUM_KINDS; ++j) {
+      printf("%s\n    { \"name\": \"%s\", \"accepted\": %ld, "
+             "\"rejected\": %ld }", j ? "," : "", kind_names[j],
+             accepted[j], rejected[j]);
+    }
+    puts(" ] }");
+  }
+}
+
+// Parses a list of "kind=weight" pairs, e.g. "correct=90,wrong=10". Kinds
+// that are not listed get a weight of zero.
+static int parse_mix(const char *arg) {
+  int weights[NUM_KINDS] = { 0 }, total = 0;
+  for (const char *ptr = arg; *ptr; ) {
+    const char *eq = strchr(ptr, '=');
+    if (!eq) {
+      return -1;
+    }
+    int kind;
+    for (kind = 0; kind < NUM_KINDS; ++kind) {
+      if (strlen(kind_names[kind]) == eq - ptr &&
+          !memcmp(ptr, kind_names[kind], eq - ptr)) {
+        break;
+      }
+    }
+    char *endptr;
+    errno = 0;
+    const long l = strtol(eq + 1, &endptr, 10);
+    if (kind == NUM_KINDS || errno || endptr == eq + 1 || l < 0 ||
+        l > 1000000 || (*endptr && *endptr != ',')) {
+      return -1;
+    }
+    weights[kind] = l;
+    total += l;
+    ptr = *endptr ? endptr + 1 : endptr;
+  }
+  if (!total) {
+    return -1;
+  }
+  memcpy(mix, weights, sizeof(mix));
+  return 0;
+}
+
+static long parse_number(const char *arg, const char *what, long max) {
+  char *endptr;
+  errno = 0;
+  const long l = strtol(arg, &endptr, 10);
+  if (errno || !*arg || *endptr || l < 1 || l > max) {
+    fprintf(stderr, "Invalid %s \"%s\"\n", what, arg);
+    _exit(1);
+  }
+  return l;
+}
+
+static void usage(void) {
+  puts(
+ "loadtest [<options>] [--] [<module options>]\n"
+ " -h, --help                     Print this message\n"
+ " -u, --users=N                  Number of concurrent users (default 8)\n"
+ " -n, --requests=N               Logins per user (default 1000)\n"
+ " -m, --mix=KIND=WEIGHT,...      Relative frequency of correct, wrong,\n"
+ "                                skewed, replayed and rate_limited codes\n"
+ "                                (default correct=70,wrong=10,skewed=10,\n"
+ "                                replayed=5,rate_limited=5)\n"
+ " -s, --time-scale=FACTOR        Speed of the virtual clock (default 30000)\n"
+ " -r, --seed=N                   Seed for secrets and the mix of codes\n"
+ " -f, --format={JSON,CSV}        Output format\n"
+ "\n"
+ "Any other arguments are passed to the PAM module, e.g. \"mmap_secret\".");
+}
+
+int main(int argc, char *argv[]) {
+  for (;;) {
+    static const char optstring[] = "+hu:n:m:s:r:f:";
+    static struct option options[] = {
+      { "help",             0, 0, 'h' },
+      { "users",            1, 0, 'u' },
+      { "requests",         1, 0, 'n' },
+      { "mix",              1, 0, 'm' },
+      { "time-scale",       1, 0, 's' },
+      { "seed",             1, 0, 'r' },
+      { "format",           1, 0, 'f' },
+      { 0,                  0, 0,  0  }
+    };
+    const int c = getopt_long(argc, argv, optstring, options, NULL);
+    if (c < 0) {
+      break;
+    }
+    switch (c) {
+    case 'u':
+      num_users = parse_number(optarg, "number of users", 10000);
+      break;
+    case 'n':
+      num_requests = parse_number(optarg, "number of requests", 100000000);
+      break;
+    case 'm':
+      if (parse_mix(optarg)) {
+        fprintf(stderr, "Invalid mix of codes \"%s\"\n", optarg);
+        _exit(1);
+      }
+      break;
+    case 's': {
+      char *endptr;
+      time_scale = strtod(optarg, &endptr);
+      if (*endptr || time_scale <= 0) {
+        fprintf(stderr, "Invalid time scale \"%s\"\n", optarg);
+        _exit(1);
+      }
+      break;
+    }
+    case 'r':
+      seed = parse_number(optarg, "seed", 0x7FFFFFFF);
+      break;
+    case 'f':
+      if (!strcasecmp(optarg, "json")) {
+        format = JSON;
+      } else if (!strcasecmp(optarg, "csv")) {
+        format = CSV;
+      } else {
+        fprintf(stderr, "Invalid output format \"%s\"\n", optarg);
+        _exit(1);
+      }
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    default:
+      usage();
+      _exit(1);
+    }
+  }
+  for (int i = optind; i < argc; ++i) {
+    if (num_module_args == MAX_ARGS - 2) {
+      fprintf(stderr, "Too many module options\n");
+      _exit(1);
+    }
+    module_args[num_module_args++] = argv[i];
+  }
+
+  // The module insists on reading the secret files of an existing user.
+  const struct passwd *pw = getpwuid(getuid());
+  if (!pw) {
+    fprintf(stderr, "Cannot look up own user name\n");
+    _exit(1);
+  }
+  user_name = strdup(pw->pw_name);
+
+  char dir[] = "/tmp/google_authenticator_loadtest_XXXXXX";
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "mkdtemp(): %s\n", strerror(errno));
+    _exit(1);
+  }
+  User *users = calloc(num_users, sizeof(User));
+  assert(users);
+  for (int i = 0; i < num_users; ++i) {
+    setup_user(users + i, i, dir);
+  }
+
+  set_time(start_time);
+  virtual_time = start_time;
+
+  // Make sure that the module accepts its options, before measuring
+  // anything.
+  User *probe = users;
+  probe->last_step = start_time / STEP_SIZE - WINDOW_SIZE/2;
+  probe->last_code = compute_code(probe->secret, SECRET_LEN, probe->last_step);
+  snprintf(probe->response, sizeof(probe->response), "%06d",
+           probe->last_code);
+  if (pam_sm_authenticate((pam_handle_t *)probe, 0, num_module_args + 1,
+                          probe->argv) != PAM_SUCCESS) {
+    fprintf(stderr, "The module rejects a valid code:\n%s\n",
+            get_error_msg());
+    remove_users(users, dir);
+    _exit(1);
+  }
+  reset_error_msg();
+  pthread_t clock;
+  assert(!pthread_create(&clock, NULL, clock_thread, NULL));
+  const double start = now();
+  for (int i = 0; i < num_users; ++i) {
+    assert(!pthread_create(&users[i].thread, NULL, user_thread, users + i));
+  }
+  for (int i = 0; i < num_users; ++i) {
+    pthread_join(users[i].thread, NULL);
+  }
+  const double elapsed = now() - start;
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  pthread_join(clock, NULL);
+
+  report(users, elapsed);
+  remove_users(users, dir);
+  return 0;
+}
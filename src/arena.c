@@ -0,0 +1,133 @@
+// Arena allocator for per-authentication scratch memory
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "util.h"
+
+#define ARENA_ALIGN          16
+#define ARENA_MAX_CHUNK_SIZE (64*1024)
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t     size;
+};
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define ARENA_CHUNK_HEADER \
+  ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(Arena *arena) {
+  arena->chunks = NULL;
+  arena->ptr    = arena->stack.buf;
+  arena->avail  = sizeof(arena->stack.buf);
+  arena->locked = 0;
+}
+
+void arena_lock(Arena *arena) {
+  arena->locked = 1;
+}
+
+static ArenaChunk *alloc_chunk(const Arena *arena, size_t size) {
+  if (!arena->locked) {
+    return malloc(size);
+  }
+  ArenaChunk *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) {
+    return NULL;
+  }
+  // Without the privilege to lock memory, the chunk is still kept out of
+  // core dumps.
+  mlock(chunk, size);
+#ifdef MADV_DONTDUMP
+  madvise(chunk, size, MADV_DONTDUMP);
+#endif
+  return chunk;
+}
+
+static void free_chunk(const Arena *arena, ArenaChunk *chunk) {
+  if (arena->locked) {
+    munmap(chunk, ARENA_CHUNK_HEADER + chunk->size);
+  } else {
+    free(chunk);
+  }
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  const size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (aligned < size) {
+    return NULL;
+  }
+  if (aligned > arena->avail) {
+    // Each chunk is twice as big as the previous one, so that a growing
+    // number of allocations only needs a logarithmic number of chunks.
+    size_t chunk_size = arena->chunks ? 2*arena->chunks->size
+                                      : 2*ARENA_STACK_SIZE;
+    if (chunk_size > ARENA_MAX_CHUNK_SIZE) {
+      chunk_size = ARENA_MAX_CHUNK_SIZE;
+    }
+    if (chunk_size < aligned) {
+      chunk_size = aligned;
+    }
+    if (chunk_size > (size_t)-1 - ARENA_CHUNK_HEADER) {
+      return NULL;
+    }
+    ArenaChunk *chunk = alloc_chunk(arena, ARENA_CHUNK_HEADER + chunk_size);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->next   = arena->chunks;
+    chunk->size   = chunk_size;
+    arena->chunks = chunk;
+    arena->ptr    = (char *)chunk + ARENA_CHUNK_HEADER;
+    arena->avail  = chunk_size;
+  }
+  void *ptr = arena->ptr;
+  arena->ptr   += aligned;
+  arena->avail -= aligned;
+  return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  if (copy) {
+    memcpy(copy, str, len);
+    copy[len] = '\000';
+  }
+  return copy;
+}
+
+void arena_wipe(Arena *arena) {
+  while (arena->chunks) {
+    ArenaChunk *chunk = arena->chunks;
+    arena->chunks = chunk->next;
+    explicit_bzero((char *)chunk + ARENA_CHUNK_HEADER, chunk->size);
+    free_chunk(arena, chunk);
+  }
+  explicit_bzero(arena->stack.buf, sizeof(arena->stack.buf));
+  const int locked = arena->locked;
+  arena_init(arena);
+  arena->locked = locked;
+}
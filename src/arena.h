@@ -0,0 +1,62 @@
+// Arena allocator for per-authentication scratch memory
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_STACK_SIZE 4096
+
+typedef struct ArenaChunk ArenaChunk;
+
+// Allocations are carved out of a buffer inside of the arena itself, which
+// normally lives on the caller's stack. Once that is exhausted, further
+// allocations come from heap chunks. Memory is never released
+// individually. Instead, arena_wipe() erases and releases all of it at once.
+typedef struct Arena {
+  ArenaChunk *chunks;
+  char       *ptr;
+  size_t     avail;
+  int        locked;
+  union {
+    long double align_ld;
+    void        *align_ptr;
+    uint64_t    align_u64;
+    char        buf[ARENA_STACK_SIZE];
+  } stack;
+} Arena;
+
+void arena_init(Arena *arena) __attribute__((visibility("hidden")));
+
+// Makes all further heap chunks come from private mappings, which are
+// locked into memory, if the limits allow, and excluded from core dumps.
+void arena_lock(Arena *arena) __attribute__((visibility("hidden")));
+
+// Returns NULL, if we ran out of memory.
+void *arena_alloc(Arena *arena, size_t size)
+  __attribute__((visibility("hidden")));
+
+// Copies "len" bytes of "str" and adds a NUL terminator.
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+  __attribute__((visibility("hidden")));
+
+// Erases all memory that was handed out, frees the heap chunks, and leaves
+// the arena ready for reuse.
+void arena_wipe(Arena *arena) __attribute__((visibility("hidden")));
+
+#endif /* _ARENA_H_ */
@@ -19,36 +19,68 @@
 
 #include "base32.h"
 
+#define SK 0x40  // White-space and hyphens are skipped
+#define XX 0x80  // Invalid character
+
+// Maps every input character to its base32 digit. Commonly mistyped
+// characters ('0', '1' and '8') decode like the letters they resemble.
+static const uint8_t base32_digits[256] = {
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, SK, SK, XX, XX, SK, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  SK, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, SK, XX, XX,
+  14, 11, 26, 27, 28, 29, 30, 31,  1, XX, XX, XX, XX, XX, XX, XX,
+  XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+  XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX
+};
+
+#undef SK
+#undef XX
+
+static const char base32_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
 int base32_decode(const uint8_t *encoded, uint8_t *result, int bufSize) {
-  int buffer = 0;
+  unsigned int buffer = 0;
   int bitsLeft = 0;
   int count = 0;
-  for (const uint8_t *ptr = encoded; count < bufSize && *ptr; ++ptr) {
-    uint8_t ch = *ptr;
-    if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '-') {
-      continue;
-    }
-    buffer <<= 5;
-
-    // Deal with commonly mistyped characters
-    if (ch == '0') {
-      ch = 'O';
-    } else if (ch == '1') {
-      ch = 'L';
-    } else if (ch == '8') {
-      ch = 'B';
+  for (const uint8_t *ptr = encoded; count < bufSize && *ptr; ) {
+    // Whenever we are at a byte boundary, try to decode a whole block of
+    // eight digits into five bytes at once. The block ends early at the
+    // first character that is not a digit, including the terminating NUL,
+    // and is then decoded one character at a time below.
+    if (!bitsLeft && bufSize - count >= 5) {
+      uint64_t block = 0;
+      int i = 0;
+      for (uint8_t digit; i < 8 && (digit = base32_digits[ptr[i]]) < 32; ++i) {
+        block = block << 5 | digit;
+      }
+      if (i == 8) {
+        result[count++] = block >> 32;
+        result[count++] = block >> 24;
+        result[count++] = block >> 16;
+        result[count++] = block >> 8;
+        result[count++] = block;
+        ptr += 8;
+        continue;
+      }
     }
 
-    // Look up one base32 digit
-    if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z')) {
-      ch = (ch & 0x1F) - 1;
-    } else if (ch >= '2' && ch <= '7') {
-      ch -= '2' - 26;
-    } else {
+    const uint8_t digit = base32_digits[*ptr++];
+    if (digit & 0x40) {
+      continue;
+    } else if (digit & 0x80) {
       return -1;
     }
-
-    buffer |= ch;
+    buffer = buffer << 5 | digit;
     bitsLeft += 5;
     if (bitsLeft >= 8) {
       result[count++] = buffer >> (bitsLeft - 8);
@@ -67,9 +99,24 @@ int base32_encode(const uint8_t *data, int length, uint8_t *result,
     return -1;
   }
   int count = 0;
-  if (length > 0) {
-    int buffer = data[0];
-    int next = 1;
+
+  // Every five bytes encode to eight characters, so complete blocks can be
+  // converted without carrying any bits over to the next block.
+  int next = 0;
+  for (; length - next >= 5 && bufSize - count >= 8; next += 5) {
+    uint64_t block = 0;
+    for (int i = 0; i < 5; ++i) {
+      block = block << 8 | data[next + i];
+    }
+    for (int i = 8; i--; block >>= 5) {
+      result[count + i] = base32_alphabet[block & 0x1F];
+    }
+    count += 8;
+  }
+
+  // Encode the remaining bytes, padding the last digit with zero bits.
+  if (next < length) {
+    unsigned int buffer = data[next++];
     int bitsLeft = 8;
     while (count < bufSize && (bitsLeft > 0 || next < length)) {
       if (bitsLeft < 5) {
@@ -85,7 +132,7 @@ int base32_encode(const uint8_t *data, int length, uint8_t *result,
       }
       int index = 0x1F & (buffer >> (bitsLeft - 5));
       bitsLeft -= 5;
-      result[count++] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"[index];
+      result[count++] = base32_alphabet[index];
     }
   }
   if (count < bufSize) {
@@ -21,14 +21,22 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "base32.h"
 
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 /*
  * Convert arbitrary input from a file to base-32 encoded output on stdout.
  * Decode base-32 input from a file or from the command line to arbitrary
@@ -37,6 +45,11 @@
  * ~/google-authenticator/libpam/base32 e $(awk '{ print $2 }' < gauth.seed | xxd -r -p)
  */
 
+#define DEFAULT_BUFSIZE (1024 * 1024)
+#define MIN_BUFSIZE     16
+#define MAX_BUFSIZE     (256 * 1024 * 1024)
+#define MAX_THREADS     64
+
 enum modes {
   ENCODE_NONE = 0,
   ENCODE_FILE = 1,
@@ -44,6 +57,18 @@ enum modes {
   DECODE_STRING = 3,
 };
 
+/* A piece of the input that gets converted on its own. Decoder input must
+ * be NUL terminated.
+ */
+typedef struct Chunk {
+  int mode;
+  const uint8_t *input;
+  size_t len;
+  uint8_t *result;
+  size_t result_avail;
+  int retval;
+} Chunk;
+
 static void usage(const char *argv0, int exitval, char *errmsg) __attribute__((noreturn));
 static void usage(const char *argv0, int exitval, char *errmsg)
 {
@@ -53,36 +78,364 @@ static void usage(const char *argv0, int exitval, char *errmsg)
     f = stderr;
   }
 
-  fprintf(f, "Usage: %s -e [<file>]\n", argv0);
-  fprintf(f, "Usage: %s -d [<file>]\n", argv0);
+  fprintf(f, "Usage: %s -e [-b <bytes>] [-j <threads>] [<file>]\n", argv0);
+  fprintf(f, "Usage: %s -d [-b <bytes>] [<file>]\n", argv0);
   fprintf(f, "Usage: %s -D <value>\n", argv0);
   fprintf(f, "  Emits <value> encoded in/decoded from base-32 on stdout.\n");
   fprintf(f, "  When encoding, the file should contain raw binary data.\n");
   fprintf(f, "   If no filename is specified, it reads from stdin.\n");
+  fprintf(f, "  Files are streamed through a buffer of <bytes> bytes (default: %d).\n",
+          DEFAULT_BUFSIZE);
+  fprintf(f, "  Regular files are mapped into memory instead of being read.\n");
+  fprintf(f, "  Encoding converts up to <threads> buffers in parallel (default: 1).\n");
   fprintf(f, "  All output is written to stdout.\n");
 
   exit(exitval);
 }
 
+/* Write all of the buffers to the given file descriptor, even across
+ * multiple short writes. The iovec array is used up in the process.
+ * If writev() fails, exit with an error.
+ */
+static void full_writev(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err(1, "Failed to write to stdout");
+    }
+    for (; iovcnt > 0 && (size_t)written >= iov->iov_len; --iovcnt, ++iov) {
+      written -= iov->iov_len;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
 /* Write the full contents of buf to the given file descriptor,
  * even across multiple short writes.
  * If write() fails, exit with an error.
  */
 static void full_write(int fd, uint8_t *buf, size_t remaining)
 {
-  ssize_t offset, written;
-  for (offset = 0; remaining != 0; remaining -= written, offset += written) {
-    if ((written = write(fd, buf + offset, remaining)) < 0) {
-      err(1, "Failed to write to stdout");
+  struct iovec iov = { buf, remaining };
+  full_writev(fd, &iov, 1);
+}
+
+/* Fill buf with up to len bytes, and only return less at the end of input.
+ * If read() fails, exit with an error.
+ */
+static size_t full_read(int fd, const char *name, uint8_t *buf, size_t len)
+{
+  size_t have = 0;
+  while (have < len) {
+    const ssize_t amt_read = read(fd, buf + have, len - have);
+    if (amt_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err(1, "Failed to read from %s: %s\n", name, strerror(errno));
+    } else if (amt_read == 0) {
+      break;
+    }
+    have += amt_read;
+  }
+  return have;
+}
+
+/* Allocate a page aligned buffer, or exit with an error.
+ */
+static uint8_t *alloc_buffer(size_t size)
+{
+  void *buf;
+  if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), size)) {
+    err(1, "Failed to allocate memory");
+  }
+  return buf;
+}
+
+/* Map a regular file into memory, followed by at least one zero byte, so
+ * that its contents are NUL terminated. The mapping is private and
+ * writable, which lets the decoder terminate chunks in place.
+ * Return NULL if the input cannot be mapped, and has to be read instead.
+ */
+static uint8_t *map_input(int fd, size_t *size, size_t *map_size)
+{
+  struct stat sb;
+  if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) || sb.st_size <= 0 ||
+      (unsigned long long)sb.st_size >= (size_t)-1 / 2) {
+    return NULL;
+  }
+  const size_t page = sysconf(_SC_PAGESIZE);
+  *size = sb.st_size;
+  *map_size = (*size / page + 1) * page;
+  uint8_t *map = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  if (mmap(map, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    munmap(map, *map_size);
+    return NULL;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(map, *map_size, MADV_SEQUENTIAL);
+#endif
+  return map;
+}
+
+static void *convert_chunk(void *arg)
+{
+  Chunk *chunk = arg;
+  if (chunk->mode == ENCODE_FILE) {
+    chunk->retval = base32_encode(chunk->input, chunk->len, chunk->result,
+                                  chunk->result_avail);
+  } else {
+    chunk->retval = base32_decode(chunk->input, chunk->result,
+                                  chunk->result_avail);
+  }
+  return NULL;
+}
+
+/* Convert the chunks, each one on its own thread, and write all of the
+ * results to stdout in order with a single writev() call where possible.
+ */
+static void convert_chunks(Chunk *chunks, int count)
+{
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS] = { 0 };
+  for (int i = 1; i < count; ++i) {
+    started[i] = !pthread_create(threads + i, NULL, convert_chunk, chunks + i);
+    if (!started[i]) {
+      // Fall back to doing the work on this thread.
+      convert_chunk(chunks + i);
     }
   }
+  convert_chunk(chunks);
+
+  struct iovec iov[MAX_THREADS];
+  for (int i = 0; i < count; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    if (chunks[i].retval < 0) {
+      fprintf(stderr, "%s failed.  Input too long?\n", (chunks[i].mode == ENCODE_FILE) ? "base32_encode" : "base32_decode");
+      exit(1);
+    }
+    iov[i].iov_base = chunks[i].result;
+    iov[i].iov_len = chunks[i].retval;
+  }
+  full_writev(STDOUT_FILENO, iov, count);
+}
+
+/* Characters that base32_decode() ignores.
+ */
+static int is_skipped(uint8_t ch)
+{
+  return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '-';
+}
+
+/* Return the length of the longest prefix of buf that contains a multiple
+ * of eight base-32 digits, and that can thus be decoded on its own.
+ */
+static size_t decode_split(const uint8_t *buf, size_t len)
+{
+  size_t digits = 0;
+  for (size_t i = 0; i < len; ++i) {
+    digits += !is_skipped(buf[i]);
+  }
+  size_t keep = digits % 8;
+  while (keep) {
+    keep -= !is_skipped(buf[--len]);
+  }
+  return len;
+}
+
+/* Encode the input in chunks of a multiple of five bytes, so that no
+ * chunk needs any bits from its neighbours. Up to "threads" chunks are
+ * encoded in parallel, straight out of the file mapping if there is one.
+ */
+static void encode_stream(int fd, const char *name, size_t bufsize,
+                          int threads)
+{
+  const size_t step = bufsize - bufsize % 5;
+  const size_t batch_size = step * threads;
+  const size_t result_avail = step / 5 * 8 + 1;
+  if (batch_size / threads != step) {
+    errx(1, "Buffer size too large for %d threads", threads);
+  }
+
+  size_t size = 0, map_size = 0;
+  uint8_t *map = map_input(fd, &size, &map_size);
+  uint8_t *input = map ? NULL : alloc_buffer(batch_size);
+  uint8_t *result = alloc_buffer(result_avail * threads);
+  Chunk chunks[MAX_THREADS];
+  for (size_t pos = 0;;) {
+    const uint8_t *batch = input;
+    size_t have;
+    if (map) {
+      batch = map + pos;
+      have = size - pos < batch_size ? size - pos : batch_size;
+      pos += have;
+    } else {
+      have = full_read(fd, name, input, batch_size);
+    }
+    if (!have) {
+      break;
+    }
+    int count = 0;
+    for (size_t offset = 0; offset < have; offset += step, ++count) {
+      chunks[count] = (Chunk){
+        .mode = ENCODE_FILE,
+        .input = batch + offset,
+        .len = have - offset < step ? have - offset : step,
+        .result = result + count * result_avail,
+        .result_avail = result_avail,
+      };
+    }
+    convert_chunks(chunks, count);
+    if (have < batch_size) {
+      break;
+    }
+  }
+  if (map) {
+    munmap(map, map_size);
+  }
+  free(input);
+  free(result);
+  printf("\n");
+}
+
+/* Decode a mapped file in chunks that hold a multiple of eight digits. A
+ * chunk normally covers one buffer's worth of input, but grows if white-space
+ * leaves fewer than eight digits in it. Chunks are NUL terminated by
+ * briefly overwriting the first byte of the next chunk.
+ */
+static void decode_mapped(uint8_t *map, size_t size, size_t bufsize)
+{
+  uint8_t *result = NULL;
+  size_t result_avail = 0;
+  for (size_t pos = 0; pos < size; ) {
+    size_t len = size - pos;
+    for (size_t window = bufsize; window < size - pos; window *= 2) {
+      if ((len = decode_split(map + pos, window)) != 0) {
+        break;
+      }
+      len = size - pos;
+    }
+    if ((len + 7) / 8 * 5 + 1 > result_avail) {
+      if ((len + 7) / 8 * 5 + 1 > INT_MAX) {
+        errx(1, "Too much white-space between base-32 digits");
+      }
+      free(result);
+      result_avail = (len + 7) / 8 * 5 + 1;
+      result = alloc_buffer(result_avail);
+    }
+
+    uint8_t *end = map + pos + len;
+    const uint8_t saved = *end;
+    *end = '\0';
+    Chunk chunk = {
+      .mode = DECODE_FILE,
+      .input = map + pos,
+      .len = len,
+      .result = result,
+      .result_avail = result_avail,
+    };
+    convert_chunks(&chunk, 1);
+    *end = saved;
+    pos += len;
+  }
+  free(result);
+}
+
+static void decode_stream(int fd, const char *name, size_t bufsize)
+{
+  size_t size, map_size;
+  uint8_t *map = map_input(fd, &size, &map_size);
+  if (map) {
+    decode_mapped(map, size, bufsize);
+    munmap(map, map_size);
+    return;
+  }
+
+  // Decoding: up to 5 bytes out for every 8 input.
+  const size_t result_avail = (bufsize + 7) / 8 * 5 + 1;
+  uint8_t *input = alloc_buffer(bufsize + 1);
+  uint8_t *result = alloc_buffer(result_avail);
+
+  // Stream the input through a fixed size buffer. Only complete blocks of
+  // eight digits are converted, and anything left over is carried over to
+  // the next chunk. This keeps the output identical to converting the whole
+  // file at once, no matter how reads get split up.
+  size_t have = 0;
+  for (int eof = 0; !eof; ) {
+    const size_t amt_read = full_read(fd, name, input + have, bufsize - have);
+    have += amt_read;
+    eof = have < bufsize;
+
+    const size_t use = eof ? have : decode_split(input, have);
+    const uint8_t saved = input[use];
+    input[use] = '\0';
+    Chunk chunk = {
+      .mode = DECODE_FILE,
+      .input = input,
+      .len = use,
+      .result = result,
+      .result_avail = result_avail,
+    };
+    convert_chunks(&chunk, 1);
+    input[use] = saved;
+
+    // Decoding skips white-space, so only the leftover digits need to be
+    // kept. That leaves room for at least one more block in the buffer.
+    size_t carry = 0;
+    for (size_t i = use; i < have; ++i) {
+      if (!is_skipped(input[i])) {
+        input[carry++] = input[i];
+      }
+    }
+    have = carry;
+  }
+  free(input);
+  free(result);
 }
 
 int main(int argc, char *argv[]) {
   int c;
   int mode = ENCODE_NONE;
-  while ((c = getopt(argc, argv, "edDh")) != -1) {
+  size_t bufsize = DEFAULT_BUFSIZE;
+  int threads = 1;
+  while ((c = getopt(argc, argv, "edDb:j:h")) != -1) {
     switch (c) {
+      case 'b': {
+        char *endptr;
+        errno = 0;
+        const unsigned long l = strtoul(optarg, &endptr, 10);
+        if (errno || endptr == optarg || *endptr ||
+            l < MIN_BUFSIZE || l > MAX_BUFSIZE) {
+          usage(argv[0], 1, "Invalid buffer size");
+        }
+        bufsize = l;
+        break;
+      }
+      case 'j': {
+        char *endptr;
+        errno = 0;
+        const unsigned long l = strtoul(optarg, &endptr, 10);
+        if (errno || endptr == optarg || *endptr ||
+            l < 1 || l > MAX_THREADS) {
+          usage(argv[0], 1, "Invalid number of threads");
+        }
+        threads = l;
+        break;
+      }
       case 'e':
         mode = ENCODE_FILE;
         break;
@@ -116,58 +469,14 @@ int main(int argc, char *argv[]) {
     if (d < 0) {
       err(1, "Failed to open %s: %s\n", binfile, strerror(errno));
     }
-    struct stat st;
-    memset(&st, 0, sizeof(st));
-    if (fstat(d, &st) < 0 || st.st_size == 0) {
-      st.st_size = 5 * 1024;  // multiple of 5 to avoid internal padding
-      // AND multiple of 8 to ensure we feed
-      //  valid data to base32_decode().
-    }
-    const size_t bufsize = st.st_size + 1;
-    if (bufsize < st.st_size) {
-      err(1, "Integer overflow in input size");
-    }
-    uint8_t *input = malloc(bufsize);
-    if (!input) {
-      err(1, "Failed to allocate memory");
-    }
-    int amt_read;
-    const int amt_to_read = st.st_size;
-    errno = 0;
-    while ((amt_read = read(d, input, amt_to_read)) > 0 || errno == EINTR) {
-      if (errno == EINTR) {
-        continue;
-      }
-
-      // Encoding: 8 bytes out for every 5 input, plus up to 6 padding, and nul
-      // Decoding: up to 5 bytes out for every 8 input.
-      const int result_avail = (mode == ENCODE_FILE) ?
-                               ((amt_read + 4) / 5 * 8 + 6 + 1) :
-                               ((amt_read + 7) / 8 * 5) ;
-      uint8_t *result = malloc(result_avail);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(d, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-      input[amt_read] = '\0';
-
-      if (mode == ENCODE_FILE) {
-        retval = base32_encode(input, amt_read, result, result_avail);
-      } else {
-        retval = base32_decode(input, result, result_avail);
-      }
-      if (retval < 0) {
-        fprintf(stderr, "%s failed.  Input too long?\n", (mode == ENCODE_FILE) ? "base32_encode" : "base32_decode");
-        exit(1);
-      }
-      //printf("%s", result);
-      full_write(STDOUT_FILENO, result, retval);
-      fflush(stdout);
-      free(result);
-    }
-    free(input);
-    if (amt_read < 0) {
-      err(1, "Failed to read from %s: %s\n", binfile, strerror(errno));
-    }
     if (mode == ENCODE_FILE) {
-      printf("\n");
+      encode_stream(d, binfile, bufsize, threads);
+    } else {
+      decode_stream(d, binfile, bufsize);
     }
   } else { // mode == DECODE_STRING
     if (argc - optind < 1) {
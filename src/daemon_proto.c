@@ -0,0 +1,97 @@
+// Wire protocol between the PAM module and google-authenticatord
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "daemon_proto.h"
+#include "util.h"
+
+void daemon_msg_init(DaemonMsg *msg, const char *type) {
+  msg->len = 0;
+  daemon_msg_add(msg, type);
+}
+
+int daemon_msg_add(DaemonMsg *msg, const char *str) {
+  const size_t len = strlen(str) + 1;
+  if (len > sizeof(msg->buf) - msg->len) {
+    return -1;
+  }
+  memcpy(msg->buf + msg->len, str, len);
+  msg->len += len;
+  return 0;
+}
+
+int daemon_msg_add_opt(DaemonMsg *msg, const char *str) {
+  if (!str) {
+    return daemon_msg_add(msg, "-");
+  }
+  const size_t len = strlen(str) + 1;
+  if (len + 1 > sizeof(msg->buf) - msg->len) {
+    return -1;
+  }
+  msg->buf[msg->len] = '+';
+  memcpy(msg->buf + msg->len + 1, str, len);
+  msg->len += len + 1;
+  return 0;
+}
+
+const char *daemon_msg_opt(const char *field) {
+  return *field == '+' ? field + 1 : NULL;
+}
+
+int daemon_msg_send(int fd, const DaemonMsg *msg) {
+  for (;;) {
+    const ssize_t rc = send(fd, msg->buf, msg->len, MSG_NOSIGNAL);
+    if (rc == (ssize_t)msg->len) {
+      return 0;
+    }
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    return -1;
+  }
+}
+
+int daemon_msg_recv(int fd, DaemonMsg *msg, const char **fields,
+                    int max_fields) {
+  ssize_t rc;
+  do {
+    rc = recv(fd, msg->buf, sizeof(msg->buf), 0);
+  } while (rc < 0 && errno == EINTR);
+  // Every string, including the last one, must be NUL terminated.
+  if (rc <= 0 || msg->buf[rc - 1]) {
+    return -1;
+  }
+  msg->len = rc;
+  int n = 0;
+  for (size_t i = 0; i < msg->len; i += strlen(msg->buf + i) + 1) {
+    if (n == max_fields) {
+      return -1;
+    }
+    fields[n++] = msg->buf + i;
+  }
+  return n;
+}
+
+void daemon_msg_clear(DaemonMsg *msg) {
+  explicit_bzero(msg->buf, sizeof(msg->buf));
+  msg->len = 0;
+}
@@ -0,0 +1,75 @@
+// Wire protocol between the PAM module and google-authenticatord
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _DAEMON_PROTO_H_
+#define _DAEMON_PROTO_H_
+
+#include <stddef.h>
+
+// The module and the daemon talk over a SOCK_SEQPACKET Unix socket. Each
+// message is a single packet holding a sequence of NUL terminated strings.
+// The first string names the message type:
+//
+//   module -> daemon  "auth" user service rhost authtok argv...
+//   daemon -> module  "conv" style prompt
+//   module -> daemon  "resp" answer
+//   daemon -> module  "done" rc authtok
+//
+// The daemon runs the regular authentication logic, and relays every PAM
+// conversation through the module. Optional strings are prefixed with '+',
+// and a missing value is sent as "-".
+#define DAEMON_MSG_AUTH      "auth"
+#define DAEMON_MSG_CONV      "conv"
+#define DAEMON_MSG_RESP      "resp"
+#define DAEMON_MSG_DONE      "done"
+
+#define DAEMON_MSG_MAX_SIZE  8192
+#define DAEMON_MSG_MAX_ARGS  64
+
+typedef struct DaemonMsg {
+  size_t len;
+  char   buf[DAEMON_MSG_MAX_SIZE];
+} DaemonMsg;
+
+void daemon_msg_init(DaemonMsg *msg, const char *type)
+  __attribute__((visibility("hidden")));
+
+// Appends a string. Returns 0 on success, or -1 if the message is full.
+int daemon_msg_add(DaemonMsg *msg, const char *str)
+  __attribute__((visibility("hidden")));
+
+// Appends a string that can be NULL.
+int daemon_msg_add_opt(DaemonMsg *msg, const char *str)
+  __attribute__((visibility("hidden")));
+
+// Decodes a string that was added with daemon_msg_add_opt().
+const char *daemon_msg_opt(const char *field)
+  __attribute__((visibility("hidden")));
+
+// Returns 0 on success, or -1 on error.
+int daemon_msg_send(int fd, const DaemonMsg *msg)
+  __attribute__((visibility("hidden")));
+
+// Receives a message, and splits it into at most "max_fields" strings that
+// point into "msg". Returns the number of strings, or -1 on error.
+int daemon_msg_recv(int fd, DaemonMsg *msg, const char **fields,
+                    int max_fields)
+  __attribute__((visibility("hidden")));
+
+// Erases the message, as it can hold passwords and verification codes.
+void daemon_msg_clear(DaemonMsg *msg) __attribute__((visibility("hidden")));
+
+#endif /* _DAEMON_PROTO_H_ */
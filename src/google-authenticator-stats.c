@@ -0,0 +1,133 @@
+// Exports the counters and latency histograms that the PAM module records
+// with "stats=shm:/path/to/table" in the Prometheus text format.
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define METRIC_PREFIX "google_authenticator_"
+
+static uint64_t load(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void print_metrics(const StatsTable *table) {
+  printf("# HELP " METRIC_PREFIX "outcomes_total"
+         " Verification outcomes.\n"
+         "# TYPE " METRIC_PREFIX "outcomes_total counter\n");
+  for (int i = 0; i < STATS_NUM_OUTCOMES; ++i) {
+    printf(METRIC_PREFIX "outcomes_total{outcome=\"%s\"} %llu\n",
+           stats_outcome_names[i],
+           (unsigned long long)load(table->outcomes + i));
+  }
+
+  static const uint32_t bounds[] = STATS_BUCKET_BOUNDS;
+  printf("# HELP " METRIC_PREFIX "phase_duration_seconds"
+         " Time spent in each phase of an authentication.\n"
+         "# TYPE " METRIC_PREFIX "phase_duration_seconds histogram\n");
+  for (int i = 0; i < STATS_NUM_PHASES; ++i) {
+    const StatsHistogram *histogram = table->phases + i;
+    const char *phase = stats_phase_names[i];
+
+    // Prometheus buckets are cumulative. The total of all buckets is used
+    // as the count, so that the "+Inf" bucket always matches it.
+    uint64_t total = 0;
+    for (int j = 0; j < STATS_NUM_BUCKETS; ++j) {
+      total += load(histogram->buckets + j);
+      if (j < STATS_NUM_BUCKETS - 1) {
+        printf(METRIC_PREFIX "phase_duration_seconds_bucket"
+               "{phase=\"%s\",le=\"%g\"} %llu\n",
+               phase, bounds[j] / 1e6, (unsigned long long)total);
+      } else {
+        printf(METRIC_PREFIX "phase_duration_seconds_bucket"
+               "{phase=\"%s\",le=\"+Inf\"} %llu\n",
+               phase, (unsigned long long)total);
+      }
+    }
+    printf(METRIC_PREFIX "phase_duration_seconds_sum{phase=\"%s\"} %.9f\n",
+           phase, load(&histogram->sum_ns) / 1e9);
+    printf(METRIC_PREFIX "phase_duration_seconds_count{phase=\"%s\"} %llu\n",
+           phase, (unsigned long long)total);
+  }
+}
+
+static void usage(void) {
+  puts(
+ "google-authenticator-stats [<options>] <table>\n"
+ " -h, --help                     Print this message\n"
+ "     --http                     Prefix the output with an HTTP response\n"
+ "                                header, e.g. when running from inetd");
+}
+
+int main(int argc, char *argv[]) {
+  int http = 0;
+  for (;;) {
+    static const char optstring[] = "+h";
+    static struct option options[] = {
+      { "help",             0, 0, 'h' },
+      { "http",             0, 0, 'H' },
+      { 0,                  0, 0,  0  }
+    };
+    const int c = getopt_long(argc, argv, optstring, options, NULL);
+    if (c < 0) {
+      break;
+    }
+    switch (c) {
+    case 'H':
+      http = 1;
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    default:
+      usage();
+      _exit(1);
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    _exit(1);
+  }
+
+  // Accept the same "shm:" prefix as the module option.
+  const char *path = argv[optind];
+  if (!strncmp(path, "shm:/", 5)) {
+    path += 4;
+  }
+  Stats stats;
+  const int err = stats_open(&stats, path, 0);
+  if (err) {
+    if (http) {
+      printf("HTTP/1.0 503 Service Unavailable\r\n\r\n");
+    }
+    fprintf(stderr, "Failed to open \"%s\": %s\n", path, strerror(err));
+    _exit(1);
+  }
+  if (http) {
+    printf("HTTP/1.0 200 OK\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+  }
+  print_metrics(stats.table);
+  stats_close(&stats);
+  return 0;
+}
@@ -0,0 +1,151 @@
+// Manages the table that the PAM module reads with
+// "secret_store=mmap:/path/to/table".
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "secret_store.h"
+#include "util.h"
+
+static void usage(void) {
+  puts(
+ "google-authenticator-store [<options>] <table> <command>\n"
+ " -h, --help                     Print this message\n"
+ "\n"
+ "Commands:\n"
+ "  create <records>              Create an empty table for this many users\n"
+ "  import <user>                 Store a secret file, read from stdin\n"
+ "  export <user>                 Print the state of a user\n"
+ "  delete <user>                 Remove a user from the table\n"
+ "  list                          Print the names of all users");
+}
+
+static void print_user(const char *user, void *arg) {
+  (void)arg;
+  puts(user);
+}
+
+static void fail(const char *what, const char *path, int err) {
+  fprintf(stderr, "Failed to %s \"%s\": %s\n", what, path, strerror(err));
+  _exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  for (;;) {
+    static const char optstring[] = "+h";
+    static struct option options[] = {
+      { "help",             0, 0, 'h' },
+      { 0,                  0, 0,  0  }
+    };
+    const int c = getopt_long(argc, argv, optstring, options, NULL);
+    if (c < 0) {
+      break;
+    }
+    switch (c) {
+    case 'h':
+      usage();
+      exit(0);
+    default:
+      usage();
+      _exit(1);
+    }
+  }
+  if (argc - optind < 2) {
+    usage();
+    _exit(1);
+  }
+
+  // Accept the same "mmap:" prefix as the module option.
+  const char *path = argv[optind];
+  if (!strncmp(path, "mmap:/", 6)) {
+    path += 5;
+  }
+  const char *cmd = argv[optind + 1];
+  const char *arg = argv[optind + 2];
+  const int nargs = argc - optind - 2;
+  if (nargs != (strcmp(cmd, "list") ? 1 : 0)) {
+    usage();
+    _exit(1);
+  }
+
+  if (!strcmp(cmd, "create")) {
+    char *endptr;
+    errno = 0;
+    const long records = strtol(arg, &endptr, 10);
+    if (errno || *endptr || records < 1 ||
+        records > SECRET_STORE_MAX_RECORDS) {
+      fprintf(stderr, "The number of records must be between 1 and %d\n",
+              SECRET_STORE_MAX_RECORDS);
+      _exit(1);
+    }
+    const int err = secret_store_create(path, (uint32_t)records);
+    if (err) {
+      fail("create", path, err);
+    }
+    return 0;
+  }
+
+  SecretStore store;
+  int err = secret_store_open(&store, path);
+  if (err) {
+    fail("open", path, err);
+  }
+  char buf[SECRET_STORE_DATA_SIZE + 2];
+  if (!strcmp(cmd, "import")) {
+    const size_t len = fread(buf, 1, sizeof(buf) - 1, stdin);
+    buf[len] = '\000';
+    if (ferror(stdin)) {
+      err = EIO;
+    } else if (len > SECRET_STORE_DATA_SIZE) {
+      err = E2BIG;
+    } else if (strlen(buf) != len) {
+      err = EINVAL;
+    } else {
+      err = secret_store_write(&store, arg, buf, SECRET_STORE_ANY_VERSION);
+    }
+    if (err) {
+      fprintf(stderr, "Failed to import \"%s\": %s\n", arg, strerror(err));
+    }
+  } else if (!strcmp(cmd, "export")) {
+    uint32_t version;
+    const int len = secret_store_read(&store, arg, buf, &version);
+    if (len < 0) {
+      err = errno;
+      fprintf(stderr, "Failed to export \"%s\": %s\n", arg, strerror(err));
+    } else {
+      fwrite(buf, 1, len, stdout);
+    }
+  } else if (!strcmp(cmd, "delete")) {
+    if ((err = secret_store_delete(&store, arg))) {
+      fprintf(stderr, "Failed to delete \"%s\": %s\n", arg, strerror(err));
+    }
+  } else if (!strcmp(cmd, "list")) {
+    secret_store_list(&store, print_user, NULL);
+  } else {
+    usage();
+    err = EINVAL;
+  }
+  explicit_bzero(buf, sizeof(buf));
+  secret_store_close(&store);
+  return err ? 1 : 0;
+}
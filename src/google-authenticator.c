@@ -23,27 +23,40 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
 #include <time.h>
 #include <unistd.h>
 
 #include "base32.h"
 #include "hmac.h"
+#include "png.h"
+#include "scratch_codes.h"
 #include "sha1.h"
+#include "util.h"
 
 #define SECRET                    "/.google_authenticator"
 #define SECRET_BITS               128         // Must be divisible by eight
 #define VERIFICATION_CODE_MODULUS (1000*1000) // Six digits
 #define SCRATCHCODES              5           // Default number of initial scratchcodes
 #define MAX_SCRATCHCODES          10          // Max number of initial scratchcodes
+                                              // ... unless they are hashed
 #define SCRATCHCODE_LENGTH        8           // Eight digits per scratchcode
 #define BYTES_PER_SCRATCHCODE     4           // 32bit of randomness is enough
 #define BITS_PER_BASE32_CHAR      5           // Base32 expands space by 8/5
+#define SCRATCHCODE_MODULUS       (100*1000*1000)
+#define BATCH_RANDOM_BUFFER       4096        // Bytes per getrandom() call
+#define BATCH_MAX_JOBS            256
+#define BATCH_MAX_FIELD           256         // Max length of a batch field
+#define BATCH_QR_SCALE            4           // Pixels per QR code module
 
 static enum { QR_UNSET=0, QR_NONE, QR_ANSI, QR_UTF8 } qr_mode = QR_UNSET;
 
@@ -202,39 +215,63 @@ static const char *getURL(const char *secret, const char *label,
 #define UTF8_TOPHALF      "\xE2\x96\x80"
 #define UTF8_BOTTOMHALF   "\xE2\x96\x84"
 
-// Display QR code visually. If not possible, return 0.
-static int displayQRCode(const char* url) {
-  void *qrencode = dlopen("libqrencode.so.2", RTLD_NOW | RTLD_LOCAL);
-  if (!qrencode) {
-    qrencode = dlopen("libqrencode.so.3", RTLD_NOW | RTLD_LOCAL);
-  }
-  if (!qrencode) {
-    qrencode = dlopen("libqrencode.so.4", RTLD_NOW | RTLD_LOCAL);
-  }
-  if (!qrencode) {
-    qrencode = dlopen("libqrencode.3.dylib", RTLD_NOW | RTLD_LOCAL);
+typedef struct {
+  int version;
+  int width;
+  unsigned char *data;
+} QRcode;
+
+typedef struct {
+  QRcode *(*encodeString8bit)(const char *, int, int);
+  void (*free)(QRcode *qrcode);
+} QRencoder;
+
+// Looks for libqrencode at run-time. The library is loaded at most once and
+// then stays loaded, so that batch mode can share it between all of its
+// worker threads. Returns NULL if it cannot be found.
+static const QRencoder *loadQRencoder(void) {
+  static QRencoder encoder;
+  static int loaded;
+  if (loaded) {
+    return encoder.encodeString8bit ? &encoder : NULL;
   }
-  if (!qrencode) {
-    qrencode = dlopen("libqrencode.4.dylib", RTLD_NOW | RTLD_LOCAL);
+  loaded = 1;
+  // Current systems ship the newest version, so that it is probed first.
+  // Every miss is a search of the whole library path.
+  static const char *const libraries[] = {
+    "libqrencode.so.4", "libqrencode.so.3", "libqrencode.so.2",
+    "libqrencode.4.dylib", "libqrencode.3.dylib", NULL };
+  void *qrencode = NULL;
+  for (const char *const *lib = libraries; !qrencode && *lib; ++lib) {
+    qrencode = dlopen(*lib, RTLD_NOW | RTLD_LOCAL);
   }
   if (!qrencode) {
-    return 0;
+    return NULL;
   }
-  typedef struct {
-    int version;
-    int width;
-    unsigned char *data;
-  } QRcode;
-  QRcode *(*QRcode_encodeString8bit)(const char *, int, int) =
+  QRcode *(*encodeString8bit)(const char *, int, int) =
       (QRcode *(*)(const char *, int, int))
       dlsym(qrencode, "QRcode_encodeString8bit");
-  void (*QRcode_free)(QRcode *qrcode) =
+  void (*free_qrcode)(QRcode *qrcode) =
       (void (*)(QRcode *))dlsym(qrencode, "QRcode_free");
-  if (!QRcode_encodeString8bit || !QRcode_free) {
+  if (!encodeString8bit || !free_qrcode) {
     dlclose(qrencode);
+    return NULL;
+  }
+  encoder.encodeString8bit = encodeString8bit;
+  encoder.free = free_qrcode;
+  return &encoder;
+}
+
+// Display QR code visually. If not possible, return 0.
+static int displayQRCode(const char* url) {
+  const QRencoder *encoder = loadQRencoder();
+  if (!encoder) {
+    return 0;
+  }
+  QRcode *qrcode = encoder->encodeString8bit(url, 0, 1);
+  if (!qrcode) {
     return 0;
   }
-  QRcode *qrcode = QRcode_encodeString8bit(url, 0, 1);
   const char *ptr = (char *)qrcode->data;
   // Output QRCode using ANSI colors. Instead of black on white, we
   // output black on grey, as that works independently of whether the
@@ -315,8 +352,7 @@ static int displayQRCode(const char* url) {
     }
     puts(ANSI_RESET);
   }
-  QRcode_free(qrcode);
-  dlclose(qrencode);
+  encoder->free(qrcode);
   return 1;
 }
 
@@ -413,6 +449,563 @@ static char *maybeAddOption(const char *msg, char *buf, size_t nbuf,
   return buf;
 }
 
+// Batch mode provisions many users from a single process. Randomness comes
+// from a buffered getrandom() stream, and a pool of worker threads generates
+// and writes the secret files.
+typedef struct {
+  uint8_t buf[BATCH_RANDOM_BUFFER];
+  size_t pos;
+  size_t len;
+} RandomStream;
+
+#ifndef HAVE_GETRANDOM
+static int urandom_fd = -1;
+#endif
+
+static int randomBytes(RandomStream *rnd, uint8_t *out, size_t len) {
+  while (len) {
+    if (rnd->pos == rnd->len) {
+#ifdef HAVE_GETRANDOM
+      const ssize_t n = getrandom(rnd->buf, sizeof(rnd->buf), 0);
+#else
+      const ssize_t n = read(urandom_fd, rnd->buf, sizeof(rnd->buf));
+#endif
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      rnd->pos = 0;
+      rnd->len = n;
+    }
+    const size_t chunk = len < rnd->len - rnd->pos ? len : rnd->len - rnd->pos;
+    memcpy(out, rnd->buf + rnd->pos, chunk);
+    // Bytes that have been handed out must not linger in the buffer.
+    explicit_bzero(rnd->buf + rnd->pos, chunk);
+    rnd->pos += chunk;
+    out += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+typedef struct {
+  char *user;
+  char *label;   // NULL for the default
+  char *issuer;  // NULL for the default
+  char *url;     // Filled in once the secret file has been written
+  enum { BATCH_PENDING = 0, BATCH_DONE, BATCH_SKIPPED, BATCH_FAILED } status;
+} BatchEntry;
+
+typedef struct {
+  BatchEntry *entries;
+  size_t count;
+  size_t next;            // Next entry for a worker, updated atomically
+  const char *secret_fn;  // Path template, may refer to ~, ${HOME}, ${USER}
+  const char *options;    // Option lines added to every file
+  const char *issuer;
+  const char *hostname;
+  const char *qr_dir;
+  const QRencoder *encoder;
+  int use_totp;
+  int emergency_codes;
+  int force;
+  int quiet;
+} Batch;
+
+// User names end up in file names, so only allow a conservative set of
+// characters.
+static int validUserName(const char *user) {
+  if (!*user || *user == '.' || *user == '-' ||
+      strlen(user) > BATCH_MAX_FIELD) {
+    return 0;
+  }
+  for (const char *ptr = user; *ptr; ++ptr) {
+    if (!strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                "0123456789._@-", *ptr)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int compareUsers(const void *a, const void *b) {
+  return strcmp((*(const BatchEntry **)a)->user,
+                (*(const BatchEntry **)b)->user);
+}
+
+// Reads lines of "user" or "user,label,issuer" from "fn", or from stdin if
+// "fn" is "-". Empty lines and lines starting with '#' are ignored. Any
+// error is fatal, as provisioning only part of a broken list is worse than
+// provisioning none of it.
+static BatchEntry *readBatch(const char *fn, size_t *count) {
+  FILE *fp = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+  if (!fp) {
+    fprintf(stderr, "Failed to open \"%s\" (%s)\n", fn, strerror(errno));
+    _exit(1);
+  }
+  BatchEntry *entries = NULL;
+  size_t size = 0;
+  *count = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  for (int lineno = 1; (len = getline(&line, &line_size, fp)) >= 0;
+       ++lineno) {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+      line[--len] = '\000';
+    }
+    if (!*line || *line == '#') {
+      continue;
+    }
+    char *ptr = line;
+    const char *user = strsep(&ptr, ",");
+    const char *label = strsep(&ptr, ",");
+    const char *issuer = strsep(&ptr, ",");
+    if (ptr || !validUserName(user) ||
+        (label && strlen(label) > BATCH_MAX_FIELD) ||
+        (issuer && strlen(issuer) > BATCH_MAX_FIELD)) {
+      fprintf(stderr, "Invalid entry in line %d of \"%s\"\n", lineno, fn);
+      _exit(1);
+    }
+    if (*count == size) {
+      size = size ? 2*size : 256;
+      entries = realloc(entries, size * sizeof(BatchEntry));
+      if (!entries) {
+        perror("malloc()");
+        _exit(1);
+      }
+    }
+    BatchEntry *entry = entries + (*count)++;
+    memset(entry, 0, sizeof(*entry));
+    entry->user = strdup(user);
+    entry->label = label && *label ? strdup(label) : NULL;
+    entry->issuer = issuer && *issuer ? strdup(issuer) : NULL;
+    if (!entry->user || (label && *label && !entry->label) ||
+        (issuer && *issuer && !entry->issuer)) {
+      perror("malloc()");
+      _exit(1);
+    }
+  }
+  if (ferror(fp)) {
+    fprintf(stderr, "Failed to read \"%s\"\n", fn);
+    _exit(1);
+  }
+  free(line);
+  if (fp != stdin) {
+    fclose(fp);
+  }
+
+  // Two workers writing the same file would race with each other.
+  if (*count > 1) {
+    const BatchEntry **sorted = malloc(*count * sizeof(BatchEntry *));
+    if (!sorted) {
+      perror("malloc()");
+      _exit(1);
+    }
+    for (size_t i = 0; i < *count; ++i) {
+      sorted[i] = entries + i;
+    }
+    qsort(sorted, *count, sizeof(BatchEntry *), compareUsers);
+    for (size_t i = 1; i < *count; ++i) {
+      if (!strcmp(sorted[i-1]->user, sorted[i]->user)) {
+        fprintf(stderr, "Duplicate user \"%s\" in \"%s\"\n",
+                sorted[i]->user, fn);
+        _exit(1);
+      }
+    }
+    free(sorted);
+  }
+  return entries;
+}
+
+// Looks up "user" in the password database. Returns a heap-allocated entry,
+// or NULL if there is no such user.
+static struct passwd *lookupUser(const char *user) {
+  #ifdef _SC_GETPW_R_SIZE_MAX
+  long len = sysconf(_SC_GETPW_R_SIZE_MAX);
+  if (len <= 0) {
+    len = 4096;
+  }
+  #else
+  long len = 4096;
+  #endif
+  for (;;) {
+    // The strings in the result point into the buffer that follows it.
+    struct passwd *pwbuf = malloc(sizeof(struct passwd) + len);
+    if (!pwbuf) {
+      return NULL;
+    }
+    struct passwd *pw;
+    const int err = getpwnam_r(user, pwbuf, (char *)(pwbuf + 1), len, &pw);
+    if (!err && pw) {
+      return pwbuf;
+    }
+    free(pwbuf);
+    if (err != ERANGE || len >= 1024*1024) {
+      return NULL;
+    }
+    len *= 2;
+  }
+}
+
+// Expands a leading "~", "${HOME}" and "${USER}" in the path template.
+// Returns a heap-allocated string, or NULL if the user's home directory is
+// needed but unknown.
+static char *expandSecretPath(const char *tmpl, const char *user,
+                              const struct passwd *pw) {
+  const char *home = pw && *pw->pw_dir == '/' ? pw->pw_dir : NULL;
+  size_t size = strlen(tmpl) + 1;
+  for (const char *ptr = tmpl; (ptr = strchr(ptr, '$')) != NULL; ++ptr) {
+    size += (home ? strlen(home) : 0) + strlen(user);
+  }
+  if (*tmpl == '~') {
+    size += home ? strlen(home) : 0;
+  }
+  char *fn = malloc(size);
+  if (!fn) {
+    return NULL;
+  }
+  char *out = fn;
+  const char *in = tmpl;
+  if (*in == '~' && (!in[1] || in[1] == '/')) {
+    if (!home) {
+      goto missing_home;
+    }
+    out = stpcpy(out, home);
+    ++in;
+  }
+  while (*in) {
+    if (!strncmp(in, "${HOME}", 7)) {
+      if (!home) {
+        goto missing_home;
+      }
+      out = stpcpy(out, home);
+      in += 7;
+    } else if (!strncmp(in, "${USER}", 7)) {
+      out = stpcpy(out, user);
+      in += 7;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  *out = '\000';
+  return fn;
+
+missing_home:
+  free(fn);
+  errno = ENOENT;
+  return NULL;
+}
+
+// Opens the directory that holds "fn" and points "*name" at the last path
+// component. Batch mode runs as root, but writes into directories that users
+// own. So, none of the intermediate components may be a symbolic link, or
+// users could redirect the files anywhere. Returns -1 on error.
+static int openParentDir(const char *fn, const char **name) {
+  const char *slash = strrchr(fn, '/');
+  *name = slash ? slash + 1 : fn;
+  int dirfd = open(*fn == '/' ? "/" : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  for (const char *ptr = fn; dirfd >= 0 && slash && ptr < slash; ) {
+    const char *end = strchr(ptr, '/');
+    if (end > ptr) {
+      char *component = strndup(ptr, end - ptr);
+      const int fd = component
+        ? openat(dirfd, component, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)
+        : -1;
+      const int err = errno;
+      free(component);
+      close(dirfd);
+      errno = err;
+      dirfd = fd;
+    }
+    ptr = end + 1;
+  }
+  return dirfd;
+}
+
+// Writes "contents" to a new file "fn". If the caller is root and the user
+// exists, the file is handed over to the user. Returns 1 on success, 0 if the
+// file exists and "force" is not set, or -1 on error.
+static int writeSecretFile(const char *fn, const char *contents,
+                           const struct passwd *pw, int force) {
+  const char *name;
+  const int dirfd = openParentDir(fn, &name);
+  if (dirfd < 0) {
+    return -1;
+  }
+  struct stat sb;
+  if (!force && !fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW)) {
+    close(dirfd);
+    return 0;
+  }
+  const size_t size = strlen(name) + 2;
+  char *tmp_fn = malloc(size);
+  if (!tmp_fn) {
+    close(dirfd);
+    return -1;
+  }
+  snprintf(tmp_fn, size, "%s~", name);
+  int fd = openat(dirfd, tmp_fn, O_WRONLY|O_EXCL|O_CREAT|O_NOFOLLOW|O_TRUNC|
+                                 O_CLOEXEC, 0400);
+  if (fd < 0) {
+    const int err = errno;
+    free(tmp_fn);
+    close(dirfd);
+    errno = err;
+    return -1;
+  }
+  const ssize_t len = strlen(contents);
+  int rc = 1;
+  if ((pw && !geteuid() && fchown(fd, pw->pw_uid, pw->pw_gid)) ||
+      write(fd, contents, len) != len) {
+    rc = -1;
+  }
+  // The descriptor is released even if close() fails, and by then, another
+  // worker thread could already have been handed the same number.
+  if (close(fd) && rc > 0) {
+    rc = -1;
+  }
+  fd = -1;
+  if (rc > 0 && renameat(dirfd, tmp_fn, dirfd, name)) {
+    rc = -1;
+  }
+  if (rc < 0) {
+    const int err = errno;
+    unlinkat(dirfd, tmp_fn, 0);
+    errno = err;
+  }
+  free(tmp_fn);
+  const int err = errno;
+  close(dirfd);
+  errno = err;
+  return rc;
+}
+
+static int writeQRCodePNG(const Batch *batch, const BatchEntry *entry) {
+  QRcode *qrcode = batch->encoder->encodeString8bit(entry->url, 0, 1);
+  if (!qrcode) {
+    return -1;
+  }
+  char *fn;
+  if (asprintf(&fn, "%s/%s.png", batch->qr_dir, entry->user) < 0) {
+    batch->encoder->free(qrcode);
+    return -1;
+  }
+  const char *name;
+  const int dirfd = openParentDir(fn, &name);
+  int rc = -1;
+  if (dirfd >= 0) {
+    // The image reveals the secret just like the URL does.
+    const int fd = openat(dirfd, name,
+                          O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600);
+    if (fd >= 0) {
+      rc = png_write_qrcode(fd, qrcode->data, qrcode->width, BATCH_QR_SCALE);
+      if (close(fd)) {
+        rc = -1;
+      }
+    }
+    close(dirfd);
+  }
+  free(fn);
+  batch->encoder->free(qrcode);
+  return rc;
+}
+
+static void provisionUser(const Batch *batch, BatchEntry *entry,
+                          RandomStream *rnd) {
+  const char *error = NULL;
+  struct passwd *pw = lookupUser(entry->user);
+  char *fn = expandSecretPath(batch->secret_fn, entry->user, pw);
+  if (!fn) {
+    error = "cannot determine home directory";
+    goto out;
+  }
+
+  uint8_t buf[SECRET_BITS/8];
+  char contents[1024];
+  if (randomBytes(rnd, buf, sizeof(buf))) {
+    error = "failed to read random data";
+    goto out;
+  }
+  base32_encode(buf, sizeof(buf), (uint8_t *)contents, sizeof(contents));
+  explicit_bzero(buf, sizeof(buf));
+  char *secret = strdup(contents);
+  if (!secret) {
+    error = strerror(errno);
+    goto wipe;
+  }
+  char *ptr = strrchr(contents, '\000');
+  ptr += snprintf(ptr, sizeof(contents) - (ptr - contents), "\n%s%s",
+                  batch->options, batch->use_totp ? "\" TOTP_AUTH\n"
+                                                  : "\" HOTP_COUNTER 1\n");
+  for (int i = 0; i < batch->emergency_codes; ++i) {
+    uint32_t scratch;
+    do {
+      // Make sure that scratch codes are always exactly eight digits. If they
+      // start with a sequence of zeros, just generate a new scratch code.
+      uint8_t code[BYTES_PER_SCRATCHCODE];
+      if (randomBytes(rnd, code, sizeof(code))) {
+        error = "failed to read random data";
+        goto wipe;
+      }
+      scratch = 0;
+      for (int j = 0; j < BYTES_PER_SCRATCHCODE; ++j) {
+        scratch = 256*scratch + code[j];
+      }
+      explicit_bzero(code, sizeof(code));
+      scratch = (scratch & 0x7FFFFFFF) % SCRATCHCODE_MODULUS;
+    } while (scratch < SCRATCHCODE_MODULUS/10);
+    ptr += snprintf(ptr, sizeof(contents) - (ptr - contents), "%08u\n",
+                    scratch);
+  }
+
+  char *label = entry->label;
+  if (!label && asprintf(&label, "%s@%s", entry->user, batch->hostname) < 0) {
+    label = NULL;
+    error = strerror(ENOMEM);
+    goto wipe;
+  }
+  const int rc = writeSecretFile(fn, contents, pw, batch->force);
+  if (rc < 0) {
+    error = strerror(errno);
+  } else if (rc == 0) {
+    entry->status = BATCH_SKIPPED;
+    if (!batch->quiet) {
+      fprintf(stderr, "%s: skipped, \"%s\" already exists\n",
+              entry->user, fn);
+    }
+  } else {
+    entry->url = (char *)getURL(secret, label, NULL, batch->use_totp,
+                                entry->issuer ? entry->issuer : batch->issuer);
+    if (batch->qr_dir && writeQRCodePNG(batch, entry)) {
+      error = "failed to write QR code image";
+    }
+  }
+  if (label != entry->label) {
+    free(label);
+  }
+
+wipe:
+  explicit_bzero(contents, sizeof(contents));
+  if (secret) {
+    explicit_bzero(secret, strlen(secret));
+    free(secret);
+  }
+out:
+  if (error) {
+    entry->status = BATCH_FAILED;
+    fprintf(stderr, "%s: %s\n", entry->user, error);
+  } else if (entry->status == BATCH_PENDING) {
+    entry->status = BATCH_DONE;
+  }
+  free(fn);
+  free(pw);
+}
+
+static void *batchWorker(void *arg) {
+  Batch *batch = (Batch *)arg;
+  RandomStream rnd = { .pos = 0, .len = 0 };
+  for (;;) {
+    const size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    if (i >= batch->count) {
+      break;
+    }
+    provisionUser(batch, batch->entries + i, &rnd);
+  }
+  explicit_bzero(&rnd, sizeof(rnd));
+  return NULL;
+}
+
+static int runBatch(Batch *batch, const char *batch_fn, int jobs,
+                    const char *manifest_fn) {
+  batch->entries = readBatch(batch_fn, &batch->count);
+  if (batch->qr_dir && !(batch->encoder = loadQRencoder())) {
+    fprintf(stderr, "Failed to use libqrencode to write QR code images\n");
+    return 1;
+  }
+#ifndef HAVE_GETRANDOM
+  urandom_fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+  if (urandom_fd < 0) {
+    perror("Failed to open \"/dev/urandom\"");
+    return 1;
+  }
+#endif
+
+  // Create the manifest up front, so that a bad path does not leave users
+  // provisioned without a record of their URLs.
+  FILE *manifest = NULL;
+  if (manifest_fn) {
+    if (!strcmp(manifest_fn, "-")) {
+      manifest = stdout;
+    } else {
+      const int fd = open(manifest_fn, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|
+                                       O_CLOEXEC, 0600);
+      if (fd < 0 || !(manifest = fdopen(fd, "w"))) {
+        fprintf(stderr, "Failed to create \"%s\" (%s)\n",
+                manifest_fn, strerror(errno));
+        return 1;
+      }
+    }
+  }
+
+  if (jobs <= 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0) {
+      jobs = 1;
+    } else if (jobs > BATCH_MAX_JOBS) {
+      jobs = BATCH_MAX_JOBS;
+    }
+  }
+  if ((size_t)jobs > batch->count) {
+    jobs = batch->count ? batch->count : 1;
+  }
+  pthread_t threads[BATCH_MAX_JOBS];
+  int started = 0;
+  while (started < jobs &&
+         !pthread_create(threads + started, NULL, batchWorker, batch)) {
+    ++started;
+  }
+  if (!started) {
+    // Fall back to doing all of the work on this thread.
+    batchWorker(batch);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  size_t done = 0, skipped = 0, failed = 0;
+  for (size_t i = 0; i < batch->count; ++i) {
+    BatchEntry *entry = batch->entries + i;
+    if (entry->status == BATCH_DONE) {
+      ++done;
+    } else if (entry->status == BATCH_SKIPPED) {
+      ++skipped;
+    } else {
+      ++failed;
+    }
+    if (manifest && entry->url) {
+      fprintf(manifest, "%s,%s\n", entry->user, entry->url);
+    }
+    free(entry->user);
+    free(entry->label);
+    free(entry->issuer);
+    free(entry->url);
+  }
+  free(batch->entries);
+  if (manifest && (fflush(manifest) || (manifest != stdout &&
+                                         fclose(manifest)))) {
+    fprintf(stderr, "Failed to write \"%s\"\n", manifest_fn);
+    failed = failed ? failed : 1;
+  }
+  if (!batch->quiet) {
+    fprintf(stderr, "Provisioned %zu users, skipped %zu, failed %zu\n",
+            done, skipped, failed);
+  }
+  return failed ? 1 : 0;
+}
+
 static void
 print_version() {
   puts("google-authenticator "VERSION);
@@ -441,7 +1034,12 @@ static void usage(void) {
  " -S, --step-size=S              Set interval between token refreshes\n"
  " -w, --window-size=W            Set window of concurrently valid codes\n"
  " -W, --minimal-window           Disable window of concurrently valid codes\n"
- " -e, --emergency-codes=N        Number of emergency codes to generate");
+ " -e, --emergency-codes=N        Number of emergency codes to generate\n"
+ " -b, --batch=<file>             Provision users listed in <file>, one\n"
+ "                                \"user\" or \"user,label,issuer\" per line\n"
+ " -j, --jobs=N                   Number of threads to use with -b\n"
+ " -M, --manifest=<file>          Write \"user,otpauth-url\" lines with -b\n"
+ " -P, --qr-dir=<dir>             Write a QR code image per user with -b");
 }
 
 int main(int argc, char *argv[]) {
@@ -460,6 +1058,8 @@ int main(int argc, char *argv[]) {
               sizeof(window) +
               sizeof(ratelimit) + 5 + // NN MMM (total of five digits)
               SCRATCHCODE_LENGTH*(MAX_SCRATCHCODES + 1 /* newline */) +
+              sizeof("\" SCRATCH_CODES \n") +
+              SCRATCH_CODE_SLOT*MAX_HASHED_SCRATCHCODES +
               1 /* NUL termination character */];
 
   enum { ASK_MODE, HOTP_MODE, TOTP_MODE } mode = ASK_MODE;
@@ -473,9 +1073,13 @@ int main(int argc, char *argv[]) {
   int confirm = 1;
   int window_size = 0;
   int emergency_codes = -1;
+  char *batch_fn = NULL;
+  int jobs = 0;
+  char *manifest_fn = NULL;
+  char *qr_dir = NULL;
   int idx;
   for (;;) {
-    static const char optstring[] = "+hcCtdDfl:i:qQ:r:R:us:S:w:We:";
+    static const char optstring[] = "+hcCtdDfl:i:qQ:r:R:us:S:w:We:b:j:M:P:";
     static struct option options[] = {
       { "help",             0, 0, 'h' },
       { "version",          0, 0, 0},
@@ -497,6 +1101,10 @@ int main(int argc, char *argv[]) {
       { "window-size",      1, 0, 'w' },
       { "minimal-window",   0, 0, 'W' },
       { "emergency-codes",  1, 0, 'e' },
+      { "batch",            1, 0, 'b' },
+      { "jobs",             1, 0, 'j' },
+      { "manifest",         1, 0, 'M' },
+      { "qr-dir",           1, 0, 'P' },
       { 0,                  0, 0,  0  }
     };
     idx = -1;
@@ -715,11 +1323,49 @@ int main(int argc, char *argv[]) {
       char *endptr;
       errno = 0;
       long l = strtol(optarg, &endptr, 10);
-      if (errno || endptr == optarg || *endptr || l < 0 || l > MAX_SCRATCHCODES) {
-        fprintf(stderr, "-e requires an argument in the range 0..%d\n", MAX_SCRATCHCODES);
+      if (errno || endptr == optarg || *endptr || l < 0 ||
+          l > MAX_HASHED_SCRATCHCODES) {
+        fprintf(stderr, "-e requires an argument in the range 0..%d\n",
+                MAX_HASHED_SCRATCHCODES);
         _exit(1);
       }
       emergency_codes = (int)l;
+    } else if (!idx--) {
+      // batch
+      if (batch_fn) {
+        fprintf(stderr, "Duplicate -b option detected\n");
+        _exit(1);
+      }
+      batch_fn = strdup(optarg);
+    } else if (!idx--) {
+      // jobs
+      if (jobs) {
+        fprintf(stderr, "Duplicate -j option detected\n");
+        _exit(1);
+      }
+      char *endptr;
+      errno = 0;
+      const long l = strtol(optarg, &endptr, 10);
+      if (errno || endptr == optarg || *endptr || l < 1 || l > BATCH_MAX_JOBS) {
+        fprintf(stderr, "-j requires an argument in the range 1..%d\n",
+                BATCH_MAX_JOBS);
+        _exit(1);
+      }
+      jobs = (int)l;
+    } else if (!idx--) {
+      // manifest
+      if (manifest_fn) {
+        fprintf(stderr, "Duplicate -M option detected\n");
+        _exit(1);
+      }
+      manifest_fn = strdup(optarg);
+    } else if (!idx--) {
+      // qr-dir
+      if (qr_dir) {
+        fprintf(stderr, "Duplicate -P option detected\n");
+        _exit(1);
+      }
+      qr_dir = strdup(optarg);
     } else {
       fprintf(stderr, "Error\n");
       _exit(1);
@@ -740,6 +1386,72 @@ int main(int argc, char *argv[]) {
   if (emergency_codes < 0) {
     emergency_codes = SCRATCHCODES;
   }
+  if (batch_fn) {
+    if (mode == ASK_MODE) {
+      fprintf(stderr, "Must select -c or -t, when using -b\n");
+      _exit(1);
+    }
+    if (emergency_codes > MAX_SCRATCHCODES) {
+      // More codes are hashed, but nobody gets to see them with -b.
+      fprintf(stderr, "-e requires an argument in the range 0..%d, when "
+              "using -b\n", MAX_SCRATCHCODES);
+      _exit(1);
+    }
+    if (label) {
+      fprintf(stderr, "-l cannot be used with -b, use a label column instead\n");
+      _exit(1);
+    }
+    // Options that are not given on the command line are left at the
+    // module's defaults, as there is nobody to ask.
+    char options[256] = "\n";
+    if (mode == TOTP_MODE) {
+      if (reuse == DISALLOW_REUSE) {
+        addOption(options, sizeof(options), disallow);
+      }
+      if (step_size) {
+        char s[80];
+        snprintf(s, sizeof s, "\" STEP_SIZE %d\n", step_size);
+        addOption(options, sizeof(options), s);
+      }
+    }
+    if (window_size) {
+      char s[80];
+      snprintf(s, sizeof s, "\" WINDOW_SIZE %d\n", window_size > 0
+               ? window_size : mode == TOTP_MODE ? 3 : 1);
+      addOption(options, sizeof(options), s);
+    }
+    if (r_limit > 0 && r_time > 0) {
+      char s[80];
+      snprintf(s, sizeof s, "\" RATE_LIMIT %d %d\n", r_limit, r_time);
+      addOption(options, sizeof(options), s);
+    }
+    char hostname[128] = { 0 };
+    if (gethostname(hostname, sizeof(hostname)-1)) {
+      strcpy(hostname, "unix");
+    }
+    Batch batch = {
+      .secret_fn       = secret_fn ? secret_fn : "~" SECRET,
+      .options         = options + 1,
+      .issuer          = issuer ? issuer : hostname,
+      .hostname        = hostname,
+      .qr_dir          = qr_dir,
+      .use_totp        = mode == TOTP_MODE,
+      .emergency_codes = emergency_codes,
+      .force           = force,
+      .quiet           = quiet,
+    };
+    const int rc = runBatch(&batch, batch_fn, jobs, manifest_fn);
+    free(batch_fn);
+    free(manifest_fn);
+    free(qr_dir);
+    free(secret_fn);
+    free(issuer);
+    return rc;
+  }
+  if (jobs || manifest_fn || qr_dir) {
+    fprintf(stderr, "Must set -b when setting -j, -M or -P\n");
+    _exit(1);
+  }
   if (!label) {
     const uid_t uid = getuid();
     const char *user = getUserName(uid);
@@ -814,11 +1526,27 @@ int main(int argc, char *argv[]) {
   } else {
     strcat(secret, hotp);
   }
+  // More than MAX_SCRATCHCODES codes are kept as a single line of keyed
+  // hashes, which the PAM module can search without a linear scan. They can
+  // only be seen now.
+  const int hashed = emergency_codes > MAX_SCRATCHCODES;
+  int *codes = hashed ? calloc(emergency_codes, sizeof(int)) : NULL;
+  if (hashed && !codes) {
+    perror("calloc()");
+    _exit(1);
+  }
   for (int i = 0; i < emergency_codes; ++i) {
+    // Random data for codes beyond MAX_SCRATCHCODES is read as needed.
+    uint8_t extra[BYTES_PER_SCRATCHCODE];
+    uint8_t *rnd = i < MAX_SCRATCHCODES
+      ? buf + SECRET_BITS/8 + BYTES_PER_SCRATCHCODE*i : extra;
+    if (rnd == extra && read(fd, extra, sizeof(extra)) != sizeof(extra)) {
+      goto urandom_failure;
+    }
   new_scratch_code:;
     int scratch = 0;
     for (int j = 0; j < BYTES_PER_SCRATCHCODE; ++j) {
-      scratch = 256*scratch + buf[SECRET_BITS/8 + BYTES_PER_SCRATCHCODE*i + j];
+      scratch = 256*scratch + rnd[j];
     }
     int modulus = 1;
     for (int j = 0; j < SCRATCHCODE_LENGTH; j++) {
@@ -828,17 +1556,35 @@ int main(int argc, char *argv[]) {
     if (scratch < modulus/10) {
       // Make sure that scratch codes are always exactly eight digits. If they
       // start with a sequence of zeros, just generate a new scratch code.
-      if (read(fd, buf + (SECRET_BITS/8 + BYTES_PER_SCRATCHCODE*i),
-               BYTES_PER_SCRATCHCODE) != BYTES_PER_SCRATCHCODE) {
+      if (read(fd, rnd, BYTES_PER_SCRATCHCODE) != BYTES_PER_SCRATCHCODE) {
         goto urandom_failure;
       }
       goto new_scratch_code;
     }
+    explicit_bzero(extra, sizeof(extra));
     if (!quiet) {
       printf("  %08d\n", scratch);
     }
-    snprintf(strrchr(secret, '\000'), sizeof(secret) - strlen(secret),
-             "%08d\n", scratch);
+    if (hashed) {
+      codes[i] = scratch;
+    } else {
+      snprintf(strrchr(secret, '\000'), sizeof(secret) - strlen(secret),
+               "%08d\n", scratch);
+    }
+  }
+  if (hashed) {
+    HMAC_SHA1_CTX hmac;
+    hmac_sha1_init(&hmac, buf, SECRET_BITS/8);
+    char *ptr = strrchr(secret, '\000');
+    ptr += sprintf(ptr, "\" SCRATCH_CODES ");
+    scratch_codes_format(&hmac, codes, emergency_codes, ptr);
+    strcat(ptr, "\n");
+    hmac_sha1_clear(&hmac);
+    explicit_bzero(codes, emergency_codes * sizeof(int));
+    free(codes);
+    if (!quiet) {
+      printf("These codes are stored as hashes, and cannot be shown again.\n");
+    }
   }
   close(fd);
   if (!secret_fn) {
@@ -0,0 +1,427 @@
+// Verification daemon for the PAM module. PAM modules configured with
+// "daemon=/path/to/socket" hand their requests to this process.
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "daemon_proto.h"
+#include "secret_cache.h"
+#include "util.h"
+
+#if !defined(PAM_BAD_ITEM)
+// FreeBSD does not know about PAM_BAD_ITEM. And PAM_SYMBOL_ERR is an "enum",
+// we can't test for it at compile-time.
+#define PAM_BAD_ITEM PAM_SYMBOL_ERR
+#endif
+
+#define DEFAULT_SOCKET     "/run/google-authenticator.sock"
+#define DEFAULT_CLIENTS    256
+#define DEFAULT_CACHE      256
+#define DEFAULT_VOLATILE   "RESETTING_TIME_SKEW,LAST*"
+
+#define DAEMON_STR_(x)     #x
+#define DAEMON_STR(x)      DAEMON_STR_(x)
+
+// The user has to type the verification code while we wait.
+#define CONVERSATION_TIMEOUT 600
+
+// The PAM module is linked into the daemon, and calls back into the
+// functions below instead of into libpam. The opaque pam_handle_t points
+// to the Request that is being served.
+typedef struct Request {
+  int             fd;
+  const char      *user;
+  const char      *service;
+  const char      *rhost;
+  const char      *authtok;
+  char            *new_authtok;
+  struct pam_conv conv;
+} Request;
+
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int num_clients, max_clients = DEFAULT_CLIENTS;
+
+// Module options that the daemon adds to every request, unless the client
+// set them itself. Either can be NULL.
+static char *cache_arg;
+static char *volatile_arg;
+
+// Relays the module's prompts to the PAM application that talks to the user.
+static int conversation(int num_msg, PAM_CONST struct pam_message **msg,
+                        struct pam_response **resp, void *appdata_ptr) {
+  Request *req = appdata_ptr;
+  struct pam_response *responses = calloc(num_msg, sizeof(*responses));
+  if (!responses) {
+    return PAM_BUF_ERR;
+  }
+  DaemonMsg packet;
+  for (int i = 0; i < num_msg; ++i) {
+    char style[16];
+    snprintf(style, sizeof(style), "%d", msg[i]->msg_style);
+    daemon_msg_init(&packet, DAEMON_MSG_CONV);
+    const char *fields[2];
+    if (daemon_msg_add(&packet, style) ||
+        daemon_msg_add(&packet, msg[i]->msg) ||
+        daemon_msg_send(req->fd, &packet) ||
+        daemon_msg_recv(req->fd, &packet, fields, 2) != 2 ||
+        strcmp(fields[0], DAEMON_MSG_RESP)) {
+      goto error;
+    }
+    const char *answer = daemon_msg_opt(fields[1]);
+    if (answer && !(responses[i].resp = strdup(answer))) {
+      goto error;
+    }
+  }
+  daemon_msg_clear(&packet);
+  *resp = responses;
+  return PAM_SUCCESS;
+
+error:
+  daemon_msg_clear(&packet);
+  for (int i = 0; i < num_msg; ++i) {
+    if (responses[i].resp) {
+      explicit_bzero(responses[i].resp, strlen(responses[i].resp));
+      free(responses[i].resp);
+    }
+  }
+  free(responses);
+  return PAM_CONV_ERR;
+}
+
+int pam_get_user(pam_handle_t *pamh, PAM_CONST char **user,
+                 const char *prompt) {
+  const Request *req = (const Request *)pamh;
+  *user = req->user;
+  return PAM_SUCCESS;
+}
+
+int pam_get_item(const pam_handle_t *pamh, int item_type,
+                 PAM_CONST void **item) {
+  const Request *req = (const Request *)pamh;
+  switch (item_type) {
+    case PAM_SERVICE:
+      *item = req->service;
+      return PAM_SUCCESS;
+    case PAM_USER:
+      *item = req->user;
+      return PAM_SUCCESS;
+    case PAM_RHOST:
+      *item = req->rhost;
+      return PAM_SUCCESS;
+    case PAM_AUTHTOK:
+      *item = req->new_authtok ? req->new_authtok : req->authtok;
+      return PAM_SUCCESS;
+    case PAM_CONV:
+      *item = &req->conv;
+      return PAM_SUCCESS;
+    default:
+      return PAM_BAD_ITEM;
+  }
+}
+
+int pam_set_item(pam_handle_t *pamh, int item_type, const void *item) {
+  Request *req = (Request *)pamh;
+  switch (item_type) {
+    case PAM_AUTHTOK: {
+      char *authtok = strdup(item ? item : "");
+      if (!authtok) {
+        return PAM_BUF_ERR;
+      }
+      if (req->new_authtok) {
+        explicit_bzero(req->new_authtok, strlen(req->new_authtok));
+        free(req->new_authtok);
+      }
+      req->new_authtok = authtok;
+      return PAM_SUCCESS;
+    }
+    default:
+      return PAM_BAD_ITEM;
+  }
+}
+
+static void serve(int fd) {
+  extern int pam_sm_authenticate(pam_handle_t *, int, int, const char **);
+  DaemonMsg packet;
+  const char *fields[DAEMON_MSG_MAX_ARGS];
+  const int n = daemon_msg_recv(fd, &packet, fields, DAEMON_MSG_MAX_ARGS - 3);
+  if (n < 5 || strcmp(fields[0], DAEMON_MSG_AUTH)) {
+    syslog(LOG_ERR, "Invalid request");
+    daemon_msg_clear(&packet);
+    return;
+  }
+  Request req = {
+    .fd      = fd,
+    .user    = fields[1],
+    .service = daemon_msg_opt(fields[2]),
+    .rhost   = daemon_msg_opt(fields[3]),
+    .authtok = daemon_msg_opt(fields[4]),
+    .conv    = { .conv = conversation, .appdata_ptr = &req },
+  };
+
+  // Other threads serve other users at the same time, so the module must
+  // not switch user ids.
+  const char **argv = fields + 5;
+  int argc = n - 5;
+  int has_cache = 0, has_volatile = 0, has_store = 0;
+  for (int i = 0; i < argc; ++i) {
+    has_cache    |= !strncmp(argv[i], "secret_cache=", 13);
+    has_volatile |= !strncmp(argv[i], "volatile_keys=", 14);
+    has_store    |= !strncmp(argv[i], "secret_store=", 13);
+  }
+  argv[argc++] = "reentrant";
+
+  // As the daemon stays around, it keeps the decoded secrets in its cache,
+  // and journals bookkeeping state instead of rewriting the secret file for
+  // it. With a secret store, there are no files to cache or journal.
+  if (!has_store) {
+    if (!has_cache && cache_arg) {
+      argv[argc++] = cache_arg;
+    }
+    if (!has_volatile && volatile_arg) {
+      argv[argc++] = volatile_arg;
+    }
+  }
+
+  const int rc = pam_sm_authenticate((pam_handle_t *)&req, 0, argc, argv);
+
+  char *new_authtok = req.new_authtok;
+  char result[16];
+  snprintf(result, sizeof(result), "%d", rc);
+  daemon_msg_init(&packet, DAEMON_MSG_DONE);
+  if (daemon_msg_add(&packet, result) ||
+      daemon_msg_add_opt(&packet, new_authtok) ||
+      daemon_msg_send(fd, &packet)) {
+    syslog(LOG_ERR, "Failed to send reply");
+  }
+  daemon_msg_clear(&packet);
+  if (new_authtok) {
+    explicit_bzero(new_authtok, strlen(new_authtok));
+    free(new_authtok);
+  }
+}
+
+static void *client_thread(void *arg) {
+  const int fd = (int)(intptr_t)arg;
+  serve(fd);
+  close(fd);
+  pthread_mutex_lock(&clients_mutex);
+  --num_clients;
+  pthread_mutex_unlock(&clients_mutex);
+  return NULL;
+}
+
+// Only the administrator's processes, in practice the ones running the PAM
+// stack, may query the daemon. Everybody else could use it to guess codes
+// outside of the usual login paths.
+static int trusted_peer(int fd) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) &&
+         (cred.uid == 0 || cred.uid == geteuid());
+#else
+  // Rely on the permissions of the socket.
+  return 1;
+#endif
+}
+
+static void usage(void) {
+  puts(
+ "google-authenticatord [<options>]\n"
+ " -h, --help                     Print this message\n"
+ " -s, --socket=<file>            Listen on this socket (default "
+                                    DEFAULT_SOCKET ")\n"
+ " -m, --max-clients=N            Serve at most N requests at a time\n"
+ " -c, --secret-cache=N           Cache up to N secret files (default "
+                                    DAEMON_STR(DEFAULT_CACHE) ", 0 disables)\n"
+ " -v, --volatile-keys=KEYS       Journal these keys (default "
+                                    DEFAULT_VOLATILE ", \"\" disables)");
+}
+
+int main(int argc, char *argv[]) {
+  const char *socket_fn = DEFAULT_SOCKET;
+  long cache_entries = DEFAULT_CACHE;
+  const char *volatile_keys = DEFAULT_VOLATILE;
+  for (;;) {
+    static const char optstring[] = "+hs:m:c:v:";
+    static struct option options[] = {
+      { "help",             0, 0, 'h' },
+      { "socket",           1, 0, 's' },
+      { "max-clients",      1, 0, 'm' },
+      { "secret-cache",     1, 0, 'c' },
+      { "volatile-keys",    1, 0, 'v' },
+      { 0,                  0, 0,  0  }
+    };
+    const int c = getopt_long(argc, argv, optstring, options, NULL);
+    if (c < 0) {
+      break;
+    }
+    switch (c) {
+    case 's':
+      socket_fn = optarg;
+      break;
+    case 'm': {
+      char *endptr;
+      errno = 0;
+      const long l = strtol(optarg, &endptr, 10);
+      if (errno || l < 1 || l > 65535 || *endptr) {
+        fprintf(stderr, "-m requires an argument in the range 1..65535\n");
+        _exit(1);
+      }
+      max_clients = (int)l;
+      break;
+    }
+    case 'c': {
+      char *endptr;
+      errno = 0;
+      cache_entries = strtol(optarg, &endptr, 10);
+      if (errno || cache_entries < 0 ||
+          cache_entries > SECRET_CACHE_MAX_ENTRIES || *endptr) {
+        fprintf(stderr, "-c requires an argument in the range 0..%d\n",
+                SECRET_CACHE_MAX_ENTRIES);
+        _exit(1);
+      }
+      break;
+    }
+    case 'v':
+      if (strspn(optarg, "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_*,") !=
+          strlen(optarg)) {
+        fprintf(stderr, "-v requires a comma separated list of keys\n");
+        _exit(1);
+      }
+      volatile_keys = optarg;
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    default:
+      usage();
+      fprintf(stderr, "Failed to parse command line\n");
+      _exit(1);
+    }
+  }
+  if (optind != argc) {
+    usage();
+    _exit(1);
+  }
+  if ((cache_entries &&
+       asprintf(&cache_arg, "secret_cache=%ld", cache_entries) < 0) ||
+      (*volatile_keys &&
+       asprintf(&volatile_arg, "volatile_keys=%s", volatile_keys) < 0)) {
+    perror("asprintf");
+    _exit(1);
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(socket_fn) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket name \"%s\" is too long\n", socket_fn);
+    _exit(1);
+  }
+  strcpy(addr.sun_path, socket_fn);
+
+  // Secrets must neither end up in swap, nor in core files.
+  setrlimit(RLIMIT_CORE, (struct rlimit []){ { 0, 0 } });
+  if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+    fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  const int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    _exit(1);
+  }
+  // Remove the socket that a previous instance left behind, but never
+  // anything else that happens to live at that path.
+  struct stat sb;
+  if (!lstat(socket_fn, &sb)) {
+    if (!S_ISSOCK(sb.st_mode)) {
+      fprintf(stderr, "\"%s\" exists, and is not a socket\n", socket_fn);
+      _exit(1);
+    }
+    unlink(socket_fn);
+  }
+  const mode_t old_mask = umask(077);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(listen_fd, SOMAXCONN)) {
+    fprintf(stderr, "Failed to listen on \"%s\": %s\n", socket_fn,
+            strerror(errno));
+    _exit(1);
+  }
+  umask(old_mask);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;) {
+    const int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        syslog(LOG_ERR, "accept(): %s", strerror(errno));
+        sleep(1);
+      }
+      continue;
+    }
+    if (!trusted_peer(fd)) {
+      syslog(LOG_WARNING, "Rejected request from untrusted peer");
+      close(fd);
+      continue;
+    }
+    const struct timeval timeout = { CONVERSATION_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    pthread_mutex_lock(&clients_mutex);
+    const int busy = num_clients >= max_clients;
+    if (!busy) {
+      ++num_clients;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    pthread_t thread;
+    if (busy ||
+        pthread_create(&thread, &attr, client_thread, (void *)(intptr_t)fd)) {
+      // The module falls back to verifying the code itself, only if it
+      // cannot connect. A request that we drop fails.
+      syslog(LOG_WARNING, "Too many concurrent requests");
+      if (!busy) {
+        pthread_mutex_lock(&clients_mutex);
+        --num_clients;
+        pthread_mutex_unlock(&clients_mutex);
+      }
+      close(fd);
+    }
+  }
+}
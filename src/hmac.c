@@ -21,17 +21,15 @@
 #include "sha1.h"
 #include "util.h"
 
-void hmac_sha1(const uint8_t *key, int keyLength,
-               const uint8_t *data, int dataLength,
-               uint8_t *result, int resultLength) {
-  SHA1_INFO ctx;
+void hmac_sha1_init(HMAC_SHA1_CTX *ctx, const uint8_t *key, int keyLength) {
+  SHA1_INFO tmp;
   uint8_t hashed_key[SHA1_DIGEST_LENGTH];
   if (keyLength > 64) {
     // The key can be no bigger than 64 bytes. If it is, we'll hash it down to
     // 20 bytes.
-    sha1_init(&ctx);
-    sha1_update(&ctx, key, keyLength);
-    sha1_final(&ctx, hashed_key);
+    sha1_init(&tmp);
+    sha1_update(&tmp, key, keyLength);
+    sha1_final(&tmp, hashed_key);
     key = hashed_key;
     keyLength = SHA1_DIGEST_LENGTH;
   }
@@ -46,12 +44,10 @@ void hmac_sha1(const uint8_t *key, int keyLength,
     memset(tmp_key + keyLength, 0x36, 64 - keyLength);
   }
 
-  // Compute inner digest
-  sha1_init(&ctx);
-  sha1_update(&ctx, tmp_key, 64);
-  sha1_update(&ctx, data, dataLength);
-  uint8_t sha[SHA1_DIGEST_LENGTH];
-  sha1_final(&ctx, sha);
+  // Hash the inner key block. The resulting midstate is the starting point
+  // for every inner digest computed with this context.
+  sha1_init(&ctx->inner);
+  sha1_update(&ctx->inner, tmp_key, 64);
 
   // The key for the outer digest is derived from our key, by padding the key
   // the full length of 64 bytes, and then XOR'ing each byte with 0x5C.
@@ -60,11 +56,30 @@ void hmac_sha1(const uint8_t *key, int keyLength,
   }
   memset(tmp_key + keyLength, 0x5C, 64 - keyLength);
 
-  // Compute outer digest
-  sha1_init(&ctx);
-  sha1_update(&ctx, tmp_key, 64);
-  sha1_update(&ctx, sha, SHA1_DIGEST_LENGTH);
-  sha1_final(&ctx, sha);
+  // Hash the outer key block.
+  sha1_init(&ctx->outer);
+  sha1_update(&ctx->outer, tmp_key, 64);
+
+  // Zero out all internal data structures
+  explicit_bzero(&tmp, sizeof(tmp));
+  explicit_bzero(hashed_key, sizeof(hashed_key));
+  explicit_bzero(tmp_key, sizeof(tmp_key));
+}
+
+void hmac_sha1_compute(const HMAC_SHA1_CTX *ctx,
+                       const uint8_t *data, int dataLength,
+                       uint8_t *result, int resultLength) {
+  // Compute inner digest, starting from the precomputed inner midstate.
+  SHA1_INFO sha1;
+  sha1 = ctx->inner;
+  sha1_update(&sha1, data, dataLength);
+  uint8_t sha[SHA1_DIGEST_LENGTH];
+  sha1_final(&sha1, sha);
+
+  // Compute outer digest, starting from the precomputed outer midstate.
+  sha1 = ctx->outer;
+  sha1_update(&sha1, sha, SHA1_DIGEST_LENGTH);
+  sha1_final(&sha1, sha);
 
   // Copy result to output buffer and truncate or pad as necessary
   memset(result, 0, resultLength);
@@ -74,7 +89,179 @@ void hmac_sha1(const uint8_t *key, int keyLength,
   memcpy(result, sha, resultLength);
 
   // Zero out all internal data structures
-  explicit_bzero(hashed_key, sizeof(hashed_key));
+  explicit_bzero(&sha1, sizeof(sha1));
+  explicit_bzero(sha, sizeof(sha));
+}
+
+void hmac_sha1_counters(const HMAC_SHA1_CTX *ctx, uint64_t counter, int n,
+                        uint8_t result[][SHA1_DIGEST_LENGTH]) {
+  uint32_t block[16][SHA1_LANES];
+  uint32_t sha[5][SHA1_LANES];
+  for (int base = 0; base < n; base += SHA1_LANES) {
+    // The inner message is the counter value, followed by the SHA1 padding
+    // for a total message length of 64 + 8 bytes. It always fits into a
+    // single block.
+    memset(block, 0, sizeof(block));
+    for (int j = 0; j < SHA1_LANES; ++j) {
+      const uint64_t value = counter + base + j;
+      block[0][j]  = (uint32_t)(value >> 32);
+      block[1][j]  = (uint32_t)value;
+      block[2][j]  = 0x80000000;
+      block[15][j] = (64 + 8) * 8;
+    }
+    sha1_transform_lanes(ctx->inner.digest, block, sha);
+
+    // The outer message is the inner digest, padded for a total message
+    // length of 64 + 20 bytes.
+    memset(block, 0, sizeof(block));
+    for (int j = 0; j < SHA1_LANES; ++j) {
+      for (int i = 0; i < 5; ++i) {
+        block[i][j] = sha[i][j];
+      }
+      block[5][j]  = 0x80000000;
+      block[15][j] = (64 + SHA1_DIGEST_LENGTH) * 8;
+    }
+    sha1_transform_lanes(ctx->outer.digest, block, sha);
+
+    // Unused lanes in the last round are computed, but discarded.
+    const int lanes = n - base < SHA1_LANES ? n - base : SHA1_LANES;
+    for (int j = 0; j < lanes; ++j) {
+      for (int i = 0; i < 5; ++i) {
+        result[base + j][4*i    ] = sha[i][j] >> 24;
+        result[base + j][4*i + 1] = sha[i][j] >> 16;
+        result[base + j][4*i + 2] = sha[i][j] >>  8;
+        result[base + j][4*i + 3] = sha[i][j];
+      }
+    }
+  }
+
+  // Zero out all internal data structures
+  explicit_bzero(block, sizeof(block));
+  explicit_bzero(sha, sizeof(sha));
+}
+
+void hmac_sha1_clear(HMAC_SHA1_CTX *ctx) {
+  explicit_bzero(ctx, sizeof(*ctx));
+}
+
+void hmac_sha1(const uint8_t *key, int keyLength,
+               const uint8_t *data, int dataLength,
+               uint8_t *result, int resultLength) {
+  HMAC_SHA1_CTX ctx;
+  hmac_sha1_init(&ctx, key, keyLength);
+  hmac_sha1_compute(&ctx, data, dataLength, result, resultLength);
+  hmac_sha1_clear(&ctx);
+}
+
+// Both the SHA256 and the SHA512 key schedules are set up the same way as
+// the one for SHA1, only with different block and digest sizes.
+#define HMAC_INIT(sha, SHA, ctx, key, keyLength)                              \
+  do {                                                                        \
+    SHA##_INFO tmp;                                                           \
+    uint8_t hashed_key[SHA##_DIGEST_LENGTH];                                  \
+    if (keyLength > SHA##_BLOCKSIZE) {                                        \
+      sha##_init(&tmp);                                                       \
+      sha##_update(&tmp, key, keyLength);                                     \
+      sha##_final(&tmp, hashed_key);                                          \
+      key = hashed_key;                                                       \
+      keyLength = SHA##_DIGEST_LENGTH;                                        \
+    }                                                                         \
+    uint8_t tmp_key[SHA##_BLOCKSIZE];                                         \
+    for (int i = 0; i < SHA##_BLOCKSIZE; ++i) {                               \
+      tmp_key[i] = (i < keyLength ? key[i] : 0) ^ 0x36;                       \
+    }                                                                         \
+    sha##_init(&ctx->inner);                                                  \
+    sha##_update(&ctx->inner, tmp_key, SHA##_BLOCKSIZE);                      \
+    for (int i = 0; i < SHA##_BLOCKSIZE; ++i) {                               \
+      tmp_key[i] = (i < keyLength ? key[i] : 0) ^ 0x5C;                       \
+    }                                                                         \
+    sha##_init(&ctx->outer);                                                  \
+    sha##_update(&ctx->outer, tmp_key, SHA##_BLOCKSIZE);                      \
+    explicit_bzero(&tmp, sizeof(tmp));                                        \
+    explicit_bzero(hashed_key, sizeof(hashed_key));                           \
+    explicit_bzero(tmp_key, sizeof(tmp_key));                                 \
+  } while (0)
+
+void hmac_sha256_init(HMAC_SHA256_CTX *ctx, const uint8_t *key,
+                      int keyLength) {
+  HMAC_INIT(sha256, SHA256, ctx, key, keyLength);
+}
+
+void hmac_sha256_counters(const HMAC_SHA256_CTX *ctx, uint64_t counter, int n,
+                          uint8_t result[][SHA256_DIGEST_LENGTH]) {
+  uint32_t block[16][SHA256_LANES];
+  uint32_t sha[8][SHA256_LANES];
+  for (int base = 0; base < n; base += SHA256_LANES) {
+    // Inner message: the counter, padded for a length of 64 + 8 bytes.
+    memset(block, 0, sizeof(block));
+    for (int j = 0; j < SHA256_LANES; ++j) {
+      const uint64_t value = counter + base + j;
+      block[0][j]  = (uint32_t)(value >> 32);
+      block[1][j]  = (uint32_t)value;
+      block[2][j]  = 0x80000000;
+      block[15][j] = (64 + 8) * 8;
+    }
+    sha256_transform_lanes(ctx->inner.digest, block, sha);
+
+    // Outer message: the inner digest, padded for a length of 64 + 32 bytes.
+    memset(block, 0, sizeof(block));
+    for (int j = 0; j < SHA256_LANES; ++j) {
+      for (int i = 0; i < 8; ++i) {
+        block[i][j] = sha[i][j];
+      }
+      block[8][j]  = 0x80000000;
+      block[15][j] = (64 + SHA256_DIGEST_LENGTH) * 8;
+    }
+    sha256_transform_lanes(ctx->outer.digest, block, sha);
+
+    const int lanes = n - base < SHA256_LANES ? n - base : SHA256_LANES;
+    for (int j = 0; j < lanes; ++j) {
+      for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        result[base + j][i] = sha[i/4][j] >> (24 - 8*(i & 3));
+      }
+    }
+  }
+  explicit_bzero(block, sizeof(block));
+  explicit_bzero(sha, sizeof(sha));
+}
+
+void hmac_sha512_init(HMAC_SHA512_CTX *ctx, const uint8_t *key,
+                      int keyLength) {
+  HMAC_INIT(sha512, SHA512, ctx, key, keyLength);
+}
+
+void hmac_sha512_counters(const HMAC_SHA512_CTX *ctx, uint64_t counter, int n,
+                          uint8_t result[][SHA512_DIGEST_LENGTH]) {
+  uint64_t block[16][SHA512_LANES];
+  uint64_t sha[8][SHA512_LANES];
+  for (int base = 0; base < n; base += SHA512_LANES) {
+    // Inner message: the counter, padded for a length of 128 + 8 bytes.
+    memset(block, 0, sizeof(block));
+    for (int j = 0; j < SHA512_LANES; ++j) {
+      block[0][j]  = counter + base + j;
+      block[1][j]  = 0x8000000000000000ULL;
+      block[15][j] = (128 + 8) * 8;
+    }
+    sha512_transform_lanes(ctx->inner.digest, block, sha);
+
+    // Outer message: the inner digest, padded for a length of 128 + 64 bytes.
+    memset(block, 0, sizeof(block));
+    for (int j = 0; j < SHA512_LANES; ++j) {
+      for (int i = 0; i < 8; ++i) {
+        block[i][j] = sha[i][j];
+      }
+      block[8][j]  = 0x8000000000000000ULL;
+      block[15][j] = (128 + SHA512_DIGEST_LENGTH) * 8;
+    }
+    sha512_transform_lanes(ctx->outer.digest, block, sha);
+
+    const int lanes = n - base < SHA512_LANES ? n - base : SHA512_LANES;
+    for (int j = 0; j < lanes; ++j) {
+      for (int i = 0; i < SHA512_DIGEST_LENGTH; ++i) {
+        result[base + j][i] = sha[i/8][j] >> (56 - 8*(i & 7));
+      }
+    }
+  }
+  explicit_bzero(block, sizeof(block));
   explicit_bzero(sha, sizeof(sha));
-  explicit_bzero(tmp_key, sizeof(tmp_key));
 }
@@ -20,9 +20,63 @@
 
 #include <stdint.h>
 
+#include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
+
+// Precomputed HMAC_SHA1 key schedule. The inner and outer padded key blocks
+// are hashed once by hmac_sha1_init(), so that each subsequent call to
+// hmac_sha1_compute() only needs to compress the message itself.
+typedef struct {
+  SHA1_INFO inner;
+  SHA1_INFO outer;
+} HMAC_SHA1_CTX;
+
+void hmac_sha1_init(HMAC_SHA1_CTX *ctx, const uint8_t *key, int keyLength)
+ __attribute__((visibility("hidden")));
+void hmac_sha1_compute(const HMAC_SHA1_CTX *ctx,
+                       const uint8_t *data, int dataLength,
+                       uint8_t *result, int resultLength)
+ __attribute__((visibility("hidden")));
+// Compute the HMACs of "n" consecutive counter values, starting at "counter".
+// Each counter is encoded as an 8 byte big-endian number, which is the
+// message format used by both HOTP and TOTP. Candidates are processed
+// SHA1_LANES at a time by the multi-buffer SHA1 kernels.
+void hmac_sha1_counters(const HMAC_SHA1_CTX *ctx, uint64_t counter, int n,
+                        uint8_t result[][SHA1_DIGEST_LENGTH])
+ __attribute__((visibility("hidden")));
+void hmac_sha1_clear(HMAC_SHA1_CTX *ctx)
+ __attribute__((visibility("hidden")));
+
 void hmac_sha1(const uint8_t *key, int keyLength,
                const uint8_t *data, int dataLength,
                uint8_t *result, int resultLength)
  __attribute__((visibility("hidden")));
 
+// Key schedules for the HMAC variants that RFC 6238 allows in addition to
+// HMAC_SHA1. Only the batched counter computation is needed for these, and
+// it is implemented on top of the multi-buffer SHA256 and SHA512 kernels.
+typedef struct {
+  SHA256_INFO inner;
+  SHA256_INFO outer;
+} HMAC_SHA256_CTX;
+
+typedef struct {
+  SHA512_INFO inner;
+  SHA512_INFO outer;
+} HMAC_SHA512_CTX;
+
+void hmac_sha256_init(HMAC_SHA256_CTX *ctx, const uint8_t *key,
+                      int keyLength)
+ __attribute__((visibility("hidden")));
+void hmac_sha256_counters(const HMAC_SHA256_CTX *ctx, uint64_t counter, int n,
+                          uint8_t result[][SHA256_DIGEST_LENGTH])
+ __attribute__((visibility("hidden")));
+void hmac_sha512_init(HMAC_SHA512_CTX *ctx, const uint8_t *key,
+                      int keyLength)
+ __attribute__((visibility("hidden")));
+void hmac_sha512_counters(const HMAC_SHA512_CTX *ctx, uint64_t counter, int n,
+                          uint8_t result[][SHA512_DIGEST_LENGTH])
+ __attribute__((visibility("hidden")));
+
 #endif /* _HMAC_H_ */
@@ -19,13 +19,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
@@ -48,9 +53,19 @@
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
 
+#include "arena.h"
+#include "daemon_proto.h"
 #include "base32.h"
 #include "hmac.h"
+#include "remote_store.h"
+#include "scratch_codes.h"
+#include "secret_cache.h"
+#include "secret_store.h"
 #include "sha1.h"
+#include "shm_store.h"
+#include "skew_cache.h"
+#include "state_store.h"
+#include "stats.h"
 #include "util.h"
 
 // Module name shortened to work with rsyslog.
@@ -61,6 +76,25 @@
 #define CODE_PROMPT   "Verification code: "
 #define PWCODE_PROMPT "Password & verification code: "
 
+// By default, time skew of up to 25 minutes in either direction is detected.
+#define SKEW_SEARCH_STEPS       (25*60)
+#define SKEW_SEARCH_MAX_STEPS   100000
+#define SKEW_SEARCH_CHUNK       2048
+#define SKEW_SEARCH_MAX_THREADS 8
+
+// By default, the grace period is remembered for the ten most recent hosts.
+#define GRACE_HOSTS             10
+#define GRACE_MAX_HOSTS         128
+
+#define MAX_UPDATE_RETRIES      100
+
+// Number of distinct sets of module options that are parsed only once.
+#define PARAMS_CACHE_ENTRIES    8
+
+// By default, the state_store gets a quarter of a second to answer.
+#define STATE_STORE_TIMEOUT     250
+#define STATE_STORE_MAX_TIMEOUT 10000
+
 typedef struct Params {
   const char *secret_filename_spec;
   const char *authtok_prompt;
@@ -76,7 +110,30 @@ typedef struct Params {
   int        no_strict_owner;
   int        allowed_perm;
   time_t     grace_period;
+  int        grace_hosts;
   int        allow_readonly;
+  const char *rate_limit_store;
+  ShmStore   *shm;
+  int        rate_limit_ring;
+  int        disallow_reuse_bits;
+  const char *volatile_keys;
+  int        reentrant;
+  int        dirfd;
+  const char *daemon;
+  const char *stats_table;
+  Stats      *stats;
+  int        secret_cache;
+  const char *secret_store;
+  SecretStore *store;
+  int        prefetch;
+  int        skew_cache;
+  int        skew_search_steps;
+  int        mmap_secret;
+  int        update_retries;
+  const char *state_store;
+  int        state_store_timeout;
+  int        state_store_fail_closed;
+  StateStore *state;
 } Params;
 
 static char oom;
@@ -84,7 +141,8 @@ static char oom;
 static const char* nobody = "nobody";
 
 #if defined(DEMO) || defined(TESTING)
-static char* error_msg = NULL;
+// Each thread collects its own log messages.
+static __thread char* error_msg = NULL;
 
 const char *get_error_msg(void) __attribute__((visibility("default")));
 const char *get_error_msg(void) {
@@ -93,6 +151,34 @@ const char *get_error_msg(void) {
   }
   return error_msg;
 }
+
+void reset_error_msg(void) __attribute__((visibility("default")));
+void reset_error_msg(void) {
+  free(error_msg);
+  error_msg = NULL;
+}
+
+// Appends the messages that another thread collected to those of this
+// thread, and takes ownership of "msg".
+static void adopt_error_msg(char *msg) {
+  if (!msg || !*msg) {
+    free(msg);
+    return;
+  }
+  if (!error_msg || !*error_msg) {
+    free(error_msg);
+    error_msg = msg;
+    return;
+  }
+  const size_t len = strlen(error_msg) + 1 + strlen(msg) + 1;
+  char *n = malloc(len);
+  if (n) {
+    snprintf(n, len, "%s\n%s", error_msg, msg);
+    free(error_msg);
+    error_msg = n;
+  }
+  free(msg);
+}
 #endif
 
 static void log_message(int priority, pam_handle_t *pamh,
@@ -218,15 +304,25 @@ static char *get_secret_filename(pam_handle_t *pamh, const Params *params,
   char *secret_filename = NULL; // Here because goto jumps.
 
   if (!params->fixed_uid) {
-    const int len = getpwnam_buf_max_size();
-    buf = malloc(len);
+    // The suggested buffer size is only a hint. Entries from a directory
+    // service can be larger, so grow the buffer until they fit.
+    size_t len = getpwnam_buf_max_size();
+    int rc;
     *uid = -1;
-    if (buf == NULL) {
-      log_message(LOG_ERR, pamh, "Short (%d) mem allocation failed", len);
-      goto errout;
+    for (;;) {
+      buf = malloc(len);
+      if (buf == NULL) {
+        log_message(LOG_ERR, pamh, "Short (%d) mem allocation failed", len);
+        goto errout;
+      }
+      rc = getpwnam_r(username, &pwbuf, buf, len, &pw);
+      if (rc != ERANGE || len >= 1024*1024) {
+        break;
+      }
+      free(buf);
+      buf = NULL;
+      len *= 2;
     }
-
-    const int rc = getpwnam_r(username, &pwbuf, buf, len, &pw);
     if (rc) {
       log_message(LOG_ERR, pamh, "getpwnam_r(\"%s\")!=0: %d", username, rc);
       goto errout;
@@ -366,14 +462,7 @@ static int drop_privileges(pam_handle_t *pamh, const char *username, int uid,
   // directories.
 
   // First, look up the user's default group
-  #ifdef _SC_GETPW_R_SIZE_MAX
-  int len = sysconf(_SC_GETPW_R_SIZE_MAX);
-  if (len <= 0) {
-    len = 4096;
-  }
-  #else
-  int len = 4096;
-  #endif
+  const size_t len = getpwnam_buf_max_size();
   char *buf = malloc(len);
   if (!buf) {
     log_message(LOG_ERR, pamh, "Out of memory");
@@ -422,12 +511,136 @@ static int drop_privileges(pam_handle_t *pamh, const char *username, int uid,
   return 0;
 }
 
+// In reentrant mode, the secret file and the files next to it are accessed
+// relative to a descriptor for their directory, and none of the process wide
+// state (file system user ids, umask) is touched. This lets a multi-threaded
+// caller authenticate several users at the same time.
+// Return 0 on success, or -1 on error.
+static int open_secret_dir(pam_handle_t *pamh, Params *params,
+                           const char *secret_filename, uid_t uid) {
+  const char *slash = strrchr(secret_filename, '/');
+  char *dir = !slash ? strdup(".")
+    : strndup(secret_filename, slash == secret_filename ? 1
+                                                        : slash - secret_filename);
+  if (!dir) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+  const int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct stat sb;
+  if (fd < 0 || fstat(fd, &sb)) {
+    log_message(LOG_ERR, pamh, "Failed to open directory \"%s\": %s",
+                dir, strerror(errno));
+    goto error;
+  }
+
+  // Anybody who can rename entries in the directory could substitute
+  // their own files, which we would then read and write with our
+  // privileges.
+  if ((sb.st_uid != uid && sb.st_uid != 0) ||
+      ((sb.st_mode & (S_IWGRP | S_IWOTH)) && !(sb.st_mode & S_ISVTX))) {
+    log_message(LOG_ERR, pamh,
+                "Directory \"%s\" must be owned by the user or by root,"
+                " and must not be writable by others", dir);
+    goto error;
+  }
+  free(dir);
+  params->dirfd = fd;
+  return 0;
+
+error:
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(dir);
+  return -1;
+}
+
+// Returns the name to pass to the *at() functions for "path".
+static const char *dir_entry(const Params *params, const char *path) {
+  const char *slash = strrchr(path, '/');
+  return params->dirfd < 0 || !slash ? path : slash + 1;
+}
+
+static int open_in_dir(const Params *params, const char *path,
+                       int flags, mode_t mode) {
+  if (params->dirfd < 0) {
+    return open(path, flags, mode);
+  }
+  return openat(params->dirfd, dir_entry(params, path),
+                flags | O_NOFOLLOW | O_CLOEXEC, mode);
+}
+
+static int stat_in_dir(const Params *params, const char *path,
+                       struct stat *sb) {
+  if (params->dirfd < 0) {
+    return stat(path, sb);
+  }
+  return fstatat(params->dirfd, dir_entry(params, path), sb,
+                 AT_SYMLINK_NOFOLLOW);
+}
+
+static int rename_in_dir(const Params *params, const char *from,
+                         const char *to) {
+  if (params->dirfd < 0) {
+    return rename(from, to);
+  }
+  return renameat(params->dirfd, dir_entry(params, from),
+                  params->dirfd, dir_entry(params, to));
+}
+
+static int unlink_in_dir(const Params *params, const char *path) {
+  if (params->dirfd < 0) {
+    return unlink(path);
+  }
+  return unlinkat(params->dirfd, dir_entry(params, path), 0);
+}
+
+// Like mkstemp(), but relative to the directory descriptor, and without
+// relying on the umask.
+static int mkstemp_in_dir(const Params *params, char *template) {
+  static const char chars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  char *suffix = template + strlen(template) - 6;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t seed = (uint64_t)ts.tv_nsec ^ ((uint64_t)ts.tv_sec << 32) ^
+                  (uint64_t)getpid() ^ (uint64_t)(uintptr_t)&ts;
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    for (int i = 0; i < 6; ++i) {
+      // xorshift64; the names only need to be unlikely to collide, as
+      // O_EXCL makes sure that we never use a file somebody else created.
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      suffix[i] = chars[seed % (sizeof(chars) - 1)];
+    }
+    const int fd = open_in_dir(params, template,
+                               O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0 || errno != EEXIST) {
+      return fd;
+    }
+  }
+  errno = EEXIST;
+  return -1;
+}
+
+// Files that we create as root in reentrant mode must still belong to the
+// owner of the secret file.
+static int chown_like(const Params *params, int fd,
+                      const struct stat *orig_stat) {
+  if (params->dirfd < 0 || geteuid() == orig_stat->st_uid) {
+    return 0;
+  }
+  return fchown(fd, orig_stat->st_uid, orig_stat->st_gid);
+}
+
 // open secret file, return fd on success, or <0 on error.
 static int open_secret_file(pam_handle_t *pamh, const char *secret_filename,
                             struct Params *params, const char *username,
                             int uid, struct stat *orig_stat) {
   // Try to open "~/.google_authenticator"
-  const int fd = open(secret_filename, O_RDONLY);
+  const int fd = open_in_dir(params, secret_filename, O_RDONLY, 0);
   if (fd < 0 ||
       fstat(fd, orig_stat) < 0) {
     if (params->nullok != NULLERR && errno == ENOENT) {
@@ -489,29 +702,322 @@ static int open_secret_file(pam_handle_t *pamh, const char *secret_filename,
   return fd;
 }
 
-// Read secret file contents.
-// If there's an error the file is closed, NULL is returned, and errno set.
-static char *read_file_contents(pam_handle_t *pamh,
-                                const Params *params,
-                                const char *secret_filename, int *fd,
-                                off_t filesize) {
+// The secret file is split into lines once, when it is read. Options are
+// then looked up by key, and changes are recorded as patches to individual
+// lines. The file contents are only assembled again by cfg_serialize(),
+// when the new state has to be written.
+typedef struct CfgLine {
+  const char *text;     // Current contents of the line, without terminator
+  int        len;
+  int        term_len;  // Line terminator, including any blank lines
+  int        key_len;   // Length of the key, if this is an option line
+  int        patched;   // The line was changed or added
+  int        added;
+  int        deleted;
+} CfgLine;
+
+// With "update_retries", the changes that a call makes to the state are
+// also recorded as a list of edits. If somebody else updated the state in
+// the meantime, the edits are applied again to the newer version. Each edit
+// knows how to merge with concurrent changes.
+typedef enum CfgEditType {
+  EDIT_SET,             // Set "key" to "val". The last writer wins.
+  EDIT_RATE_LIMIT,      // Append a login attempt to RATE_LIMIT
+  EDIT_DISALLOW_REUSE,  // Block time step "arg[0]" within window "arg[1]"
+  EDIT_HOTP_COUNTER,    // Advance HOTP_COUNTER past "arg[0]" to "arg[1]"
+  EDIT_SCRATCH_CODE,    // Remove scratch code "arg[0]", or hash "val"
+  EDIT_LAST_LOGIN,      // Remember a login from the remote host
+} CfgEditType;
+
+typedef struct CfgEdit {
+  CfgEditType type;
+  const char  *key;
+  const char  *val;
+  long        arg[2];
+} CfgEdit;
+
+typedef struct Config {
+  Arena      *arena;    // Backs the file contents, the index and all values
+  char       *buf;      // Original contents of the secret file
+  CfgLine    *lines;
+  int        num_lines;
+  int        max_lines;
+  void       *map;      // With "mmap_secret", the mapping that holds "buf"
+  size_t     map_size;
+  CfgEdit    *edits;    // Changes made by this call, if "record_edits" is set
+  int        num_edits;
+  int        max_edits;
+  int        record_edits;
+} Config;
+
+static void cfg_set_key_len(CfgLine *line) {
+  line->key_len = line->len >= 2 && line->text[0] == '"' &&
+                  line->text[1] == ' '
+                  ? (int)strcspn(line->text + 2, " \t\r\n") : 0;
+}
+
+static CfgLine *cfg_add_line(Config *cfg) {
+  if (cfg->num_lines == cfg->max_lines) {
+    const int max_lines = cfg->max_lines ? 2*cfg->max_lines : 16;
+    CfgLine *lines = arena_alloc(cfg->arena, max_lines * sizeof(CfgLine));
+    if (!lines) {
+      return NULL;
+    }
+    if (cfg->num_lines) {
+      memcpy(lines, cfg->lines, cfg->num_lines * sizeof(CfgLine));
+    }
+    cfg->lines = lines;
+    cfg->max_lines = max_lines;
+  }
+  CfgLine *line = cfg->lines + cfg->num_lines++;
+  memset(line, 0, sizeof(*line));
+  return line;
+}
+
+// Appends an edit to the list of changes made by this call, if they are
+// being recorded. Return 0 on success, -1 if we ran out of memory.
+static int cfg_record_edit(pam_handle_t *pamh, Config *cfg, CfgEditType type,
+                           const char *key, const char *val,
+                           long arg0, long arg1) {
+  if (!cfg->record_edits) {
+    return 0;
+  }
+  if (cfg->num_edits == cfg->max_edits) {
+    const int max_edits = cfg->max_edits ? 2*cfg->max_edits : 8;
+    CfgEdit *edits = arena_alloc(cfg->arena, max_edits * sizeof(CfgEdit));
+    if (!edits) {
+      goto oom;
+    }
+    if (cfg->num_edits) {
+      memcpy(edits, cfg->edits, cfg->num_edits * sizeof(CfgEdit));
+    }
+    cfg->edits = edits;
+    cfg->max_edits = max_edits;
+  }
+  CfgEdit *edit = cfg->edits + cfg->num_edits;
+  memset(edit, 0, sizeof(*edit));
+  edit->type = type;
+  if ((key && !(edit->key = arena_strndup(cfg->arena, key, strlen(key)))) ||
+      (val && !(edit->val = arena_strndup(cfg->arena, val, strlen(val))))) {
+    goto oom;
+  }
+  edit->arg[0] = arg0;
+  edit->arg[1] = arg1;
+  ++cfg->num_edits;
+  return 0;
+
+oom:
+  log_message(LOG_ERR, pamh, "Out of memory");
+  return -1;
+}
+
+// Forget the file contents. The memory is reclaimed with the arena. The
+// list of edits is kept, so that it can be applied to the new contents.
+static void cfg_clear(Config *cfg) {
+  cfg->buf = NULL;
+  cfg->lines = NULL;
+  cfg->num_lines = cfg->max_lines = 0;
+}
+
+// Index all lines in "buf", which must have been allocated from the arena.
+// Return 0 on success, -1 if we ran out of memory.
+static int cfg_parse(pam_handle_t *pamh, Config *cfg, char *buf) {
+  cfg_clear(cfg);
+  cfg->buf = buf;
+  for (const char *ptr = buf; *ptr; ) {
+    CfgLine *line = cfg_add_line(cfg);
+    if (!line) {
+      log_message(LOG_ERR, pamh, "Out of memory");
+      return -1;
+    }
+    line->text = ptr;
+    line->len = strcspn(ptr, "\r\n");
+    line->term_len = strspn(ptr + line->len, "\r\n");
+    cfg_set_key_len(line);
+    ptr += line->len + line->term_len;
+  }
+  return 0;
+}
+
+// Returns the line holding "key", or NULL if there is none.
+static CfgLine *cfg_find(const Config *cfg, const char *key) {
+  const size_t key_len = strlen(key);
+  for (int i = 0; i < cfg->num_lines; ++i) {
+    CfgLine *line = cfg->lines + i;
+    if (!line->deleted && line->key_len == key_len &&
+        !memcmp(line->text + 2, key, key_len)) {
+      return line;
+    }
+  }
+  return NULL;
+}
+
+// Assemble the current file contents. Lines that have not been changed keep
+// their original line terminators. Added lines are inserted immediately
+// after the first line, with the most recently added one first.
+// Return pointer to buffer in the arena, or NULL on error.
+static char *cfg_serialize(pam_handle_t *pamh, const Config *cfg) {
+  size_t size = 2;
+  for (int i = 0; i < cfg->num_lines; ++i) {
+    size += cfg->lines[i].len + cfg->lines[i].term_len + 1;
+  }
+  char *buf = arena_alloc(cfg->arena, size);
+  if (!buf) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return NULL;
+  }
+  char *ptr = buf;
+  for (int pass = 0; pass < 3; ++pass) {
+    for (int j = 0; j < cfg->num_lines; ++j) {
+      // Pass 0 emits the first line, pass 1 the added lines, and pass 2
+      // everything else.
+      const int i = pass == 1 ? cfg->num_lines - 1 - j : j;
+      const CfgLine *line = cfg->lines + i;
+      if (line->deleted ||
+          (pass == 0 && i != 0) ||
+          (pass == 1 && !line->added) ||
+          (pass == 2 && (i == 0 || line->added))) {
+        continue;
+      }
+      if (ptr > buf && ptr[-1] != '\n' && ptr[-1] != '\r') {
+        *ptr++ = '\n';
+      }
+      memcpy(ptr, line->text, line->len);
+      ptr += line->len;
+      if (line->patched) {
+        *ptr++ = '\n';
+      } else {
+        memcpy(ptr, line->text + line->len, line->term_len);
+        ptr += line->term_len;
+      }
+    }
+  }
+  *ptr = '\000';
+  return buf;
+}
+
+static char *get_cfg_value(pam_handle_t *pamh, const char *key,
+                           const Config *cfg) {
+  const CfgLine *line = cfg_find(cfg, key);
+  if (!line) {
+    return NULL;
+  }
+  const char *ptr = line->text + 2 + line->key_len;
+  const char *end = line->text + line->len;
+  while (ptr < end && (*ptr == ' ' || *ptr == '\t')) {
+    ++ptr;
+  }
+  char *val = arena_strndup(cfg->arena, ptr, end - ptr);
+  if (!val) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return &oom;
+  }
+  return val;
+}
+
+static int set_cfg_value(pam_handle_t *pamh, const char *key, const char *val,
+                         Config *cfg) {
+  const size_t key_len = strlen(key);
+  const size_t val_len = strlen(val);
+
+  // Replace an existing line, if any. If there is no existing line, add a
+  // new one. Patches of the same length, such as those of fixed-width
+  // values, are overwritten in place.
+  CfgLine *line = cfg_find(cfg, key);
+  char *patch;
+  if (line && line->patched && line->len == key_len + val_len + 3) {
+    patch = (char *)line->text;
+  } else if (!(patch = arena_alloc(cfg->arena, key_len + val_len + 4))) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+  snprintf(patch, key_len + val_len + 4, "\" %s %s", key, val);
+  if (!line && !(line = cfg_add_line(cfg))) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+  if (!line->text) {
+    line->added = 1;
+  }
+  line->patched = 1;
+  line->text = patch;
+  line->len = key_len + val_len + 3;
+  line->key_len = key_len;
+
+  // Check if there are any other occurrences of "key". If so, delete them.
+  for (CfgLine *dup = line + 1; dup < cfg->lines + cfg->num_lines; ++dup) {
+    if (!dup->deleted && dup->key_len == key_len &&
+        !memcmp(dup->text + 2, key, key_len)) {
+      dup->deleted = 1;
+    }
+  }
+  return 0;
+}
+
+// Maps the file read-only, followed by at least one zero byte, so that the
+// contents are NUL terminated without copying them. The zero bytes either
+// fill the rest of the last page of the file, or come from an anonymous page
+// that the file mapping is placed in front of.
+// Return the contents, or NULL on error.
+static char *map_file_contents(int fd, off_t filesize, Config *cfg) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t map_size = (filesize / page + 1) * page;
+  char *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  if (filesize &&
+      mmap(map, filesize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+      MAP_FAILED) {
+    munmap(map, map_size);
+    return NULL;
+  }
+#ifdef MADV_DONTDUMP
+  madvise(map, map_size, MADV_DONTDUMP);
+#endif
+  cfg->map = map;
+  cfg->map_size = map_size;
+  return map;
+}
+
+static void unmap_file_contents(Config *cfg) {
+  if (cfg->map) {
+    munmap(cfg->map, cfg->map_size);
+    cfg->map = NULL;
+  }
+}
+
+// Read secret file contents, and index its lines.
+// If there's an error the file is closed, -1 is returned, and errno set.
+static int read_file_contents(pam_handle_t *pamh,
+                              const Params *params,
+                              const char *secret_filename, int *fd,
+                              off_t filesize, Config *cfg) {
   // Arbitrary limit to prevent integer overflow.
   if (filesize > 1000000) {
     close(*fd);
     errno = E2BIG;
-    return NULL;
+    return -1;
   }
 
   // Read file contents
-  char *buf = malloc(filesize + 1);
-  if (!buf) {
-    log_message(LOG_ERR, pamh, "Failed to malloc %d+1", filesize);
-    goto out;
-  }
-
-  if (filesize != read(*fd, buf, filesize)) {
-    log_message(LOG_ERR, pamh, "Could not read \"%s\"", secret_filename);
-    goto out;
+  char *buf;
+  if (params->mmap_secret) {
+    if (!(buf = map_file_contents(*fd, filesize, cfg))) {
+      log_message(LOG_ERR, pamh, "Could not map \"%s\": %s",
+                  secret_filename, strerror(errno));
+      goto out;
+    }
+  } else {
+    if (!(buf = arena_alloc(cfg->arena, filesize + 1))) {
+      log_message(LOG_ERR, pamh, "Failed to malloc %d+1", filesize);
+      goto out;
+    }
+    if (filesize != read(*fd, buf, filesize)) {
+      log_message(LOG_ERR, pamh, "Could not read \"%s\"", secret_filename);
+      goto out;
+    }
   }
   close(*fd);
   *fd = -1;
@@ -523,29 +1029,31 @@ static char *read_file_contents(pam_handle_t *pamh,
     goto out;
   }
 
-  // Terminate the buffer with a NUL byte.
-  buf[filesize] = '\000';
+  // Terminate the buffer with a NUL byte. A mapping already ends in one.
+  if (!cfg->map) {
+    buf[filesize] = '\000';
+  }
+
+  if (cfg_parse(pamh, cfg, buf)) {
+    cfg_clear(cfg);
+    return -1;
+  }
 
   if(params->debug) {
     log_message(LOG_INFO, pamh, "debug: \"%s\" read", secret_filename);
   }
-  return buf;
+  return 0;
 
 out:
-  // If we have any data, erase it.
-  if (buf) {
-    explicit_bzero(buf, filesize);
-  }
-  free(buf);
   if (*fd >= 0) {
     close(*fd);
     *fd = -1;
   }
-  return NULL;
+  return -1;
 }
 
-static int is_totp(const char *buf) {
-  return !!strstr(buf, "\" TOTP_AUTH");
+static int is_totp(const Config *cfg) {
+  return !!cfg_find(cfg, "TOTP_AUTH");
 }
 
 // Wrap write() making sure that partial writes don't break everything.
@@ -581,8 +1089,9 @@ static int write_file_contents(pam_handle_t *pamh,
                                const char *secret_filename,
                                struct stat *orig_stat,
                                const char *buf) {
+  const uint64_t start = stats_start(params->stats);
   int err = 0;
-  int fd = -1;
+  int fd = -1, lock_fd = -1;
   const size_t fnlength = strlen(secret_filename) + 1 + 6 + 1;
 
   char *tmp_filename = malloc(fnlength);
@@ -596,9 +1105,13 @@ static int write_file_contents(pam_handle_t *pamh,
     err = ERANGE;
     goto cleanup;
   }
-  const mode_t old_mask = umask(077);
-  fd = mkstemp(tmp_filename);
-  umask(old_mask);
+  if (params->dirfd >= 0) {
+    fd = mkstemp_in_dir(params, tmp_filename);
+  } else {
+    const mode_t old_mask = umask(077);
+    fd = mkstemp(tmp_filename);
+    umask(old_mask);
+  }
   if (fd < 0) {
     err = errno;
     log_message(LOG_ERR, pamh, "Failed to create tempfile \"%s\": %s",
@@ -609,7 +1122,7 @@ static int write_file_contents(pam_handle_t *pamh,
     tmp_filename = NULL;
     goto cleanup;
   }
-  if (fchmod(fd, 0400)) {
+  if (fchmod(fd, 0400) || chown_like(params, fd, orig_stat)) {
     err = errno;
     goto cleanup;
   }
@@ -620,15 +1133,30 @@ static int write_file_contents(pam_handle_t *pamh,
   //
   // (except for the brief race condition between this stat and the
   // `rename` below)
+  //
+  // With "update_retries", concurrent logins are expected. Writers then
+  // lock the file that they replace, which closes the race.
+  if (params->update_retries) {
+    lock_fd = open_in_dir(params, secret_filename,
+                          O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX)) {
+      err = errno;
+      log_message(LOG_ERR, pamh, "Failed to lock \"%s\": %s",
+                  secret_filename, strerror(err));
+      goto cleanup;
+    }
+  }
   {
-    struct stat sb;
-    if (stat(secret_filename, &sb) != 0) {
+    struct stat sb, lock_sb;
+    if (stat_in_dir(params, secret_filename, &sb) != 0 ||
+        (lock_fd >= 0 && fstat(lock_fd, &lock_sb))) {
       err = errno;
       log_message(LOG_ERR, pamh, "stat(): %s", strerror(err));
       goto cleanup;
     }
 
-    if (sb.st_ino != orig_stat->st_ino ||
+    if ((lock_fd >= 0 && lock_sb.st_ino != sb.st_ino) ||
+        sb.st_ino != orig_stat->st_ino ||
         sb.st_size != orig_stat->st_size ||
         sb.st_mtime != orig_stat->st_mtime) {
       err = EAGAIN;
@@ -659,7 +1187,7 @@ static int write_file_contents(pam_handle_t *pamh,
   // Double-check that the file size is correct.
   {
     struct stat st;
-    if (stat(tmp_filename, &st)) {
+    if (stat_in_dir(params, tmp_filename, &st)) {
       err = errno;
       log_message(LOG_ERR, pamh, "stat(%s): %s", tmp_filename, strerror(err));
       goto cleanup;
@@ -672,13 +1200,16 @@ static int write_file_contents(pam_handle_t *pamh,
     }
   }
   
-  if (rename(tmp_filename, secret_filename) != 0) {
+  if (rename_in_dir(params, tmp_filename, secret_filename) != 0) {
     err = errno;
     log_message(LOG_ERR, pamh, "rename(): %s", strerror(err));
     goto cleanup;
   }
   free(tmp_filename);
   tmp_filename = NULL; // Prevent unlink & double-free.
+  if (params->secret_cache) {
+    secret_cache_drop(orig_stat);
+  }
 
   if (params->debug) {
     log_message(LOG_INFO, pamh, "debug: \"%s\" written", secret_filename);
@@ -688,13 +1219,17 @@ cleanup:
   if (fd >= 0) {
     close(fd);
   }
+  if (lock_fd >= 0) {
+    close(lock_fd);
+  }
   if (tmp_filename) {
-    if (unlink(tmp_filename)) {
+    if (unlink_in_dir(params, tmp_filename)) {
       log_message(LOG_ERR, pamh, "Failed to delete tempfile \"%s\": %s",
                   tmp_filename, strerror(errno));
     }
   }
   free(tmp_filename);
+  stats_record(params->stats, STATS_PHASE_WRITE, start);
 
   if (err) {
     log_message(LOG_ERR, pamh, "Failed to update secret file \"%s\": %s",
@@ -704,185 +1239,500 @@ cleanup:
   return 0;
 }
 
-// given secret file content (buf), extract the secret and base32 decode it.
-//
-// Return pointer to `malloc()`'d secret on success (caller frees),
-// NULL on error. Length of secret stored in *secretLen.
-static uint8_t *get_shared_secret(pam_handle_t *pamh,
-                                  const Params *params,
-                                  const char *secret_filename,
-                                  const char *buf, int *secretLen) {
-  if (!buf) {
+// With "secret_store", the state of each user is kept in a record of a
+// shared table instead of in a secret file. The record holds the same
+// text as the secret file would, so everything else works unchanged. The
+// "secret_filename" that is used in log messages names the table and the
+// user.
+static char *get_store_record_name(const Params *params,
+                                   const char *username) {
+  if (!username) {
     return NULL;
   }
-  // Decode secret key
-  const int base32Len = strcspn(buf, "\n");
-
-  // Arbitrary limit to prevent integer overflow.
-  if (base32Len > 100000) {
-    return NULL;
+  const size_t len = strlen(params->secret_store) + 1 + strlen(username) + 1;
+  char *name = malloc(len);
+  if (name) {
+    snprintf(name, len, "%s:%s", params->secret_store, username);
   }
+  return name;
+}
 
-  *secretLen = (base32Len*5 + 7)/8;
-  uint8_t *secret = malloc(base32Len + 1);
-  if (secret == NULL) {
-    *secretLen = 0;
-    return NULL;
+static int read_store_record(pam_handle_t *pamh, Params *params,
+                             const char *secret_filename,
+                             const char *username, uint32_t *version,
+                             Config *cfg) {
+  char *buf = arena_alloc(cfg->arena, SECRET_STORE_DATA_SIZE + 1);
+  if (!buf) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
   }
-  memcpy(secret, buf, base32Len);
-  secret[base32Len] = '\000';
-  if ((*secretLen = base32_decode(secret, secret, base32Len)) < 1) {
+  if (secret_store_read(params->store, username, buf, version) < 0) {
+    if (params->nullok != NULLERR && errno == ENOENT) {
+      params->nullok = SECRETNOTFOUND;
+    } else {
+      log_message(LOG_ERR, pamh, "Failed to read \"%s\": %s",
+                  secret_filename, strerror(errno));
+    }
+    return -1;
+  }
+  if (cfg_parse(pamh, cfg, buf)) {
+    cfg_clear(cfg);
+    return -1;
+  }
+  if (params->debug) {
+    log_message(LOG_INFO, pamh, "debug: \"%s\" read", secret_filename);
+  }
+  return 0;
+}
+
+// Updates the record in place, unless it changed since it was read at
+// "version". Return 0 on success, errno otherwise.
+static int write_store_record(pam_handle_t *pamh, const Params *params,
+                              const char *secret_filename,
+                              const char *username, uint32_t version,
+                              const char *buf) {
+  const uint64_t start = stats_start(params->stats);
+  const int err = secret_store_write(params->store, username, buf, version);
+  stats_record(params->stats, STATS_PHASE_WRITE, start);
+  if (err == EAGAIN) {
     log_message(LOG_ERR, pamh,
-                "Could not find a valid BASE32 encoded secret in \"%s\"",
+                "\"%s\" changed while trying to use scratch code",
                 secret_filename);
-    explicit_bzero(secret, base32Len);
-    free(secret);
-    return NULL;
+  } else if (err) {
+    log_message(LOG_ERR, pamh, "Failed to update \"%s\": %s",
+                secret_filename, strerror(err));
+  } else if (params->debug) {
+    log_message(LOG_INFO, pamh, "debug: \"%s\" written", secret_filename);
   }
-  memset(secret + *secretLen, 0, base32Len + 1 - *secretLen);
+  return err;
+}
 
-  if(params->debug) {
-    log_message(LOG_INFO, pamh, "debug: shared secret in \"%s\" processed", secret_filename);
+// Volatile keys hold bookkeeping state, which can be lost without harm. When
+// nothing but volatile keys changed, the new values are appended to a
+// journal next to the secret file, rather than rewriting the secret file.
+// The journal is neither synced nor renamed into place. It is merged when
+// reading the secret file, and deleted by the next full write.
+// Each record holds all volatile keys, and ends in a commit line that names
+// the version of the secret file that it applies to. Records for any other
+// version are ignored, and keys that are missing from a record are deleted.
+#define JOURNAL_SUFFIX     ".journal"
+#define JOURNAL_COMMIT     "\" JOURNAL_COMMIT"
+#define JOURNAL_MAX_SIZE   (16*1024)
+#define JOURNAL_TAG_SIZE   80
+
+// Returns true, if "line" holds a key that the "volatile_keys" option
+// lists. The option is a comma separated list of key names. A trailing '*'
+// matches all keys starting with the given prefix.
+static int is_volatile_line(const Params *params, const char *line) {
+  if (!params->volatile_keys || line[0] != '"' || line[1] != ' ') {
+    return 0;
   }
-  return secret;
+  const char *key = line + 2;
+  const size_t key_len = strcspn(key, " \t\r\n");
+  for (const char *ptr = params->volatile_keys; *ptr; ) {
+    const size_t len = strcspn(ptr, ",");
+    if (len && ptr[len-1] == '*') {
+      if (key_len >= len - 1 && !memcmp(key, ptr, len - 1)) {
+        return 1;
+      }
+    } else if (len == key_len && !memcmp(key, ptr, len)) {
+      return 1;
+    }
+    ptr += len;
+    ptr += strspn(ptr, ",");
+  }
+  return 0;
 }
 
-#ifdef TESTING
-static time_t current_time;
-void set_time(time_t t) __attribute__((visibility("default")));
-void set_time(time_t t) {
-  current_time = t;
+// Advances "line" to the next line in the buffer that does not hold a
+// volatile key.
+static const char *next_durable_line(const Params *params, const char *line) {
+  while (*line && is_volatile_line(params, line)) {
+    line += strcspn(line, "\r\n");
+    line += strspn(line, "\r\n");
+  }
+  return line;
 }
 
-static time_t get_time(void) {
-  return current_time;
-}
-#else
-static time_t get_time(void) {
-  return time(NULL);
+// Returns true, if the two buffers only differ in volatile keys.
+static int same_durable_state(const Params *params,
+                              const char *a, const char *b) {
+  for (;;) {
+    a = next_durable_line(params, a);
+    b = next_durable_line(params, b);
+    if (!*a || !*b) {
+      return !*a && !*b;
+    }
+    const size_t a_len = strcspn(a, "\r\n");
+    const size_t b_len = strcspn(b, "\r\n");
+    if (a_len != b_len || memcmp(a, b, a_len)) {
+      return 0;
+    }
+    a += a_len;
+    a += strspn(a, "\r\n");
+    b += b_len;
+    b += strspn(b, "\r\n");
+  }
 }
-#endif
 
-static int comparator(const void *a, const void *b) {
-  return *(unsigned int *)a - *(unsigned int *)b;
+// Formats the commit line that binds a record to the secret file "sb".
+// Returns the length of the line, including its terminator.
+static size_t journal_tag(const struct stat *sb, char *tag) {
+  return snprintf(tag, JOURNAL_TAG_SIZE, JOURNAL_COMMIT " %llu %lld %lld\n",
+                  (unsigned long long)sb->st_ino, (long long)sb->st_size,
+                  (long long)sb->st_mtime);
 }
 
-static char *get_cfg_value(pam_handle_t *pamh, const char *key,
-                           const char *buf) {
-  const size_t key_len = strlen(key);
-  for (const char *line = buf; *line; ) {
-    const char *ptr;
-    if (line[0] == '"' && line[1] == ' ' && !strncmp(line+2, key, key_len) &&
-        (!*(ptr = line+2+key_len) || *ptr == ' ' || *ptr == '\t' ||
-         *ptr == '\r' || *ptr == '\n')) {
-      ptr += strspn(ptr, " \t");
-      size_t val_len = strcspn(ptr, "\r\n");
-      char *val = malloc(val_len + 1);
-      if (!val) {
-        log_message(LOG_ERR, pamh, "Out of memory");
-        return &oom;
-      } else {
-        memcpy(val, ptr, val_len);
-        val[val_len] = '\000';
-        return val;
-      }
-    } else {
-      line += strcspn(line, "\r\n");
-      line += strspn(line, "\r\n");
+// Returns true, if the record in "start" to "stop" sets "key".
+static int journal_has_key(const char *start, const char *stop,
+                           const char *key, size_t key_len) {
+  for (const char *line = start; line < stop; ) {
+    if (line[0] == '"' && line[1] == ' ' &&
+        strcspn(line + 2, " \t\r\n") == key_len &&
+        !memcmp(line + 2, key, key_len)) {
+      return 1;
     }
+    line += strcspn(line, "\r\n");
+    line += strspn(line, "\r\n");
   }
-  return NULL;
+  return 0;
 }
 
-static int set_cfg_value(pam_handle_t *pamh, const char *key, const char *val,
-                         char **buf) {
-  const size_t key_len = strlen(key);
-  char *start = NULL;
-  char *stop = NULL;
-
-  // Find an existing line, if any.
-  for (char *line = *buf; *line; ) {
-    char *ptr;
-    if (line[0] == '"' && line[1] == ' ' && !strncmp(line+2, key, key_len) &&
-        (!*(ptr = line+2+key_len) || *ptr == ' ' || *ptr == '\t' ||
-         *ptr == '\r' || *ptr == '\n')) {
-      start = line;
-      stop  = start + strcspn(start, "\r\n");
-      stop += strspn(stop, "\r\n");
-      break;
-    } else {
-      line += strcspn(line, "\r\n");
-      line += strspn(line, "\r\n");
-    }
+static char *journal_filename(const char *secret_filename) {
+  const size_t len = strlen(secret_filename) + sizeof(JOURNAL_SUFFIX);
+  char *fn = malloc(len);
+  if (fn) {
+    snprintf(fn, len, "%s" JOURNAL_SUFFIX, secret_filename);
   }
+  return fn;
+}
 
-  // If no existing line, insert immediately after the first line.
-  if (!start) {
-    start  = *buf + strcspn(*buf, "\r\n");
-    start += strspn(start, "\r\n");
-    stop   = start;
+// Merge the last complete record from the journal, if any, into "buf".
+// A missing or unusable journal is not an error, as it only holds state
+// that could be lost anyway.
+// Return 0 on success, -1 if we ran out of memory.
+static int apply_journal(pam_handle_t *pamh, const Params *params,
+                         const char *secret_filename,
+                         const struct stat *orig_stat, Config *cfg) {
+  char *fn = journal_filename(secret_filename);
+  if (!fn) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+  const int fd = open_in_dir(params, fn, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+  if (fd < 0) {
+    free(fn);
+    return 0;
+  }
+  int rc = 0;
+  struct stat sb;
+  char *journal;
+  if (fstat(fd, &sb) ||
+      !S_ISREG(sb.st_mode) ||
+      sb.st_uid != orig_stat->st_uid ||
+      (sb.st_mode & (S_IWGRP | S_IWOTH)) ||
+      sb.st_size > JOURNAL_MAX_SIZE) {
+    log_message(LOG_WARNING, pamh, "Ignoring journal \"%s\"", fn);
+    goto out;
+  }
+  if (!(journal = arena_alloc(cfg->arena, sb.st_size + 1))) {
+    rc = -1;
+    goto out;
+  }
+  const ssize_t len = read(fd, journal, sb.st_size);
+  if (len < 0 || memchr(journal, 0, len)) {
+    goto out;
+  }
+  journal[len] = '\000';
+
+  // Find the last record that was written completely, for this version of
+  // the secret file. Left over records for a file that has since been
+  // replaced are skipped.
+  char tag[JOURNAL_TAG_SIZE];
+  const size_t tag_len = journal_tag(orig_stat, tag);
+  const char *start = NULL, *stop = NULL;
+  for (const char *rec = journal, *line = journal; *line; ) {
+    const size_t line_len = strcspn(line, "\r\n");
+    const char *next = line + line_len + strspn(line + line_len, "\r\n");
+    if (!strncmp(line, JOURNAL_COMMIT " ", sizeof(JOURNAL_COMMIT))) {
+      if (line_len == tag_len - 1 && !memcmp(line, tag, line_len)) {
+        start = rec;
+        stop = line;
+      }
+      rec = next;
+    }
+    line = next;
+  }
+  if (!start) {
+    goto out;
   }
 
-  // Replace [start..stop] with the new contents.
-  const size_t val_len = strlen(val);
-  const size_t total_len = key_len + val_len + 4;
-  if (total_len <= stop - start) {
-    // We are decreasing out space requirements. Shrink the buffer and pad with
-    // NUL characters.
-    const size_t tail_len = strlen(stop);
-    memmove(start + total_len, stop, tail_len + 1);
-    memset(start + total_len + tail_len, 0, stop - start - total_len + 1);
-  } else {
-    // Must resize existing buffer. We cannot call realloc(), as it could
-    // leave parts of the buffer content in unused parts of the heap.
-    const size_t buf_len = strlen(*buf);
-    const size_t tail_len = buf_len - (stop - *buf);
-    char *resized = malloc(buf_len - (stop - start) + total_len + 1);
-    if (!resized) {
-      log_message(LOG_ERR, pamh, "Out of memory");
-      return -1;
+  // Volatile keys that the record does not hold were deleted.
+  for (int i = 0; i < cfg->num_lines; ++i) {
+    CfgLine *line = cfg->lines + i;
+    if (!line->deleted && line->key_len &&
+        is_volatile_line(params, line->text) &&
+        !journal_has_key(start, stop, line->text + 2, line->key_len)) {
+      line->deleted = 1;
     }
-    memcpy(resized, *buf, start - *buf);
-    memcpy(resized + (start - *buf) + total_len, stop, tail_len + 1);
-    memset(*buf, 0, buf_len);
-    free(*buf);
-    start = start - *buf + resized;
-    *buf = resized;
-  }
-
-  // Fill in new contents.
-  start[0] = '"';
-  start[1] = ' ';
-  memcpy(start + 2, key, key_len);
-  start[2+key_len] = ' ';
-  memcpy(start+3+key_len, val, val_len);
-  start[3+key_len+val_len] = '\n';
-
-  // Check if there are any other occurrences of "value". If so, delete them.
-  for (char *line = start + 4 + key_len + val_len; *line; ) {
-    char *ptr;
-    if (line[0] == '"' && line[1] == ' ' && !strncmp(line+2, key, key_len) &&
-        (!*(ptr = line+2+key_len) || *ptr == ' ' || *ptr == '\t' ||
-         *ptr == '\r' || *ptr == '\n')) {
-      start = line;
-      stop = start + strcspn(start, "\r\n");
-      stop += strspn(stop, "\r\n");
-      size_t tail_len = strlen(stop);
-      memmove(start, stop, tail_len + 1);
-      memset(start + tail_len, 0, stop - start);
-      line = start;
-    } else {
-      line += strcspn(line, "\r\n");
-      line += strspn(line, "\r\n");
+  }
+
+  for (const char *line = start; line < stop; ) {
+    const size_t line_len = strcspn(line, "\r\n");
+    if (is_volatile_line(params, line)) {
+      char *copy = arena_strndup(cfg->arena, line + 2, line_len - 2);
+      if (!copy) {
+        rc = -1;
+        goto out;
+      }
+      char *val = copy + strcspn(copy, " \t");
+      if (*val) {
+        *val++ = '\000';
+        val += strspn(val, " \t");
+      }
+      if (set_cfg_value(pamh, copy, val, cfg) < 0) {
+        rc = -1;
+        goto out;
+      }
     }
+    line += line_len;
+    line += strspn(line, "\r\n");
+  }
+  if (params->debug) {
+    log_message(LOG_INFO, pamh, "debug: journal \"%s\" applied", fn);
   }
 
-  return 0;
+out:
+  close(fd);
+  free(fn);
+  return rc;
+}
+
+// If "buf" only differs from the original file contents in volatile keys,
+// append all volatile keys to the journal. If the secret file changed since
+// it was read, the record would be stale, and the file is written instead.
+// Return 0 when done, or non-zero if the secret file must be written.
+static int write_journal(pam_handle_t *pamh, const Params *params,
+                         const char *secret_filename,
+                         const struct stat *orig_stat,
+                         const Config *cfg, const char *buf) {
+  if (!same_durable_state(params, cfg->buf, buf)) {
+    return -1;
+  }
+
+  struct stat sb;
+  if (stat_in_dir(params, secret_filename, &sb) ||
+      sb.st_ino != orig_stat->st_ino ||
+      sb.st_size != orig_stat->st_size ||
+      sb.st_mtime != orig_stat->st_mtime) {
+    return -1;
+  }
+
+  // Assemble the record, so that it can be appended with a single write.
+  char *record = arena_alloc(cfg->arena, strlen(buf) + JOURNAL_TAG_SIZE);
+  if (!record) {
+    return -1;
+  }
+  char *ptr = record;
+  for (const char *line = buf; *line; ) {
+    const size_t line_len = strcspn(line, "\r\n");
+    if (is_volatile_line(params, line)) {
+      memcpy(ptr, line, line_len);
+      ptr += line_len;
+      *ptr++ = '\n';
+    }
+    line += line_len;
+    line += strspn(line, "\r\n");
+  }
+  const size_t record_len = ptr - record + journal_tag(orig_stat, ptr);
+
+  int err = -1;
+  char *fn = journal_filename(secret_filename);
+  const int flags = O_WRONLY | O_APPEND | O_NOFOLLOW | O_CLOEXEC;
+  int fd = fn ? open_in_dir(params, fn, flags | O_CREAT | O_EXCL, 0600) : -1;
+  if (fd >= 0) {
+    if (chown_like(params, fd, orig_stat)) {
+      close(fd);
+      fd = -1;
+    }
+  } else if (fn && errno == EEXIST) {
+    fd = open_in_dir(params, fn, flags, 0);
+  }
+  if (fd >= 0 &&
+      !fstat(fd, &sb) &&
+      S_ISREG(sb.st_mode) &&
+      sb.st_uid == orig_stat->st_uid &&
+      sb.st_size + record_len <= JOURNAL_MAX_SIZE) {
+    // A journal that grew too large is compacted by writing the secret file.
+    err = full_write(fd, record, record_len);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!err && params->debug) {
+    log_message(LOG_INFO, pamh, "debug: journal \"%s\" written", fn);
+  }
+  free(fn);
+  return err;
+}
+
+// After writing the secret file, the journal no longer holds any state.
+static void remove_journal(pam_handle_t *pamh, const Params *params,
+                           const char *secret_filename) {
+  char *fn = journal_filename(secret_filename);
+  if (fn && unlink_in_dir(params, fn) && errno != ENOENT) {
+    log_message(LOG_ERR, pamh, "Failed to delete journal \"%s\": %s",
+                fn, strerror(errno));
+  }
+  free(fn);
+}
+
+// Decode the secret on the first line of "cfg". Return pointer to secret in
+// the arena on success, NULL on error. Length of secret stored in *secretLen.
+static uint8_t *decode_secret(const Config *cfg, int *secretLen) {
+  const char *buf = cfg->buf;
+  if (!buf) {
+    return NULL;
+  }
+  // Decode secret key
+  const int base32Len = strcspn(buf, "\n");
+
+  // Arbitrary limit to prevent integer overflow.
+  if (base32Len > 100000) {
+    return NULL;
+  }
+
+  *secretLen = (base32Len*5 + 7)/8;
+  uint8_t *secret = arena_alloc(cfg->arena, base32Len + 1);
+  if (secret == NULL) {
+    *secretLen = 0;
+    return NULL;
+  }
+  memcpy(secret, buf, base32Len);
+  secret[base32Len] = '\000';
+  if ((*secretLen = base32_decode(secret, secret, base32Len)) < 1) {
+    return NULL;
+  }
+  memset(secret + *secretLen, 0, base32Len + 1 - *secretLen);
+  return secret;
+}
+
+// given secret file content (cfg), extract the secret and base32 decode it.
+//
+// Return pointer to secret in the arena on success, NULL on error. Length of
+// secret stored in *secretLen.
+static uint8_t *get_shared_secret(pam_handle_t *pamh,
+                                  const Params *params,
+                                  const char *secret_filename,
+                                  const Config *cfg, int *secretLen) {
+  if (!cfg->buf) {
+    return NULL;
+  }
+  uint8_t *secret = decode_secret(cfg, secretLen);
+  if (!secret) {
+    log_message(LOG_ERR, pamh,
+                "Could not find a valid BASE32 encoded secret in \"%s\"",
+                secret_filename);
+    return NULL;
+  }
+
+  if(params->debug) {
+    log_message(LOG_INFO, pamh, "debug: shared secret in \"%s\" processed", secret_filename);
+  }
+  return secret;
+}
+
+// With "secret_cache", the line index and the decoded secret of a secret
+// file are kept across calls, for as long as the file stays the same. The
+// cached copy is laid out as this header, followed by the lines, the secret
+// and the file contents.
+typedef struct CachedConfig {
+  int        num_lines;
+  int        secretLen;
+  size_t     buf_len;
+  CfgLine    lines[];
+} CachedConfig;
+
+// Remember the freshly read "cfg" for the file described by "sb". Nothing
+// is cached, if the secret cannot be decoded.
+static void cfg_to_cache(pam_handle_t *pamh, const Params *params,
+                         const struct stat *sb, const Config *cfg) {
+  int secretLen;
+  const uint8_t *secret = decode_secret(cfg, &secretLen);
+  if (!secret) {
+    return;
+  }
+  const size_t lines_len = cfg->num_lines * sizeof(CfgLine);
+  const size_t buf_len = strlen(cfg->buf) + 1;
+  const size_t size = sizeof(CachedConfig) + lines_len + secretLen + buf_len;
+  CachedConfig *cached = arena_alloc(cfg->arena, size);
+  if (!cached) {
+    return;
+  }
+  cached->num_lines = cfg->num_lines;
+  cached->secretLen = secretLen;
+  cached->buf_len = buf_len;
+  memcpy(cached->lines, cfg->lines, lines_len);
+  uint8_t *ptr = (uint8_t *)cached->lines + lines_len;
+  memcpy(ptr, secret, secretLen);
+  memcpy(ptr + secretLen, cfg->buf, buf_len);
+  const int err = secret_cache_put(sb, cached, size, params->secret_cache);
+  if (err && params->debug) {
+    log_message(LOG_INFO, pamh, "debug: cannot cache secret: %s",
+                strerror(err));
+  }
+}
+
+// Restore "cfg" and the decoded secret from the cache, if the file
+// described by "sb" has not changed since it was cached. Return pointers
+// into the arena, or NULL if nothing was found.
+static uint8_t *cfg_from_cache(const struct stat *sb, Config *cfg,
+                               int *secretLen) {
+  size_t size;
+  CachedConfig *cached = secret_cache_get(sb, cfg->arena, &size);
+  if (!cached) {
+    return NULL;
+  }
+  uint8_t *secret = (uint8_t *)(cached->lines + cached->num_lines);
+  char *buf = (char *)secret + cached->secretLen;
+
+  // Only the file contents moved. Lines have not been patched yet, so they
+  // all point into the contents, one after the other.
+  cfg_clear(cfg);
+  cfg->buf = buf;
+  cfg->lines = cached->lines;
+  cfg->num_lines = cfg->max_lines = cached->num_lines;
+  for (int i = 0; i < cfg->num_lines; ++i) {
+    cfg->lines[i].text = buf;
+    buf += cfg->lines[i].len + cfg->lines[i].term_len;
+  }
+  *secretLen = cached->secretLen;
+  return secret;
+}
+
+#ifdef TESTING
+static time_t current_time;
+void set_time(time_t t) __attribute__((visibility("default")));
+void set_time(time_t t) {
+  __atomic_store_n(&current_time, t, __ATOMIC_RELAXED);
+}
+
+static time_t get_time(void) {
+  return __atomic_load_n(&current_time, __ATOMIC_RELAXED);
+}
+#else
+static time_t get_time(void) {
+  return time(NULL);
+}
+#endif
+
+static int comparator(const void *a, const void *b) {
+  return *(unsigned int *)a - *(unsigned int *)b;
 }
 
 static int step_size(pam_handle_t *pamh, const char *secret_filename,
-                     const char *buf) {
-  const char *value = get_cfg_value(pamh, "STEP_SIZE", buf);
+                     const Config *cfg) {
+  const char *value = get_cfg_value(pamh, "STEP_SIZE", cfg);
   if (!value) {
     // Default step size is 30.
     return 30;
@@ -898,29 +1748,27 @@ static int step_size(pam_handle_t *pamh, const char *secret_filename,
       (*endptr && *endptr != ' ' && *endptr != '\t' &&
        *endptr != '\n' && *endptr != '\r') ||
       step < 1 || step > 60) {
-    free((void *)value);
     log_message(LOG_ERR, pamh, "Invalid STEP_SIZE option in \"%s\"",
                 secret_filename);
     return 0;
   }
-  free((void *)value);
   return step;
 }
 
 static int get_timestamp(pam_handle_t *pamh, const char *secret_filename,
-                         const char **buf) {
-  const int step = step_size(pamh, secret_filename, *buf);
+                         const Config *cfg) {
+  const int step = step_size(pamh, secret_filename, cfg);
   if (!step) {
     return 0;
   }
   return get_time()/step;
 }
 
-static long get_hotp_counter(pam_handle_t *pamh, const char *buf) {
-  if (!buf) {
+static long get_hotp_counter(pam_handle_t *pamh, const Config *cfg) {
+  if (!cfg->buf) {
     return -1;
   }
-  const char *counter_str = get_cfg_value(pamh, "HOTP_COUNTER", buf);
+  const char *counter_str = get_cfg_value(pamh, "HOTP_COUNTER", cfg);
   if (counter_str == &oom) {
     // Out of memory. This is a fatal error
     return -1;
@@ -930,128 +1778,266 @@ static long get_hotp_counter(pam_handle_t *pamh, const char *buf) {
   if (counter_str) {
     counter = strtol(counter_str, NULL, 10);
   }
-  free((void *)counter_str);
 
   return counter;
 }
 
-static int rate_limit(pam_handle_t *pamh, const char *secret_filename,
-                      int *updated, char **buf) {
-  const char *value = get_cfg_value(pamh, "RATE_LIMIT", *buf);
-  if (!value) {
+// The RATE_LIMIT line holds a ring with one slot for each of the "n" most
+// recent login attempts, written as "@head:slots". "head" is the index of
+// the oldest slot, and "slots" are fixed-width hexadecimal time stamps, with
+// zero standing for an unused slot. Reading from "head" onwards, the time
+// stamps are in ascending order. As the line never changes its length, it
+// can be updated in place.
+// Older versions cannot parse the ring. Unless the "rate_limit_ring" option
+// is set, lines that still hold a space-separated list of time stamps are
+// written back in that format.
+#define RATE_LIMIT_MAX_ATTEMPTS 100
+#define RATE_LIMIT_SLOT_DIGITS  8
+
+typedef struct RateLimitRing {
+  unsigned int slots[RATE_LIMIT_MAX_ATTEMPTS];
+  int          size;
+  int          head;
+  int          legacy;  // Read from a space-separated list
+} RateLimitRing;
+
+static unsigned int rate_limit_slot(const RateLimitRing *ring, int k) {
+  return ring->slots[(ring->head + k) % ring->size];
+}
+
+// Fills the ring from a list of time stamps, keeping the most recent ones.
+// This is only needed for the space-separated decimal list written by older
+// versions, and for rings that have been edited by hand.
+static void rate_limit_ring_fill(RateLimitRing *ring, unsigned int *list,
+                                 int len) {
+  qsort(list, len, sizeof(int), comparator);
+  if (len > ring->size) {
+    list += len - ring->size;
+    len = ring->size;
+  }
+  memset(ring->slots, 0, sizeof(ring->slots));
+  memcpy(ring->slots, list, len * sizeof(int));
+  ring->head = 0;
+}
+
+// Parses the state that follows "n m" in the RATE_LIMIT line.
+// Returns 0 on success, or -1 if the state is malformed.
+static int rate_limit_ring_parse(RateLimitRing *ring, const char *ptr) {
+  unsigned int list[RATE_LIMIT_MAX_ATTEMPTS + 1];
+  int len = 0;
+  if (ptr[strspn(ptr, " \t")] == '@') {
+    ptr += strspn(ptr, " \t") + 1;
+    char *endptr;
+    errno = 0;
+    const long head = strtol(ptr, &endptr, 10);
+    if (errno || endptr == ptr || *endptr != ':' || head < 0) {
+      return -1;
+    }
+    const char *digits = endptr + 1;
+    const size_t num_digits = strspn(digits, "0123456789abcdef");
+    const char *end = digits + num_digits;
+    if (*end && *end != '\r' && *end != '\n') {
+      return -1;
+    }
+    const int num_slots = num_digits / RATE_LIMIT_SLOT_DIGITS;
+    if (num_digits % RATE_LIMIT_SLOT_DIGITS ||
+        num_slots > RATE_LIMIT_MAX_ATTEMPTS ||
+        head >= (num_slots ? num_slots : 1)) {
+      return -1;
+    }
+    for (int i = 0; i < num_slots; ++i) {
+      unsigned int timestamp = 0;
+      for (int j = 0; j < RATE_LIMIT_SLOT_DIGITS; ++j) {
+        const char ch = *digits++;
+        timestamp = (timestamp << 4) | (ch <= '9' ? ch - '0' : ch - 'a' + 10);
+      }
+      ring->slots[i] = timestamp;
+    }
+    ring->legacy = 0;
+
+    // A ring that still has the expected size and order can be used as is.
+    int ordered = num_slots == ring->size;
+    unsigned int prev = 0;
+    for (int k = 0; ordered && k < num_slots; ++k) {
+      const unsigned int timestamp = ring->slots[(head + k) % num_slots];
+      if (timestamp) {
+        ordered = timestamp >= prev;
+        prev = timestamp;
+      }
+    }
+    if (ordered) {
+      ring->head = head;
+      return 0;
+    }
+    for (int i = 0; i < num_slots; ++i) {
+      if (ring->slots[i]) {
+        list[len++] = ring->slots[i];
+      }
+    }
+  } else {
+    ring->legacy = 1;
+    while (*ptr && *ptr != '\r' && *ptr != '\n') {
+      const char *start = ptr;
+      char *endptr;
+      errno = 0;
+      const unsigned int timestamp = (unsigned int)strtoul(ptr, &endptr, 10);
+      if ((*start != ' ' && *start != '\t') || errno || endptr == start) {
+        return -1;
+      }
+      ptr = endptr;
+      // Only the most recent attempts matter, but the list is not
+      // necessarily sorted.
+      if (len == RATE_LIMIT_MAX_ATTEMPTS + 1) {
+        qsort(list, len, sizeof(int), comparator);
+        memmove(list, list + 1, --len * sizeof(int));
+      }
+      list[len++] = timestamp;
+    }
+  }
+  rate_limit_ring_fill(ring, list, len);
+  return 0;
+}
+
+static void rate_limit_ring_format(const RateLimitRing *ring, int attempts,
+                                   int interval, int legacy, char *buf) {
+  if (legacy) {
+    buf += sprintf(buf, "%d %d", attempts, interval);
+    for (int k = 0; k < ring->size; ++k) {
+      if (rate_limit_slot(ring, k)) {
+        buf += sprintf(buf, " %u", rate_limit_slot(ring, k));
+      }
+    }
+    return;
+  }
+  buf += sprintf(buf, "%d %d @%d:", attempts, interval, ring->head);
+  for (int i = 0; i < ring->size; ++i) {
+    for (int j = RATE_LIMIT_SLOT_DIGITS; j-- > 0; ) {
+      *buf++ = "0123456789abcdef"[(ring->slots[i] >> (4*j)) & 0xF];
+    }
+  }
+  *buf = '\000';
+}
+
+static int rate_limit(pam_handle_t *pamh, const Params *params,
+                      const char *secret_filename,
+                      int *updated, Config *cfg, ShmStore *shm) {
+  // This runs for every single login attempt. Read the line directly,
+  // instead of making a copy of its value.
+  const CfgLine *line = cfg_find(cfg, "RATE_LIMIT");
+  if (!line) {
     // Rate limiting is not enabled for this account
     return 0;
-  } else if (value == &oom) {
-    // Out of memory. This is a fatal error.
-    return -1;
   }
 
   // Parse both the maximum number of login attempts and the time interval
   // that we are looking at.
-  const char *endptr = value, *ptr;
+  const char *endptr = line->text + 2 + line->key_len, *ptr;
   int attempts, interval;
   errno = 0;
   if (((attempts = (int)strtoul(ptr = endptr, (char **)&endptr, 10)) < 1) ||
       ptr == endptr ||
-      attempts > 100 ||
+      attempts > RATE_LIMIT_MAX_ATTEMPTS ||
       errno ||
       (*endptr != ' ' && *endptr != '\t') ||
       ((interval = (int)strtoul(ptr = endptr, (char **)&endptr, 10)) < 1) ||
       ptr == endptr ||
       interval > 3600 ||
       errno) {
-    free((void *)value);
     log_message(LOG_ERR, pamh, "Invalid RATE_LIMIT option. Check \"%s\".",
                 secret_filename);
     return -1;
   }
 
-  // Parse the time stamps of all previous login attempts.
-  const unsigned int now = get_time();
-  unsigned int *timestamps = malloc(sizeof(int));
-  if (!timestamps) {
-  oom:
-    free((void *)value);
-    log_message(LOG_ERR, pamh, "Out of memory");
+  // Load the time stamps of all previous login attempts.
+  RateLimitRing ring = { .size = attempts };
+  if (rate_limit_ring_parse(&ring, endptr)) {
+    log_message(LOG_ERR, pamh, "Invalid list of timestamps in RATE_LIMIT. "
+                "Check \"%s\".", secret_filename);
     return -1;
   }
-  timestamps[0] = now;
-  int num_timestamps = 1;
-  while (*endptr && *endptr != '\r' && *endptr != '\n') {
-    unsigned int timestamp;
-    errno = 0;
-    if ((*endptr != ' ' && *endptr != '\t') ||
-        ((timestamp = (int)strtoul(ptr = endptr, (char **)&endptr, 10)),
-         errno) ||
-        ptr == endptr) {
-      free((void *)value);
-      free(timestamps);
-      log_message(LOG_ERR, pamh, "Invalid list of timestamps in RATE_LIMIT. "
-                  "Check \"%s\".", secret_filename);
-      return -1;
+  const unsigned int now = get_time();
+
+  // With a shared memory table, the attempt is recorded in the table rather
+  // than in the state file. The time stamps from the file only seed new
+  // entries.
+  if (shm) {
+    unsigned int seed[RATE_LIMIT_MAX_ATTEMPTS];
+    int num_seed = 0;
+    for (int k = 0; k < ring.size; ++k) {
+      if (rate_limit_slot(&ring, k)) {
+        seed[num_seed++] = rate_limit_slot(&ring, k);
+      }
     }
-    num_timestamps++;
-    unsigned int *tmp = (unsigned int *)realloc(timestamps,
-                                                sizeof(int) * num_timestamps);
-    if (!tmp) {
-      free(timestamps);
-      goto oom;
+    const int exceeded = shm_store_rate_limit(shm, now, attempts, interval,
+                                              seed, num_seed);
+    if (exceeded >= 0) {
+      if (exceeded) {
+        goto rate_limited;
+      }
+      return 0;
     }
-    timestamps = tmp;
-    timestamps[num_timestamps-1] = timestamp;
-  }
-  free((void *)value);
-  value = NULL;
-
-  // Sort time stamps, then prune all entries outside of the current time
-  // interval.
-  qsort(timestamps, num_timestamps, sizeof(int), comparator);
-  int start = 0, stop = -1;
-  for (int i = 0; i < num_timestamps; ++i) {
-    if (timestamps[i] < now - interval) {
-      start = i+1;
-    } else if (timestamps[i] > now) {
-      break;
+    log_message(LOG_WARNING, pamh, "rate_limit_store is full. Updating \"%s\" "
+                "instead.", secret_filename);
+  }
+
+  // Clear all slots outside of the current time interval. As the ring is in
+  // order, the remaining time stamps form a single run, which starts with
+  // the oldest of them.
+  int first = -1, last = -1, live = 0;
+  for (int k = 0; k < ring.size; ++k) {
+    unsigned int *slot = &ring.slots[(ring.head + k) % ring.size];
+    if (*slot < now - interval || *slot > now) {
+      *slot = 0;
+    } else {
+      if (first < 0) {
+        first = k;
+      }
+      last = k;
+      ++live;
     }
-    stop = i;
   }
-
-  // Error out, if there are too many login attempts.
-  int exceeded = 0;
-  if (stop - start + 1 > attempts) {
-    exceeded = 1;
-    start = stop - attempts + 1;
+  if (live && last - first + 1 != live) {
+    // Unused slots in the middle of the ring. This only happens if the
+    // line was edited by hand.
+    unsigned int list[RATE_LIMIT_MAX_ATTEMPTS];
+    int len = 0;
+    for (int i = 0; i < ring.size; ++i) {
+      if (ring.slots[i]) {
+        list[len++] = ring.slots[i];
+      }
+    }
+    rate_limit_ring_fill(&ring, list, len);
+  } else if (live) {
+    ring.head = (ring.head + first) % ring.size;
   }
 
-  // Construct new list of timestamps within the current time interval.
-  char* list;
-  {
-    const size_t list_size = 25 * (2 + (stop - start + 1)) + 4;
-    list = malloc(list_size);
-    if (!list) {
-      free(timestamps);
-      goto oom;
-    }
-    snprintf(list, list_size, "%d %d", attempts, interval);
-    char *prnt = strchr(list, '\000');
-    for (int i = start; i <= stop; ++i) {
-      prnt += snprintf(prnt, list_size-(prnt-list), " %u", timestamps[i]);
-    }
-    free(timestamps);
+  // Append the current attempt. If the ring is already full of attempts
+  // within the current interval, this replaces the oldest one, and the
+  // login is denied.
+  const int exceeded = live >= attempts;
+  if (exceeded) {
+    ring.slots[ring.head] = now;
+    ring.head = (ring.head + 1) % ring.size;
+  } else {
+    ring.slots[(ring.head + live) % ring.size] = now;
   }
 
-  // Try to update RATE_LIMIT line.
-  if (set_cfg_value(pamh, "RATE_LIMIT", list, buf) < 0) {
-    free(list);
+  // Update the RATE_LIMIT line. Its length only changes, if the line used to
+  // be in a different format.
+  char list[32 + 11*RATE_LIMIT_MAX_ATTEMPTS];
+  rate_limit_ring_format(&ring, attempts, interval,
+                         ring.legacy && !params->rate_limit_ring, list);
+  if (set_cfg_value(pamh, "RATE_LIMIT", list, cfg) < 0 ||
+      cfg_record_edit(pamh, cfg, EDIT_RATE_LIMIT, NULL, NULL, 0, 0) < 0) {
     return -1;
   }
-  free(list);
 
   // Mark the state file as changed.
   *updated = 1;
 
   // If necessary, notify the user of the rate limiting that is in effect.
   if (exceeded) {
+  rate_limited:
     log_message(LOG_ERR, pamh,
                 "Too many concurrent login attempts (\"%s\"). Please try again.", secret_filename);
     return -1;
@@ -1115,6 +2101,31 @@ static char *request_pass(pam_handle_t *pamh, int echocode,
   return ret;
 }
 
+// Marks the scratch code with "hash" in the SCRATCH_CODES line as used.
+// Return 0 on success, 1 if there is no such code that can still be used,
+// or -1 on error.
+static int use_hashed_scratch_code(pam_handle_t *pamh, Config *cfg,
+                                   const char *hash) {
+  const CfgLine *line = cfg_find(cfg, "SCRATCH_CODES");
+  if (!line) {
+    return 1;
+  }
+  const char *value = line->text + 2 + line->key_len;
+  value += strspn(value, " \t");
+  const size_t len = line->text + line->len - value;
+  const int slot = scratch_codes_find(value, len, hash);
+  if (slot < 0 || value[slot] != '+') {
+    return 1;
+  }
+  char *used = arena_strndup(cfg->arena, value, len);
+  if (!used) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+  used[slot] = '-';
+  return set_cfg_value(pamh, "SCRATCH_CODES", used, cfg) < 0 ? -1 : 0;
+}
+
 /* Checks for possible use of scratch codes. Returns -1 on error, 0 on success,
  * and 1, if no scratch code had been entered, and subsequent tests should be
  * applied.
@@ -1122,34 +2133,55 @@ static char *request_pass(pam_handle_t *pamh, int echocode,
 static int check_scratch_codes(pam_handle_t *pamh,
                                const Params *params,
                                const char *secret_filename,
-                               int *updated, char *buf, int code) {
-  // Skip the first line. It contains the shared secret.
-  char *ptr = buf + strcspn(buf, "\n");
+                               int *updated, Config *cfg,
+                               const HMAC_SHA1_CTX *hmac, int code) {
+  // Scratch codes are all eight digits long. Nothing else can match, so
+  // there is no need to look at the file for ordinary verification codes.
+  if (code < 10*1000*1000 || code >= 100*1000*1000) {
+    return 1;
+  }
 
-  // Check if this is one of the scratch codes
-  char *endptr = NULL;
-  for (;;) {
-    // Skip newlines and blank lines
-    while (*ptr == '\r' || *ptr == '\n') {
-      ptr++;
+  // Look up the code in the set of hashed scratch codes, if any.
+  char hash[SCRATCH_HASH_DIGITS + 1];
+  scratch_code_hash(hmac, code, hash);
+  switch (use_hashed_scratch_code(pamh, cfg, hash)) {
+  case 0:
+    if (cfg_record_edit(pamh, cfg, EDIT_SCRATCH_CODE, NULL, hash,
+                        code, 0) < 0) {
+      return -1;
+    }
+    *updated = 1;
+    if (params->debug) {
+      log_message(LOG_INFO, pamh, "debug: hashed scratch code used in \"%s\"",
+                  secret_filename);
     }
+    return 0;
+  case 1:
+    break;
+  default:
+    return -1;
+  }
+
+  // Skip the first line. It contains the shared secret.
+  for (int i = 1; i < cfg->num_lines; ++i) {
+    CfgLine *line = cfg->lines + i;
 
     // Skip any lines starting with double-quotes. They contain option fields
-    if (*ptr == '"') {
-      ptr += strcspn(ptr, "\n");
+    if (line->deleted || line->added || line->text[0] == '"') {
       continue;
     }
 
     // Try to interpret the line as a scratch code
+    char *endptr = NULL;
     errno = 0;
-    const int scratchcode = (int)strtoul(ptr, &endptr, 10);
+    const int scratchcode = (int)strtoul(line->text, &endptr, 10);
 
     // Sanity check that we read a valid scratch code. Scratchcodes are all
     // numeric eight-digit codes. There must not be any other information on
     // that line.
     if (errno ||
-        ptr == endptr ||
-        (*endptr != '\r' && *endptr != '\n' && *endptr) ||
+        line->text == endptr ||
+        endptr != line->text + line->len ||
         scratchcode  <  10*1000*1000 ||
         scratchcode >= 100*1000*1000) {
       break;
@@ -1158,11 +2190,11 @@ static int check_scratch_codes(pam_handle_t *pamh,
     // Check if the code matches
     if (scratchcode == code) {
       // Remove scratch code after using it
-      while (*endptr == '\n' || *endptr == '\r') {
-        ++endptr;
+      line->deleted = 1;
+      if (cfg_record_edit(pamh, cfg, EDIT_SCRATCH_CODE, NULL, NULL,
+                          code, 0) < 0) {
+        return -1;
       }
-      memmove(ptr, endptr, strlen(endptr) + 1);
-      memset(strrchr(ptr, '\000'), 0, endptr - ptr + 1);
 
       // Mark the state file as changed
       *updated = 1;
@@ -1173,7 +2205,6 @@ static int check_scratch_codes(pam_handle_t *pamh,
       }
       return 0;
     }
-    ptr = endptr;
   }
 
   // No scratch code has been used. Continue checking other types of codes.
@@ -1184,8 +2215,8 @@ static int check_scratch_codes(pam_handle_t *pamh,
 }
 
 static int window_size(pam_handle_t *pamh, const char *secret_filename,
-                       const char *buf) {
-  const char *value = get_cfg_value(pamh, "WINDOW_SIZE", buf);
+                       const Config *cfg) {
+  const char *value = get_cfg_value(pamh, "WINDOW_SIZE", cfg);
   if (!value) {
     // Default window size is 3. This gives us one STEP_SIZE second
     // window before and after the current one.
@@ -1202,109 +2233,224 @@ static int window_size(pam_handle_t *pamh, const char *secret_filename,
       (*endptr && *endptr != ' ' && *endptr != '\t' &&
        *endptr != '\n' && *endptr != '\r') ||
       window < 1 || window > 100) {
-    free((void *)value);
     log_message(LOG_ERR, pamh, "Invalid WINDOW_SIZE option in \"%s\"",
                 secret_filename);
     return 0;
   }
-  free((void *)value);
   return window;
 }
 
-/* If the DISALLOW_REUSE option has been set, record timestamps have been
- * used to log in successfully and disallow their reuse.
- *
- * Returns -1 on error, and 0 on success.
- */
-static int invalidate_timebased_code(int tm, pam_handle_t *pamh,
-                                     const char *secret_filename,
-                                     int *updated, char **buf) {
-  char *disallow = get_cfg_value(pamh, "DISALLOW_REUSE", *buf);
-  if (!disallow) {
-    // Reuse of tokens is not explicitly disallowed. Allow the login request
-    // to proceed.
+// The DISALLOW_REUSE line holds the time steps that have been used within
+// the current window, as "@base:bits". The bits are hex digits, with the
+// lowest bit in the first digit. Bit "i" stands for time step "base + i".
+// Windows have at most 100 steps, so 2*100 - 1 bits is all that ever needs
+// to be kept.
+// Older versions cannot parse the bits. Unless the "disallow_reuse_bits"
+// option is set, lines that still list the time steps in decimal are written
+// back in that format.
+#define REUSE_SET_WORDS 4
+
+typedef struct ReuseSet {
+  long     base;
+  uint64_t bits[REUSE_SET_WORDS];
+  int      legacy;  // Read from a list of decimal time steps
+} ReuseSet;
+
+// Returns the 64 bits starting at bit "pos", which can be negative.
+static uint64_t reuse_set_bits(const ReuseSet *set, long pos) {
+  if (pos <= -64 || pos >= 64*REUSE_SET_WORDS) {
     return 0;
-  } else if (disallow == &oom) {
-    // Out of memory. This is a fatal error.
-    return -1;
   }
+  const long word = pos >= 0 ? pos / 64 : -1;
+  const int shift = pos - 64*word;
+  const uint64_t lo = word >= 0 ? set->bits[word] : 0;
+  const uint64_t hi = word + 1 < REUSE_SET_WORDS ? set->bits[word + 1] : 0;
+  return shift ? lo >> shift | hi << (64 - shift) : lo;
+}
 
-  // Allow the user to customize the window size parameter.
-  const int window = window_size(pamh, secret_filename, *buf);
-  if (!window) {
-    // The user configured a non-standard window size, but there was some
-    // error with the value of this parameter.
-    free((void *)disallow);
-    return -1;
+// Moves the set to "base", keeping the first "num_bits" steps from there.
+static void reuse_set_rebase(ReuseSet *set, long base, int num_bits) {
+  long delta = base - set->base;
+  if (delta > 64*(REUSE_SET_WORDS + 1) || delta < -64*(REUSE_SET_WORDS + 1)) {
+    delta = 64*(REUSE_SET_WORDS + 1);
+  }
+  uint64_t bits[REUSE_SET_WORDS];
+  for (int i = 0; i < REUSE_SET_WORDS; ++i) {
+    const int keep = num_bits - 64*i;
+    const uint64_t mask = keep >= 64 ? ~(uint64_t)0
+                          : keep > 0 ? ((uint64_t)1 << keep) - 1 : 0;
+    bits[i] = reuse_set_bits(set, 64*i + delta) & mask;
+  }
+  memcpy(set->bits, bits, sizeof(bits));
+  set->base = base;
+}
+
+static int reuse_set_test(const ReuseSet *set, long step) {
+  const long i = step - set->base;
+  return i >= 0 && i < 64*REUSE_SET_WORDS &&
+         (set->bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void reuse_set_add(ReuseSet *set, long step) {
+  const long i = step - set->base;
+  if (i >= 0 && i < 64*REUSE_SET_WORDS) {
+    set->bits[i / 64] |= (uint64_t)1 << (i % 64);
   }
+}
 
-  // The DISALLOW_REUSE option is followed by all known timestamps that are
-  // currently unavailable for login.
-  for (char *ptr = disallow; *ptr;) {
-    // Skip white-space, if any
+// Parses "value" into "set", which covers "num_bits" steps from "base".
+// Also accepts the older format, which lists the time steps in decimal.
+// Return 0 on success, -1 if the value is invalid.
+static int reuse_set_parse(ReuseSet *set, const char *value, long base,
+                           int num_bits) {
+  memset(set, 0, sizeof(*set));
+  set->base = base;
+  value += strspn(value, " \t");
+  if (*value == '@') {
+    char *endptr;
+    errno = 0;
+    const long old_base = strtol(value + 1, &endptr, 10);
+    if (errno || endptr == value + 1 || *endptr != ':') {
+      return -1;
+    }
+    set->base = old_base;
+    const char *digits = endptr + 1;
+    const size_t len = strspn(digits, "0123456789abcdef");
+    const char *rest = digits + len;
+    rest += strspn(rest, " \t\r\n");
+    if (len > 16*REUSE_SET_WORDS || *rest) {
+      return -1;
+    }
+    for (size_t k = 0; k < len; ++k) {
+      const uint64_t nibble = digits[k] <= '9' ? digits[k] - '0'
+                                               : digits[k] - 'a' + 10;
+      set->bits[k / 16] |= nibble << (4 * (k % 16));
+    }
+    reuse_set_rebase(set, base, num_bits);
+    return 0;
+  }
+  set->legacy = 1;
+  for (const char *ptr = value; *ptr;) {
     ptr += strspn(ptr, " \t\r\n");
     if (!*ptr) {
       break;
     }
-
-    // Parse timestamp value.
     char *endptr;
     errno = 0;
-    const int blocked = (int)strtoul(ptr, &endptr, 10);
-
-    // Treat syntactically invalid options as an error
+    const long blocked = (long)strtoul(ptr, &endptr, 10);
     if (errno ||
         ptr == endptr ||
         (*endptr != ' ' && *endptr != '\t' &&
          *endptr != '\r' && *endptr != '\n' && *endptr)) {
-      free((void *)disallow);
       return -1;
     }
+    // Time steps outside of the window are dropped.
+    if (blocked - base >= 0 && blocked - base < num_bits) {
+      reuse_set_add(set, blocked);
+    }
+    ptr = endptr;
+  }
+  return 0;
+}
 
-    if (tm == blocked) {
-      // The code is currently blocked from use. Disallow login.
-      free((void *)disallow);
-      const int step = step_size(pamh, secret_filename, *buf);
-      if (!step) {
-        return -1;
+// Formats "set" as "@base:bits", or as a list of decimal time steps if
+// "legacy" is set, into an arena allocation.
+static char *reuse_set_format(const ReuseSet *set, int legacy, Arena *arena) {
+  char *buf = arena_alloc(arena, legacy ? 21*64*REUSE_SET_WORDS + 1
+                                        : 24 + 16*REUSE_SET_WORDS + 1);
+  if (!buf) {
+    return NULL;
+  }
+  if (legacy) {
+    char *ptr = buf;
+    for (long i = 0; i < 64*REUSE_SET_WORDS; ++i) {
+      if (reuse_set_test(set, set->base + i)) {
+        ptr += sprintf(ptr, ptr > buf ? " %ld" : "%ld", set->base + i);
       }
-      log_message(LOG_ERR, pamh,
-                  "Trying to reuse a previously used time-based code. (\"%s\")"
-                  "Retry again in %d seconds. "
-                  "Warning! This might mean, you are currently subject to a "
-                  "man-in-the-middle attack.", secret_filename, step);
-      return -1;
     }
+    *ptr = '\000';
+    return buf;
+  }
+  char *ptr = buf + sprintf(buf, "@%ld:", set->base);
+  int len = 16*REUSE_SET_WORDS;
+  while (len > 1 && !((set->bits[(len - 1) / 16] >> (4 * ((len - 1) % 16)))
+                      & 0xF)) {
+    --len;
+  }
+  for (int k = 0; k < len; ++k) {
+    *ptr++ = "0123456789abcdef"[(set->bits[k / 16] >> (4 * (k % 16))) & 0xF];
+  }
+  *ptr = '\000';
+  return buf;
+}
 
-    // If the blocked code is outside of the possible window of timestamps,
-    // remove it from the file.
-    if (blocked - tm >= window || tm - blocked >= window) {
-      endptr += strspn(endptr, " \t");
-      memmove(ptr, endptr, strlen(endptr) + 1);
-    } else {
-      ptr = endptr;
-    }
+/* If the DISALLOW_REUSE option has been set, record timestamps have been
+ * used to log in successfully and disallow their reuse.
+ *
+ * Returns -1 on error, and 0 on success.
+ */
+static int invalidate_timebased_code(int tm, int window, pam_handle_t *pamh,
+                                     const Params *params,
+                                     const char *secret_filename,
+                                     int *updated, Config *cfg,
+                                     StateStore *state) {
+  char *disallow = get_cfg_value(pamh, "DISALLOW_REUSE", cfg);
+  if (!disallow) {
+    // Reuse of tokens is not explicitly disallowed. Allow the login request
+    // to proceed.
+    return 0;
+  } else if (disallow == &oom) {
+    // Out of memory. This is a fatal error.
+    return -1;
   }
 
-  // Add the current timestamp to the list of disallowed timestamps.
-  {
-    const size_t resized_size = strlen(disallow) + 40;
-    char *resized = realloc(disallow, resized_size);
-    if (!resized) {
-      free((void *)disallow);
-      log_message(LOG_ERR, pamh,
-                  "Failed to allocate memory when updating \"%s\"",
-                  secret_filename);
+  // Only time steps within "window" of the current one could still be used
+  // for logging in. Remember those, and forget everything else. Treat
+  // syntactically invalid options as an error.
+  ReuseSet used;
+  if (reuse_set_parse(&used, disallow, (long)tm - (window - 1),
+                      2*window - 1)) {
+    return -1;
+  }
+  if (reuse_set_test(&used, tm)) {
+    // The code is currently blocked from use. Disallow login.
+    goto reused;
+  }
+
+  // With a shared memory table or a state store, codes that have been used
+  // are recorded there. The list in the state file is still honored, but it
+  // is no longer updated.
+  if (state) {
+    const int step = step_size(pamh, secret_filename, cfg);
+    if (!step) {
       return -1;
     }
-    disallow = resized;
-    char* pos = strrchr(disallow, '\000');
-    snprintf(pos, resized_size-(pos-disallow), " %d" + !*disallow, tm);
-    if (set_cfg_value(pamh, "DISALLOW_REUSE", disallow, buf) < 0) {
-      free((void *)disallow);
-      return -1;
+    switch (state_store_disallow_reuse(state, get_time(), tm, window, step)) {
+    case 0:
+      return 0;
+    case 1:
+      goto reused;
+    default:
+      log_message(LOG_WARNING, pamh, "Shared state is unavailable. Updating "
+                  "\"%s\" instead.", secret_filename);
+      break;
     }
-    free((void *)disallow);
+  }
+
+  // Add the current time step to the set of disallowed time steps.
+  reuse_set_add(&used, tm);
+  if (!(disallow = reuse_set_format(&used,
+                                    used.legacy && !params->disallow_reuse_bits,
+                                    cfg->arena))) {
+    log_message(LOG_ERR, pamh,
+                "Failed to allocate memory when updating \"%s\"",
+                secret_filename);
+    return -1;
+  }
+  if (set_cfg_value(pamh, "DISALLOW_REUSE", disallow, cfg) < 0 ||
+      cfg_record_edit(pamh, cfg, EDIT_DISALLOW_REUSE, NULL, NULL,
+                      tm, window) < 0) {
+    return -1;
   }
 
   // Mark the state file as changed
@@ -1312,46 +2458,284 @@ static int invalidate_timebased_code(int tm, pam_handle_t *pamh,
 
   // Allow access.
   return 0;
+
+reused:;
+  const int step = step_size(pamh, secret_filename, cfg);
+  if (!step) {
+    return -1;
+  }
+  log_message(LOG_ERR, pamh,
+              "Trying to reuse a previously used time-based code. (\"%s\")"
+              "Retry again in %d seconds. "
+              "Warning! This might mean, you are currently subject to a "
+              "man-in-the-middle attack.", secret_filename, step);
+  return -1;
 }
 
+/* Dynamically truncate an HMAC value to a 31 bit number, as described in
+ * RFC 4226. The digest length is a compile-time constant in all callers, so
+ * that this is fully unrolled.
+ */
+static inline __attribute__((always_inline)) uint32_t
+truncate_hash(const uint8_t *hash, int len) {
+  const int offset = hash[len - 1] & 0xF;
+  return ((uint32_t)hash[offset] & 0x7F) << 24 |
+         (uint32_t)hash[offset + 1] << 16 |
+         (uint32_t)hash[offset + 2] <<  8 |
+         (uint32_t)hash[offset + 3];
+}
+
+/* The HMAC key schedules of the shared secret. The SHA1 schedule is always
+ * set up, as scratch codes and the skew cache use it, whatever the
+ * algorithm of the verification codes.
+ */
+typedef struct Verifier Verifier;
+typedef struct OtpKey {
+  const Verifier  *verifier;
+  HMAC_SHA1_CTX   sha1;
+  HMAC_SHA256_CTX sha256;
+  HMAC_SHA512_CTX sha512;
+} OtpKey;
+
+/* Verification codes can use any of the hash functions and code lengths
+ * allowed by RFC 6238. Each combination has its own code generator, which
+ * the HASH_ALGORITHM and CODE_DIGITS options select once per call.
+ */
+enum HashAlgorithm { HASH_SHA1, HASH_SHA256, HASH_SHA512 };
+
+struct Verifier {
+  const char *algorithm;
+  enum HashAlgorithm hash;
+  int        digits;
+  int        modulus;  // 10^digits
+  // Computes the codes for "n" consecutive input values, starting at "first"
+  void       (*codes)(const OtpKey *key, unsigned long first, int n,
+                      int *codes);
+};
+
+/* Defines the code generator for one hash function and number of digits.
+ * The HMACs are computed by the multi-buffer kernels of the hash function,
+ * and the modulus is a constant, which the compiler can turn into a
+ * multiplication.
+ */
+#define DEFINE_CODES(sha, SHA, digits, modulus)                               \
+  static void sha##_codes_##digits(const OtpKey *key, unsigned long first,    \
+                                   int n, int *codes) {                       \
+    uint8_t hash[4*SHA##_LANES][SHA##_DIGEST_LENGTH];                         \
+    const int batch = sizeof(hash)/sizeof(*hash);                             \
+    for (int i = 0; i < n; i += batch) {                                      \
+      const int count = n - i < batch ? n - i : batch;                        \
+      hmac_##sha##_counters(&key->sha, first + i, count, hash);               \
+      for (int j = 0; j < count; ++j) {                                       \
+        codes[i + j] = truncate_hash(hash[j], SHA##_DIGEST_LENGTH) % modulus; \
+      }                                                                       \
+    }                                                                         \
+    explicit_bzero(hash, sizeof(hash));                                       \
+  }
+
+DEFINE_CODES(sha1,   SHA1,   6, 1000000)
+DEFINE_CODES(sha1,   SHA1,   8, 100000000)
+DEFINE_CODES(sha256, SHA256, 6, 1000000)
+DEFINE_CODES(sha256, SHA256, 8, 100000000)
+DEFINE_CODES(sha512, SHA512, 6, 1000000)
+DEFINE_CODES(sha512, SHA512, 8, 100000000)
+
+// The first entry is the default.
+static const Verifier verifiers[] = {
+  { "SHA1",   HASH_SHA1,   6, 1000000,   sha1_codes_6   },
+  { "SHA1",   HASH_SHA1,   8, 100000000, sha1_codes_8   },
+  { "SHA256", HASH_SHA256, 6, 1000000,   sha256_codes_6 },
+  { "SHA256", HASH_SHA256, 8, 100000000, sha256_codes_8 },
+  { "SHA512", HASH_SHA512, 6, 1000000,   sha512_codes_6 },
+  { "SHA512", HASH_SHA512, 8, 100000000, sha512_codes_8 },
+};
+
+/* Picks the code generator that the HASH_ALGORITHM and CODE_DIGITS options
+ * ask for. Returns NULL on error.
+ */
+static const Verifier *select_verifier(pam_handle_t *pamh,
+                                       const char *secret_filename,
+                                       const Config *cfg) {
+  const char *algorithm = get_cfg_value(pamh, "HASH_ALGORITHM", cfg);
+  const char *digits = get_cfg_value(pamh, "CODE_DIGITS", cfg);
+  if (algorithm == &oom || digits == &oom) {
+    // Out of memory. This is a fatal error.
+    return NULL;
+  }
+  if (!algorithm) {
+    algorithm = verifiers[0].algorithm;
+  }
+  const int n = digits ? (int)strtol(digits, NULL, 10) : verifiers[0].digits;
+  for (size_t i = 0; i < sizeof(verifiers)/sizeof(*verifiers); ++i) {
+    if (!strcmp(algorithm, verifiers[i].algorithm) &&
+        n == verifiers[i].digits) {
+      return verifiers + i;
+    }
+  }
+  log_message(LOG_ERR, pamh,
+              "Invalid HASH_ALGORITHM or CODE_DIGITS option in \"%s\"",
+              secret_filename);
+  return NULL;
+}
+
+/* Derives the HMAC key schedules from the shared secret.
+ */
+static void init_otp_key(OtpKey *key, const Verifier *verifier,
+                         const uint8_t *secret, int secretLen) {
+  key->verifier = verifier;
+  hmac_sha1_init(&key->sha1, secret, secretLen);
+  switch (verifier->hash) {
+  case HASH_SHA256:
+    hmac_sha256_init(&key->sha256, secret, secretLen);
+    break;
+  case HASH_SHA512:
+    hmac_sha512_init(&key->sha512, secret, secretLen);
+    break;
+  default:
+    break;
+  }
+}
+
+static void clear_otp_key(OtpKey *key) {
+  explicit_bzero(key, sizeof(*key));
+}
+
+/* Looks for "code" among the hash codes of the "n" consecutive input values
+ * starting at "first", and returns the offset of the first match, or -1.
+ * All codes are computed and compared, and the comparison does not branch on
+ * the codes. So, the time that this takes only depends on "n", not on
+ * whether, or where, the code matched.
+ */
+static int find_hmac_code(const OtpKey *key, unsigned long first,
+                          int n, int code) {
+  int codes[4*SHA1_LANES];
+  const int batch = sizeof(codes)/sizeof(*codes);
+  uint32_t found = 0, offset = 0;
+  for (int i = 0; i < n; i += batch) {
+    const int count = n - i < batch ? n - i : batch;
+    key->verifier->codes(key, first + i, count, codes);
+    for (int j = 0; j < count; ++j) {
+      // "hit" is 1 for the first match, and 0 otherwise.
+      const uint32_t diff = (uint32_t)codes[j] ^ (uint32_t)code;
+      const uint32_t hit = ~found & (((diff | -diff) >> 31) ^ 1);
+      offset |= (uint32_t)(i + j) & -hit;
+      found |= hit;
+    }
+  }
+  explicit_bzero(codes, sizeof(codes));
+  return found ? (int)offset : -1;
+}
+
+#ifdef TESTING
 /* Given an input value, this function computes the hash code that forms the
  * expected authentication token.
  */
-#ifdef TESTING
 int compute_code(const uint8_t *secret, int secretLen, unsigned long value)
   __attribute__((visibility("default")));
-#else
-static
-#endif
 int compute_code(const uint8_t *secret, int secretLen, unsigned long value) {
-  uint8_t val[8];
-  for (int i = 8; i--; value >>= 8) {
-    val[i] = value;
+  int code;
+  OtpKey key;
+  init_otp_key(&key, verifiers, secret, secretLen);
+  key.verifier->codes(&key, value, 1, &code);
+  clear_otp_key(&key);
+  return code;
+}
+
+/* Computes the hash codes for "n" consecutive input values.
+ */
+void compute_codes(const uint8_t *secret, int secretLen, unsigned long first,
+                   int n, int *codes)
+  __attribute__((visibility("default")));
+void compute_codes(const uint8_t *secret, int secretLen, unsigned long first,
+                   int n, int *codes) {
+  OtpKey key;
+  init_otp_key(&key, verifiers, secret, secretLen);
+  key.verifier->codes(&key, first, n, codes);
+  clear_otp_key(&key);
+}
+#endif
+
+/* Large time skew searches are split into chunks, which the calling thread
+ * and up to SKEW_SEARCH_MAX_THREADS - 1 helper threads claim one at a time.
+ * Every chunk is always computed, so the time that the search takes does
+ * not depend on where, or whether, the code matched.
+ */
+typedef struct SkewSearch {
+  const OtpKey        *key;
+  unsigned long       first;
+  int                 n;
+  int                 *codes;
+  int                 next;
+} SkewSearch;
+
+static void *skew_search_worker(void *arg) {
+  SkewSearch *search = (SkewSearch *)arg;
+  for (;;) {
+    const int i = __atomic_fetch_add(&search->next, SKEW_SEARCH_CHUNK,
+                                     __ATOMIC_RELAXED);
+    if (i >= search->n) {
+      return NULL;
+    }
+    const int count = search->n - i < SKEW_SEARCH_CHUNK
+      ? search->n - i : SKEW_SEARCH_CHUNK;
+    search->key->verifier->codes(search->key, search->first + i, count,
+                                 search->codes + i);
+  }
+}
+
+static void compute_skew_candidates(const OtpKey *key,
+                                    unsigned long first, int n, int *codes) {
+  SkewSearch search = { key, first, n, codes, 0 };
+  pthread_t threads[SKEW_SEARCH_MAX_THREADS - 1];
+  int num_threads = 0;
+  if (n > 2*SKEW_SEARCH_CHUNK) {
+    long want = sysconf(_SC_NPROCESSORS_ONLN);
+    if (want > SKEW_SEARCH_MAX_THREADS) {
+      want = SKEW_SEARCH_MAX_THREADS;
+    }
+    if (want > (n + SKEW_SEARCH_CHUNK - 1) / SKEW_SEARCH_CHUNK) {
+      want = (n + SKEW_SEARCH_CHUNK - 1) / SKEW_SEARCH_CHUNK;
+    }
+    // If threads cannot be created, the remaining chunks are computed here.
+    while (num_threads < want - 1 &&
+           !pthread_create(threads + num_threads, NULL, skew_search_worker,
+                           &search)) {
+      ++num_threads;
+    }
   }
-  uint8_t hash[SHA1_DIGEST_LENGTH];
-  hmac_sha1(secret, secretLen, val, 8, hash, SHA1_DIGEST_LENGTH);
-  explicit_bzero(val, sizeof(val));
-  const int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
-  unsigned int truncatedHash = 0;
-  for (int i = 0; i < 4; ++i) {
-    truncatedHash <<= 8;
-    truncatedHash  |= hash[offset + i];
+  skew_search_worker(&search);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
   }
-  explicit_bzero(hash, sizeof(hash));
-  truncatedHash &= 0x7FFFFFFF;
-  truncatedHash %= 1000000;
-  return truncatedHash;
+}
+
+/* Identifies the shared secret in the skew cache or in the state store,
+ * without revealing it. The message is not eight bytes long, so it never
+ * collides with a code. Codes other than six digit HMAC_SHA1 ones are kept
+ * under a different id.
+ */
+static void otp_key_id(const OtpKey *key, const char *purpose,
+                       uint8_t id[SHA1_DIGEST_LENGTH]) {
+  char label[40];
+  if (key->verifier != verifiers) {
+    snprintf(label, sizeof(label), "%s %s %d", purpose,
+             key->verifier->algorithm, key->verifier->digits);
+  } else {
+    snprintf(label, sizeof(label), "%s", purpose);
+  }
+  hmac_sha1_compute(&key->sha1, (const uint8_t *)label, strlen(label),
+                    id, SHA1_DIGEST_LENGTH);
 }
 
 /* If a user repeated attempts to log in with the same time skew, remember
  * this skew factor for future login attempts.
  */
 static int check_time_skew(pam_handle_t *pamh,
-                           int *updated, char **buf, int skew, int tm) {
+                           int *updated, Config *cfg, int skew, int tm) {
   int rc = -1;
 
   // Parse current RESETTING_TIME_SKEW line, if any.
-  char *resetting = get_cfg_value(pamh, "RESETTING_TIME_SKEW", *buf);
+  char *resetting = get_cfg_value(pamh, "RESETTING_TIME_SKEW", cfg);
   if (resetting == &oom) {
     // Out of memory. This is a fatal error.
     return -1;
@@ -1406,11 +2790,9 @@ static int check_time_skew(pam_handle_t *pamh,
     // more times.
     if (num_entries &&
         tm + skew == tms[num_entries-1] + skews[num_entries-1]) {
-      free((void *)resetting);
       return -1;
     }
   }
-  free((void *)resetting);
 
   // Append new timestamp entry
   if (num_entries == sizeof(tms)/sizeof(int)) {
@@ -1446,7 +2828,9 @@ static int check_time_skew(pam_handle_t *pamh,
     // attempts.
     char time_skew[40];
     snprintf(time_skew, sizeof time_skew, "%d", avg_skew);
-    if (set_cfg_value(pamh, "TIME_SKEW", time_skew, buf) < 0) {
+    if (set_cfg_value(pamh, "TIME_SKEW", time_skew, cfg) < 0 ||
+        cfg_record_edit(pamh, cfg, EDIT_SET, "TIME_SKEW", time_skew,
+                        0, 0) < 0) {
       return -1;
     }
     rc = 0;
@@ -1465,7 +2849,9 @@ static int check_time_skew(pam_handle_t *pamh,
         snprintf(pos, reset_size-(pos-reset), " %d%+d" + !*reset, tms[i], skews[i]);
       }
     }
-    if (set_cfg_value(pamh, "RESETTING_TIME_SKEW", reset, buf) < 0) {
+    if (set_cfg_value(pamh, "RESETTING_TIME_SKEW", reset, cfg) < 0 ||
+        cfg_record_edit(pamh, cfg, EDIT_SET, "RESETTING_TIME_SKEW", reset,
+                        0, 0) < 0) {
       return -1;
     }
   }
@@ -1481,26 +2867,27 @@ static int check_time_skew(pam_handle_t *pamh,
  * be applied.
  */
 static int check_timebased_code(pam_handle_t *pamh, const char*secret_filename,
-                                int *updated, char **buf, const uint8_t*secret,
-                                int secretLen, int code, Params *params) {
-  if (!is_totp(*buf)) {
+                                int *updated, Config *cfg,
+                                const OtpKey *key,
+                                int code, Params *params) {
+  if (!is_totp(cfg)) {
     // The secret file does not actually contain information for a time-based
     // code. Return to caller and see if any other authentication methods
     // apply.
     return 1;
   }
 
-  if (code < 0 || code >= 1000000) {
-    // All time based verification codes are no longer than six digits.
+  if (code < 0 || code >= key->verifier->modulus) {
+    // The code is longer than the time based verification codes.
     return 1;
   }
 
   // Compute verification codes and compare them with user input
-  const int tm = get_timestamp(pamh, secret_filename, (const char **)buf);
+  const int tm = get_timestamp(pamh, secret_filename, cfg);
   if (!tm) {
     return -1;
   }
-  const char *skew_str = get_cfg_value(pamh, "TIME_SKEW", *buf);
+  const char *skew_str = get_cfg_value(pamh, "TIME_SKEW", cfg);
   if (skew_str == &oom) {
     // Out of memory. This is a fatal error
     return -1;
@@ -1510,135 +2897,275 @@ static int check_timebased_code(pam_handle_t *pamh, const char*secret_filename,
   if (skew_str) {
     skew = (int)strtol(skew_str, NULL, 10);
   }
-  free((void *)skew_str);
 
-  const int window = window_size(pamh, secret_filename, *buf);
+  const int window = window_size(pamh, secret_filename, cfg);
   if (!window) {
     return -1;
   }
-  for (int i = -((window-1)/2); i <= window/2; ++i) {
-    const unsigned int hash = compute_code(secret, secretLen, tm + skew + i);
-    if (hash == (unsigned int)code) {
-      return invalidate_timebased_code(tm + skew + i, pamh, secret_filename,
-                                       updated, buf);
-    }
+  const int first = tm + skew - (window-1)/2;
+  const int offset = find_hmac_code(key, first, window, code);
+  if (offset >= 0) {
+    return invalidate_timebased_code(first + offset, window, pamh, params,
+                                     secret_filename, updated, cfg,
+                                     params->state);
   }
 
   if (!params->noskewadj) {
     // The most common failure mode is for the clocks to be insufficiently
     // synchronized. We can detect this and store a skew value for future
     // use.
-    skew = 1000000;
-    for (int i = 0; i < 25*60; ++i) {
-      unsigned int hash = compute_code(secret, secretLen, tm - i);
-      if (hash == (unsigned int)code && skew == 1000000) {
-        // Don't short-circuit out of the loop as the obvious difference in
-        // computation time could be a signal that is valuable to an attacker.
-        skew = -i;
+    //
+    // All candidate codes in the search range are computed in one batch,
+    // before looking for a match.
+    const int steps = params->skew_search_steps;
+    uint8_t id[SHA1_DIGEST_LENGTH];
+    if (params->skew_cache) {
+      otp_key_id(key, "skew cache", id);
+    }
+    if (params->skew_cache &&
+        skew_cache_find(id, tm, steps, code, &skew)) {
+      // A previous attempt in the same time step already computed all
+      // candidates.
+      if (params->debug) {
+        log_message(LOG_INFO, pamh, "debug: time skew candidates cached");
       }
-      hash = compute_code(secret, secretLen, tm + i);
-      if (hash == (unsigned int)code && skew == 1000000) {
-        skew = i;
+    } else {
+      const int n = 2*steps - 1;
+      int *codes = arena_alloc(cfg->arena, n * sizeof(int));
+      if (!codes) {
+        log_message(LOG_ERR, pamh, "Out of memory");
+        return -1;
+      }
+      compute_skew_candidates(key, tm - (steps - 1), n, codes);
+      skew = SKEW_CACHE_NO_MATCH;
+      for (int i = 0; i < steps; ++i) {
+        if (codes[steps - 1 - i] == code && skew == SKEW_CACHE_NO_MATCH) {
+          // Don't short-circuit out of the loop as the obvious difference in
+          // computation time could be a signal that is valuable to an
+          // attacker.
+          skew = -i;
+        }
+        if (codes[steps - 1 + i] == code && skew == SKEW_CACHE_NO_MATCH) {
+          skew = i;
+        }
+      }
+      if (params->skew_cache) {
+        const int err = skew_cache_put(id, tm, steps, codes,
+                                       params->skew_cache);
+        if (err && params->debug) {
+          log_message(LOG_INFO, pamh,
+                      "debug: cannot cache time skew candidates: %s",
+                      strerror(err));
+        }
       }
+      explicit_bzero(codes, n * sizeof(int));
     }
-    if (skew != 1000000) {
+    explicit_bzero(id, sizeof(id));
+    if (skew != SKEW_CACHE_NO_MATCH) {
       if(params->debug) {
         log_message(LOG_INFO, pamh, "debug: time skew adjusted");
       }
-      return check_time_skew(pamh, updated, buf, skew, tm);
+      stats_count(params->stats, STATS_SKEW_ADJUST);
+      return check_time_skew(pamh, updated, cfg, skew, tm);
     }
   }
 
   return 1;
 }
 
-/*
- * Add a 'config' variable that says we logged in from a particular place
- * at a particular time. Only remembers the last 10 logins, which
- * are replaced in LRU order.
- *
- * Returns 0 on success.
- */
-int
-update_logindetails(pam_handle_t *pamh, const Params *params, char **buf) {
-  const char *rhost = get_rhost(pamh, params);
-  const time_t now = get_time();
-  time_t oldest = now;    // Oldest entry seen so far.
-  int oldest_index = -1;  // Index of oldest entry, due for replacement.
-  int found = 0;          // Entry for this rhost found.
-  char name[] = "LAST ";  // Config name template.
-
-  if (rhost == NULL) {
-    return -1;
-  }
+// Logins that start a grace period are kept in a single LAST_LOGINS line,
+// which lists "host timestamp" pairs with the most recent one first. Hosts
+// are looked up in a small open addressing hash table, so that the line
+// only needs to be read once. Older versions kept up to ten separate
+// LAST<n> lines instead, which are merged when the list is next updated.
+#define LAST_LOGINS_MAX_ENTRIES (GRACE_MAX_HOSTS + 10)
+#define LAST_LOGINS_HASH_SIZE   512    // Power of two, at least twice as big
+
+typedef struct LastLogin {
+  const char    *host;
+  int           host_len;
+  unsigned long when;
+} LastLogin;
+
+typedef struct LastLogins {
+  LastLogin entries[LAST_LOGINS_MAX_ENTRIES + 1];
+  int       num_entries;
+  short     hash[LAST_LOGINS_HASH_SIZE];  // Index of entry plus one
+} LastLogins;
+
+static int is_legacy_last_line(const CfgLine *line) {
+  return !line->deleted && line->key_len == 5 &&
+         !memcmp(line->text + 2, "LAST", 4) &&
+         line->text[6] >= '0' && line->text[6] <= '9';
+}
 
-  for (int i = 0; i < 10; i++) {
-    //
-    // Get LAST<n> cfg value.
-    //
-    name[4] = i + '0';
-    char *line = get_cfg_value(pamh, name, *buf);
-    if (line == &oom) {
-      /* Fatal! */
-      return -1;
+// Returns the slot in the hash table, where "host" is or should be stored.
+static short *last_logins_slot(LastLogins *logins, const char *host,
+                               int host_len) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < host_len; ++i) {
+    hash = (hash ^ (uint8_t)host[i]) * 16777619u;
+  }
+  for (;; ++hash) {
+    short *slot = &logins->hash[hash & (LAST_LOGINS_HASH_SIZE - 1)];
+    if (!*slot) {
+      return slot;
     }
-
-    if (!line) {
-      /* Make first empty line the oldest */
-      if (oldest) {
-        oldest_index = i;
-        oldest = 0;
-      }
-      continue;
+    const LastLogin *entry = logins->entries + *slot - 1;
+    if (entry->host_len == host_len && !memcmp(entry->host, host, host_len)) {
+      return slot;
     }
+  }
+}
 
-    //
-    // Parse value.
-    //
+static LastLogin *last_logins_find(LastLogins *logins, const char *host) {
+  const short *slot = last_logins_slot(logins, host, strlen(host));
+  return *slot ? logins->entries + *slot - 1 : NULL;
+}
 
-    // Max len of ipv6 address is 8*4 digits plus 7 colons.
-    // Plus trailing NUL is 40.
-    // But RHOST can be FQDN, and by RFC1035 that's 255 characters as max.
-    char host[256];
-    unsigned long when = 0; // Timestamp of current entry.
-    const int scanf_rc = sscanf(line, " %255[0-9a-zA-Z:.-] %lu ", host, &when);
-    free(line);
+// Records a login from "host" at "when", unless there already is a more
+// recent one.
+static void last_logins_add(LastLogins *logins, const char *host,
+                            int host_len, unsigned long when) {
+  short *slot = last_logins_slot(logins, host, host_len);
+  if (*slot) {
+    LastLogin *entry = logins->entries + *slot - 1;
+    if (entry->when < when) {
+      entry->when = when;
+    }
+  } else if (logins->num_entries < LAST_LOGINS_MAX_ENTRIES) {
+    LastLogin *entry = logins->entries + logins->num_entries++;
+    entry->host = host;
+    entry->host_len = host_len;
+    entry->when = when;
+    *slot = logins->num_entries;
+  }
+}
 
-    if (scanf_rc != 2) {
-      log_message(LOG_ERR, pamh, "Malformed LAST%d line", i);
-      continue;
+// Parses "host timestamp" pairs from "ptr" up to the end of the line.
+// Returns 0 on success, or -1 if the line is malformed.
+static int last_logins_parse_line(LastLogins *logins, const char *ptr) {
+  for (;;) {
+    ptr += strspn(ptr, " \t");
+    if (!*ptr || *ptr == '\r' || *ptr == '\n') {
+      return 0;
     }
 
-    if (!strcmp(host, rhost)) {
-      found = 1;
-      break;
+    // RHOST can be an FQDN, which RFC1035 limits to 255 characters.
+    const char *host = ptr;
+    const size_t host_len = strspn(host, "0123456789abcdefghijklmnopqrstuvwxyz"
+                                   "ABCDEFGHIJKLMNOPQRSTUVWXYZ:.-");
+    if (host_len < 1 || host_len > 255 ||
+        (host[host_len] != ' ' && host[host_len] != '\t')) {
+      return -1;
     }
+    char *endptr;
+    errno = 0;
+    const unsigned long when = strtoul(host + host_len, &endptr, 10);
+    if (errno || endptr == host + host_len ||
+        (*endptr && !strchr(" \t\r\n", *endptr))) {
+      return -1;
+    }
+    last_logins_add(logins, host, host_len, when);
+    ptr = endptr;
+  }
+}
 
-    if (when < oldest) {
-      oldest_index = i;
-      oldest = when;
+// Collects all previous logins from both the LAST_LOGINS line and any
+// legacy LAST<n> lines, in a single pass over the index.
+static void last_logins_parse(pam_handle_t *pamh, LastLogins *logins,
+                              const Config *cfg) {
+  memset(logins, 0, sizeof(*logins));
+  for (int i = 0; i < cfg->num_lines; ++i) {
+    const CfgLine *line = cfg->lines + i;
+    if (!line->deleted && line->key_len == 11 &&
+        !memcmp(line->text + 2, "LAST_LOGINS", 11)) {
+      if (last_logins_parse_line(logins, line->text + 13)) {
+        log_message(LOG_ERR, pamh, "Malformed LAST_LOGINS line");
+      }
+    } else if (is_legacy_last_line(line)) {
+      if (last_logins_parse_line(logins, line->text + 7)) {
+        log_message(LOG_ERR, pamh, "Malformed LAST%c line", line->text[6]);
+      }
     }
   }
+}
+
+static int last_login_cmp(const void *a, const void *b) {
+  const unsigned long when_a = ((const LastLogin *)a)->when;
+  const unsigned long when_b = ((const LastLogin *)b)->when;
+  return when_a < when_b ? 1 : when_a > when_b ? -1 : 0;
+}
 
-  if (!found) {
-    /* Loop completed all ten iterations */
-    name[4] = oldest_index + '0';
+/*
+ * Record in the LAST_LOGINS line that we logged in from a particular place
+ * at a particular time. Only remembers the most recent "grace_hosts"
+ * hosts, which are replaced in LRU order.
+ *
+ * Returns 0 on success.
+ */
+int
+update_logindetails(pam_handle_t *pamh, const Params *params, Config *cfg) {
+  const char *rhost = get_rhost(pamh, params);
+  const time_t now = get_time();
+
+  if (rhost == NULL) {
+    return -1;
+  }
+  const size_t rhost_len = strlen(rhost);
+  if (rhost_len < 1 || rhost_len > 255 ||
+      rhost_len != strspn(rhost, "0123456789abcdefghijklmnopqrstuvwxyz"
+                          "ABCDEFGHIJKLMNOPQRSTUVWXYZ:.-")) {
+    log_message(LOG_ERR, pamh, "Cannot record logins from \"%s\"", rhost);
+    return -1;
   }
 
+  LastLogins logins;
+  last_logins_parse(pamh, &logins, cfg);
+  LastLogin *entry = last_logins_find(&logins, rhost);
+  if (entry) {
+    entry->when = now;
+  } else {
+    // There always is room for one more entry than can be parsed.
+    LastLogin *added = logins.entries + logins.num_entries++;
+    added->host = rhost;
+    added->host_len = rhost_len;
+    added->when = now;
+  }
+
+  // Write the most recent entries, and drop everything else.
+  qsort(logins.entries, logins.num_entries, sizeof(LastLogin),
+        last_login_cmp);
+  const int num_entries = logins.num_entries < params->grace_hosts
+                          ? logins.num_entries : params->grace_hosts;
+
   /*
    * Max length in decimal digits of a 64 bit number is (64 log 2) + 1
-   * Plus space and NUL termination, is 23.
+   * Plus two spaces, is 22.
    * Max len of hostname is 255.
    */
-  char value[255+23+1];
-  memset(value, 0, sizeof value);
-
-  snprintf(value, sizeof value, "%s %lu", rhost, (unsigned long)now);
-  if (set_cfg_value(pamh, name, value, buf) < 0) {
+  char *value = arena_alloc(cfg->arena, num_entries*(255+22) + 1);
+  if (!value) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+  char *ptr = value;
+  for (int i = 0; i < num_entries; ++i) {
+    ptr += sprintf(ptr, "%s%.*s %lu", i ? " " : "", logins.entries[i].host_len,
+                   logins.entries[i].host, logins.entries[i].when);
+  }
+  if (set_cfg_value(pamh, "LAST_LOGINS", value, cfg) < 0) {
     log_message(LOG_WARNING, pamh, "Failed to set cfg value for login host");
+    return -1;
   }
 
-  return 0;
+  // The legacy lines have been merged.
+  for (int i = 0; i < cfg->num_lines; ++i) {
+    if (is_legacy_last_line(cfg->lines + i)) {
+      cfg->lines[i].deleted = 1;
+    }
+  }
+  return cfg_record_edit(pamh, cfg, EDIT_LAST_LOGIN, NULL, NULL, 0, 0);
 }
 
 /*
@@ -1647,86 +3174,104 @@ update_logindetails(pam_handle_t *pamh, const Params *params, char **buf) {
  */
 int
 within_grace_period(pam_handle_t *pamh, const Params *params,
-                    const char *buf) {
+                    const Config *cfg) {
   const char *rhost = get_rhost(pamh, params);
   const time_t now = get_time();
   const time_t grace = params->grace_period;
-  unsigned long when = 0;
-  char match[128];
 
   if (rhost == NULL) {
     return 0;
   }
-  snprintf(match, sizeof match, " %s %%lu ", rhost);
-
-  for (int i = 0; i < 10; i++) {
-    static char name[] = "LAST0";
-    name[4] = i + '0';
-    char* line = get_cfg_value(pamh, name, buf);
 
-    if (line == &oom) {
-      /* Fatal! */
-      return 0;
-    }
-    if (!line) {
-      continue;
-    }
-    if (sscanf(line, match, &when) == 1) {
-      free(line);
-      break;
-    }
-    free(line);
-  }
-
-  if (when == 0) {
+  LastLogins logins;
+  last_logins_parse(pamh, &logins, cfg);
+  const LastLogin *entry = last_logins_find(&logins, rhost);
+  if (!entry || entry->when == 0) {
     /* No match */
     return 0;
   }
 
-  return (when + grace > now);
+  return (entry->when + grace > now);
 }
 
 /* Checks for counter based verification code. Returns -1 on error, 0 on
  * success, and 1, if no counter based code had been entered, and subsequent
- * tests should be applied.
+ * tests should be applied. With a state store, "*hotp_counter" catches up
+ * with the counter that other hosts have advanced.
  */
 static int check_counterbased_code(pam_handle_t *pamh,
                                    const char*secret_filename, int *updated,
-                                   char **buf, const uint8_t*secret,
-                                   int secretLen, int code,
-                                   long hotp_counter,
-                                   int *must_advance_counter) {
-  if (hotp_counter < 1) {
+                                   Config *cfg, const OtpKey *key,
+                                   int code, long *hotp_counter,
+                                   int *must_advance_counter,
+                                   StateStore *state, Stats *stats) {
+  if (*hotp_counter < 1) {
     // The secret file did not actually contain information for a counter-based
     // code. Return to caller and see if any other authentication methods
     // apply.
     return 1;
   }
 
-  if (code < 0 || code >= 1000000) {
-    // All counter based verification codes are no longer than six digits.
+  if (code < 0 || code >= key->verifier->modulus) {
+    // The code is longer than the counter based verification codes.
     return 1;
   }
 
   // Compute [window_size] verification codes and compare them with user input.
   // Future codes are allowed in case the user computed but did not use a code.
-  const int window = window_size(pamh, secret_filename, *buf);
+  const int window = window_size(pamh, secret_filename, cfg);
   if (!window) {
     return -1;
   }
-  for (int i = 0; i < window; ++i) {
-    const unsigned int hash = compute_code(secret, secretLen, hotp_counter + i);
-    if (hash == (unsigned int)code) {
-      char counter_str[40];
-      snprintf(counter_str, sizeof counter_str, "%ld", hotp_counter + i + 1);
-      if (set_cfg_value(pamh, "HOTP_COUNTER", counter_str, buf) < 0) {
-        return -1;
+  long counter = *hotp_counter, shared;
+  int i = find_hmac_code(key, counter, window, code);
+  if (i < 0 && state &&
+      !state_store_advance_counter(state, -1, 0, &shared) &&
+      shared > counter) {
+    // The user has been logging in on other hosts, and our copy of the
+    // counter fell behind by more than the window.
+    *hotp_counter = counter = shared;
+    i = find_hmac_code(key, counter, window, code);
+  }
+  if (i >= 0 && state) {
+    // Consume the code everywhere. Another host might have been faster.
+    switch (state_store_advance_counter(state, counter + i, counter + i + 1,
+                                        &shared)) {
+    case 1:
+      if (shared > counter) {
+        log_message(LOG_ERR, pamh, "Counter-based code for \"%s\" was "
+                    "already used on another host", secret_filename);
+        *hotp_counter = shared;
+      } else {
+        log_message(LOG_ERR, pamh, "Shared state is unavailable. Denying "
+                    "counter-based code for \"%s\".", secret_filename);
       }
-      *updated = 1;
-      *must_advance_counter = 0;
-      return 0;
+      *must_advance_counter = 1;
+      return 1;
+    case 0:
+      break;
+    default:
+      log_message(LOG_WARNING, pamh, "Shared state is unavailable. Only "
+                  "updating \"%s\".", secret_filename);
+      break;
     }
   }
+  if (i >= 0) {
+    char counter_str[40];
+    snprintf(counter_str, sizeof counter_str, "%ld", counter + i + 1);
+    if (set_cfg_value(pamh, "HOTP_COUNTER", counter_str, cfg) < 0 ||
+        cfg_record_edit(pamh, cfg, EDIT_HOTP_COUNTER, NULL, NULL,
+                        counter + i, counter + i + 1) < 0) {
+      return -1;
+    }
+    *updated = 1;
+    *must_advance_counter = 0;
+    if (i > 0) {
+      // The user generated codes without logging in.
+      stats_count(stats, STATS_HOTP_RESYNC);
+    }
+    return 0;
+  }
 
   *must_advance_counter = 1;
   return 1;
@@ -1744,22 +3289,136 @@ static int parse_user(pam_handle_t *pamh, const char *name, uid_t *uid) {
     *uid = (uid_t)l;
     return 0;
   }
-  const size_t len = getpwnam_buf_max_size();
-  char *buf = malloc(len);
-  if (!buf) {
-    log_message(LOG_ERR, pamh, "Out of memory");
-    return -1;
+  const size_t len = getpwnam_buf_max_size();
+  char *buf = malloc(len);
+  if (!buf) {
+    log_message(LOG_ERR, pamh, "Out of memory");
+    return -1;
+  }
+  struct passwd pwbuf, *pw;
+  if (getpwnam_r(name, &pwbuf, buf, len, &pw) || !pw) {
+    free(buf);
+    log_message(LOG_ERR, pamh, "Failed to look up user \"%s\"", name);
+    return -1;
+  }
+  *uid = pw->pw_uid;
+  free(buf);
+  return 0;
+}
+
+#if !defined(DAEMON)
+// Forward the request to google-authenticatord, and relay the PAM
+// conversation that the daemon holds with the user. This keeps all
+// prompting in the calling application, while the daemon does the actual
+// verification.
+// Return a PAM status, or -1 if the daemon cannot be reached. In that case,
+// the caller verifies the code itself.
+static int daemon_authenticate(pam_handle_t *pamh, const Params *params,
+                               int argc, const char **argv) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(params->daemon) >= sizeof(addr.sun_path)) {
+    log_message(LOG_ERR, pamh, "Socket name \"%s\" is too long",
+                params->daemon);
+    return -1;
+  }
+  strcpy(addr.sun_path, params->daemon);
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    log_message(LOG_WARNING, pamh, "Failed to connect to \"%s\": %s",
+                params->daemon, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  int rc = PAM_AUTH_ERR;
+#ifdef SO_PEERCRED
+  // Nobody but the administrator gets to answer on behalf of the daemon.
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) ||
+      (cred.uid != 0 && cred.uid != geteuid())) {
+    log_message(LOG_ERR, pamh, "Daemon on \"%s\" is not trusted",
+                params->daemon);
+    close(fd);
+    return rc;
+  }
+#endif
+
+  PAM_CONST void *user = NULL, *service = NULL, *rhost = NULL, *authtok = NULL;
+  pam_get_item(pamh, PAM_SERVICE, &service);
+  pam_get_item(pamh, PAM_RHOST, &rhost);
+  pam_get_item(pamh, PAM_AUTHTOK, &authtok);
+  if (!(user = get_user_name(pamh, params))) {
+    close(fd);
+    return rc;
+  }
+
+  DaemonMsg msg;
+  daemon_msg_init(&msg, DAEMON_MSG_AUTH);
+  int err = daemon_msg_add(&msg, user) ||
+            daemon_msg_add_opt(&msg, service) ||
+            daemon_msg_add_opt(&msg, rhost) ||
+            daemon_msg_add_opt(&msg, authtok);
+  for (int i = 0; i < argc; ++i) {
+    if (strncmp(argv[i], "daemon=", 7)) {
+      err |= daemon_msg_add(&msg, argv[i]);
+    }
   }
-  struct passwd pwbuf, *pw;
-  if (getpwnam_r(name, &pwbuf, buf, len, &pw) || !pw) {
-    free(buf);
-    log_message(LOG_ERR, pamh, "Failed to look up user \"%s\"", name);
-    return -1;
+  if (err || daemon_msg_send(fd, &msg)) {
+    log_message(LOG_ERR, pamh, "Failed to send request to \"%s\"",
+                params->daemon);
+    goto out;
   }
-  *uid = pw->pw_uid;
-  free(buf);
-  return 0;
+
+  for (;;) {
+    const char *fields[3];
+    const int n = daemon_msg_recv(fd, &msg, fields, 3);
+    if (n == 3 && !strcmp(fields[0], DAEMON_MSG_CONV)) {
+      PAM_CONST struct pam_message message = {
+        .msg_style = atoi(fields[1]),
+        .msg       = fields[2],
+      };
+      PAM_CONST struct pam_message *msgs = &message;
+      struct pam_response *resp = NULL;
+      const int retval = converse(pamh, 1, &msgs, &resp);
+      const char *answer = retval == PAM_SUCCESS && resp && resp->resp
+        ? resp->resp : NULL;
+      daemon_msg_init(&msg, DAEMON_MSG_RESP);
+      err = daemon_msg_add_opt(&msg, answer);
+      if (resp) {
+        if (resp->resp) {
+          explicit_bzero(resp->resp, strlen(resp->resp));
+          free(resp->resp);
+        }
+        free(resp);
+      }
+      if (err || daemon_msg_send(fd, &msg)) {
+        break;
+      }
+    } else if (n == 3 && !strcmp(fields[0], DAEMON_MSG_DONE)) {
+      rc = atoi(fields[1]);
+      const char *new_authtok = daemon_msg_opt(fields[2]);
+      if (new_authtok &&
+          pam_set_item(pamh, PAM_AUTHTOK, new_authtok) != PAM_SUCCESS) {
+        log_message(LOG_ERR, pamh, "Failed to forward password");
+        rc = PAM_AUTH_ERR;
+      }
+      break;
+    } else {
+      log_message(LOG_ERR, pamh, "Lost connection to \"%s\"",
+                  params->daemon);
+      break;
+    }
+  }
+
+out:
+  daemon_msg_clear(&msg);
+  close(fd);
+  return rc;
 }
+#endif
 
 static int parse_args(pam_handle_t *pamh, int argc, const char **argv,
                       Params *params) {
@@ -1806,6 +3465,12 @@ static int parse_args(pam_handle_t *pamh, int argc, const char **argv,
       params->nullok = NULLOK;
     } else if (!strcmp(argv[i], "allow_readonly")) {
       params->allow_readonly = 1;
+    } else if (!strcmp(argv[i], "reentrant")) {
+      params->reentrant = 1;
+    } else if (!strcmp(argv[i], "rate_limit_ring")) {
+      params->rate_limit_ring = 1;
+    } else if (!strcmp(argv[i], "disallow_reuse_bits")) {
+      params->disallow_reuse_bits = 1;
     } else if (!strcmp(argv[i], "echo-verification-code") ||
                !strcmp(argv[i], "echo_verification_code")) {
       params->echocode = PAM_PROMPT_ECHO_ON;
@@ -1820,30 +3485,585 @@ static int parse_args(pam_handle_t *pamh, int argc, const char **argv,
         return -1;
       }
       params->grace_period = grace;
+    } else if (!strncmp(argv[i], "update_retries=", 15)) {
+      char *remainder = NULL;
+      const long retries = strtol(argv[i] + 15, &remainder, 10);
+      if (retries < 1 || retries > MAX_UPDATE_RETRIES || *remainder) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " update_retries must be a number between 1 and %d.",
+                    argv[i], MAX_UPDATE_RETRIES);
+        return -1;
+      }
+      params->update_retries = (int)retries;
+    } else if (!strncmp(argv[i], "grace_hosts=", 12)) {
+      char *remainder = NULL;
+      const long hosts = strtol(argv[i] + 12, &remainder, 10);
+      if (hosts < 1 || hosts > GRACE_MAX_HOSTS || *remainder) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " grace_hosts must be a number of hosts between 1"
+                    " and %d.", argv[i], GRACE_MAX_HOSTS);
+        return -1;
+      }
+      params->grace_hosts = (int)hosts;
+    } else if (!strncmp(argv[i], "rate_limit_store=", 17)) {
+      const char *store = argv[i] + 17;
+      if (strncmp(store, "shm:/", 5)) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " rate_limit_store must be shm:/path/to/table.",
+                    argv[i]);
+        return -1;
+      }
+      params->rate_limit_store = store + 4;
+    } else if (!strncmp(argv[i], "state_store=", 12)) {
+      const char *store = argv[i] + 12;
+      if (strncmp(store, "redis:/", 7) || !store[7] ||
+          (store[7] == '/' && !strchr(store + 8, ':'))) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " state_store must be redis://host:port or"
+                    " redis:/path/to/socket.",
+                    argv[i]);
+        return -1;
+      }
+      params->state_store = store + 6;
+    } else if (!strncmp(argv[i], "state_store_timeout=", 20)) {
+      char *remainder = NULL;
+      const long ms = strtol(argv[i] + 20, &remainder, 10);
+      if (ms < 1 || ms > STATE_STORE_MAX_TIMEOUT || *remainder) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " state_store_timeout must be a number of milliseconds"
+                    " between 1 and %d.",
+                    argv[i], STATE_STORE_MAX_TIMEOUT);
+        return -1;
+      }
+      params->state_store_timeout = (int)ms;
+    } else if (!strcmp(argv[i], "state_store_fallback=local")) {
+      params->state_store_fail_closed = 0;
+    } else if (!strcmp(argv[i], "state_store_fallback=deny")) {
+      params->state_store_fail_closed = 1;
+    } else if (!strncmp(argv[i], "volatile_keys=", 14)) {
+      const char *keys = argv[i] + 14;
+      if (!*keys || strspn(keys, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                 "0123456789_*,") != strlen(keys)) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " volatile_keys must be a comma separated list of keys.",
+                    argv[i]);
+        return -1;
+      }
+      params->volatile_keys = keys;
+    } else if (!strncmp(argv[i], "stats=", 6)) {
+      const char *table = argv[i] + 6;
+      if (strncmp(table, "shm:/", 5)) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " stats must be shm:/path/to/table.",
+                    argv[i]);
+        return -1;
+      }
+      params->stats_table = table + 4;
+    } else if (!strncmp(argv[i], "secret_cache=", 13)) {
+      char *remainder = NULL;
+      const long entries = strtol(argv[i] + 13, &remainder, 10);
+      if (entries < 1 || entries > SECRET_CACHE_MAX_ENTRIES || *remainder) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " secret_cache must be a number of files between 1"
+                    " and %d.", argv[i], SECRET_CACHE_MAX_ENTRIES);
+        return -1;
+      }
+      params->secret_cache = (int)entries;
+    } else if (!strncmp(argv[i], "skew_search_steps=", 18)) {
+      char *remainder = NULL;
+      const long steps = strtol(argv[i] + 18, &remainder, 10);
+      if (steps < 1 || steps > SKEW_SEARCH_MAX_STEPS || *remainder) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " skew_search_steps must be a number of time steps"
+                    " between 1 and %d.", argv[i], SKEW_SEARCH_MAX_STEPS);
+        return -1;
+      }
+      params->skew_search_steps = (int)steps;
+    } else if (!strncmp(argv[i], "skew_cache=", 11)) {
+      char *remainder = NULL;
+      const long entries = strtol(argv[i] + 11, &remainder, 10);
+      if (entries < 1 || entries > SKEW_CACHE_MAX_ENTRIES || *remainder) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " skew_cache must be a number of users between 1"
+                    " and %d.", argv[i], SKEW_CACHE_MAX_ENTRIES);
+        return -1;
+      }
+      params->skew_cache = (int)entries;
+    } else if (!strcmp(argv[i], "mmap_secret")) {
+      params->mmap_secret = 1;
+    } else if (!strcmp(argv[i], "prefetch")) {
+      params->prefetch = 1;
+    } else if (!strncmp(argv[i], "secret_store=", 13)) {
+      const char *store = argv[i] + 13;
+      if (strncmp(store, "mmap:/", 6)) {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " secret_store must be mmap:/path/to/table.",
+                    argv[i]);
+        return -1;
+      }
+      params->secret_store = store + 5;
+#if !defined(DAEMON)
+    } else if (!strncmp(argv[i], "daemon=", 7)) {
+      if (argv[i][7] != '/') {
+        log_message(LOG_ERR, pamh,
+                    "Invalid value in setting \"%s\"."
+                    " daemon must be the absolute path of a socket.",
+                    argv[i]);
+        return -1;
+      }
+      params->daemon = argv[i] + 7;
+#endif
     } else {
       log_message(LOG_ERR, pamh, "Unrecognized option \"%s\"", argv[i]);
       return -1;
     }
   }
+  if (params->reentrant && params->no_strict_owner) {
+    // Without switching users, the owner check is all that keeps us from
+    // reading and rewriting files that don't belong to the user.
+    log_message(LOG_ERR, pamh,
+                "reentrant cannot be combined with no_strict_owner");
+    return -1;
+  }
+  if ((params->reentrant || params->daemon) && params->mmap_secret) {
+    // Truncating a mapped file raises SIGBUS in everybody who maps it. A
+    // user must not be able to take down a process that serves other users.
+    log_message(LOG_ERR, pamh,
+                "mmap_secret cannot be combined with reentrant or daemon");
+    return -1;
+  }
+  if (params->secret_store &&
+      (params->volatile_keys || params->secret_cache)) {
+    // Both of these work on secret files. Records are updated in place,
+    // and are cheap to read, anyway.
+    log_message(LOG_ERR, pamh, "secret_store cannot be combined with "
+                "volatile_keys or secret_cache");
+    return -1;
+  }
+  return 0;
+}
+
+// PAM stacks call the module over and over again with the same options, as
+// sshd, sudo and su all authenticate from the same process. Options are
+// parsed once per distinct argv, and kept in a small cache. Entries are
+// never freed or replaced, so that the strings that the parameters point to
+// stay valid without holding the lock.
+typedef struct ParamsCacheEntry {
+  int    argc;
+  char   **argv;   // Private copy, which "params" points into
+  Params params;
+} ParamsCacheEntry;
+
+static ParamsCacheEntry params_cache[PARAMS_CACHE_ENTRIES];
+static int              params_cache_size;
+static pthread_mutex_t  params_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const ParamsCacheEntry *params_cache_find(int argc,
+                                                 const char **argv) {
+  for (int i = 0; i < params_cache_size; ++i) {
+    const ParamsCacheEntry *entry = params_cache + i;
+    if (entry->argc != argc) {
+      continue;
+    }
+    int j = 0;
+    while (j < argc && !strcmp(entry->argv[j], argv[j])) {
+      ++j;
+    }
+    if (j == argc) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// The only time that cached options are released is when the process exits,
+// or the module is unloaded.
+static void __attribute__((destructor)) params_cache_clear(void) {
+  for (int i = 0; i < params_cache_size; ++i) {
+    free(params_cache[i].argv);
+  }
+  params_cache_size = 0;
+}
+
+// Returns a copy of "argv" in a single allocation, or NULL if out of memory.
+static char **copy_args(int argc, const char **argv) {
+  size_t len = (argc + 1) * sizeof(char *);
+  for (int i = 0; i < argc; ++i) {
+    len += strlen(argv[i]) + 1;
+  }
+  char **copy = malloc(len);
+  if (copy) {
+    char *ptr = (char *)(copy + argc + 1);
+    for (int i = 0; i < argc; ++i) {
+      copy[i] = strcpy(ptr, argv[i]);
+      ptr += strlen(ptr) + 1;
+    }
+    copy[argc] = NULL;
+  }
+  return copy;
+}
+
+static int parse_default_args(pam_handle_t *pamh, int argc, const char **argv,
+                              Params *params) {
+  memset(params, 0, sizeof(*params));
+  params->allowed_perm = 0600;
+  params->dirfd = -1;
+  params->skew_search_steps = SKEW_SEARCH_STEPS;
+  params->grace_hosts = GRACE_HOSTS;
+  params->state_store_timeout = STATE_STORE_TIMEOUT;
+  return parse_args(pamh, argc, argv, params);
+}
+
+// Sets the defaults, and then parses the module options, unless the same
+// options have been seen before. Returns -1 on error.
+static int get_params(pam_handle_t *pamh, int argc, const char **argv,
+                      Params *params) {
+  pthread_mutex_lock(&params_cache_lock);
+  const ParamsCacheEntry *entry = params_cache_find(argc, argv);
+  if (entry) {
+    *params = entry->params;
+  }
+  const int full = params_cache_size == PARAMS_CACHE_ENTRIES;
+  pthread_mutex_unlock(&params_cache_lock);
+  if (entry) {
+    return 0;
+  }
+
+  // Errors are never cached, so that they are logged every time.
+  char **copy = full ? NULL : copy_args(argc, argv);
+  if (!copy) {
+    return parse_default_args(pamh, argc, argv, params);
+  }
+  if (parse_default_args(pamh, argc, (const char **)copy, params) < 0) {
+    free(copy);
+    return -1;
+  }
+  pthread_mutex_lock(&params_cache_lock);
+  if (!params_cache_find(argc, argv) &&
+      params_cache_size < PARAMS_CACHE_ENTRIES) {
+    ParamsCacheEntry *added = params_cache + params_cache_size++;
+    added->argc = argc;
+    added->argv = copy;
+    added->params = *params;
+    copy = NULL;
+  }
+  pthread_mutex_unlock(&params_cache_lock);
+  if (copy) {
+    // Another thread cached the same options first, or filled the cache.
+    // As "params" points into our copy, parse the caller's strings again.
+    free(copy);
+    return parse_default_args(pamh, argc, argv, params);
+  }
   return 0;
 }
 
+// Applies the edits recorded by this call to a newer version of the state.
+// Concurrent logins are merged, but if a code that this call accepted has
+// been used up in the meantime, the login must be denied.
+// Return 0 on success, 1 if the login has to be denied, or -1 on error.
+static int cfg_replay_edits(pam_handle_t *pamh, const Params *params,
+                            const char *secret_filename, Config *cfg,
+                            const CfgEdit *edits, int num_edits) {
+  int denied = 0, updated = 0;
+  for (const CfgEdit *edit = edits; edit < edits + num_edits; ++edit) {
+    switch (edit->type) {
+    case EDIT_SET:
+      if (set_cfg_value(pamh, edit->key, edit->val, cfg) < 0) {
+        return -1;
+      }
+      break;
+    case EDIT_RATE_LIMIT:
+      // Edits are only recorded, if the file holds the rate limiting state.
+      if (rate_limit(pamh, params, secret_filename, &updated, cfg,
+                     NULL) < 0) {
+        denied = 1;
+      }
+      break;
+    case EDIT_DISALLOW_REUSE:
+      if (invalidate_timebased_code(edit->arg[0], edit->arg[1], pamh, params,
+                                    secret_filename, &updated, cfg,
+                                    NULL) < 0) {
+        denied = 1;
+      }
+      break;
+    case EDIT_HOTP_COUNTER: {
+      const long counter = get_hotp_counter(pamh, cfg);
+      if (edit->arg[0] >= 0 && counter > edit->arg[0]) {
+        // Somebody else already used this counter value.
+        denied = 1;
+      }
+      if (counter < edit->arg[1]) {
+        char counter_str[40];
+        snprintf(counter_str, sizeof counter_str, "%ld", edit->arg[1]);
+        if (set_cfg_value(pamh, "HOTP_COUNTER", counter_str, cfg) < 0) {
+          return -1;
+        }
+      }
+      break;
+    }
+    case EDIT_SCRATCH_CODE: {
+      if (edit->val) {
+        const int used = use_hashed_scratch_code(pamh, cfg, edit->val);
+        if (used < 0) {
+          return -1;
+        }
+        // Somebody else might already have used this scratch code.
+        denied |= used;
+        break;
+      }
+      char code[20];
+      snprintf(code, sizeof code, "%ld", edit->arg[0]);
+      const size_t len = strlen(code);
+      CfgLine *line = cfg->lines + 1;
+      while (line < cfg->lines + cfg->num_lines &&
+             (line->deleted || line->len != (int)len ||
+              memcmp(line->text, code, len))) {
+        ++line;
+      }
+      if (line < cfg->lines + cfg->num_lines) {
+        line->deleted = 1;
+      } else {
+        // Somebody else already used this scratch code.
+        denied = 1;
+      }
+      break;
+    }
+    case EDIT_LAST_LOGIN:
+      // Only successful logins start a grace period.
+      if (!denied && update_logindetails(pamh, params, cfg)) {
+        return -1;
+      }
+      break;
+    }
+  }
+  return denied;
+}
+
+// Reads the state again, after the update failed because somebody else
+// changed it, and applies this call's edits to it.
+// Return 0 on success, 1 if the login has to be denied, or -1 on error.
+static int reload_state(pam_handle_t *pamh, Params *params,
+                        const char *secret_filename, const char *username,
+                        uid_t uid, struct stat *orig_stat,
+                        uint32_t *store_version, Config *cfg) {
+  // The codes were verified with the old secret. If the user set up a new
+  // one in the meantime, there is nothing to merge with.
+  const CfgLine *first = cfg->lines;
+  char *secret_line = first
+    ? arena_strndup(cfg->arena, first->text, first->len) : NULL;
+  if (!secret_line) {
+    return -1;
+  }
+
+  unmap_file_contents(cfg);
+  cfg_clear(cfg);
+  if (params->store) {
+    if (read_store_record(pamh, params, secret_filename, username,
+                          store_version, cfg)) {
+      return -1;
+    }
+  } else {
+    int fd = open_secret_file(pamh, secret_filename, params, username, uid,
+                              orig_stat);
+    if (fd < 0 ||
+        read_file_contents(pamh, params, secret_filename, &fd,
+                           orig_stat->st_size, cfg)) {
+      return -1;
+    }
+    if (params->volatile_keys &&
+        apply_journal(pamh, params, secret_filename, orig_stat, cfg)) {
+      return -1;
+    }
+  }
+  if (!cfg->num_lines ||
+      cfg->lines->len != (int)strlen(secret_line) ||
+      memcmp(cfg->lines->text, secret_line, cfg->lines->len)) {
+    log_message(LOG_ERR, pamh, "Secret in \"%s\" changed during login",
+                secret_filename);
+    return -1;
+  }
+
+  cfg->record_edits = 0;
+  const int rc = cfg_replay_edits(pamh, params, secret_filename, cfg,
+                                  cfg->edits, cfg->num_edits);
+  cfg->record_edits = 1;
+  if (params->debug) {
+    log_message(LOG_INFO, pamh, "debug: changes merged into \"%s\"",
+                secret_filename);
+  }
+  return rc;
+}
+
+// The state that google_authenticator() needs before it can check a code.
+typedef struct SecretLoad {
+  pam_handle_t  *pamh;
+  Params        *params;
+  const char    *username;
+  const char    *secret_filename;
+  uid_t         uid;
+  Config        *cfg;
+  struct stat   *orig_stat;
+  uint32_t      *store_version;
+  OtpKey        *key;
+  pthread_t     thread;
+  int           fd;
+  uint8_t       *secret;
+  int           early_updated;
+  int           stopped_by_rate_limit;
+#if defined(DEMO) || defined(TESTING)
+  char          *error_msg;  // Log messages of the helper thread
+#endif
+} SecretLoad;
+
+// Opens, reads and rate limits the user's state, and prepares the shared
+// secret for verification. Failures leave "secret" unset.
+static void load_secret(SecretLoad *load) {
+  pam_handle_t *pamh = load->pamh;
+  Params *params = load->params;
+  const char *secret_filename = load->secret_filename;
+  Config *cfg = load->cfg;
+  uint8_t *cached_secret = NULL;
+  int secretLen = 0;
+  uint64_t start;
+
+  if (params->store) {
+    start = stats_start(params->stats);
+    read_store_record(pamh, params, secret_filename, load->username,
+                      load->store_version, cfg);
+    stats_record(params->stats, STATS_PHASE_READ, start);
+  } else {
+    start = stats_start(params->stats);
+    load->fd = open_secret_file(pamh, secret_filename, params,
+                                load->username, load->uid, load->orig_stat);
+    stats_record(params->stats, STATS_PHASE_OPEN, start);
+  }
+  if (load->fd >= 0) {
+    start = stats_start(params->stats);
+    if (params->secret_cache &&
+        (cached_secret = cfg_from_cache(load->orig_stat, cfg, &secretLen))) {
+      close(load->fd);
+      load->fd = -1;
+      if (params->debug) {
+        log_message(LOG_INFO, pamh, "debug: \"%s\" found in cache",
+                    secret_filename);
+      }
+    } else if (!read_file_contents(pamh, params, secret_filename, &load->fd,
+                                   load->orig_stat->st_size, cfg) &&
+               params->secret_cache) {
+      cfg_to_cache(pamh, params, load->orig_stat, cfg);
+    }
+    stats_record(params->stats, STATS_PHASE_READ, start);
+  }
+
+  if (cfg->buf && params->volatile_keys &&
+      apply_journal(pamh, params, secret_filename, load->orig_stat, cfg)) {
+    cfg_clear(cfg);
+  }
+
+  if (cfg->buf && params->shm) {
+    shm_store_bind(params->shm, secret_filename);
+  }
+
+  if (cfg->buf) {
+    start = stats_start(params->stats);
+    const int limited = rate_limit(pamh, params, secret_filename,
+                                   &load->early_updated, cfg,
+                                   params->shm) < 0;
+    stats_record(params->stats, STATS_PHASE_RATE_LIMIT, start);
+    if (!limited) {
+      // An invalid choice of algorithm leaves the user without a secret.
+      const Verifier *verifier = select_verifier(pamh, secret_filename, cfg);
+      if (verifier) {
+        load->secret = cached_secret
+          ? cached_secret
+          : get_shared_secret(pamh, params, secret_filename, cfg, &secretLen);
+      }
+      if (load->secret) {
+        // Derive the HMAC key schedules once. All codes in the window, and
+        // in the time skew search, are computed from them.
+        init_otp_key(load->key, verifier, load->secret, secretLen);
+        if (params->state) {
+          uint8_t id[SHA1_DIGEST_LENGTH];
+          otp_key_id(load->key, "state store", id);
+          state_store_bind(params->state, id);
+          explicit_bzero(id, sizeof(id));
+        }
+      }
+    } else {
+      load->stopped_by_rate_limit = 1;
+      stats_count(params->stats, STATS_RATE_LIMITED);
+    }
+  }
+}
+
+// With "prefetch", the state is loaded on a helper thread while the user is
+// being prompted. The thread inherits the file system user id that we
+// switched to. It only touches the arena while the main thread is waiting in
+// the conversation function.
+static void *load_secret_thread(void *arg) {
+  SecretLoad *load = arg;
+  load_secret(load);
+#if defined(DEMO) || defined(TESTING)
+  // The messages are reported by the main thread, once it joined us.
+  load->error_msg = error_msg;
+  error_msg = NULL;
+#endif
+  return NULL;
+}
+
 static int google_authenticator(pam_handle_t *pamh,
                                 int argc, const char **argv) {
   int        rc = PAM_AUTH_ERR;
   uid_t      uid = -1;
   int        old_uid = -1, old_gid = -1, fd = -1;
-  char       *buf = NULL;
+  Arena      arena;
+  Config     cfg = { 0 };
   struct stat orig_stat = { 0 };
   uint8_t    *secret = NULL;
-  int        secretLen = 0;
+  char       *early_pw = NULL;
+  OtpKey     key = { 0 };
+  ShmStore   shm = { -1 };
+  StateStore shm_state, remote_state;
+  Stats      stats = { 0 };
+  SecretStore store = { -1 };
+  uint32_t   store_version = 0;
+
+  // All scratch memory for this call comes from the arena, and is wiped
+  // when we are done.
+  arena_init(&arena);
+  cfg.arena = &arena;
 
   // Handle optional arguments that configure our PAM module
-  Params params = { 0 };
-  params.allowed_perm = 0600;
-  if (parse_args(pamh, argc, argv, &params) < 0) {
+  Params params;
+  if (get_params(pamh, argc, argv, &params) < 0) {
     return rc;
   }
+  if (params.mmap_secret) {
+    // The secret file is never copied, and anything derived from it stays
+    // in locked memory.
+    arena_lock(&arena);
+  }
+  cfg.record_edits = params.update_retries > 0;
+
+#if !defined(DAEMON)
+  if (params.daemon) {
+    const int daemon_rc = daemon_authenticate(pamh, &params, argc, argv);
+    if (daemon_rc >= 0) {
+      return daemon_rc;
+    }
+  }
+#endif
 
   const char *prompt = params.authtok_prompt
     ? params.authtok_prompt
@@ -1853,12 +4073,74 @@ static int google_authenticator(pam_handle_t *pamh,
   int early_updated = 0, updated = 0;
 
   const char* const username = get_user_name(pamh, &params);
-  char* const secret_filename = get_secret_filename(pamh, &params,
-                                                    username, &uid);
+  char* const secret_filename = params.secret_store
+    ? get_store_record_name(&params, username)
+    : get_secret_filename(pamh, &params, username, &uid);
   int stopped_by_rate_limit = 0;
 
-  // Drop privileges.
-  {
+  // The shared rate limiting table is only writable by root, so it has to
+  // be opened before dropping privileges. If it is unavailable, all state
+  // is kept in the secret file instead.
+  if (params.rate_limit_store) {
+    const int err = shm_store_open(&shm, params.rate_limit_store);
+    if (err) {
+      log_message(LOG_ERR, pamh, "Failed to open rate_limit_store \"%s\": %s",
+                  params.rate_limit_store, strerror(err));
+    } else {
+      params.shm = &shm;
+      state_store_init_shm(&shm_state, &shm);
+      params.state = &shm_state;
+    }
+  }
+
+  // The connection to the state store is shared by all logins in this
+  // process. If it cannot be established, requests fall back to the
+  // rate_limit_store and the secret file, or fail with
+  // "state_store_fallback=deny".
+  if (params.state_store) {
+    const int err = remote_store_open(&remote_state, params.state_store,
+                                      params.state_store_timeout);
+    if (err) {
+      log_message(LOG_WARNING, pamh, "Failed to connect to state_store "
+                  "\"%s\": %s", params.state_store, strerror(err));
+    }
+    remote_state.fail_closed = params.state_store_fail_closed;
+    remote_state.fallback = params.state;
+    params.state = &remote_state;
+  }
+  if (params.stats_table) {
+    const int err = stats_open(&stats, params.stats_table, 1);
+    if (err) {
+      log_message(LOG_ERR, pamh, "Failed to open stats \"%s\": %s",
+                  params.stats_table, strerror(err));
+    } else {
+      params.stats = &stats;
+    }
+  }
+
+  // Like the other tables, the secret store is only accessible to root.
+  // Without it, there is no state to authenticate the user against.
+  if (params.secret_store) {
+    const int err = secret_store_open(&store, params.secret_store);
+    if (err) {
+      log_message(LOG_ERR, pamh, "Failed to open secret_store \"%s\": %s",
+                  params.secret_store, strerror(err));
+      goto out;
+    }
+    params.store = &store;
+  }
+
+  uint64_t start = stats_start(params.stats);
+  if (params.store) {
+    // No files are accessed on behalf of the user, so there is no need to
+    // switch to the user's privileges.
+  } else if (params.reentrant) {
+    if (secret_filename &&
+        open_secret_dir(pamh, &params, secret_filename, uid) < 0) {
+      goto out;
+    }
+  } else {
+    // Drop privileges.
     const char* drop_username = username;
 
     // If user doesn't exist, use 'nobody'.
@@ -1875,30 +4157,41 @@ static int google_authenticator(pam_handle_t *pamh,
       goto out;
     }
   }
+  stats_record(params.stats, STATS_PHASE_DROP_PRIVILEGES, start);
 
+  SecretLoad load = {
+    .pamh = pamh, .params = &params, .username = username,
+    .secret_filename = secret_filename, .uid = uid, .cfg = &cfg,
+    .orig_stat = &orig_stat, .store_version = &store_version,
+    .key = &key, .fd = -1 };
   if (secret_filename) {
-    fd = open_secret_file(pamh, secret_filename, &params, username, uid, &orig_stat);
-    if (fd >= 0) {
-      buf = read_file_contents(pamh, &params, secret_filename, &fd, orig_stat.st_size);
-    }
-
-    if (buf) {
-      if (rate_limit(pamh, secret_filename, &early_updated, &buf) >= 0) {
-        secret = get_shared_secret(pamh, &params, secret_filename, buf, &secretLen);
-      } else {
-        stopped_by_rate_limit=1;
-      }
+    if (params.prefetch && params.pass_mode == PROMPT &&
+        params.nullok == NULLERR && !params.grace_period &&
+        !pthread_create(&load.thread, NULL, load_secret_thread, &load)) {
+      // Nothing that we could learn from the secret file saves us from
+      // prompting. So, ask for the code while the file is being read.
+      early_pw = request_pass(pamh, params.echocode, prompt);
+      pthread_join(load.thread, NULL);
+#if defined(DEMO) || defined(TESTING)
+      adopt_error_msg(load.error_msg);
+#endif
+    } else {
+      load_secret(&load);
     }
   }
+  fd = load.fd;
+  secret = load.secret;
+  early_updated = load.early_updated;
+  stopped_by_rate_limit = load.stopped_by_rate_limit;
 
-  const long hotp_counter = get_hotp_counter(pamh, buf);
+  long hotp_counter = get_hotp_counter(pamh, &cfg);
 
   /*
    * Check to see if a successful login from the same host happened
    * within the grace period. If it did, then allow login without
    * an additional code.
    */
-  if (buf && within_grace_period(pamh, &params, buf)) {
+  if (cfg.buf && within_grace_period(pamh, &params, &cfg)) {
     rc = PAM_SUCCESS;
     log_message(LOG_INFO, pamh,
                 "within grace period: \"%s\"", username);
@@ -1915,8 +4208,12 @@ static int google_authenticator(pam_handle_t *pamh,
       log_message(LOG_WARNING , pamh, "No secret configured for user %s, asking for code anyway.", username);
     }
 
+    // Verification codes are six digits long, unless CODE_DIGITS says
+    // otherwise.
+    const int digits = key.verifier ? key.verifier->digits : 6;
     int must_advance_counter = 0;
-    char *pw = NULL, *saved_pw = NULL;
+    char *pw = NULL, *saved_pw = early_pw;
+    early_pw = NULL;
     for (int mode = 0; mode < 4; ++mode) {
       // In the case of TRY_FIRST_PASS, we don't actually know whether we
       // get the verification code from the system password or from prompting
@@ -1985,10 +4282,10 @@ static int google_authenticator(pam_handle_t *pamh,
       }
 
       if (pw_len < expected_len ||
-          // Verification are six digits starting with '0'..'9',
+          // Verification codes are all digits starting with '0'..'9',
           // scratch codes are eight digits starting with '1'..'9'
           (ch = pw[pw_len - expected_len]) > '9' ||
-          ch < (expected_len == 8 ? '1' : '0')) {
+          ch < (expected_len != digits ? '1' : '0')) {
       invalid:
         explicit_bzero(pw, pw_len);
         free(pw);
@@ -2018,28 +4315,39 @@ static int google_authenticator(pam_handle_t *pamh,
       // In all other cases will we just remain at PAM_AUTH_ERR
       if (secret) {
         // Check all possible types of verification codes.
-        switch (check_scratch_codes(pamh, &params, secret_filename, &updated, buf, code)) {
+        start = stats_start(params.stats);
+        switch (check_scratch_codes(pamh, &params, secret_filename, &updated,
+                                    &cfg, &key.sha1, code)) {
         case 1:
-          if (hotp_counter > 0) {
+          if (expected_len != digits) {
+            // Not a scratch code, and not long enough to be a verification
+            // code either.
+            stats_record(params.stats, STATS_PHASE_VERIFY, start);
+            goto invalid;
+          } else if (hotp_counter > 0) {
             switch (check_counterbased_code(pamh, secret_filename, &updated,
-                                            &buf, secret, secretLen, code,
-                                            hotp_counter,
-                                            &must_advance_counter)) {
+                                            &cfg, &key, code, &hotp_counter,
+                                            &must_advance_counter,
+                                            params.state, params.stats)) {
             case 0:
               rc = PAM_SUCCESS;
+              stats_count(params.stats, STATS_HOTP_HIT);
               break;
             case 1:
+              stats_record(params.stats, STATS_PHASE_VERIFY, start);
               goto invalid;
             default:
               break;
             }
           } else {
-            switch (check_timebased_code(pamh, secret_filename, &updated, &buf,
-                                         secret, secretLen, code, &params)) {
+            switch (check_timebased_code(pamh, secret_filename, &updated, &cfg,
+                                         &key, code, &params)) {
             case 0:
               rc = PAM_SUCCESS;
+              stats_count(params.stats, STATS_TOTP_HIT);
               break;
             case 1:
+              stats_record(params.stats, STATS_PHASE_VERIFY, start);
               goto invalid;
             default:
               break;
@@ -2048,10 +4356,12 @@ static int google_authenticator(pam_handle_t *pamh,
           break;
         case 0:
           rc = PAM_SUCCESS;
+          stats_count(params.stats, STATS_SCRATCH_HIT);
           break;
         default:
           break;
         }
+        stats_record(params.stats, STATS_PHASE_VERIFY, start);
 
         break;
       }
@@ -2079,9 +4389,17 @@ static int google_authenticator(pam_handle_t *pamh,
     // If an hotp login attempt has been made, the counter must always be
     // advanced by at least one, unless this has been disabled.
     if (!params.no_increment_hotp && must_advance_counter) {
+      if (params.state) {
+        // Other hosts must not accept the code that was just tried, either.
+        long shared;
+        state_store_advance_counter(params.state, -1, hotp_counter + 1,
+                                    &shared);
+      }
       char counter_str[40];
       snprintf(counter_str, sizeof counter_str, "%ld", hotp_counter + 1);
-      if (set_cfg_value(pamh, "HOTP_COUNTER", counter_str, &buf) < 0) {
+      if (set_cfg_value(pamh, "HOTP_COUNTER", counter_str, &cfg) < 0 ||
+          cfg_record_edit(pamh, &cfg, EDIT_HOTP_COUNTER, NULL, NULL,
+                          -1, hotp_counter + 1) < 0) {
         rc = PAM_AUTH_ERR;
       }
       updated = 1;
@@ -2090,9 +4408,16 @@ static int google_authenticator(pam_handle_t *pamh,
     // Display a success or error message
     if (rc == PAM_SUCCESS) {
       log_message(LOG_INFO , pamh, "Accepted google_authenticator for %s", username);
+      if (params.skew_cache) {
+        // Candidate codes are only kept around while the user is struggling.
+        uint8_t id[SHA1_DIGEST_LENGTH];
+        otp_key_id(&key, "skew cache", id);
+        skew_cache_drop(id);
+        explicit_bzero(id, sizeof(id));
+      }
       if (params.grace_period != 0) {
         updated = 1;
-        if (update_logindetails(pamh, &params, &buf)) {
+        if (update_logindetails(pamh, &params, &cfg)) {
           log_message(LOG_ERR, pamh, "Failed to store grace_period timestamp in config");
         }
       }
@@ -2112,10 +4437,50 @@ static int google_authenticator(pam_handle_t *pamh,
     rc = PAM_IGNORE;
   }
 
-  // Persist the new state.
-  if (early_updated || updated) {
-    int err;
-    if ((err = write_file_contents(pamh, &params, secret_filename, &orig_stat, buf))) {
+  // Persist the new state. With "update_retries", changes that somebody else
+  // made in the meantime are merged, rather than failing the login.
+  for (int retries = params.update_retries; early_updated || updated; ) {
+    // Assemble the new file contents from the original lines and all the
+    // changes that we made.
+    char *buf = cfg_serialize(pamh, &cfg);
+    int err = 0;
+    if (!buf) {
+      rc = PAM_AUTH_ERR;
+    } else if (params.store) {
+      err = write_store_record(pamh, &params, secret_filename, username,
+                               store_version, buf);
+    } else if (params.volatile_keys &&
+               !write_journal(pamh, &params, secret_filename, &orig_stat,
+                              &cfg, buf)) {
+      // Only volatile keys changed, and they have been journaled.
+    } else {
+      err = write_file_contents(pamh, &params, secret_filename, &orig_stat,
+                                buf);
+      if (!err && params.volatile_keys) {
+        remove_journal(pamh, &params, secret_filename);
+      }
+    }
+    if (err == EAGAIN && retries-- > 0) {
+      switch (reload_state(pamh, &params, secret_filename, username, uid,
+                           &orig_stat, &store_version, &cfg)) {
+      case 0:
+        continue;
+      case 1:
+        log_message(LOG_ERR, pamh, "Concurrent login prevents login for %s",
+                    username);
+        rc = PAM_AUTH_ERR;
+        continue;
+      default:
+        break;
+      }
+    }
+    if (!err) {
+      // Done.
+    } else if (params.store) {
+      if (!params.allow_readonly) {
+        rc = PAM_AUTH_ERR;
+      }
+    } else {
       // Inform user of error if the error is clearly a system error
       // and not an auth error.
       char s[1024];
@@ -2136,6 +4501,7 @@ static int google_authenticator(pam_handle_t *pamh,
         rc = PAM_AUTH_ERR;
       }
     }
+    break;
   }
 
 out:
@@ -2144,6 +4510,10 @@ out:
                 "debug: end of google_authenticator for \"%s\". Result: %s",
                 username, pam_strerror(pamh, rc));
   }
+  if (early_pw) {
+    explicit_bzero(early_pw, strlen(early_pw));
+    free(early_pw);
+  }
   if (fd >= 0) {
     close(fd);
   }
@@ -2158,17 +4528,19 @@ out:
                   "but can't switch back", old_uid, uid);
     }
   }
-  free(secret_filename);
-
-  // Clean up
-  if (buf) {
-    explicit_bzero(buf, strlen(buf));
-    free(buf);
-  }
-  if (secret) {
-    explicit_bzero(secret, secretLen);
-    free(secret);
+  if (params.dirfd >= 0) {
+    close(params.dirfd);
   }
+  free(secret_filename);
+  shm_store_close(&shm);
+  stats_close(&stats);
+  secret_store_close(&store);
+
+  // Clean up. This erases the file contents, the shared secret, and all
+  // values derived from them in one go.
+  unmap_file_contents(&cfg);
+  arena_wipe(&arena);
+  clear_otp_key(&key);
   return rc;
 }
 
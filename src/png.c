@@ -0,0 +1,153 @@
+// Minimal PNG writer for QR codes
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "png.h"
+
+#define PNG_BORDER       4
+#define DEFLATE_MAX_LEN  65535
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len) {
+  // Bitwise CRC-32, as used by PNG. The images are tiny, so there is no
+  // point in a table that would have to be initialized in a thread safe way.
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; ++i) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static uint8_t *put32(uint8_t *ptr, uint32_t val) {
+  *ptr++ = val >> 24;
+  *ptr++ = val >> 16;
+  *ptr++ = val >> 8;
+  *ptr++ = val;
+  return ptr;
+}
+
+// Appends a chunk with the given type and data to "out", and returns the
+// new end of the buffer.
+static uint8_t *put_chunk(uint8_t *out, const char *type,
+                          const uint8_t *data, uint32_t len) {
+  uint8_t *start = out;
+  out = put32(out, len);
+  memcpy(out, type, 4);
+  memmove(out + 4, data, len);
+  out += 4 + len;
+  return put32(out, crc32_update(0, start + 4, len + 4));
+}
+
+int png_write_qrcode(int fd, const unsigned char *modules, int width,
+                     int scale) {
+  if (width <= 0 || scale <= 0 || width > 1000 || scale > 64) {
+    return -1;
+  }
+  const uint32_t pixels = (width + 2*PNG_BORDER) * scale;
+  const uint32_t stride = 1 + (pixels + 7)/8;  // Filter byte and bitmap
+  const uint32_t raw_len = stride * pixels;
+  const uint32_t blocks = (raw_len + DEFLATE_MAX_LEN - 1) / DEFLATE_MAX_LEN;
+  const uint32_t zlib_len = 2 + 5*blocks + raw_len + 4;
+
+  // Signature, IHDR, IDAT and IEND chunks.
+  const size_t size = 8 + (12 + 13) + (12 + zlib_len) + 12;
+  uint8_t *png = malloc(size);
+  uint8_t *raw = calloc(raw_len, 1);
+  if (!png || !raw) {
+    free(png);
+    free(raw);
+    return -1;
+  }
+
+  // One bit per pixel, where 0 is black. Start out all white.
+  for (uint32_t y = 0; y < pixels; ++y) {
+    memset(raw + y*stride + 1, 0xFF, stride - 1);
+  }
+  for (int y = 0; y < width; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (!(modules[y*width + x] & 1)) {
+        continue;
+      }
+      for (int dy = 0; dy < scale; ++dy) {
+        uint8_t *row = raw + ((y + PNG_BORDER)*scale + dy)*stride + 1;
+        for (int dx = 0; dx < scale; ++dx) {
+          const uint32_t px = (x + PNG_BORDER)*scale + dx;
+          row[px/8] &= ~(0x80 >> (px % 8));
+        }
+      }
+    }
+  }
+
+  uint8_t *out = png;
+  memcpy(out, "\x89PNG\r\n\x1A\n", 8);
+  out += 8;
+
+  uint8_t ihdr[13];
+  put32(ihdr, pixels);
+  put32(ihdr + 4, pixels);
+  ihdr[8]  = 1;  // Bit depth
+  ihdr[9]  = 0;  // Grayscale
+  ihdr[10] = 0;  // Deflate
+  ihdr[11] = 0;  // Adaptive filtering
+  ihdr[12] = 0;  // No interlacing
+  out = put_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+  // Assemble the zlib stream from stored deflate blocks right where the
+  // IDAT chunk data goes.
+  uint8_t *z = out + 8;
+  *z++ = 0x78;
+  *z++ = 0x01;
+  uint32_t a = 1, b = 0;
+  for (uint32_t done = 0; done < raw_len; ) {
+    const uint32_t len = raw_len - done > DEFLATE_MAX_LEN
+      ? DEFLATE_MAX_LEN : raw_len - done;
+    *z++ = done + len == raw_len;  // BFINAL, and BTYPE of zero
+    *z++ = len;
+    *z++ = len >> 8;
+    *z++ = ~len;
+    *z++ = ~len >> 8;
+    memcpy(z, raw + done, len);
+    for (uint32_t i = 0; i < len; ++i) {
+      a = (a + z[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    z += len;
+    done += len;
+  }
+  put32(z, b << 16 | a);
+  out = put_chunk(out, "IDAT", out + 8, zlib_len);
+  out = put_chunk(out, "IEND", NULL, 0);
+
+  int rc = 0;
+  for (const uint8_t *ptr = png; ptr < out; ) {
+    const ssize_t len = write(fd, ptr, out - ptr);
+    if (len <= 0) {
+      rc = -1;
+      break;
+    }
+    ptr += len;
+  }
+  free(raw);
+  free(png);
+  return rc;
+}
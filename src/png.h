@@ -0,0 +1,32 @@
+// Minimal PNG writer for QR codes
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _PNG_H_
+#define _PNG_H_
+
+#include <stdint.h>
+
+// Writes a black and white image of a "width" x "width" square of modules
+// to "fd". Every module is "scale" pixels wide, and the bit 0 of each byte
+// in "modules" is set for black modules. A white border of four modules
+// surrounds the image, as QR code readers require. The pixel data is
+// stored uncompressed, which avoids a dependency on zlib, and is small
+// enough for one bit per pixel images.
+// Returns 0 on success, or -1 on error.
+int png_write_qrcode(int fd, const unsigned char *modules, int width,
+                     int scale) __attribute__((visibility("hidden")));
+
+#endif /* _PNG_H_ */
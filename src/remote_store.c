@@ -0,0 +1,572 @@
+// State store on a Redis server that is shared by several hosts
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "remote_store.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define REMOTE_STORE_MAX_SERVERS 4
+#define REMOTE_STORE_ADDRESS_LEN 108
+#define REMOTE_STORE_CMD_SIZE    512
+#define REMOTE_STORE_IOV_MAX     64
+#define REMOTE_STORE_KEY_PREFIX  "google-authenticator:"
+
+// Raises the counter in KEYS[1] to at least ARGV[1], and returns the value
+// that it had before. The server runs scripts atomically, so two hosts can
+// never both consume the same counter value.
+static const char counter_script[] =
+  "local c = tonumber(redis.call('GET', KEYS[1])) or 0 "
+  "if c < tonumber(ARGV[1]) then redis.call('SET', KEYS[1], ARGV[1]) end "
+  "return c";
+
+// A single command, and its reply. Requests live on the stack of the thread
+// that makes them, until another thread marks them as "done".
+typedef struct RemoteRequest {
+  struct RemoteRequest *next;
+  char      cmd[REMOTE_STORE_CMD_SIZE];
+  int       len;
+  int       done;
+  int       status;   // 0 for an integer or status reply, 1 for nil, -1 on error
+  long long value;
+} RemoteRequest;
+
+// The connection to one server. Whichever thread finds the connection idle
+// sends all queued requests, and reads all of their replies, while other
+// threads queue up more requests for the next batch. Only that thread
+// touches "fd" and "buf".
+typedef struct RemoteServer {
+  char            address[REMOTE_STORE_ADDRESS_LEN];
+  int             timeout_ms;
+  int             fd;
+  pid_t           pid;          // Process that opened "fd"
+  time_t          retry_after;  // Set after a failure
+  int             error;
+  int             busy;
+  RemoteRequest   *queue, **tail;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  char            buf[4096];
+  int             buf_pos, buf_len;
+} RemoteServer;
+
+static RemoteServer servers[REMOTE_STORE_MAX_SERVERS];
+static int num_servers;
+static pthread_mutex_t servers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t monotonic_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static long long monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits until "fd" is ready for "events", or until "deadline" has passed.
+// Returns 0 on success, or -1 on error.
+static int wait_fd(int fd, short events, long long deadline) {
+  for (;;) {
+    const long long remaining = deadline - monotonic_ms();
+    if (remaining <= 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    struct pollfd pfd = { .fd = fd, .events = events };
+    const int rc = poll(&pfd, 1, (int)remaining);
+    if (rc > 0) {
+      return 0;
+    } else if (rc < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+static void server_disconnect(RemoteServer *server) {
+  // A child process must not talk over its parent's connection, but it
+  // can close its own copy of the descriptor.
+  if (server->fd >= 0) {
+    close(server->fd);
+    server->fd = -1;
+  }
+  server->buf_pos = server->buf_len = 0;
+}
+
+// Connects a non-blocking socket to "addr". Returns the socket, or -1.
+static int connect_socket(int family, const struct sockaddr *addr,
+                          socklen_t len, long long deadline) {
+  const int fd = socket(family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+    goto error;
+  }
+#ifdef SO_NOSIGPIPE
+  const int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  if (connect(fd, addr, len)) {
+    if (errno != EINPROGRESS || wait_fd(fd, POLLOUT, deadline)) {
+      goto error;
+    }
+    int err;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len)) {
+      goto error;
+    } else if (err) {
+      errno = err;
+      goto error;
+    }
+  }
+  return fd;
+
+error:;
+  const int err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+// Opens the connection. Returns 0 on success, or -1 on error.
+static int server_connect(RemoteServer *server, long long deadline) {
+  int fd = -1;
+  if (server->address[1] == '/') {
+    // "//host:port". Only the last colon separates the port, so that
+    // numeric IPv6 addresses work as well.
+    char host[REMOTE_STORE_ADDRESS_LEN];
+    strcpy(host, server->address + 2);
+    char *port = strrchr(host, ':');
+    if (!port || port == host) {
+      errno = EINVAL;
+      return -1;
+    }
+    *port++ = '\000';
+    if (*host == '[' && port[-2] == ']') {
+      port[-2] = '\000';
+      memmove(host, host + 1, strlen(host));
+    }
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM,
+                              .ai_flags = AI_NUMERICSERV };
+    struct addrinfo *res;
+    const int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc) {
+      errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+      return -1;
+    }
+    for (const struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+      fd = connect_socket(ai->ai_family, ai->ai_addr, ai->ai_addrlen,
+                          deadline);
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+      // Batches are small, and written all at once.
+      const int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+  } else {
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    if (strlen(server->address) >= sizeof(sun.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(sun.sun_path, server->address);
+    fd = connect_socket(AF_UNIX, (struct sockaddr *)&sun, sizeof(sun),
+                        deadline);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  server->fd = fd;
+  server->pid = getpid();
+  server->buf_pos = server->buf_len = 0;
+  return 0;
+}
+
+// Sends the commands of all requests in "batch".
+// Returns 0 on success, or -1 on error.
+static int send_requests(RemoteServer *server, RemoteRequest *batch,
+                         long long deadline) {
+  while (batch) {
+    struct iovec iov[REMOTE_STORE_IOV_MAX];
+    int iovcnt = 0;
+    for (; batch && iovcnt < REMOTE_STORE_IOV_MAX; batch = batch->next) {
+      iov[iovcnt].iov_base = batch->cmd;
+      iov[iovcnt++].iov_len = batch->len;
+    }
+    for (struct iovec *next = iov; iovcnt > 0; ) {
+      struct msghdr msg = { .msg_iov = next, .msg_iovlen = iovcnt };
+      ssize_t sent = sendmsg(server->fd, &msg, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EINTR ||
+            ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+             !wait_fd(server->fd, POLLOUT, deadline))) {
+          continue;
+        }
+        return -1;
+      }
+      for (; iovcnt > 0 && (size_t)sent >= next->iov_len; --iovcnt, ++next) {
+        sent -= next->iov_len;
+      }
+      if (iovcnt > 0) {
+        next->iov_base = (char *)next->iov_base + sent;
+        next->iov_len -= sent;
+      }
+    }
+  }
+  return 0;
+}
+
+// Reads more data from the server into the buffer.
+// Returns 0 on success, or -1 on error.
+static int fill_buffer(RemoteServer *server, long long deadline) {
+  if (server->buf_pos) {
+    server->buf_len -= server->buf_pos;
+    memmove(server->buf, server->buf + server->buf_pos, server->buf_len);
+    server->buf_pos = 0;
+  }
+  if (server->buf_len == sizeof(server->buf)) {
+    errno = EPROTO;
+    return -1;
+  }
+  for (;;) {
+    const ssize_t len = recv(server->fd, server->buf + server->buf_len,
+                             sizeof(server->buf) - server->buf_len, 0);
+    if (len > 0) {
+      server->buf_len += len;
+      return 0;
+    } else if (len == 0) {
+      errno = ECONNRESET;
+      return -1;
+    } else if (errno != EINTR &&
+               ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+                wait_fd(server->fd, POLLIN, deadline))) {
+      return -1;
+    }
+  }
+}
+
+// Returns the next line of the reply without its CRLF, or NULL on error.
+static char *read_line(RemoteServer *server, long long deadline) {
+  for (;;) {
+    char *line = server->buf + server->buf_pos;
+    char *end = memchr(line, '\n', server->buf_len - server->buf_pos);
+    if (end) {
+      if (end == line || end[-1] != '\r') {
+        errno = EPROTO;
+        return NULL;
+      }
+      end[-1] = '\000';
+      server->buf_pos = end + 1 - server->buf;
+      return line;
+    }
+    if (fill_buffer(server, deadline)) {
+      return NULL;
+    }
+  }
+}
+
+// Reads the reply to "req". Error replies only fail the request, but
+// anything that leaves the connection out of step fails all of them.
+// Returns 0 on success, or -1 if the connection is no longer usable.
+static int read_reply(RemoteServer *server, RemoteRequest *req,
+                      long long deadline) {
+  const char *line = read_line(server, deadline);
+  if (!line) {
+    return -1;
+  }
+  char *endptr;
+  errno = 0;
+  switch (*line) {
+  case ':':
+    req->value = strtoll(line + 1, &endptr, 10);
+    if (errno || endptr == line + 1 || *endptr) {
+      errno = EPROTO;
+      return -1;
+    }
+    req->status = 0;
+    return 0;
+  case '+':
+    req->status = 0;
+    return 0;
+  case '-':
+    req->status = -1;
+    return 0;
+  case '_':
+    req->status = 1;
+    return 0;
+  case '$': {
+    const long long len = strtoll(line + 1, &endptr, 10);
+    if (errno || endptr == line + 1 || *endptr || len < -1) {
+      errno = EPROTO;
+      return -1;
+    }
+    if (len < 0) {
+      req->status = 1;
+      return 0;
+    }
+    // None of our commands return strings. Skip the value, and its CRLF.
+    for (long long skip = len + 2; skip > 0; ) {
+      if (server->buf_pos == server->buf_len &&
+          fill_buffer(server, deadline)) {
+        return -1;
+      }
+      const int avail = server->buf_len - server->buf_pos;
+      const int n = skip < avail ? (int)skip : avail;
+      server->buf_pos += n;
+      skip -= n;
+    }
+    req->status = -1;
+    return 0;
+  }
+  default:
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+// Sends a batch of requests, and collects the replies. Returns 0 on
+// success, or -1 if the connection failed.
+static int run_requests(RemoteServer *server, RemoteRequest *batch) {
+  const long long deadline = monotonic_ms() + server->timeout_ms;
+  int rc = 0;
+  if (server->fd < 0) {
+    rc = server_connect(server, deadline);
+  }
+  if (!rc) {
+    rc = send_requests(server, batch, deadline);
+  }
+  for (RemoteRequest *req = batch; req; req = req->next) {
+    if (rc || (rc = read_reply(server, req, deadline))) {
+      req->status = -1;
+    }
+  }
+  if (rc) {
+    server->error = errno;
+    server_disconnect(server);
+  }
+  return rc;
+}
+
+// Sends "req" to the server, either in a batch of its own, or along with
+// the requests of other threads.
+// Returns the status of the reply, or -1 on error.
+static int remote_request(RemoteServer *server, RemoteRequest *req) {
+  if (!server) {
+    // remote_store_open() could not set up the server.
+    return -1;
+  }
+  pthread_mutex_lock(&server->lock);
+  if (server->fd >= 0 && server->pid != getpid() && !server->busy) {
+    server_disconnect(server);
+  }
+  if (server->fd < 0 && !server->busy &&
+      monotonic_seconds() < server->retry_after) {
+    // Don't make every login wait for a server that is known to be down.
+    pthread_mutex_unlock(&server->lock);
+    return -1;
+  }
+
+  req->next = NULL;
+  req->done = 0;
+  req->status = -1;
+  *server->tail = req;
+  server->tail = &req->next;
+  while (!req->done) {
+    if (server->busy) {
+      pthread_cond_wait(&server->cond, &server->lock);
+      continue;
+    }
+    server->busy = 1;
+    RemoteRequest *batch = server->queue;
+    server->queue = NULL;
+    server->tail = &server->queue;
+    pthread_mutex_unlock(&server->lock);
+
+    const int failed = run_requests(server, batch);
+
+    pthread_mutex_lock(&server->lock);
+    if (failed) {
+      server->retry_after = monotonic_seconds() + REMOTE_STORE_BACKOFF;
+    }
+    for (RemoteRequest *next; batch; batch = next) {
+      next = batch->next;
+      batch->done = 1;
+    }
+    server->busy = 0;
+    pthread_cond_broadcast(&server->cond);
+  }
+  pthread_mutex_unlock(&server->lock);
+  return req->status;
+}
+
+// Serializes a command in the Redis protocol.
+// Returns 0 on success, or -1 if the command is too long.
+static int format_command(RemoteRequest *req, int argc, const char **argv) {
+  int len = snprintf(req->cmd, sizeof(req->cmd), "*%d\r\n", argc);
+  for (int i = 0; i < argc && len < (int)sizeof(req->cmd); ++i) {
+    len += snprintf(req->cmd + len, sizeof(req->cmd) - len, "$%zu\r\n%s\r\n",
+                    strlen(argv[i]), argv[i]);
+  }
+  if (len >= (int)sizeof(req->cmd)) {
+    return -1;
+  }
+  req->len = len;
+  return 0;
+}
+
+static void format_key(char *key, size_t size, const StateStore *store,
+                       const char *suffix) {
+  char *ptr = key + snprintf(key, size, "%s", REMOTE_STORE_KEY_PREFIX);
+  for (int i = 0; i < STATE_STORE_ID_LENGTH; ++i) {
+    ptr += sprintf(ptr, "%02x", store->id[i]);
+  }
+  snprintf(ptr, size - (ptr - key), "%s", suffix);
+}
+
+static int remote_disallow_reuse(StateStore *store, unsigned int now,
+                                 int tm, int window, int step) {
+  // Keep the code around for as long as it could still be accepted, even
+  // with a time skew that moves it backwards.
+  long long ttl = ((long long)tm + window) * step - now;
+  if (ttl < 2LL * window * step) {
+    ttl = 2LL * window * step;
+  }
+  char suffix[24], key[128], expires[24];
+  snprintf(suffix, sizeof(suffix), ":totp:%d", tm);
+  format_key(key, sizeof(key), store, suffix);
+  snprintf(expires, sizeof(expires), "%lld", ttl);
+  RemoteRequest req;
+  if (format_command(&req, 6, (const char *[]){ "SET", key, "1", "NX", "EX",
+                                                expires })) {
+    return -1;
+  }
+  // The server only sets the key, if it did not exist yet.
+  return remote_request(store->impl, &req);
+}
+
+static int remote_advance_counter(StateStore *store, long next,
+                                  long *current) {
+  char key[128], value[24];
+  format_key(key, sizeof(key), store, ":hotp");
+  snprintf(value, sizeof(value), "%ld", next);
+  RemoteRequest req;
+  if (format_command(&req, 5, (const char *[]){ "EVAL", counter_script, "1",
+                                                key, value }) ||
+      remote_request(store->impl, &req) ||
+      req.value < 0) {
+    return -1;
+  }
+  *current = (long)req.value;
+  return 0;
+}
+
+static const StateStoreOps remote_ops = {
+  .disallow_reuse  = remote_disallow_reuse,
+  .advance_counter = remote_advance_counter,
+};
+
+int remote_store_open(StateStore *store, const char *address,
+                      int timeout_ms) {
+  memset(store, 0, sizeof(*store));
+  store->ops = &remote_ops;
+  if (strlen(address) >= REMOTE_STORE_ADDRESS_LEN) {
+    return ENAMETOOLONG;
+  }
+
+  // Servers are never removed, so their connections survive from one login
+  // to the next.
+  RemoteServer *server = NULL;
+  pthread_mutex_lock(&servers_lock);
+  for (int i = 0; i < num_servers && !server; ++i) {
+    if (!strcmp(servers[i].address, address)) {
+      server = servers + i;
+    }
+  }
+  if (!server && num_servers < REMOTE_STORE_MAX_SERVERS) {
+    server = servers + num_servers++;
+    strcpy(server->address, address);
+    server->fd = -1;
+    server->tail = &server->queue;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+  }
+  pthread_mutex_unlock(&servers_lock);
+  if (!server) {
+    return ENOSPC;
+  }
+  store->impl = server;
+
+  int err = 0;
+  pthread_mutex_lock(&server->lock);
+  server->timeout_ms = timeout_ms;
+  if (server->fd >= 0 && server->pid != getpid() && !server->busy) {
+    server_disconnect(server);
+  }
+  if (server->fd < 0 && !server->busy) {
+    if (monotonic_seconds() < server->retry_after) {
+      err = server->error;
+    } else {
+      server->busy = 1;
+      pthread_mutex_unlock(&server->lock);
+      const int failed = server_connect(server,
+                                        monotonic_ms() + timeout_ms);
+      const int connect_err = errno;
+      pthread_mutex_lock(&server->lock);
+      if (failed) {
+        err = server->error = connect_err;
+        server->retry_after = monotonic_seconds() + REMOTE_STORE_BACKOFF;
+      }
+      server->busy = 0;
+      pthread_cond_broadcast(&server->cond);
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+  return err;
+}
+
+// PAM applications unload the module when they are done with it, which must
+// not leak the connections.
+static void __attribute__((destructor)) remote_store_cleanup(void) {
+  for (int i = 0; i < num_servers; ++i) {
+    if (servers[i].fd >= 0 && servers[i].pid == getpid()) {
+      close(servers[i].fd);
+    }
+  }
+}
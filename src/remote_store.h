@@ -0,0 +1,38 @@
+// State store on a Redis server that is shared by several hosts
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _REMOTE_STORE_H_
+#define _REMOTE_STORE_H_
+
+#include "state_store.h"
+
+// After a request fails or times out, the server is not contacted again for
+// this many seconds. Until then, requests fail right away.
+#define REMOTE_STORE_BACKOFF 30
+
+// Makes "store" send its requests to the server at "address", which is
+// either "//host:port" or the "/path" of a Unix domain socket. Each process
+// keeps one persistent connection per server, and requests that threads make
+// at the same time are sent in a single batch. No request waits for more
+// than "timeout_ms" milliseconds.
+// This should be called before dropping privileges, as it connects to the
+// server if there is no connection yet. Returns 0 on success, or an errno
+// value. Even on error, "store" is usable, but its requests fail until the
+// server can be reached again.
+int remote_store_open(StateStore *store, const char *address, int timeout_ms)
+  __attribute__((visibility("hidden")));
+
+#endif /* _REMOTE_STORE_H_ */
@@ -0,0 +1,75 @@
+// Hashed set of scratch codes, kept in a single SCRATCH_CODES line
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scratch_codes.h"
+#include "util.h"
+
+void scratch_code_hash(const HMAC_SHA1_CTX *hmac, int code,
+                       char hash[SCRATCH_HASH_DIGITS + 1]) {
+  char msg[32];
+  const int len = snprintf(msg, sizeof(msg), "scratch code %08d", code);
+  uint8_t digest[SHA1_DIGEST_LENGTH];
+  hmac_sha1_compute(hmac, (const uint8_t *)msg, len, digest, sizeof(digest));
+  for (int i = 0; i < SCRATCH_HASH_DIGITS; ++i) {
+    hash[i] = "0123456789abcdef"[(digest[i/2] >> (i & 1 ? 0 : 4)) & 0xF];
+  }
+  hash[SCRATCH_HASH_DIGITS] = '\000';
+  explicit_bzero(msg, sizeof(msg));
+  explicit_bzero(digest, sizeof(digest));
+}
+
+static int slot_cmp(const void *a, const void *b) {
+  return memcmp((const char *)a + 1, (const char *)b + 1,
+                SCRATCH_HASH_DIGITS);
+}
+
+void scratch_codes_format(const HMAC_SHA1_CTX *hmac, const int *codes, int n,
+                          char *buf) {
+  for (int i = 0; i < n; ++i) {
+    char *slot = buf + i*SCRATCH_CODE_SLOT;
+    char hash[SCRATCH_HASH_DIGITS + 1];
+    scratch_code_hash(hmac, codes[i], hash);
+    *slot = '+';
+    memcpy(slot + 1, hash, SCRATCH_HASH_DIGITS);
+  }
+  qsort(buf, n, SCRATCH_CODE_SLOT, slot_cmp);
+  buf[n*SCRATCH_CODE_SLOT] = '\000';
+}
+
+int scratch_codes_find(const char *value, size_t len, const char *hash) {
+  // Lines that have been edited by hand are not to be trusted.
+  if (len % SCRATCH_CODE_SLOT) {
+    return -1;
+  }
+  size_t lo = 0, hi = len / SCRATCH_CODE_SLOT;
+  while (lo < hi) {
+    const size_t mid = (lo + hi) / 2;
+    const int cmp = memcmp(value + mid*SCRATCH_CODE_SLOT + 1, hash,
+                           SCRATCH_HASH_DIGITS);
+    if (!cmp) {
+      return (int)(mid*SCRATCH_CODE_SLOT);
+    } else if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,52 @@
+// Hashed set of scratch codes, kept in a single SCRATCH_CODES line
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SCRATCH_CODES_H_
+#define _SCRATCH_CODES_H_
+
+#include <stddef.h>
+
+#include "hmac.h"
+
+#define SCRATCH_HASH_DIGITS        12
+#define SCRATCH_CODE_SLOT          (1 + SCRATCH_HASH_DIGITS)
+#define MAX_HASHED_SCRATCHCODES    1000
+
+// The value of the SCRATCH_CODES line is a sorted array of fixed-width
+// slots, one per scratch code. Each slot is a '+' for a code that can still
+// be used, or a '-' for one that has been used up, followed by the keyed
+// hash of the code as lower case hexadecimal digits. The hash is keyed with
+// the shared secret, so the codes cannot be read from the file. Lookups
+// are a binary search on the text of the line, and using up a code only
+// changes one character.
+
+// Computes the keyed hash of an eight digit scratch code.
+void scratch_code_hash(const HMAC_SHA1_CTX *hmac, int code,
+                       char hash[SCRATCH_HASH_DIGITS + 1])
+  __attribute__((visibility("hidden")));
+
+// Writes the value of a SCRATCH_CODES line holding "n" codes into "buf",
+// which must have room for n*SCRATCH_CODE_SLOT + 1 bytes.
+void scratch_codes_format(const HMAC_SHA1_CTX *hmac, const int *codes, int n,
+                          char *buf)
+  __attribute__((visibility("hidden")));
+
+// Looks up "hash" in the "len" bytes of the value of a SCRATCH_CODES line.
+// Returns the offset of its slot, or -1 if there is none.
+int scratch_codes_find(const char *value, size_t len, const char *hash)
+  __attribute__((visibility("hidden")));
+
+#endif /* _SCRATCH_CODES_H_ */
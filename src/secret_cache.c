@@ -0,0 +1,203 @@
+// Process wide cache of secret file contents for long running PAM hosts
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "secret_cache.h"
+#include "util.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct CacheKey {
+  dev_t    dev;
+  ino_t    ino;
+  off_t    size;
+  uid_t    uid;
+  mode_t   mode;
+  time_t   mtime;
+  time_t   ctime;
+  long     mtime_ns;
+  long     ctime_ns;
+} CacheKey;
+
+// Each entry lives at the start of its own locked mapping. The key is part
+// of the mapping, so that it reads as all zeros in a child process that
+// had the mapping wiped, and then never matches a real file.
+typedef struct CacheEntry {
+  CacheKey key;
+  size_t   size;
+  union {
+    long double align_ld;
+    void        *align_ptr;
+    uint64_t    align_u64;
+    char        data[1];
+  } u;
+} CacheEntry;
+
+typedef struct CacheSlot {
+  CacheEntry *entry;
+  size_t     map_size;
+  uint64_t   last_used;
+} CacheSlot;
+
+static CacheSlot       slots[SECRET_CACHE_MAX_ENTRIES];
+static int             num_slots;
+static uint64_t        use_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void make_key(CacheKey *key, const struct stat *sb) {
+  memset(key, 0, sizeof(*key));
+  key->dev   = sb->st_dev;
+  key->ino   = sb->st_ino;
+  key->size  = sb->st_size;
+  key->uid   = sb->st_uid;
+  key->mode  = sb->st_mode;
+  key->mtime = sb->st_mtime;
+  key->ctime = sb->st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  key->mtime_ns = sb->st_mtim.tv_nsec;
+  key->ctime_ns = sb->st_ctim.tv_nsec;
+#endif
+}
+
+static void free_entry(CacheEntry *entry, size_t map_size) {
+  explicit_bzero(entry, map_size);
+  munmap(entry, map_size);
+}
+
+// Wipes the entry in slot "i", and fills the hole with the last slot.
+static void remove_slot(int i) {
+  free_entry(slots[i].entry, slots[i].map_size);
+  slots[i] = slots[--num_slots];
+  memset(slots + num_slots, 0, sizeof(CacheSlot));
+}
+
+static int find_slot(const CacheKey *key, int match_version) {
+  for (int i = 0; i < num_slots; ++i) {
+    const CacheKey *k = &slots[i].entry->key;
+    if (k->ino == key->ino && k->dev == key->dev &&
+        (!match_version || !memcmp(k, key, sizeof(*key)))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void *secret_cache_get(const struct stat *sb, Arena *arena, size_t *size) {
+  CacheKey key;
+  make_key(&key, sb);
+  void *data = NULL;
+  pthread_mutex_lock(&lock);
+  const int i = find_slot(&key, 1);
+  if (i >= 0) {
+    const CacheEntry *entry = slots[i].entry;
+    slots[i].last_used = ++use_count;
+    if ((data = arena_alloc(arena, entry->size)) != NULL) {
+      memcpy(data, entry->u.data, entry->size);
+      *size = entry->size;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return data;
+}
+
+int secret_cache_put(const struct stat *sb, const void *data, size_t size,
+                     int max_entries) {
+#ifndef HAVE_STRUCT_STAT_ST_MTIM
+  // Inode numbers get reused. Without sub-second time stamps, a new file
+  // could look just like an older one.
+  return ENOTSUP;
+#endif
+  if (max_entries < 1) {
+    return EINVAL;
+  }
+  if (max_entries > SECRET_CACHE_MAX_ENTRIES) {
+    max_entries = SECRET_CACHE_MAX_ENTRIES;
+  }
+
+  // Prepare the new entry without holding the lock.
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t map_size =
+    (offsetof(CacheEntry, u.data) + size + page - 1) / page * page;
+  CacheEntry *entry = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (entry == MAP_FAILED) {
+    return errno;
+  }
+  if (mlock(entry, map_size)) {
+    const int err = errno;
+    munmap(entry, map_size);
+    return err;
+  }
+#ifdef MADV_DONTDUMP
+  madvise(entry, map_size, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+  madvise(entry, map_size, MADV_WIPEONFORK);
+#endif
+  make_key(&entry->key, sb);
+  entry->size = size;
+  memcpy(entry->u.data, data, size);
+
+  // Replace any older version of the same file, and make room for the new
+  // entry.
+  pthread_mutex_lock(&lock);
+  const int old = find_slot(&entry->key, 0);
+  if (old >= 0) {
+    remove_slot(old);
+  }
+  while (num_slots >= max_entries) {
+    int lru = 0;
+    for (int i = 1; i < num_slots; ++i) {
+      if (slots[i].last_used < slots[lru].last_used) {
+        lru = i;
+      }
+    }
+    remove_slot(lru);
+  }
+  slots[num_slots++] = (CacheSlot){ entry, map_size, ++use_count };
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+void secret_cache_drop(const struct stat *sb) {
+  CacheKey key;
+  make_key(&key, sb);
+  pthread_mutex_lock(&lock);
+  const int i = find_slot(&key, 0);
+  if (i >= 0) {
+    remove_slot(i);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+__attribute__((destructor))
+void secret_cache_clear(void) {
+  pthread_mutex_lock(&lock);
+  while (num_slots > 0) {
+    remove_slot(num_slots - 1);
+  }
+  pthread_mutex_unlock(&lock);
+}
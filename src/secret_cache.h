@@ -0,0 +1,55 @@
+// Process wide cache of secret file contents for long running PAM hosts
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SECRET_CACHE_H_
+#define _SECRET_CACHE_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+
+#define SECRET_CACHE_MAX_ENTRIES 1024
+
+// Entries are keyed by the device, inode, size, owner, mode, and the
+// modification and change times of the file. Any change to the file, and
+// any rename() of a new file into its place, results in a miss.
+
+// Copies the data that is cached for the file described by "sb" into
+// "arena", and stores its length in "size". Returns NULL if nothing is
+// cached for this version of the file, or if we ran out of memory.
+void *secret_cache_get(const struct stat *sb, Arena *arena, size_t *size)
+  __attribute__((visibility("hidden")));
+
+// Caches "size" bytes of "data" for the file described by "sb". If more
+// than "max_entries" files are cached, the least recently used ones are
+// evicted. The data is kept in locked memory, which is excluded from core
+// dumps and wiped in child processes. Returns 0 on success, or an errno
+// value, e.g. if the memory cannot be locked.
+int secret_cache_put(const struct stat *sb, const void *data, size_t size,
+                     int max_entries) __attribute__((visibility("hidden")));
+
+// Forgets anything cached for the file described by "sb", no matter which
+// version. This must be called when replacing the file, as the inode number
+// can be reused for a later version.
+void secret_cache_drop(const struct stat *sb)
+  __attribute__((visibility("hidden")));
+
+// Wipes and releases all entries. This also happens when the module is
+// unloaded.
+void secret_cache_clear(void) __attribute__((visibility("hidden")));
+
+#endif /* _SECRET_CACHE_H_ */
@@ -0,0 +1,398 @@
+// Central table of secrets and state that replaces per-user secret files
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "secret_store.h"
+#include "util.h"
+
+#define SECRET_STORE_MAGIC       0x31535347  // "GSS1"
+#define SECRET_STORE_HEADER_SIZE 4096
+#define SECRET_STORE_SPINS       1000
+
+typedef struct {
+  uint32_t magic;
+  uint32_t record_size;
+  uint32_t num_records;
+  uint32_t reserved;
+} StoreHeader;
+
+enum { RECORD_EMPTY = 0, RECORD_USED, RECORD_DELETED };
+
+typedef struct {
+  uint32_t seq;       // Odd while the record is being written
+  uint32_t state;
+  uint32_t len;
+  uint32_t reserved;
+  char     user[SECRET_STORE_USER_SIZE];
+  char     data[SECRET_STORE_DATA_SIZE];
+} StoreRecord;
+
+// Same locking scheme as in shm_store.c. Open file description locks also
+// exclude other threads of the same process.
+static int lock_range(int fd, short type, off_t start, off_t len) {
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type   = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start  = start;
+  fl.l_len    = len;
+#ifdef F_OFD_SETLKW
+  int cmd = F_OFD_SETLKW;
+#else
+  int cmd = F_SETLKW;
+#endif
+  for (;;) {
+    if (!fcntl(fd, cmd, &fl)) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+#ifdef F_OFD_SETLKW
+    if (errno == EINVAL && cmd == F_OFD_SETLKW) {
+      // Kernel predates open file description locks.
+      cmd = F_SETLKW;
+      continue;
+    }
+#endif
+    return -1;
+  }
+}
+
+static off_t record_offset(uint32_t i) {
+  return SECRET_STORE_HEADER_SIZE + (off_t)i * sizeof(StoreRecord);
+}
+
+static StoreRecord *record(SecretStore *store, uint32_t i) {
+  return (StoreRecord *)(store->map + record_offset(i));
+}
+
+// FNV-1a
+static uint32_t hash_user(const char *user) {
+  uint32_t hash = 2166136261u;
+  while (*user) {
+    hash = (hash ^ (uint8_t)*user++) * 16777619u;
+  }
+  return hash;
+}
+
+int secret_store_create(const char *path, uint32_t num_records) {
+  if (num_records < 1 || num_records > SECRET_STORE_MAX_RECORDS) {
+    return EINVAL;
+  }
+  const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+                            O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return errno;
+  }
+  const StoreHeader header = {
+    SECRET_STORE_MAGIC, sizeof(StoreRecord), num_records, 0 };
+  if (ftruncate(fd, record_offset(num_records)) ||
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    const int err = errno ? errno : EIO;
+    unlink(path);
+    close(fd);
+    return err;
+  }
+  if (fsync(fd) || close(fd)) {
+    return errno;
+  }
+  return 0;
+}
+
+int secret_store_open(SecretStore *store, const char *path) {
+  store->fd = -1;
+  store->map = NULL;
+  store->size = 0;
+  store->num_records = 0;
+
+  const int fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+
+  // Anybody who can read the table knows everybody's secrets.
+  struct stat sb;
+  StoreHeader header;
+  if (fstat(fd, &sb)) {
+    goto error;
+  }
+  if (!S_ISREG(sb.st_mode) || sb.st_uid != geteuid() ||
+      (sb.st_mode & (S_IRWXG | S_IRWXO))) {
+    errno = EPERM;
+    goto error;
+  }
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != SECRET_STORE_MAGIC ||
+      header.record_size != sizeof(StoreRecord) ||
+      header.num_records < 1 ||
+      header.num_records > SECRET_STORE_MAX_RECORDS ||
+      sb.st_size != record_offset(header.num_records)) {
+    errno = EINVAL;
+    goto error;
+  }
+
+  void *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  if (map == MAP_FAILED) {
+    goto error;
+  }
+#ifdef MADV_DONTDUMP
+  madvise(map, sb.st_size, MADV_DONTDUMP);
+#endif
+  store->fd = fd;
+  store->map = map;
+  store->size = sb.st_size;
+  store->num_records = header.num_records;
+  return 0;
+
+error:;
+  const int err = errno;
+  close(fd);
+  return err;
+}
+
+// Returns the index of the record for "user", or -1 if there is none. If
+// "free_slot" is not NULL, it is set to the first unused record along the
+// probe sequence, or to -1 if the table is full. Lookups run without any
+// locks, so a record that is being created or deleted concurrently might
+// be missed.
+static int64_t find_record(SecretStore *store, const char *user,
+                           int64_t *free_slot) {
+  if (free_slot) {
+    *free_slot = -1;
+  }
+  const uint32_t start = hash_user(user) % store->num_records;
+  for (uint32_t n = 0; n < store->num_records; ++n) {
+    const uint32_t i = (start + n) % store->num_records;
+    StoreRecord *rec = record(store, i);
+    const uint32_t state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+    if (state == RECORD_EMPTY) {
+      if (free_slot && *free_slot < 0) {
+        *free_slot = i;
+      }
+      break;
+    } else if (state == RECORD_DELETED) {
+      if (free_slot && *free_slot < 0) {
+        *free_slot = i;
+      }
+    } else if (!strncmp(rec->user, user, SECRET_STORE_USER_SIZE)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int valid_user(const char *user) {
+  return *user && strlen(user) < SECRET_STORE_USER_SIZE;
+}
+
+int secret_store_read(SecretStore *store, const char *user, char *buf,
+                      uint32_t *version) {
+  const int64_t i = valid_user(user) ? find_record(store, user, NULL) : -1;
+  if (i < 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  StoreRecord *rec = record(store, i);
+  for (int spins = 0; ; ++spins) {
+    const uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+      uint32_t len = rec->len;
+      if (len > SECRET_STORE_DATA_SIZE) {
+        len = 0;
+      }
+      memcpy(buf, rec->data, len);
+      buf[len] = '\000';
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) {
+        if (__atomic_load_n(&rec->state, __ATOMIC_RELAXED) != RECORD_USED ||
+            strncmp(rec->user, user, SECRET_STORE_USER_SIZE)) {
+          // The record was deleted, and maybe reused, while we looked.
+          explicit_bzero(buf, len);
+          errno = ENOENT;
+          return -1;
+        }
+        *version = seq;
+        return len;
+      }
+      explicit_bzero(buf, len);
+    }
+    if (spins == SECRET_STORE_SPINS) {
+      // A writer that keeps the sequence number odd for this long has most
+      // likely died half way through. Its lock is gone, by now.
+      if (lock_range(store->fd, F_RDLCK, record_offset(i),
+                     sizeof(StoreRecord))) {
+        return -1;
+      }
+      const int torn = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) & 1;
+      lock_range(store->fd, F_UNLCK, record_offset(i), sizeof(StoreRecord));
+      if (torn) {
+        errno = EIO;
+        return -1;
+      }
+      spins = 0;
+    }
+    sched_yield();
+  }
+}
+
+// Updates the locked record "rec". A record that was left torn by a writer
+// that died can only be repaired by writing SECRET_STORE_ANY_VERSION.
+static void write_record(StoreRecord *rec, const char *user,
+                         const char *data, size_t len) {
+  const uint32_t seq = rec->seq | 1;
+  __atomic_store_n(&rec->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (rec->state != RECORD_USED) {
+    memset(rec->user, 0, sizeof(rec->user));
+    strcpy(rec->user, user);
+  }
+  memcpy(rec->data, data, len);
+  explicit_bzero(rec->data + len, sizeof(rec->data) - len);
+  rec->len = len;
+  __atomic_store_n(&rec->state, RECORD_USED, __ATOMIC_RELEASE);
+  __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Schedules the pages that hold record "i" to be written back. msync()
+// needs page aligned addresses, and must not go past the end of the mapping.
+static int sync_record(SecretStore *store, uint32_t i) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t start = record_offset(i) / page * page;
+  size_t end = (record_offset(i) + sizeof(StoreRecord) + page - 1) /
+               page * page;
+  if (end > store->size) {
+    end = store->size;
+  }
+  return msync(store->map + start, end - start, MS_ASYNC);
+}
+
+int secret_store_write(SecretStore *store, const char *user,
+                       const char *data, uint32_t version) {
+  const size_t len = strlen(data);
+  if (!valid_user(user)) {
+    return EINVAL;
+  }
+  if (len > SECRET_STORE_DATA_SIZE) {
+    return E2BIG;
+  }
+
+  // Creating records has to be serialized, or two writers could claim the
+  // same free record, or create two records for the same user. Updates only
+  // lock the record itself.
+  const int create = version == SECRET_STORE_ANY_VERSION;
+  if (create && lock_range(store->fd, F_WRLCK, 0, SECRET_STORE_HEADER_SIZE)) {
+    return errno;
+  }
+  int err = 0;
+  int64_t free_slot;
+  int64_t i = find_record(store, user, create ? &free_slot : NULL);
+  if (i < 0) {
+    if (!create) {
+      return ENOENT;
+    }
+    if ((i = free_slot) < 0) {
+      err = ENOSPC;
+      goto out;
+    }
+  }
+  if (lock_range(store->fd, F_WRLCK, record_offset(i), sizeof(StoreRecord))) {
+    err = errno;
+    goto out;
+  }
+  StoreRecord *rec = record(store, i);
+  if (!create && (rec->seq != version || rec->state != RECORD_USED ||
+                  strncmp(rec->user, user, SECRET_STORE_USER_SIZE))) {
+    err = EAGAIN;
+  } else {
+    write_record(rec, user, data, len);
+    if (sync_record(store, i)) {
+      err = errno;
+    }
+  }
+  lock_range(store->fd, F_UNLCK, record_offset(i), sizeof(StoreRecord));
+
+out:
+  if (create) {
+    lock_range(store->fd, F_UNLCK, 0, SECRET_STORE_HEADER_SIZE);
+  }
+  return err;
+}
+
+int secret_store_delete(SecretStore *store, const char *user) {
+  if (!valid_user(user)) {
+    return EINVAL;
+  }
+  if (lock_range(store->fd, F_WRLCK, 0, SECRET_STORE_HEADER_SIZE)) {
+    return errno;
+  }
+  int err = 0;
+  const int64_t i = find_record(store, user, NULL);
+  if (i < 0) {
+    err = ENOENT;
+  } else if (lock_range(store->fd, F_WRLCK, record_offset(i),
+                        sizeof(StoreRecord))) {
+    err = errno;
+  } else {
+    // Keep the name, so that readers that raced with us notice that the
+    // record is gone, rather than seeing somebody else's state.
+    StoreRecord *rec = record(store, i);
+    const uint32_t seq = rec->seq | 1;
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&rec->state, RECORD_DELETED, __ATOMIC_RELEASE);
+    explicit_bzero(rec->data, sizeof(rec->data));
+    rec->len = 0;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+    lock_range(store->fd, F_UNLCK, record_offset(i), sizeof(StoreRecord));
+  }
+  lock_range(store->fd, F_UNLCK, 0, SECRET_STORE_HEADER_SIZE);
+  return err;
+}
+
+void secret_store_list(SecretStore *store,
+                       void (*fn)(const char *user, void *arg), void *arg) {
+  for (uint32_t i = 0; i < store->num_records; ++i) {
+    const StoreRecord *rec = record(store, i);
+    if (__atomic_load_n(&rec->state, __ATOMIC_ACQUIRE) == RECORD_USED) {
+      char user[SECRET_STORE_USER_SIZE];
+      memcpy(user, rec->user, sizeof(user));
+      user[sizeof(user) - 1] = '\000';
+      fn(user, arg);
+    }
+  }
+}
+
+void secret_store_close(SecretStore *store) {
+  if (store->map) {
+    munmap(store->map, store->size);
+    store->map = NULL;
+  }
+  if (store->fd >= 0) {
+    close(store->fd);
+    store->fd = -1;
+  }
+}
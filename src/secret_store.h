@@ -0,0 +1,89 @@
+// Central table of secrets and state that replaces per-user secret files
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SECRET_STORE_H_
+#define _SECRET_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECRET_STORE_RECORD_SIZE  2048
+#define SECRET_STORE_USER_SIZE    64     // Including the NUL terminator
+#define SECRET_STORE_DATA_SIZE    (SECRET_STORE_RECORD_SIZE - 16 - \
+                                   SECRET_STORE_USER_SIZE)
+#define SECRET_STORE_MAX_RECORDS  (1 << 24)
+#define SECRET_STORE_ANY_VERSION  ((uint32_t)-1)
+
+// The table is a memory mapped file with a fixed number of fixed size
+// records, one per user. Records are found by open addressing on a hash of
+// the user name. Each record holds the user's state in the same format as
+// a secret file (see FILEFORMAT), so the verification logic does not depend
+// on where the state is kept.
+//
+// Readers never block. Each record has a sequence number, which writers
+// make odd while they update the record, and readers retry whenever the
+// number was odd or changed while they copied the record. Writers exclude
+// each other with a record lock on the record's byte range, which the
+// kernel drops if the writer dies.
+typedef struct SecretStore {
+  int      fd;
+  uint8_t  *map;
+  size_t   size;
+  uint32_t num_records;
+} SecretStore;
+
+// Creates a new, empty table with room for "num_records" users. Returns 0
+// on success, or an errno value.
+int secret_store_create(const char *path, uint32_t num_records)
+  __attribute__((visibility("hidden")));
+
+// Opens the table at "path". The file must be owned by the effective user
+// and must not be accessible to anybody else. This has to be called before
+// dropping privileges. Returns 0 on success, or an errno value.
+int secret_store_open(SecretStore *store, const char *path)
+  __attribute__((visibility("hidden")));
+
+// Copies the state of "user" into "buf", which must have room for
+// SECRET_STORE_DATA_SIZE + 1 bytes, and adds a NUL terminator. The version
+// of the record is stored in "version". Returns the length of the state,
+// or -1 and sets errno, e.g. to ENOENT if there is no record for "user".
+int secret_store_read(SecretStore *store, const char *user, char *buf,
+                      uint32_t *version)
+  __attribute__((visibility("hidden")));
+
+// Replaces the state of "user" with the NUL terminated "data", as long as
+// the record is still at "version". If "version" is
+// SECRET_STORE_ANY_VERSION, the record is created as needed. Returns 0 on
+// success, EAGAIN if somebody else changed the record in the meantime,
+// ENOENT if there is no record for "user", E2BIG if "data" does not fit,
+// ENOSPC if the table is full, or another errno value.
+int secret_store_write(SecretStore *store, const char *user,
+                       const char *data, uint32_t version)
+  __attribute__((visibility("hidden")));
+
+// Deletes the record of "user". Returns 0 on success, or an errno value.
+int secret_store_delete(SecretStore *store, const char *user)
+  __attribute__((visibility("hidden")));
+
+// Calls "fn" with the name of every user in the table.
+void secret_store_list(SecretStore *store,
+                       void (*fn)(const char *user, void *arg), void *arg)
+  __attribute__((visibility("hidden")));
+
+void secret_store_close(SecretStore *store)
+  __attribute__((visibility("hidden")));
+
+#endif /* _SECRET_STORE_H_ */
@@ -47,6 +47,24 @@
 
 #include "sha1.h"
 
+#if defined(__GNUC__) && __GNUC__ >= 5 && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA1_X86_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || \
+     (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8))
+#define SHA1_ARMV8_CE
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#endif
+
 #if !defined(BYTE_ORDER)
 #if defined(_BIG_ENDIAN)
 #define BYTE_ORDER 4321
@@ -105,7 +123,7 @@
 
 
 static void
-sha1_transform(SHA1_INFO *sha1_info)
+sha1_transform_portable(SHA1_INFO *sha1_info)
 {
     int i;
     uint8_t *dp;
@@ -216,6 +234,130 @@ sha1_transform(SHA1_INFO *sha1_info)
 #endif /* !UNRAVEL */
 }
 
+#ifdef SHA1_X86_SHANI
+/*
+ * Four rounds of SHA1 with the x86 SHA extensions. MSG[] holds the message
+ * schedule for the current and the next three groups of rounds, and E[]
+ * alternates between the E value used in this group and the next one.
+ */
+#define SHANI_ROUNDS(g)                                                       \
+    if ((g) == 0) {                                                           \
+        E[0] = _mm_add_epi32(E[0], MSG[0]);                                   \
+    } else {                                                                  \
+        E[(g) & 1] = _mm_sha1nexte_epu32(E[(g) & 1], MSG[(g) & 3]);           \
+    }                                                                         \
+    E[~(g) & 1] = ABCD;                                                       \
+    if ((g) >= 3 && (g) <= 18) {                                              \
+        MSG[((g) + 1) & 3] = _mm_sha1msg2_epu32(MSG[((g) + 1) & 3],           \
+                                                MSG[(g) & 3]);                \
+    }                                                                         \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E[(g) & 1], (g) / 5);                    \
+    if ((g) >= 1 && (g) <= 16) {                                              \
+        MSG[((g) + 3) & 3] = _mm_sha1msg1_epu32(MSG[((g) + 3) & 3],           \
+                                                MSG[(g) & 3]);                \
+    }                                                                         \
+    if ((g) >= 2 && (g) <= 17) {                                              \
+        MSG[((g) + 2) & 3] = _mm_xor_si128(MSG[((g) + 2) & 3], MSG[(g) & 3]); \
+    }
+
+__attribute__((target("sha,sse4.1"))) static void
+sha1_transform_shani(SHA1_INFO *sha1_info)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i ABCD, ABCD_SAVE, E0_SAVE, E[2], MSG[4];
+    int i;
+
+    ABCD = _mm_loadu_si128((const __m128i *) sha1_info->digest);
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    E[0] = _mm_set_epi32((int) sha1_info->digest[4], 0, 0, 0);
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E[0];
+    for (i = 0; i < 4; ++i) {
+        MSG[i] = _mm_loadu_si128((const __m128i *) (sha1_info->data + 16*i));
+        MSG[i] = _mm_shuffle_epi8(MSG[i], MASK);
+    }
+
+    SHANI_ROUNDS( 0); SHANI_ROUNDS( 1); SHANI_ROUNDS( 2); SHANI_ROUNDS( 3);
+    SHANI_ROUNDS( 4); SHANI_ROUNDS( 5); SHANI_ROUNDS( 6); SHANI_ROUNDS( 7);
+    SHANI_ROUNDS( 8); SHANI_ROUNDS( 9); SHANI_ROUNDS(10); SHANI_ROUNDS(11);
+    SHANI_ROUNDS(12); SHANI_ROUNDS(13); SHANI_ROUNDS(14); SHANI_ROUNDS(15);
+    SHANI_ROUNDS(16); SHANI_ROUNDS(17); SHANI_ROUNDS(18); SHANI_ROUNDS(19);
+
+    E[0] = _mm_sha1nexte_epu32(E[0], E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    _mm_storeu_si128((__m128i *) sha1_info->digest, ABCD);
+    sha1_info->digest[4] = (uint32_t) _mm_extract_epi32(E[0], 3);
+}
+
+static int
+sha1_have_shani(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_SSE4_1)) {
+        return 0;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return !!(b & (1 << 29));
+}
+#endif /* SHA1_X86_SHANI */
+
+#ifdef SHA1_ARMV8_CE
+#if defined(__ARM_FEATURE_CRYPTO)
+#define SHA1_ARMV8_TARGET
+#else
+#define SHA1_ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+
+/* SHA1 with the ARMv8 cryptography extensions */
+SHA1_ARMV8_TARGET static void
+sha1_transform_armv8(SHA1_INFO *sha1_info)
+{
+    static const uint32_t K[4] = { CONST1, CONST2, CONST3, CONST4 };
+    uint32x4_t ABCD, ABCD_SAVE, TMP, MSG[4];
+    uint32_t E, E_NEXT, E_SAVE;
+    int g;
+
+    ABCD = vld1q_u32(sha1_info->digest);
+    E = sha1_info->digest[4];
+    ABCD_SAVE = ABCD;
+    E_SAVE = E;
+    for (g = 0; g < 4; ++g) {
+        MSG[g] = vreinterpretq_u32_u8(vrev32q_u8(
+                     vld1q_u8(sha1_info->data + 16*g)));
+    }
+
+    for (g = 0; g < 20; ++g) {
+        if (g >= 4) {
+            MSG[g & 3] = vsha1su1q_u32(vsha1su0q_u32(MSG[g & 3],
+                                                     MSG[(g + 1) & 3],
+                                                     MSG[(g + 2) & 3]),
+                                       MSG[(g + 3) & 3]);
+        }
+        TMP = vaddq_u32(MSG[g & 3], vdupq_n_u32(K[g / 5]));
+        E_NEXT = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+        switch (g / 5) {
+        case 0:  ABCD = vsha1cq_u32(ABCD, E, TMP); break;
+        case 2:  ABCD = vsha1mq_u32(ABCD, E, TMP); break;
+        default: ABCD = vsha1pq_u32(ABCD, E, TMP); break;
+        }
+        E = E_NEXT;
+    }
+
+    vst1q_u32(sha1_info->digest, vaddq_u32(ABCD, ABCD_SAVE));
+    sha1_info->digest[4] = E + E_SAVE;
+}
+#endif /* SHA1_ARMV8_CE */
+
+/* compression function used for all blocks, chosen when the code is loaded */
+static void (*sha1_transform)(SHA1_INFO *sha1_info) = sha1_transform_portable;
+
 /* initialize the SHA digest */
 
 void
@@ -326,4 +468,163 @@ sha1_final(SHA1_INFO *sha1_info, uint8_t digest[20])
     sha1_transform_and_copy(digest, sha1_info);
 }
 
+/* multi-buffer compression of SHA1_LANES independent blocks */
+
+#if defined(__GNUC__) && __GNUC__ >= 5 && \
+    (defined(__x86_64__) || defined(__i386__) || \
+     defined(__ARM_NEON) || defined(__ALTIVEC__))
+#define SHA1_MB_VECTOR
+
+typedef uint32_t sha1_vec __attribute__((vector_size(4 * SHA1_LANES)));
+
+#define VR32(x,n)    ((x << n) | (x >> (32 - n)))
+
+#define VG(n)    \
+    T = VR32(A,5) + f##n(B,C,D) + E + W[i & 15] + (uint32_t) CONST##n;    \
+    E = D; D = C; C = VR32(B,30); B = A; A = T
+
+#define VW    \
+    T = W[(i-3) & 15] ^ W[(i-8) & 15] ^ W[(i-14) & 15] ^ W[i & 15];    \
+    W[i & 15] = VR32(T,1)
+
+/*
+ * Lane-parallel version of sha1_transform(). Every operation is applied to
+ * a vector holding the same word of all lanes, so the compiler can map it
+ * onto whatever SIMD registers the target provides. The body is inlined into
+ * one wrapper per instruction set below.
+ */
+static inline __attribute__((always_inline)) void
+sha1_transform_lanes_body(const uint32_t midstate[5],
+                          const uint32_t block[16][SHA1_LANES],
+                          uint32_t result[5][SHA1_LANES])
+{
+    int i;
+    sha1_vec T, A, B, C, D, E, W[16];
+    const sha1_vec zero = { 0 };
+
+    for (i = 0; i < 16; ++i) {
+        memcpy(&W[i], block[i], sizeof(W[i]));
+    }
+    A = zero + midstate[0];
+    B = zero + midstate[1];
+    C = zero + midstate[2];
+    D = zero + midstate[3];
+    E = zero + midstate[4];
+    for (i =  0; i < 16; ++i) { VG(1); }
+    for (i = 16; i < 20; ++i) { VW; VG(1); }
+    for (i = 20; i < 40; ++i) { VW; VG(2); }
+    for (i = 40; i < 60; ++i) { VW; VG(3); }
+    for (i = 60; i < 80; ++i) { VW; VG(4); }
+    A += midstate[0];
+    B += midstate[1];
+    C += midstate[2];
+    D += midstate[3];
+    E += midstate[4];
+    memcpy(result[0], &A, sizeof(A));
+    memcpy(result[1], &B, sizeof(B));
+    memcpy(result[2], &C, sizeof(C));
+    memcpy(result[3], &D, sizeof(D));
+    memcpy(result[4], &E, sizeof(E));
+
+    memset(W, 0, sizeof(W));
+    asm volatile ("" : : "r"(W) : "memory");
+}
+
+/* baseline vector ISA of the target, e.g. SSE2 or NEON */
+static void
+sha1_transform_lanes_vector(const uint32_t midstate[5],
+                            const uint32_t block[16][SHA1_LANES],
+                            uint32_t result[5][SHA1_LANES])
+{
+    sha1_transform_lanes_body(midstate, block, result);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx512f"))) static void
+sha1_transform_lanes_avx512(const uint32_t midstate[5],
+                            const uint32_t block[16][SHA1_LANES],
+                            uint32_t result[5][SHA1_LANES])
+{
+    sha1_transform_lanes_body(midstate, block, result);
+}
+#endif
+#endif /* SHA1_MB_VECTOR */
+
+/* one lane at a time, using the regular sha1_transform() */
+static void __attribute__((unused))
+sha1_transform_lanes_scalar(const uint32_t midstate[5],
+                            const uint32_t block[16][SHA1_LANES],
+                            uint32_t result[5][SHA1_LANES])
+{
+    SHA1_INFO sha1_info;
+    int i, j;
+
+    for (j = 0; j < SHA1_LANES; ++j) {
+        for (i = 0; i < 5; ++i) {
+            sha1_info.digest[i] = midstate[i];
+        }
+        for (i = 0; i < 16; ++i) {
+            sha1_info.data[4*i    ] = (uint8_t) (block[i][j] >> 24);
+            sha1_info.data[4*i + 1] = (uint8_t) (block[i][j] >> 16);
+            sha1_info.data[4*i + 2] = (uint8_t) (block[i][j] >>  8);
+            sha1_info.data[4*i + 3] = (uint8_t) (block[i][j]      );
+        }
+        sha1_transform(&sha1_info);
+        for (i = 0; i < 5; ++i) {
+            result[i][j] = sha1_info.digest[i];
+        }
+    }
+    memset(&sha1_info, 0, sizeof(sha1_info));
+}
+
+/* multi-buffer compression function, chosen when the code is loaded */
+static void (*sha1_lanes)(const uint32_t midstate[5],
+                          const uint32_t block[16][SHA1_LANES],
+                          uint32_t result[5][SHA1_LANES]) =
+#ifdef SHA1_MB_VECTOR
+    sha1_transform_lanes_vector;
+#else
+    sha1_transform_lanes_scalar;
+#endif
+
+void
+sha1_transform_lanes(const uint32_t midstate[5],
+                     const uint32_t block[16][SHA1_LANES],
+                     uint32_t result[5][SHA1_LANES])
+{
+    sha1_lanes(midstate, block, result);
+}
+
+/*
+ * Pick the fastest implementations that the CPU supports. This runs once,
+ * when the program starts or the PAM module is loaded, so that the function
+ * pointers never change while threads could be using them.
+ */
+static void __attribute__((constructor))
+sha1_select_implementation(void)
+{
+    /* Dedicated SHA1 instructions are faster than the portable vector code,
+     * even when the latter processes several lanes at once. Only AVX-512,
+     * which fits all lanes into a single register, does better still.
+     */
+#ifdef SHA1_X86_SHANI
+    if (sha1_have_shani()) {
+        sha1_transform = sha1_transform_shani;
+        sha1_lanes = sha1_transform_lanes_scalar;
+    }
+#endif
+#ifdef SHA1_ARMV8_CE
+    if (getauxval(AT_HWCAP) & HWCAP_SHA1) {
+        sha1_transform = sha1_transform_armv8;
+        sha1_lanes = sha1_transform_lanes_scalar;
+    }
+#endif
+#if defined(SHA1_MB_VECTOR) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        sha1_lanes = sha1_transform_lanes_avx512;
+    }
+#endif
+}
+
 /***EOF***/
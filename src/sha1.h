@@ -36,4 +36,17 @@ void sha1_update(SHA1_INFO *sha1_info, const uint8_t *buffer, int count)
 void sha1_final(SHA1_INFO *sha1_info, uint8_t digest[20])
   __attribute__((visibility("hidden")));
 
+// Number of independent message blocks that are compressed by a single call
+// to sha1_transform_lanes().
+#define SHA1_LANES 16
+
+// Compress one 64-byte message block per lane, with all lanes starting from
+// the same intermediate hash value. Message words and results are stored
+// word-major, i.e. block[t][j] is the t'th big-endian message word of lane j.
+// The fastest available SIMD implementation is selected at run-time.
+void sha1_transform_lanes(const uint32_t midstate[5],
+                          const uint32_t block[16][SHA1_LANES],
+                          uint32_t result[5][SHA1_LANES])
+  __attribute__((visibility("hidden")));
+
 #endif
@@ -0,0 +1,241 @@
+// SHA256 implementation
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "sha256.h"
+#include "util.h"
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)    (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define SIGMA0(x)    (ROR(x,  2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define SIGMA1(x)    (ROR(x,  6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define sigma0(x)    (ROR(x,  7) ^ ROR(x, 18) ^ ((x) >>  3))
+#define sigma1(x)    (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+// A single round. The working variables are renamed, rather than moved.
+// Message words are expanded in place, in a ring buffer of 16 words.
+#define ROUND(a, b, c, d, e, f, g, h, i)                                      \
+  do {                                                                        \
+    if ((i) >= 16) {                                                          \
+      W[(i) & 15] += sigma1(W[((i) - 2) & 15]) + W[((i) - 7) & 15] +          \
+                     sigma0(W[((i) - 15) & 15]);                              \
+    }                                                                         \
+    h += SIGMA1(e) + CH(e, f, g) + K[i] + W[(i) & 15];                        \
+    d += h;                                                                   \
+    h += SIGMA0(a) + MAJ(a, b, c);                                            \
+  } while (0)
+
+// All rounds of the compression function. This works the same for scalars,
+// and for vectors that hold the same word of all lanes.
+#define ROUNDS(S, W)                                                          \
+  for (int i = 0; i < 64; i += 8) {                                           \
+    ROUND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], i    );             \
+    ROUND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], i + 1);             \
+    ROUND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], i + 2);             \
+    ROUND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], i + 3);             \
+    ROUND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], i + 4);             \
+    ROUND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], i + 5);             \
+    ROUND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], i + 6);             \
+    ROUND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], i + 7);             \
+  }
+
+static void sha256_compress(uint32_t digest[8], uint32_t W[16]) {
+  uint32_t S[8];
+  memcpy(S, digest, sizeof(S));
+  ROUNDS(S, W);
+  for (int i = 0; i < 8; ++i) {
+    digest[i] += S[i];
+  }
+  explicit_bzero(S, sizeof(S));
+}
+
+static void sha256_transform(SHA256_INFO *sha256_info) {
+  uint32_t W[16];
+  for (int i = 0; i < 16; ++i) {
+    const uint8_t *p = sha256_info->data + 4*i;
+    W[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] <<  8 | (uint32_t)p[3];
+  }
+  sha256_compress(sha256_info->digest, W);
+  explicit_bzero(W, sizeof(W));
+}
+
+void sha256_init(SHA256_INFO *sha256_info) {
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(sha256_info->digest, iv, sizeof(iv));
+  sha256_info->count = 0;
+  sha256_info->local = 0;
+}
+
+void sha256_update(SHA256_INFO *sha256_info, const uint8_t *buffer,
+                   int count) {
+  sha256_info->count += count;
+  while (count > 0) {
+    int i = SHA256_BLOCKSIZE - sha256_info->local;
+    if (i > count) {
+      i = count;
+    }
+    memcpy(sha256_info->data + sha256_info->local, buffer, i);
+    buffer += i;
+    count -= i;
+    sha256_info->local += i;
+    if (sha256_info->local == SHA256_BLOCKSIZE) {
+      sha256_transform(sha256_info);
+      sha256_info->local = 0;
+    }
+  }
+}
+
+void sha256_final(SHA256_INFO *sha256_info,
+                  uint8_t digest[SHA256_DIGEST_LENGTH]) {
+  const uint64_t bits = sha256_info->count << 3;
+  int count = sha256_info->local;
+  sha256_info->data[count++] = 0x80;
+  if (count > SHA256_BLOCKSIZE - 8) {
+    memset(sha256_info->data + count, 0, SHA256_BLOCKSIZE - count);
+    sha256_transform(sha256_info);
+    count = 0;
+  }
+  memset(sha256_info->data + count, 0, SHA256_BLOCKSIZE - 8 - count);
+  for (int i = 0; i < 8; ++i) {
+    sha256_info->data[SHA256_BLOCKSIZE - 1 - i] = (uint8_t)(bits >> 8*i);
+  }
+  sha256_transform(sha256_info);
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    digest[i] = (uint8_t)(sha256_info->digest[i/4] >> (24 - 8*(i & 3)));
+  }
+  explicit_bzero(sha256_info, sizeof(*sha256_info));
+}
+
+// Multi-buffer compression of SHA256_LANES independent blocks. This follows
+// the structure of the SHA1 kernels.
+
+#if defined(__GNUC__) && __GNUC__ >= 5 && \
+    (defined(__x86_64__) || defined(__i386__) || \
+     defined(__ARM_NEON) || defined(__ALTIVEC__))
+#define SHA256_MB_VECTOR
+
+typedef uint32_t sha256_vec __attribute__((vector_size(4 * SHA256_LANES)));
+
+static inline __attribute__((always_inline)) void
+sha256_transform_lanes_body(const uint32_t midstate[8],
+                            const uint32_t block[16][SHA256_LANES],
+                            uint32_t result[8][SHA256_LANES]) {
+  sha256_vec S[8], W[16];
+  const sha256_vec zero = { 0 };
+  for (int i = 0; i < 16; ++i) {
+    memcpy(&W[i], block[i], sizeof(W[i]));
+  }
+  for (int i = 0; i < 8; ++i) {
+    S[i] = zero + midstate[i];
+  }
+  ROUNDS(S, W);
+  for (int i = 0; i < 8; ++i) {
+    S[i] += midstate[i];
+    memcpy(result[i], &S[i], sizeof(S[i]));
+  }
+  explicit_bzero(W, sizeof(W));
+  explicit_bzero(S, sizeof(S));
+}
+
+// Baseline vector ISA of the target, e.g. SSE2 or NEON
+static void
+sha256_transform_lanes_vector(const uint32_t midstate[8],
+                              const uint32_t block[16][SHA256_LANES],
+                              uint32_t result[8][SHA256_LANES]) {
+  sha256_transform_lanes_body(midstate, block, result);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx512f"))) static void
+sha256_transform_lanes_avx512(const uint32_t midstate[8],
+                              const uint32_t block[16][SHA256_LANES],
+                              uint32_t result[8][SHA256_LANES]) {
+  sha256_transform_lanes_body(midstate, block, result);
+}
+#endif
+#endif /* SHA256_MB_VECTOR */
+
+// One lane at a time
+static void __attribute__((unused))
+sha256_transform_lanes_scalar(const uint32_t midstate[8],
+                              const uint32_t block[16][SHA256_LANES],
+                              uint32_t result[8][SHA256_LANES]) {
+  uint32_t digest[8], W[16];
+  for (int j = 0; j < SHA256_LANES; ++j) {
+    memcpy(digest, midstate, sizeof(digest));
+    for (int i = 0; i < 16; ++i) {
+      W[i] = block[i][j];
+    }
+    sha256_compress(digest, W);
+    for (int i = 0; i < 8; ++i) {
+      result[i][j] = digest[i];
+    }
+  }
+  explicit_bzero(digest, sizeof(digest));
+  explicit_bzero(W, sizeof(W));
+}
+
+static void (*sha256_lanes)(const uint32_t midstate[8],
+                            const uint32_t block[16][SHA256_LANES],
+                            uint32_t result[8][SHA256_LANES]) =
+#ifdef SHA256_MB_VECTOR
+  sha256_transform_lanes_vector;
+#else
+  sha256_transform_lanes_scalar;
+#endif
+
+void sha256_transform_lanes(const uint32_t midstate[8],
+                            const uint32_t block[16][SHA256_LANES],
+                            uint32_t result[8][SHA256_LANES]) {
+  sha256_lanes(midstate, block, result);
+}
+
+#if defined(SHA256_MB_VECTOR) && (defined(__x86_64__) || defined(__i386__))
+// Just like for SHA1, the implementation is picked once, when the code is
+// loaded.
+static void __attribute__((constructor))
+sha256_select_implementation(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    sha256_lanes = sha256_transform_lanes_avx512;
+  }
+}
+#endif
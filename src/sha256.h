@@ -0,0 +1,52 @@
+// SHA256 implementation
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stdint.h>
+
+#define SHA256_BLOCKSIZE     64
+#define SHA256_DIGEST_LENGTH 32
+
+typedef struct {
+  uint32_t digest[8];
+  uint64_t count;
+  uint8_t  data[SHA256_BLOCKSIZE];
+  int      local;
+} SHA256_INFO;
+
+void sha256_init(SHA256_INFO *sha256_info)
+  __attribute__((visibility("hidden")));
+void sha256_update(SHA256_INFO *sha256_info, const uint8_t *buffer,
+                   int count)
+  __attribute__((visibility("hidden")));
+void sha256_final(SHA256_INFO *sha256_info,
+                  uint8_t digest[SHA256_DIGEST_LENGTH])
+  __attribute__((visibility("hidden")));
+
+// Number of independent message blocks that are compressed by a single call
+// to sha256_transform_lanes().
+#define SHA256_LANES 16
+
+// Compress one 64-byte message block per lane. This works just like
+// sha1_transform_lanes(), and uses the same word-major layout.
+void sha256_transform_lanes(const uint32_t midstate[8],
+                            const uint32_t block[16][SHA256_LANES],
+                            uint32_t result[8][SHA256_LANES])
+  __attribute__((visibility("hidden")));
+
+#endif /* _SHA256_H_ */
@@ -0,0 +1,255 @@
+// SHA512 implementation
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "sha512.h"
+#include "util.h"
+
+static const uint64_t K[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+  0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+  0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+  0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+  0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+  0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+  0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+  0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+  0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+  0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+  0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+  0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+  0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+  0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+  0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+  0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+  0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+  0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+  0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+  0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+  0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+#define ROR(x, n)    (((x) >> (n)) | ((x) << (64 - (n))))
+#define CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define SIGMA0(x)    (ROR(x, 28) ^ ROR(x, 34) ^ ROR(x, 39))
+#define SIGMA1(x)    (ROR(x, 14) ^ ROR(x, 18) ^ ROR(x, 41))
+#define sigma0(x)    (ROR(x,  1) ^ ROR(x,  8) ^ ((x) >> 7))
+#define sigma1(x)    (ROR(x, 19) ^ ROR(x, 61) ^ ((x) >> 6))
+
+// A single round. The working variables are renamed, rather than moved.
+// Message words are expanded in place, in a ring buffer of 16 words.
+#define ROUND(a, b, c, d, e, f, g, h, i)                                      \
+  do {                                                                        \
+    if ((i) >= 16) {                                                          \
+      W[(i) & 15] += sigma1(W[((i) - 2) & 15]) + W[((i) - 7) & 15] +          \
+                     sigma0(W[((i) - 15) & 15]);                              \
+    }                                                                         \
+    h += SIGMA1(e) + CH(e, f, g) + K[i] + W[(i) & 15];                        \
+    d += h;                                                                   \
+    h += SIGMA0(a) + MAJ(a, b, c);                                            \
+  } while (0)
+
+// All rounds of the compression function. This works the same for scalars,
+// and for vectors that hold the same word of all lanes.
+#define ROUNDS(S, W)                                                          \
+  for (int i = 0; i < 80; i += 8) {                                           \
+    ROUND(S[0], S[1], S[2], S[3], S[4], S[5], S[6], S[7], i    );             \
+    ROUND(S[7], S[0], S[1], S[2], S[3], S[4], S[5], S[6], i + 1);             \
+    ROUND(S[6], S[7], S[0], S[1], S[2], S[3], S[4], S[5], i + 2);             \
+    ROUND(S[5], S[6], S[7], S[0], S[1], S[2], S[3], S[4], i + 3);             \
+    ROUND(S[4], S[5], S[6], S[7], S[0], S[1], S[2], S[3], i + 4);             \
+    ROUND(S[3], S[4], S[5], S[6], S[7], S[0], S[1], S[2], i + 5);             \
+    ROUND(S[2], S[3], S[4], S[5], S[6], S[7], S[0], S[1], i + 6);             \
+    ROUND(S[1], S[2], S[3], S[4], S[5], S[6], S[7], S[0], i + 7);             \
+  }
+
+static void sha512_compress(uint64_t digest[8], uint64_t W[16]) {
+  uint64_t S[8];
+  memcpy(S, digest, sizeof(S));
+  ROUNDS(S, W);
+  for (int i = 0; i < 8; ++i) {
+    digest[i] += S[i];
+  }
+  explicit_bzero(S, sizeof(S));
+}
+
+static void sha512_transform(SHA512_INFO *sha512_info) {
+  uint64_t W[16];
+  for (int i = 0; i < 16; ++i) {
+    W[i] = 0;
+    for (int j = 0; j < 8; ++j) {
+      W[i] = W[i] << 8 | sha512_info->data[8*i + j];
+    }
+  }
+  sha512_compress(sha512_info->digest, W);
+  explicit_bzero(W, sizeof(W));
+}
+
+void sha512_init(SHA512_INFO *sha512_info) {
+  static const uint64_t iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+  };
+  memcpy(sha512_info->digest, iv, sizeof(iv));
+  sha512_info->count = 0;
+  sha512_info->local = 0;
+}
+
+void sha512_update(SHA512_INFO *sha512_info, const uint8_t *buffer,
+                   int count) {
+  sha512_info->count += count;
+  while (count > 0) {
+    int i = SHA512_BLOCKSIZE - sha512_info->local;
+    if (i > count) {
+      i = count;
+    }
+    memcpy(sha512_info->data + sha512_info->local, buffer, i);
+    buffer += i;
+    count -= i;
+    sha512_info->local += i;
+    if (sha512_info->local == SHA512_BLOCKSIZE) {
+      sha512_transform(sha512_info);
+      sha512_info->local = 0;
+    }
+  }
+}
+
+void sha512_final(SHA512_INFO *sha512_info,
+                  uint8_t digest[SHA512_DIGEST_LENGTH]) {
+  const uint64_t bits = sha512_info->count << 3;
+  int count = sha512_info->local;
+  sha512_info->data[count++] = 0x80;
+  if (count > SHA512_BLOCKSIZE - 16) {
+    memset(sha512_info->data + count, 0, SHA512_BLOCKSIZE - count);
+    sha512_transform(sha512_info);
+    count = 0;
+  }
+  memset(sha512_info->data + count, 0, SHA512_BLOCKSIZE - 8 - count);
+  for (int i = 0; i < 8; ++i) {
+    sha512_info->data[SHA512_BLOCKSIZE - 1 - i] = (uint8_t)(bits >> 8*i);
+  }
+  sha512_transform(sha512_info);
+  for (int i = 0; i < SHA512_DIGEST_LENGTH; ++i) {
+    digest[i] = (uint8_t)(sha512_info->digest[i/8] >> (56 - 8*(i & 7)));
+  }
+  explicit_bzero(sha512_info, sizeof(*sha512_info));
+}
+
+// Multi-buffer compression of SHA512_LANES independent blocks. This follows
+// the structure of the SHA1 kernels.
+
+#if defined(__GNUC__) && __GNUC__ >= 5 && \
+    (defined(__x86_64__) || defined(__i386__) || \
+     defined(__ARM_NEON) || defined(__ALTIVEC__))
+#define SHA512_MB_VECTOR
+
+typedef uint64_t sha512_vec __attribute__((vector_size(8 * SHA512_LANES)));
+
+static inline __attribute__((always_inline)) void
+sha512_transform_lanes_body(const uint64_t midstate[8],
+                            const uint64_t block[16][SHA512_LANES],
+                            uint64_t result[8][SHA512_LANES]) {
+  sha512_vec S[8], W[16];
+  const sha512_vec zero = { 0 };
+  for (int i = 0; i < 16; ++i) {
+    memcpy(&W[i], block[i], sizeof(W[i]));
+  }
+  for (int i = 0; i < 8; ++i) {
+    S[i] = zero + midstate[i];
+  }
+  ROUNDS(S, W);
+  for (int i = 0; i < 8; ++i) {
+    S[i] += midstate[i];
+    memcpy(result[i], &S[i], sizeof(S[i]));
+  }
+  explicit_bzero(W, sizeof(W));
+  explicit_bzero(S, sizeof(S));
+}
+
+// Baseline vector ISA of the target, e.g. SSE2 or NEON
+static void
+sha512_transform_lanes_vector(const uint64_t midstate[8],
+                              const uint64_t block[16][SHA512_LANES],
+                              uint64_t result[8][SHA512_LANES]) {
+  sha512_transform_lanes_body(midstate, block, result);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx512f"))) static void
+sha512_transform_lanes_avx512(const uint64_t midstate[8],
+                              const uint64_t block[16][SHA512_LANES],
+                              uint64_t result[8][SHA512_LANES]) {
+  sha512_transform_lanes_body(midstate, block, result);
+}
+#endif
+#endif /* SHA512_MB_VECTOR */
+
+// One lane at a time
+static void __attribute__((unused))
+sha512_transform_lanes_scalar(const uint64_t midstate[8],
+                              const uint64_t block[16][SHA512_LANES],
+                              uint64_t result[8][SHA512_LANES]) {
+  uint64_t digest[8], W[16];
+  for (int j = 0; j < SHA512_LANES; ++j) {
+    memcpy(digest, midstate, sizeof(digest));
+    for (int i = 0; i < 16; ++i) {
+      W[i] = block[i][j];
+    }
+    sha512_compress(digest, W);
+    for (int i = 0; i < 8; ++i) {
+      result[i][j] = digest[i];
+    }
+  }
+  explicit_bzero(digest, sizeof(digest));
+  explicit_bzero(W, sizeof(W));
+}
+
+static void (*sha512_lanes)(const uint64_t midstate[8],
+                            const uint64_t block[16][SHA512_LANES],
+                            uint64_t result[8][SHA512_LANES]) =
+#ifdef SHA512_MB_VECTOR
+  sha512_transform_lanes_vector;
+#else
+  sha512_transform_lanes_scalar;
+#endif
+
+void sha512_transform_lanes(const uint64_t midstate[8],
+                            const uint64_t block[16][SHA512_LANES],
+                            uint64_t result[8][SHA512_LANES]) {
+  sha512_lanes(midstate, block, result);
+}
+
+#if defined(SHA512_MB_VECTOR) && (defined(__x86_64__) || defined(__i386__))
+// Just like for SHA1, the implementation is picked once, when the code is
+// loaded.
+static void __attribute__((constructor))
+sha512_select_implementation(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    sha512_lanes = sha512_transform_lanes_avx512;
+  }
+}
+#endif
@@ -0,0 +1,52 @@
+// SHA512 implementation
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SHA512_H_
+#define _SHA512_H_
+
+#include <stdint.h>
+
+#define SHA512_BLOCKSIZE     128
+#define SHA512_DIGEST_LENGTH 64
+
+typedef struct {
+  uint64_t digest[8];
+  uint64_t count;
+  uint8_t  data[SHA512_BLOCKSIZE];
+  int      local;
+} SHA512_INFO;
+
+void sha512_init(SHA512_INFO *sha512_info)
+  __attribute__((visibility("hidden")));
+void sha512_update(SHA512_INFO *sha512_info, const uint8_t *buffer,
+                   int count)
+  __attribute__((visibility("hidden")));
+void sha512_final(SHA512_INFO *sha512_info,
+                  uint8_t digest[SHA512_DIGEST_LENGTH])
+  __attribute__((visibility("hidden")));
+
+// Number of independent message blocks that are compressed by a single call
+// to sha512_transform_lanes().
+#define SHA512_LANES 8
+
+// Compress one 128-byte message block per lane. This works just like
+// sha1_transform_lanes(), and uses the same word-major layout.
+void sha512_transform_lanes(const uint64_t midstate[8],
+                            const uint64_t block[16][SHA512_LANES],
+                            uint64_t result[8][SHA512_LANES])
+  __attribute__((visibility("hidden")));
+
+#endif /* _SHA512_H_ */
@@ -0,0 +1,321 @@
+// Shared memory table for rate limiting and code reuse state
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sha1.h"
+#include "shm_store.h"
+
+#define SHM_STORE_MAGIC        0x31534147  // "GAS1"
+#define SHM_STORE_BUCKETS      512
+#define SHM_STORE_WAYS         8
+
+// rate_limit() accepts at most 100 attempts, and window_size() allows a
+// window of at most 100 steps.
+#define SHM_STORE_MAX_ATTEMPTS 100
+#define SHM_STORE_MAX_USED     100
+
+typedef struct {
+  uint32_t magic;
+  uint32_t buckets;
+  uint32_t ways;
+  uint32_t entry_size;
+} ShmHeader;
+
+typedef struct {
+  uint8_t  key[SHM_STORE_KEY_LENGTH];
+  // Time after which neither list holds any data that is still relevant.
+  // From then on, the entry can be reused for a different user.
+  uint32_t expires;
+  uint16_t num_attempts;
+  uint16_t num_used;
+  uint32_t attempts[SHM_STORE_MAX_ATTEMPTS];
+  int32_t  used[SHM_STORE_MAX_USED];
+} ShmEntry;
+
+#define SHM_STORE_HEADER_SIZE  64
+#define SHM_STORE_BUCKET_SIZE  (SHM_STORE_WAYS * sizeof(ShmEntry))
+#define SHM_STORE_SIZE         (SHM_STORE_HEADER_SIZE + \
+                                SHM_STORE_BUCKETS * SHM_STORE_BUCKET_SIZE)
+
+// Each bucket is protected by a record lock on its byte range. Unlike a
+// lock word inside of the mapping, the kernel releases these locks if the
+// holder crashes, so a killed sshd process can never wedge the table. Open
+// file description locks are preferred, as they also exclude other threads
+// of the same process.
+static int lock_range(int fd, short type, off_t start, off_t len) {
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type   = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start  = start;
+  fl.l_len    = len;
+#ifdef F_OFD_SETLKW
+  int cmd = F_OFD_SETLKW;
+#else
+  int cmd = F_SETLKW;
+#endif
+  for (;;) {
+    if (!fcntl(fd, cmd, &fl)) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+#ifdef F_OFD_SETLKW
+    if (errno == EINVAL && cmd == F_OFD_SETLKW) {
+      // Kernel predates open file description locks.
+      cmd = F_SETLKW;
+      continue;
+    }
+#endif
+    return -1;
+  }
+}
+
+int shm_store_open(ShmStore *store, const char *path) {
+  store->fd = -1;
+  store->map = NULL;
+  memset(store->key, 0, sizeof(store->key));
+
+  const int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return errno;
+  }
+
+  // Serialize initialization of a new table.
+  if (lock_range(fd, F_WRLCK, 0, SHM_STORE_HEADER_SIZE)) {
+    goto error;
+  }
+
+  // Anybody who can write to the table could lift their own rate limit.
+  struct stat sb;
+  if (fstat(fd, &sb)) {
+    goto error;
+  }
+  if (!S_ISREG(sb.st_mode) || sb.st_uid != geteuid() ||
+      (sb.st_mode & (S_IRWXG | S_IRWXO))) {
+    errno = EPERM;
+    goto error;
+  }
+  if (sb.st_size == 0 && ftruncate(fd, SHM_STORE_SIZE)) {
+    goto error;
+  } else if (sb.st_size != 0 && sb.st_size != SHM_STORE_SIZE) {
+    errno = EINVAL;
+    goto error;
+  }
+
+  const ShmHeader expected = {
+    SHM_STORE_MAGIC, SHM_STORE_BUCKETS, SHM_STORE_WAYS, sizeof(ShmEntry) };
+  ShmHeader header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    errno = EINVAL;
+    goto error;
+  }
+  if (!header.magic) {
+    if (pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected)) {
+      errno = EIO;
+      goto error;
+    }
+  } else if (memcmp(&header, &expected, sizeof(header))) {
+    errno = EINVAL;
+    goto error;
+  }
+
+  void *map = mmap(NULL, SHM_STORE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  if (map == MAP_FAILED) {
+    goto error;
+  }
+  lock_range(fd, F_UNLCK, 0, SHM_STORE_HEADER_SIZE);
+  store->fd = fd;
+  store->map = map;
+  return 0;
+
+error:;
+  const int err = errno;
+  close(fd);
+  return err;
+}
+
+void shm_store_bind(ShmStore *store, const char *name) {
+  SHA1_INFO ctx;
+  uint8_t digest[SHA1_DIGEST_LENGTH];
+  sha1_init(&ctx);
+  sha1_update(&ctx, (const uint8_t *)name, strlen(name));
+  sha1_final(&ctx, digest);
+  memcpy(store->key, digest, sizeof(store->key));
+}
+
+// Locks the bucket for the current key, and returns its offset in the file.
+static off_t lock_bucket(ShmStore *store) {
+  const uint32_t hash = store->key[0] | store->key[1] << 8 |
+                        store->key[2] << 16 | (uint32_t)store->key[3] << 24;
+  const off_t offset = SHM_STORE_HEADER_SIZE +
+                       (off_t)(hash % SHM_STORE_BUCKETS) *
+                       SHM_STORE_BUCKET_SIZE;
+  if (lock_range(store->fd, F_WRLCK, offset, SHM_STORE_BUCKET_SIZE)) {
+    return -1;
+  }
+  return offset;
+}
+
+static void unlock_bucket(ShmStore *store, off_t offset) {
+  lock_range(store->fd, F_UNLCK, offset, SHM_STORE_BUCKET_SIZE);
+}
+
+// Finds the entry for the current key in a locked bucket. If there is
+// none, the expired entry that has been unused the longest is taken over.
+// Returns NULL, if all entries in the bucket are still in use.
+static ShmEntry *lookup_entry(ShmStore *store, off_t offset,
+                              unsigned int now, int *created) {
+  ShmEntry *bucket = (ShmEntry *)(store->map + offset);
+  ShmEntry *victim = NULL;
+  for (int i = 0; i < SHM_STORE_WAYS; ++i) {
+    ShmEntry *entry = bucket + i;
+    if (!memcmp(entry->key, store->key, sizeof(entry->key))) {
+      // A process could have been killed while updating the entry.
+      if (entry->num_attempts > SHM_STORE_MAX_ATTEMPTS) {
+        entry->num_attempts = 0;
+      }
+      if (entry->num_used > SHM_STORE_MAX_USED) {
+        entry->num_used = 0;
+      }
+      *created = 0;
+      return entry;
+    }
+    if (entry->expires <= now &&
+        (!victim || entry->expires < victim->expires)) {
+      victim = entry;
+    }
+  }
+  if (victim) {
+    memset(victim, 0, sizeof(*victim));
+    memcpy(victim->key, store->key, sizeof(victim->key));
+    *created = 1;
+  }
+  return victim;
+}
+
+int shm_store_rate_limit(ShmStore *store, unsigned int now,
+                         int attempts, int interval,
+                         const unsigned int *seed, int num_seed) {
+  const off_t offset = lock_bucket(store);
+  if (offset < 0) {
+    return -1;
+  }
+  int created;
+  ShmEntry *entry = lookup_entry(store, offset, now, &created);
+  if (!entry) {
+    unlock_bucket(store, offset);
+    return -1;
+  }
+  if (created) {
+    if (num_seed > SHM_STORE_MAX_ATTEMPTS) {
+      seed += num_seed - SHM_STORE_MAX_ATTEMPTS;
+      num_seed = SHM_STORE_MAX_ATTEMPTS;
+    }
+    memcpy(entry->attempts, seed, num_seed * sizeof(*seed));
+    entry->num_attempts = num_seed;
+  }
+
+  // Attempts are appended in chronological order. Prune all entries outside
+  // of the current time interval, then append the current attempt.
+  int n = 0;
+  for (int i = 0; i < entry->num_attempts; ++i) {
+    const unsigned int timestamp = entry->attempts[i];
+    if (timestamp >= now - interval && timestamp <= now) {
+      entry->attempts[n++] = timestamp;
+    }
+  }
+  if (n == SHM_STORE_MAX_ATTEMPTS) {
+    memmove(entry->attempts, entry->attempts + 1, --n * sizeof(uint32_t));
+  }
+  entry->attempts[n++] = now;
+
+  // Only the most recent attempts are needed to decide about the next one.
+  int exceeded = 0;
+  if (n > attempts) {
+    exceeded = 1;
+    memmove(entry->attempts, entry->attempts + n - attempts,
+            attempts * sizeof(uint32_t));
+    n = attempts;
+  }
+  entry->num_attempts = n;
+  if (entry->expires < now + interval) {
+    entry->expires = now + interval;
+  }
+  unlock_bucket(store, offset);
+  return exceeded;
+}
+
+int shm_store_disallow_reuse(ShmStore *store, unsigned int now,
+                             int tm, int window, int step) {
+  const off_t offset = lock_bucket(store);
+  if (offset < 0) {
+    return -1;
+  }
+  int created;
+  ShmEntry *entry = lookup_entry(store, offset, now, &created);
+  if (!entry) {
+    unlock_bucket(store, offset);
+    return -1;
+  }
+
+  // Drop all time stamps that are outside of the possible window.
+  int n = 0, used = 0;
+  for (int i = 0; i < entry->num_used; ++i) {
+    const int blocked = entry->used[i];
+    if (blocked == tm) {
+      used = 1;
+    }
+    if (blocked - tm < window && tm - blocked < window) {
+      entry->used[n++] = blocked;
+    }
+  }
+  entry->num_used = n;
+  if (!used) {
+    if (n == SHM_STORE_MAX_USED) {
+      unlock_bucket(store, offset);
+      return -1;
+    }
+    entry->used[entry->num_used++] = tm;
+    const unsigned int expires = (unsigned int)(tm + window) * step;
+    if (entry->expires < expires) {
+      entry->expires = expires;
+    }
+  }
+  unlock_bucket(store, offset);
+  return used;
+}
+
+void shm_store_close(ShmStore *store) {
+  if (store->map) {
+    munmap(store->map, SHM_STORE_SIZE);
+    store->map = NULL;
+  }
+  if (store->fd >= 0) {
+    close(store->fd);
+    store->fd = -1;
+  }
+}
@@ -0,0 +1,65 @@
+// Shared memory table for rate limiting and code reuse state
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SHM_STORE_H_
+#define _SHM_STORE_H_
+
+#include <stdint.h>
+
+#define SHM_STORE_KEY_LENGTH 16
+
+// A fixed size hash table in a memory mapped file, which is shared by all
+// processes that run the PAM module. It holds the RATE_LIMIT and
+// DISALLOW_REUSE time stamps, so that recording a login attempt does not
+// require rewriting the secret file.
+typedef struct ShmStore {
+  int     fd;
+  uint8_t *map;
+  uint8_t key[SHM_STORE_KEY_LENGTH];
+} ShmStore;
+
+// Opens, and if necessary creates, the table at "path". The file must be
+// owned by the effective user and must not be accessible to anybody else.
+// This has to be called before dropping privileges. Returns 0 on success,
+// or an errno value.
+int shm_store_open(ShmStore *store, const char *path)
+  __attribute__((visibility("hidden")));
+
+// Selects the entry that subsequent calls operate on. "name" identifies the
+// user's state, e.g. the name of the secret file.
+void shm_store_bind(ShmStore *store, const char *name)
+  __attribute__((visibility("hidden")));
+
+// Records a login attempt at time "now", and prunes all attempts that are
+// older than "interval" seconds. The sorted "seed" time stamps initialize
+// an entry that did not exist yet. Returns 1 if there have been more than
+// "attempts" attempts in the interval, 0 if not, and -1 if the table has no
+// room for this user.
+int shm_store_rate_limit(ShmStore *store, unsigned int now,
+                         int attempts, int interval,
+                         const unsigned int *seed, int num_seed)
+  __attribute__((visibility("hidden")));
+
+// Marks the time-based code with time stamp "tm" as used, and prunes all
+// time stamps that are outside of "window". Returns 1 if the code had been
+// used before, 0 if not, and -1 if the table has no room for this user.
+int shm_store_disallow_reuse(ShmStore *store, unsigned int now,
+                             int tm, int window, int step)
+  __attribute__((visibility("hidden")));
+
+void shm_store_close(ShmStore *store) __attribute__((visibility("hidden")));
+
+#endif /* _SHM_STORE_H_ */
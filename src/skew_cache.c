@@ -0,0 +1,201 @@
+// Process wide cache of the codes that the time skew search compares against
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "skew_cache.h"
+#include "util.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Matches beyond the first few for the same code are ignored. With six
+// digit codes, even two matches in the search range are rare.
+#define SKEW_CACHE_MAX_MATCHES 4
+
+// Each table lives at the start of its own locked mapping. Entries hold the
+// code in the upper and the index of its time step in the lower 32 bits.
+// They are followed by SKEW_CACHE_MAX_MATCHES sentinels, which never match
+// a code.
+typedef struct SkewTable {
+  uint8_t       id[SHA1_DIGEST_LENGTH];
+  unsigned long tm;
+  int           steps;
+  int           num_entries;
+  uint64_t      entries[];
+} SkewTable;
+
+typedef struct SkewSlot {
+  SkewTable *table;
+  size_t    map_size;
+  uint64_t  last_used;
+} SkewSlot;
+
+static SkewSlot        slots[SKEW_CACHE_MAX_ENTRIES];
+static int             num_slots;
+static uint64_t        use_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void remove_slot(int i) {
+  explicit_bzero(slots[i].table, slots[i].map_size);
+  munmap(slots[i].table, slots[i].map_size);
+  slots[i] = slots[--num_slots];
+  memset(slots + num_slots, 0, sizeof(SkewSlot));
+}
+
+static int find_slot(const uint8_t id[SHA1_DIGEST_LENGTH]) {
+  for (int i = 0; i < num_slots; ++i) {
+    if (!memcmp(slots[i].table->id, id, SHA1_DIGEST_LENGTH)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Finds the closest match for "code". The number of iterations only depends
+// on the size of the table, and the comparisons are done with conditional
+// moves rather than branches where the compiler allows.
+static int search_table(const SkewTable *table, int code) {
+  const uint64_t target = (uint64_t)(uint32_t)code << 32;
+  const uint64_t *base = table->entries;
+  for (size_t len = table->num_entries; len > 1; ) {
+    const size_t half = len / 2;
+    base = base[half] < target ? base + half : base;
+    len -= half;
+  }
+  base += *base < target;
+
+  int skew = SKEW_CACHE_NO_MATCH;
+  unsigned best = ~0u;
+  for (int i = 0; i < SKEW_CACHE_MAX_MATCHES; ++i) {
+    const uint64_t entry = base[i];
+    const int s = (int)(uint32_t)entry - (table->steps - 1);
+    // Prefer the smallest time skew, and the negative one on a tie, just
+    // like the linear search.
+    const unsigned score = 2u*(unsigned)abs(s) - (s < 0);
+    const int hit = (entry >> 32) == (uint32_t)code && score < best;
+    best = hit ? score : best;
+    skew = hit ? s : skew;
+  }
+  return skew;
+}
+
+int skew_cache_find(const uint8_t id[SHA1_DIGEST_LENGTH], unsigned long tm,
+                    int steps, int code, int *skew) {
+  int found = 0;
+  pthread_mutex_lock(&lock);
+  const int i = find_slot(id);
+  if (i >= 0 && slots[i].table->tm == tm && slots[i].table->steps == steps) {
+    slots[i].last_used = ++use_count;
+    *skew = search_table(slots[i].table, code);
+    found = 1;
+  }
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+int skew_cache_put(const uint8_t id[SHA1_DIGEST_LENGTH], unsigned long tm,
+                   int steps, const int *codes, int max_entries) {
+  if (max_entries < 1 || steps < 1) {
+    return EINVAL;
+  }
+  if (max_entries > SKEW_CACHE_MAX_ENTRIES) {
+    max_entries = SKEW_CACHE_MAX_ENTRIES;
+  }
+
+  // Build the new table without holding the lock.
+  const int n = 2*steps - 1;
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t map_size =
+    (sizeof(SkewTable) + (n + SKEW_CACHE_MAX_MATCHES) * sizeof(uint64_t) +
+     page - 1) / page * page;
+  SkewTable *table = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED) {
+    return errno;
+  }
+  if (mlock(table, map_size)) {
+    const int err = errno;
+    munmap(table, map_size);
+    return err;
+  }
+#ifdef MADV_DONTDUMP
+  madvise(table, map_size, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+  madvise(table, map_size, MADV_WIPEONFORK);
+#endif
+  memcpy(table->id, id, SHA1_DIGEST_LENGTH);
+  table->tm = tm;
+  table->steps = steps;
+  table->num_entries = n;
+  for (int i = 0; i < n; ++i) {
+    table->entries[i] = (uint64_t)(uint32_t)codes[i] << 32 | (uint32_t)i;
+  }
+  qsort(table->entries, n, sizeof(uint64_t), compare_entries);
+  for (int i = 0; i < SKEW_CACHE_MAX_MATCHES; ++i) {
+    table->entries[n + i] = ~(uint64_t)0;
+  }
+
+  pthread_mutex_lock(&lock);
+  const int old = find_slot(id);
+  if (old >= 0) {
+    remove_slot(old);
+  }
+  while (num_slots >= max_entries) {
+    int lru = 0;
+    for (int i = 1; i < num_slots; ++i) {
+      if (slots[i].last_used < slots[lru].last_used) {
+        lru = i;
+      }
+    }
+    remove_slot(lru);
+  }
+  slots[num_slots++] = (SkewSlot){ table, map_size, ++use_count };
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+void skew_cache_drop(const uint8_t id[SHA1_DIGEST_LENGTH]) {
+  pthread_mutex_lock(&lock);
+  const int i = find_slot(id);
+  if (i >= 0) {
+    remove_slot(i);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+__attribute__((destructor))
+void skew_cache_clear(void) {
+  pthread_mutex_lock(&lock);
+  while (num_slots > 0) {
+    remove_slot(num_slots - 1);
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,58 @@
+// Process wide cache of the codes that the time skew search compares against
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _SKEW_CACHE_H_
+#define _SKEW_CACHE_H_
+
+#include <stdint.h>
+
+#include "sha1.h"
+
+#define SKEW_CACHE_MAX_ENTRIES 1024
+#define SKEW_CACHE_NO_MATCH    1000000
+
+// Entries are keyed by an identifier that is derived from the shared
+// secret, the time step, and the number of steps that are searched in
+// either direction. Each entry holds the codes for all time steps in the
+// search range, sorted by code, so that a later attempt in the same time
+// step is a binary search rather than thousands of HMACs.
+
+// Looks up "code" in the table for "id", "tm" and "steps". If a table is
+// cached, stores the time skew of the closest match, or SKEW_CACHE_NO_MATCH,
+// in "skew", and returns 1. Otherwise returns 0.
+int skew_cache_find(const uint8_t id[SHA1_DIGEST_LENGTH], unsigned long tm,
+                    int steps, int code, int *skew)
+  __attribute__((visibility("hidden")));
+
+// Caches the "2*steps - 1" codes for the time steps from "tm - steps + 1"
+// to "tm + steps - 1". This replaces any older table for "id". If more than
+// "max_entries" tables are cached, the least recently used ones are
+// evicted. The tables are kept in locked memory, which is excluded from
+// core dumps and wiped in child processes. Returns 0 on success, or an
+// errno value.
+int skew_cache_put(const uint8_t id[SHA1_DIGEST_LENGTH], unsigned long tm,
+                   int steps, const int *codes, int max_entries)
+  __attribute__((visibility("hidden")));
+
+// Wipes the table for "id", if any.
+void skew_cache_drop(const uint8_t id[SHA1_DIGEST_LENGTH])
+  __attribute__((visibility("hidden")));
+
+// Wipes and releases all tables. This also happens when the module is
+// unloaded.
+void skew_cache_clear(void) __attribute__((visibility("hidden")));
+
+#endif /* _SKEW_CACHE_H_ */
@@ -0,0 +1,76 @@
+// Pluggable stores for HOTP counters and code reuse state
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <string.h>
+
+#include "state_store.h"
+
+// The shared memory table is bound to the name of the secret file by the
+// caller, as it also holds the rate limiting state.
+static int shm_disallow_reuse(StateStore *store, unsigned int now,
+                              int tm, int window, int step) {
+  return shm_store_disallow_reuse(store->impl, now, tm, window, step);
+}
+
+static const StateStoreOps shm_ops = {
+  .disallow_reuse = shm_disallow_reuse,
+};
+
+void state_store_init_shm(StateStore *store, ShmStore *shm) {
+  memset(store, 0, sizeof(*store));
+  store->ops  = &shm_ops;
+  store->impl = shm;
+}
+
+void state_store_bind(StateStore *store, const uint8_t *id) {
+  for (; store; store = store->fallback) {
+    memcpy(store->id, id, sizeof(store->id));
+  }
+}
+
+int state_store_disallow_reuse(StateStore *store, unsigned int now,
+                               int tm, int window, int step) {
+  for (; store; store = store->fallback) {
+    if (store->ops->disallow_reuse) {
+      const int rc = store->ops->disallow_reuse(store, now, tm, window, step);
+      if (rc >= 0) {
+        return rc;
+      } else if (store->fail_closed) {
+        return 1;
+      }
+    }
+  }
+  return -1;
+}
+
+int state_store_advance_counter(StateStore *store, long used, long next,
+                                long *current) {
+  *current = 0;
+  for (; store; store = store->fallback) {
+    if (store->ops->advance_counter) {
+      if (store->ops->advance_counter(store, next, current) >= 0) {
+        return used >= 0 && *current > used;
+      }
+      *current = 0;
+      if (store->fail_closed) {
+        return 1;
+      }
+    }
+  }
+  return -1;
+}
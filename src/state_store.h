@@ -0,0 +1,79 @@
+// Pluggable stores for HOTP counters and code reuse state
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _STATE_STORE_H_
+#define _STATE_STORE_H_
+
+#include <stdint.h>
+
+#include "shm_store.h"
+
+#define STATE_STORE_ID_LENGTH 20
+
+typedef struct StateStore StateStore;
+
+// The operations that a store implements. Any of them can be NULL, if the
+// store does not keep that kind of state. All of them return -1, if the
+// store cannot answer right now.
+typedef struct StateStoreOps {
+  // Marks the time-based code with time stamp "tm" as used. Returns 1 if
+  // the code had been used before, and 0 if not.
+  int (*disallow_reuse)(StateStore *store, unsigned int now,
+                        int tm, int window, int step);
+
+  // Raises the HOTP counter to at least "next", and reports the counter's
+  // previous value in "*current".
+  int (*advance_counter)(StateStore *store, long next, long *current);
+} StateStoreOps;
+
+// Stores are chained. A request goes to the first store that can answer
+// it, and the secret file is only consulted if none of them can. A store
+// that is "fail_closed" denies the login instead of passing the request on.
+struct StateStore {
+  const StateStoreOps *ops;
+  void       *impl;
+  int        fail_closed;
+  StateStore *fallback;
+  // Identifies the user's state. Unlike the name of the secret file, this
+  // is the same on every host that shares the secret.
+  uint8_t    id[STATE_STORE_ID_LENGTH];
+};
+
+// Makes "shm" answer requests for code reuse state.
+void state_store_init_shm(StateStore *store, ShmStore *shm)
+  __attribute__((visibility("hidden")));
+
+// Selects the state that subsequent calls operate on, in all of the stores
+// in the chain.
+void state_store_bind(StateStore *store, const uint8_t *id)
+  __attribute__((visibility("hidden")));
+
+// Marks the time-based code with time stamp "tm" as used. Returns 1 if the
+// code had been used before, 0 if not, and -1 if no store could tell.
+int state_store_disallow_reuse(StateStore *store, unsigned int now,
+                               int tm, int window, int step)
+  __attribute__((visibility("hidden")));
+
+// Consumes HOTP counter value "used", and raises the counter to "next".
+// Pass a negative "used" to only raise the counter, and a "next" of zero to
+// only read it. Returns 1 if the counter had already moved past "used", 0
+// if not, and -1 if no store could tell. "*current" is set to the counter
+// before the call, or to 0 if it is unknown.
+int state_store_advance_counter(StateStore *store, long used, long next,
+                                long *current)
+  __attribute__((visibility("hidden")));
+
+#endif /* _STATE_STORE_H_ */
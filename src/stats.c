@@ -0,0 +1,134 @@
+// Shared memory counters and latency histograms for the PAM module
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define STATS_MAGIC 0x31545347  // "GST1"
+
+const char *const stats_phase_names[STATS_NUM_PHASES] = {
+  "drop_privileges", "open_secret_file", "read_file_contents",
+  "rate_limit", "verify", "write_file_contents" };
+
+const char *const stats_outcome_names[STATS_NUM_OUTCOMES] = {
+  "scratch_hit", "totp_hit", "hotp_hit", "skew_adjust", "rate_limited",
+  "hotp_resync" };
+
+int stats_open(Stats *stats, const char *path, int writable) {
+  stats->table = NULL;
+  const int fd = writable
+    ? open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644)
+    : open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb)) {
+    goto error;
+  }
+  // Anybody who can write to the table could fake the numbers.
+  if (!S_ISREG(sb.st_mode) ||
+      (writable && (sb.st_uid != geteuid() ||
+                    (sb.st_mode & (S_IWGRP | S_IWOTH))))) {
+    errno = EPERM;
+    goto error;
+  }
+  if (sb.st_size == 0 && writable) {
+    // Concurrent initialization writes the same values, and the magic
+    // number always ends up being written last.
+    const StatsTable header = { 0, sizeof(StatsTable) };
+    if (ftruncate(fd, sizeof(StatsTable)) ||
+        pwrite(fd, &header.size, sizeof(header.size),
+               offsetof(StatsTable, size)) != sizeof(header.size)) {
+      goto error;
+    }
+    const uint32_t magic = STATS_MAGIC;
+    if (pwrite(fd, &magic, sizeof(magic), 0) != sizeof(magic)) {
+      goto error;
+    }
+  } else if (sb.st_size != sizeof(StatsTable)) {
+    errno = EINVAL;
+    goto error;
+  }
+
+  StatsTable *table = mmap(NULL, sizeof(StatsTable),
+                           writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                           MAP_SHARED, fd, 0);
+  if (table == MAP_FAILED) {
+    goto error;
+  }
+  close(fd);
+  if (table->magic != STATS_MAGIC || table->size != sizeof(StatsTable)) {
+    munmap(table, sizeof(StatsTable));
+    return EINVAL;
+  }
+  stats->table = table;
+  return 0;
+
+error:;
+  const int err = errno;
+  close(fd);
+  return err;
+}
+
+uint64_t stats_start(const Stats *stats) {
+  if (!stats) {
+    return 0;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(Stats *stats, StatsPhase phase, uint64_t start) {
+  if (!stats) {
+    return;
+  }
+  static const uint32_t bounds[] = STATS_BUCKET_BOUNDS;
+  const uint64_t elapsed = stats_start(stats) - start;
+  int bucket = 0;
+  while (bucket < STATS_NUM_BUCKETS - 1 &&
+         elapsed > (uint64_t)bounds[bucket] * 1000) {
+    ++bucket;
+  }
+  StatsHistogram *histogram = stats->table->phases + phase;
+  __atomic_fetch_add(histogram->buckets + bucket, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum_ns, elapsed, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+void stats_count(Stats *stats, StatsOutcome outcome) {
+  if (stats) {
+    __atomic_fetch_add(stats->table->outcomes + outcome, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void stats_close(Stats *stats) {
+  if (stats->table) {
+    munmap(stats->table, sizeof(StatsTable));
+    stats->table = NULL;
+  }
+}
@@ -0,0 +1,96 @@
+// Shared memory counters and latency histograms for the PAM module
+//
+// Copyright 2010 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+typedef enum {
+  STATS_PHASE_DROP_PRIVILEGES = 0,
+  STATS_PHASE_OPEN,
+  STATS_PHASE_READ,
+  STATS_PHASE_RATE_LIMIT,
+  STATS_PHASE_VERIFY,
+  STATS_PHASE_WRITE,
+  STATS_NUM_PHASES
+} StatsPhase;
+
+typedef enum {
+  STATS_SCRATCH_HIT = 0,
+  STATS_TOTP_HIT,
+  STATS_HOTP_HIT,
+  STATS_SKEW_ADJUST,
+  STATS_RATE_LIMITED,
+  STATS_HOTP_RESYNC,
+  STATS_NUM_OUTCOMES
+} StatsOutcome;
+
+// Upper bounds of the latency buckets in microseconds. The last bucket
+// is unbounded.
+#define STATS_BUCKET_BOUNDS { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, \
+                              10000, 25000, 50000, 100000, 250000, 500000, \
+                              1000000 }
+#define STATS_NUM_BUCKETS   17
+
+typedef struct StatsHistogram {
+  uint64_t buckets[STATS_NUM_BUCKETS];
+  uint64_t count;
+  uint64_t sum_ns;
+} StatsHistogram;
+
+// The table lives in a memory mapped file that all processes running the
+// module share. All updates are relaxed atomic increments, so recording
+// never blocks, and a reader may see a histogram whose count is slightly
+// ahead of its buckets.
+typedef struct StatsTable {
+  uint32_t       magic;
+  uint32_t       size;
+  uint64_t       outcomes[STATS_NUM_OUTCOMES];
+  StatsHistogram phases[STATS_NUM_PHASES];
+} StatsTable;
+
+typedef struct Stats {
+  StatsTable *table;
+} Stats;
+
+extern const char *const stats_phase_names[STATS_NUM_PHASES]
+  __attribute__((visibility("hidden")));
+extern const char *const stats_outcome_names[STATS_NUM_OUTCOMES]
+  __attribute__((visibility("hidden")));
+
+// Maps the table at "path". If "writable", the table is created as needed,
+// and must be owned by the effective user and not be writable by anybody
+// else. This has to be called before dropping privileges. Returns 0 on
+// success, or an errno value.
+int stats_open(Stats *stats, const char *path, int writable)
+  __attribute__((visibility("hidden")));
+
+// Returns a time stamp for stats_record(), or 0 if "stats" is NULL.
+uint64_t stats_start(const Stats *stats)
+  __attribute__((visibility("hidden")));
+
+// Adds the time since "start" to the histogram for "phase". Does nothing,
+// if "stats" is NULL.
+void stats_record(Stats *stats, StatsPhase phase, uint64_t start)
+  __attribute__((visibility("hidden")));
+
+void stats_count(Stats *stats, StatsOutcome outcome)
+  __attribute__((visibility("hidden")));
+
+void stats_close(Stats *stats) __attribute__((visibility("hidden")));
+
+#endif /* _STATS_H_ */
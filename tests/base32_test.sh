@@ -11,4 +11,52 @@ while [ $a -lt 150 ] ;do
 	a=$((a + 1))
 done
 
-rm testfile testfile.out
+# Small buffers split blocks across reads, and decoding has to carry
+# partial blocks over to the next read.
+a=0
+while [ $a -lt 20 ] ;do
+	dd if=/dev/urandom bs=$RANDOM count=1 of=testfile > /dev/null 2>&1
+	./base32 -e testfile > testfile.enc
+	if ! ./base32 -e -b $((16 + a)) testfile | cmp -s - testfile.enc ; then
+		echo FAILED
+		exit 1
+	fi
+	fold -w 7 testfile.enc | ./base32 -d -b $((16 + a)) > testfile.out
+	if ! cmp -s testfile testfile.out ; then
+		echo FAILED
+		exit 1
+	fi
+	a=$((a + 1))
+done
+
+# Regular files are mapped instead of read, and encoding can be split
+# across threads. Either way, the output has to match streaming from stdin.
+a=0
+while [ $a -lt 20 ] ;do
+	dd if=/dev/urandom bs=$RANDOM count=1 of=testfile > /dev/null 2>&1
+	cat testfile | ./base32 -e > testfile.enc
+	if ! ./base32 -e -b $((16 + a)) -j $((1 + a % 5)) testfile |
+	     cmp -s - testfile.enc ||
+	   ! cat testfile | ./base32 -e -b $((16 + a)) -j 3 |
+	     cmp -s - testfile.enc ; then
+		echo FAILED
+		exit 1
+	fi
+	# Spread the digits out, so that some buffers hold less than a block.
+	sed 's/./&   /g' testfile.enc > testfile.spaced
+	./base32 -d -b $((16 + a)) testfile.spaced > testfile.out
+	if ! cmp -s testfile testfile.out ; then
+		echo FAILED
+		exit 1
+	fi
+	a=$((a + 1))
+done
+
+: > testfile
+if [ "$(./base32 -e -j 4 testfile)" != "" ] ||
+   [ "$(./base32 -d testfile | wc -c)" -ne 0 ] ; then
+	echo FAILED
+	exit 1
+fi
+
+rm testfile testfile.enc testfile.out testfile.spaced
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -fr "$dir"' EXIT
+
+fail() {
+	echo "FAILED: $*"
+	exit 1
+}
+
+cat > "$dir/users" <<EOL
+# Comments and empty lines are ignored
+
+alice
+bob,Bob's laptop,Example Corp
+EOL
+
+./google-authenticator -t -d -w 3 -u -e 3 -q -j 2 -b "$dir/users" \
+	-s "$dir/\${USER}" -M "$dir/manifest" || fail "batch mode"
+
+for user in alice bob; do
+	[ "$(stat -c %a "$dir/$user")" = 400 ] || fail "mode of $user"
+	[ "$(grep -c '^[0-9]\{8\}$' "$dir/$user")" = 3 ] ||
+		fail "scratch codes of $user"
+	grep -q '^" TOTP_AUTH$' "$dir/$user" || fail "TOTP_AUTH for $user"
+	grep -q '^" DISALLOW_REUSE$' "$dir/$user" || fail "options for $user"
+	secret=$(head -n 1 "$dir/$user")
+	grep -q "^$user,otpauth://totp/.*?secret=$secret&" "$dir/manifest" ||
+		fail "manifest entry for $user"
+done
+[ "$(stat -c %a "$dir/manifest")" = 600 ] || fail "mode of manifest"
+[ "$(head -n 1 "$dir/manifest" | cut -d, -f1)" = alice ] ||
+	fail "manifest order"
+grep -q '^bob,.*/Bob'"'"'s%20laptop?.*&issuer=Example%20Corp$' \
+	"$dir/manifest" || fail "label and issuer of bob"
+[ "$(head -n 1 "$dir/alice")" != "$(head -n 1 "$dir/bob")" ] ||
+	fail "secrets are not unique"
+
+# Existing files are left alone unless forced.
+before=$(cat "$dir/alice")
+./google-authenticator -t -q -b "$dir/users" -s "$dir/\${USER}" ||
+	fail "rerun"
+[ "$before" = "$(cat "$dir/alice")" ] || fail "existing file replaced"
+./google-authenticator -t -q -f -b "$dir/users" -s "$dir/\${USER}" ||
+	fail "forced rerun"
+[ "$before" != "$(cat "$dir/alice")" ] || fail "existing file kept"
+
+# Broken lists are rejected before anything is written.
+printf 'carol\n../evil\n' > "$dir/bad"
+./google-authenticator -t -q -b "$dir/bad" -s "$dir/\${USER}" 2>/dev/null &&
+	fail "invalid user name accepted"
+[ ! -e "$dir/carol" ] || fail "partial provisioning"
+
+# Symbolic links to directories are not followed.
+mkdir "$dir/target"
+ln -s target "$dir/link"
+./google-authenticator -t -q -b "$dir/users" -s "$dir/link/\${USER}" \
+	2>/dev/null && fail "symbolic link followed"
+[ ! -e "$dir/target/alice" ] || fail "file written through symbolic link"
+exit 0
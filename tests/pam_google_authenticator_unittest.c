@@ -19,19 +19,28 @@
 
 #include <assert.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../src/base32.h"
 #include "../src/hmac.h"
+#include "../src/scratch_codes.h"
+#include "../src/secret_store.h"
+#include "../src/stats.h"
 
 #if !defined(PAM_BAD_ITEM)
 // FreeBSD does not know about PAM_BAD_ITEM. And PAM_SYMBOL_ERR is an "enum",
@@ -44,11 +53,26 @@ static char *response = "";
 static void *pam_module;
 static enum { TWO_PROMPTS, COMBINED_PASSWORD, COMBINED_PROMPT } conv_mode;
 static int num_prompts_shown = 0;
+static const char *rhost = "::1";
+
+// A concurrent login replaces "concurrent_fn" with these contents, while the
+// module waits for the user to enter a code.
+static const char *concurrent_fn = NULL;
+static const char *concurrent_data = NULL;
 
 static int conversation(int num_msg, PAM_CONST struct pam_message **msg,
                         struct pam_response **resp, void *appdata_ptr) {
   // Keep track of how often the conversation callback is executed.
   ++num_prompts_shown;
+  if (concurrent_fn) {
+    assert(!unlink(concurrent_fn));
+    const int fd = open(concurrent_fn, O_CREAT | O_EXCL | O_WRONLY, 0400);
+    assert(fd >= 0);
+    assert(write(fd, concurrent_data, strlen(concurrent_data)) ==
+           strlen(concurrent_data));
+    close(fd);
+    concurrent_fn = NULL;
+  }
   if (conv_mode == COMBINED_PASSWORD) {
     return PAM_CONV_ERR;
   }
@@ -94,7 +118,6 @@ int pam_get_item(const pam_handle_t *pamh, int item_type,
       return PAM_SUCCESS;
     }
     case PAM_RHOST: {
-        static const char *rhost = "::1";
         *item = rhost;
         return PAM_SUCCESS;
     }
@@ -148,6 +171,120 @@ static void print_diagnostics(int signo) {
   _exit(1);
 }
 
+// A stand-in for a Redis server, which only knows about the commands that
+// the state_store option sends. It serves one connection at a time.
+static struct {
+  int       listen_fd;
+  int       conn_fd;
+  pthread_t thread;
+  int       num_keys;
+  char      keys[32][128];
+  long      values[32];
+} fake_redis = { -1, -1 };
+
+static long *fake_redis_lookup(const char *key) {
+  for (int i = 0; i < fake_redis.num_keys; ++i) {
+    if (!strcmp(fake_redis.keys[i], key)) {
+      return fake_redis.values + i;
+    }
+  }
+  return NULL;
+}
+
+static long *fake_redis_insert(const char *key) {
+  assert(fake_redis.num_keys < 32 && strlen(key) < 128);
+  strcpy(fake_redis.keys[fake_redis.num_keys], key);
+  fake_redis.values[fake_redis.num_keys] = 0;
+  return fake_redis.values + fake_redis.num_keys++;
+}
+
+// Answers the first command in "buf". Returns the length of the command, or
+// 0 if it is not complete yet.
+static size_t fake_redis_command(int fd, char *buf, size_t len) {
+  char *ptr = buf, *end = buf + len, *argv[8];
+  if (!memchr(ptr, '\n', end - ptr)) {
+    return 0;
+  }
+  assert(*ptr == '*');
+  const int argc = (int)strtol(ptr + 1, &ptr, 10);
+  assert(argc > 0 && argc <= 8 && !memcmp(ptr, "\r\n", 2));
+  ptr += 2;
+  for (int i = 0; i < argc; ++i) {
+    if (!memchr(ptr, '\n', end - ptr)) {
+      return 0;
+    }
+    assert(*ptr == '$');
+    const long arg_len = strtol(ptr + 1, &ptr, 10);
+    ptr += 2;
+    if (end - ptr < arg_len + 2) {
+      return 0;
+    }
+    argv[i] = ptr;
+    ptr[arg_len] = '\000';
+    ptr += arg_len + 2;
+  }
+
+  char reply[40];
+  if (!strcmp(argv[0], "SET") && argc == 6 && !strcmp(argv[3], "NX")) {
+    if (fake_redis_lookup(argv[1])) {
+      strcpy(reply, "$-1\r\n");
+    } else {
+      *fake_redis_insert(argv[1]) = atol(argv[2]);
+      strcpy(reply, "+OK\r\n");
+    }
+  } else if (!strcmp(argv[0], "EVAL") && argc == 5) {
+    // The script raises the counter, and returns its old value.
+    long *counter = fake_redis_lookup(argv[3]);
+    if (!counter) {
+      counter = fake_redis_insert(argv[3]);
+    }
+    snprintf(reply, sizeof(reply), ":%ld\r\n", *counter);
+    if (*counter < atol(argv[4])) {
+      *counter = atol(argv[4]);
+    }
+  } else {
+    strcpy(reply, "-ERR unknown command\r\n");
+  }
+  assert(write(fd, reply, strlen(reply)) == strlen(reply));
+  return ptr - buf;
+}
+
+static void *fake_redis_main(void *arg) {
+  int fd;
+  while ((fd = accept(fake_redis.listen_fd, NULL, NULL)) >= 0) {
+    fake_redis.conn_fd = fd;
+    char buf[4096];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+      len += n;
+      for (size_t used; (used = fake_redis_command(fd, buf, len)) > 0; ) {
+        memmove(buf, buf + used, len -= used);
+      }
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+static void start_fake_redis(const char *path) {
+  struct sockaddr_un sun = { .sun_family = AF_UNIX };
+  strcpy(sun.sun_path, path);
+  fake_redis.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fake_redis.listen_fd >= 0);
+  assert(!bind(fake_redis.listen_fd, (struct sockaddr *)&sun, sizeof(sun)));
+  assert(!listen(fake_redis.listen_fd, 4));
+  assert(!pthread_create(&fake_redis.thread, NULL, fake_redis_main, NULL));
+}
+
+static void stop_fake_redis(const char *path) {
+  unlink(path);
+  shutdown(fake_redis.listen_fd, SHUT_RDWR);
+  shutdown(fake_redis.conn_fd, SHUT_RDWR);
+  pthread_join(fake_redis.thread, NULL);
+  close(fake_redis.listen_fd);
+}
+
 #define verify_prompts_shown(expected_prompts_shown) do { \
   assert(num_prompts_shown == (expected_prompts_shown)); \
   num_prompts_shown = 0; /* Reset for the next count. */ \
@@ -212,6 +349,83 @@ int main(int argc, char *argv[]) {
                                 0x75, 0x1A, 0x2A, 0x26 },
                  sizeof(hmac)));
 
+  // Testing that a precomputed key schedule can be reused for many messages
+  puts("Testing HMAC_SHA1 key schedule");
+  {
+    static const uint8_t key[] = "0123456789:;<=>?@ABC";
+    HMAC_SHA1_CTX ctx;
+    hmac_sha1_init(&ctx, key, sizeof(key)-1);
+    for (int i = 0; i < 3; ++i) {
+      hmac_sha1_compute(&ctx, (uint8_t *)"Sample #2", 9, hmac, sizeof(hmac));
+      assert(!memcmp(hmac,
+                     (uint8_t []) { 0x09, 0x22, 0xD3, 0x40, 0x5F, 0xAA, 0x3D,
+                                    0x19, 0x4F, 0x82, 0xA4, 0x58, 0x30, 0x73,
+                                    0x7D, 0x5C, 0xC6, 0xC7, 0x5D, 0x24 },
+                     sizeof(hmac)));
+    }
+    for (int len = 0; len < 200; len += 13) {
+      uint8_t msg[200], expected[20];
+      memset(msg, len, sizeof(msg));
+      hmac_sha1(key, sizeof(key)-1, msg, len, expected, sizeof(expected));
+      hmac_sha1_compute(&ctx, msg, len, hmac, sizeof(hmac));
+      assert(!memcmp(hmac, expected, sizeof(hmac)));
+    }
+    hmac_sha1_clear(&ctx);
+  }
+
+  // Testing the multi-buffer HMAC_SHA1 over consecutive counter values
+  puts("Testing batched HMAC_SHA1");
+  for (int keylen = 1; keylen <= 100; keylen += 33) {
+    uint8_t key[100];
+    memset(key, 0xA5 ^ keylen, keylen);
+    HMAC_SHA1_CTX ctx;
+    hmac_sha1_init(&ctx, key, keylen);
+    uint8_t batch[37][20];
+    const uint64_t first = 0xFFFFFFF0ull;
+    hmac_sha1_counters(&ctx, first, 37, batch);
+    for (int i = 0; i < 37; ++i) {
+      uint8_t val[8], expected[20];
+      for (int j = 8, value = 0; j--; ) {
+        val[j] = (first + i) >> (8*value++);
+      }
+      hmac_sha1(key, keylen, val, 8, expected, sizeof(expected));
+      assert(!memcmp(batch[i], expected, sizeof(expected)));
+    }
+    hmac_sha1_clear(&ctx);
+  }
+
+  // Testing the RFC 6238 test vectors for HMAC_SHA256 and HMAC_SHA512
+  puts("Testing batched HMAC_SHA256 and HMAC_SHA512");
+  {
+    static const uint8_t key[] =
+      "1234567890123456789012345678901234567890123456789012345678901234";
+    static const struct { unsigned long tm; int sha256, sha512; } vectors[] = {
+      { 59,         46119246, 90693936 },
+      { 1111111109, 68084774, 25091201 },
+      { 1234567890, 91819424, 93441116 },
+      { 2000000000, 90698825, 38618901 },
+    };
+    for (int i = 0; i < sizeof(vectors)/sizeof(*vectors); ++i) {
+      // The code of interest is in the middle of a partially filled batch.
+      const uint64_t first = vectors[i].tm/30 - 20;
+      HMAC_SHA256_CTX ctx256;
+      uint8_t hash256[37][SHA256_DIGEST_LENGTH];
+      hmac_sha256_init(&ctx256, key, 32);
+      hmac_sha256_counters(&ctx256, first, 37, hash256);
+      uint8_t *h = hash256[20], o = h[SHA256_DIGEST_LENGTH - 1] & 0xF;
+      assert((((h[o] & 0x7F) << 24 | h[o+1] << 16 | h[o+2] << 8 | h[o+3]) %
+              100000000) == vectors[i].sha256);
+
+      HMAC_SHA512_CTX ctx512;
+      uint8_t hash512[37][SHA512_DIGEST_LENGTH];
+      hmac_sha512_init(&ctx512, key, 64);
+      hmac_sha512_counters(&ctx512, first, 37, hash512);
+      h = hash512[20], o = h[SHA512_DIGEST_LENGTH - 1] & 0xF;
+      assert((((h[o] & 0x7F) << 24 | h[o+1] << 16 | h[o+2] << 8 | h[o+3]) %
+              100000000) == vectors[i].sha512);
+    }
+  }
+
   // Load the PAM module
   puts("Loading PAM module");
   pam_module = dlopen("./.libs/libpam_google_authenticator_testing.so",
@@ -235,6 +449,10 @@ int main(int argc, char *argv[]) {
   int (*compute_code)(uint8_t *, int, unsigned long) =
       (int (*)(uint8_t*, int, unsigned long))dlsym(pam_module, "compute_code");
   assert(compute_code);
+  void (*compute_codes)(uint8_t *, int, unsigned long, int, int *) =
+      (void (*)(uint8_t *, int, unsigned long, int, int *))
+      dlsym(pam_module, "compute_codes");
+  assert(compute_codes);
 
   for (int otp_mode = 0; otp_mode < 8; ++otp_mode) {
     // Create a secret file with a well-known test vector
@@ -251,6 +469,17 @@ int main(int argc, char *argv[]) {
     size_t binary_secret_len = base32_decode(secret, binary_secret,
                                              sizeof(binary_secret));
 
+    // Check that batched code computation agrees with computing single codes
+    if (otp_mode == 0) {
+      puts("Testing batched code computation");
+      int codes[100];
+      compute_codes(binary_secret, binary_secret_len, 9950, 100, codes);
+      for (int i = 0; i < 100; ++i) {
+        assert(codes[i] == compute_code(binary_secret, binary_secret_len,
+                                        9950 + i));
+      }
+    }
+
     // Set up test argc/argv parameters to let the PAM module know where to
     // find our secret file
     const char *targv[] = { malloc(strlen(fn) + 8), NULL, NULL, NULL, NULL };
@@ -389,6 +618,202 @@ int main(int argc, char *argv[]) {
     assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
     verify_prompts_shown(expected_good_prompts_shown);
 
+    // Test recording of counters and latency histograms
+    if (otp_mode == 0) {
+      puts("Testing stats option");
+      char stats_fn[] = "/tmp/.google_authenticator_stats_XXXXXX";
+      assert((fd = mkstemp(stats_fn)) >= 0);
+      close(fd);
+      char stats_arg[sizeof(stats_fn) + 10];
+      snprintf(stats_arg, sizeof(stats_arg), "stats=shm:%s", stats_fn);
+      targv[targc] = stats_arg;
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      response = "123456";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      response = "050548";
+      targv[targc] = NULL;
+
+      StatsTable table;
+      assert((fd = open(stats_fn, O_RDONLY)) >= 0);
+      assert(read(fd, &table, sizeof(table)) == sizeof(table));
+      close(fd);
+      assert(table.outcomes[STATS_TOTP_HIT] == 1);
+      assert(table.outcomes[STATS_SCRATCH_HIT] == 0);
+      assert(table.phases[STATS_PHASE_READ].count == 2);
+      assert(table.phases[STATS_PHASE_VERIFY].count == 2);
+      assert(table.phases[STATS_PHASE_WRITE].count == 0);
+      uint64_t total = 0;
+      for (int i = 0; i < STATS_NUM_BUCKETS; ++i) {
+        total += table.phases[STATS_PHASE_VERIFY].buckets[i];
+      }
+      assert(total == 2);
+      unlink(stats_fn);
+    }
+
+    // Test that parsed module options are only reused for identical options
+    if (otp_mode == 0) {
+      puts("Testing cached module options");
+      const char *(*module_error_msg)(void) =
+        (const char *(*)(void))dlsym(pam_module, "get_error_msg");
+      void (*reset_error_msg)(void) =
+        (void (*)(void))dlsym(pam_module, "reset_error_msg");
+      char option[] = "grace_hosts=5";
+      targv[targc] = option;
+      for (int i = 0; i < 2; ++i) {
+        assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+        verify_prompts_shown(expected_good_prompts_shown);
+      }
+
+      // The same string, with different contents, is parsed again.
+      option[strlen(option) - 1] = '0';
+      reset_error_msg();
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(0);
+      assert(strstr(module_error_msg(), "grace_hosts must be"));
+      reset_error_msg();
+      targv[targc] = NULL;
+    }
+
+    // Test caching of the parsed secret file
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    if (otp_mode == 0) {
+      puts("Testing secret_cache option");
+      const char *(*module_error_msg)(void) =
+        (const char *(*)(void))dlsym(pam_module, "get_error_msg");
+      void (*reset_error_msg)(void) =
+        (void (*)(void))dlsym(pam_module, "reset_error_msg");
+      targv[targc] = "secret_cache=4";
+      targv[targc+1] = "debug";
+      for (int i = 0; i < 2; ++i) {
+        reset_error_msg();
+        assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_SUCCESS);
+        verify_prompts_shown(expected_good_prompts_shown);
+        assert(!strstr(module_error_msg(), "found in cache") == !i);
+      }
+
+      // Any change to the file invalidates the cached copy.
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, "AAAAAAAAAAAAAAAA\n\" TOTP_AUTH", 28) == 28);
+      close(fd);
+      assert(!chmod(fn, 0400));
+      reset_error_msg();
+      assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(!strstr(module_error_msg(), "found in cache"));
+      reset_error_msg();
+      targv[targc] = targv[targc+1] = NULL;
+
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+      assert(write(fd, "\n\" TOTP_AUTH", 12) == 12);
+      close(fd);
+      assert(!chmod(fn, 0400));
+    }
+#endif
+
+    // Test keeping the state in a table of fixed size records
+    if (otp_mode == 0) {
+      puts("Testing secret_store option");
+      char store_fn[] = "/tmp/.google_authenticator_store_XXXXXX";
+      assert((fd = mkstemp(store_fn)) >= 0);
+      close(fd);
+      unlink(store_fn);
+      assert(!secret_store_create(store_fn, 16));
+      SecretStore store;
+      assert(!secret_store_open(&store, store_fn));
+      char record[SECRET_STORE_DATA_SIZE + 1];
+      snprintf(record, sizeof(record), "%s\n\" TOTP_AUTH\n\" DISALLOW_REUSE\n",
+               (const char *)secret);
+      assert(!secret_store_write(&store, getenv("USER"), record,
+                                 SECRET_STORE_ANY_VERSION));
+
+      char store_arg[sizeof(store_fn) + 20];
+      snprintf(store_arg, sizeof(store_arg), "secret_store=mmap:%s",
+               store_fn);
+      targv[targc] = store_arg;
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+
+      // The record was updated in place, and the code cannot be reused.
+      uint32_t version;
+      assert(secret_store_read(&store, getenv("USER"), record, &version) > 0);
+      assert(strstr(record, "\" DISALLOW_REUSE 10000\n"));
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+
+      // Writers that raced with somebody else have to start over.
+      assert(secret_store_write(&store, getenv("USER"), record,
+                                version + 2) == EAGAIN);
+      assert(!secret_store_delete(&store, getenv("USER")));
+      assert(secret_store_read(&store, getenv("USER"), record,
+                               &version) < 0 && errno == ENOENT);
+      targv[targc+1] = "nullok";
+      assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_IGNORE);
+      verify_prompts_shown(0);
+      targv[targc] = targv[targc+1] = NULL;
+      secret_store_close(&store);
+      unlink(store_fn);
+    }
+
+    // Test reading the secret file through a mapping
+    if (otp_mode == 0) {
+      puts("Testing mmap_secret option");
+      targv[targc] = "mmap_secret";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      response = "123456";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      response = "050548";
+      targv[targc+1] = "reentrant";
+      assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(0);
+      targv[targc] = targv[targc+1] = NULL;
+    }
+
+    // Test prompting while the secret file is read on another thread
+    if (otp_mode == 0) {
+      puts("Testing prefetch option");
+      const char *(*module_error_msg)(void) =
+        (const char *(*)(void))dlsym(pam_module, "get_error_msg");
+      void (*reset_error_msg)(void) =
+        (void (*)(void))dlsym(pam_module, "reset_error_msg");
+      targv[targc] = "prefetch";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      response = "123456";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      response = "050548";
+
+      // A rate limited user is still prompted, but the code is not checked.
+      // The helper thread's messages are reported.
+      char saved[4096] = { 0 };
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      assert(read(fd, saved, sizeof(saved)-1) > 0);
+      close(fd);
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_APPEND | O_WRONLY)) >= 0);
+      assert(write(fd, "\n\" RATE_LIMIT 1 30 300000\n", 26) == 26);
+      close(fd);
+      reset_error_msg();
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(strstr(module_error_msg(), "Too many concurrent login attempts"));
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(0);
+      reset_error_msg();
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, saved, strlen(saved)) == strlen(saved));
+      close(fd);
+      targv[targc] = NULL;
+    }
+
     // Test the STEP_SIZE option
     puts("Testing STEP_SIZE option");
     assert(!chmod(fn, 0600));
@@ -469,12 +894,56 @@ int main(int argc, char *argv[]) {
     assert(!memcmp(disallow + 17,
                    "10002 10003 10004 10005 10006 10007\n", 36));
 
+    // Test that the older list of time stamps is still honored. It is only
+    // converted with the "disallow_reuse_bits" option, as older versions
+    // cannot read the bits.
+    if (otp_mode == 0) {
+      puts("Testing DISALLOW_REUSE migration");
+      static const char old_list[] =
+        "\n\" TOTP_AUTH\n\" WINDOW_SIZE 6\n\" DISALLOW_REUSE 10006 10007 9000\n";
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+      assert(write(fd, old_list, sizeof(old_list)-1) == sizeof(old_list)-1);
+      close(fd);
+      char buf[7];
+      response = buf;
+      for (int i = 10007; i <= 10008; ++i) {
+        set_time(i * 30);
+        sprintf(response, "%06d", compute_code(binary_secret,
+                                               binary_secret_len, i));
+        assert(pam_sm_authenticate(NULL, 0, targc, targv) ==
+               (i == 10008 ? PAM_SUCCESS : PAM_AUTH_ERR));
+        verify_prompts_shown(expected_good_prompts_shown);
+      }
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf, "\" DISALLOW_REUSE 10006 10007 10008\n"));
+      set_time(10009 * 30);
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 10009));
+      targv[targc] = "disallow_reuse_bits";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      targv[targc] = NULL;
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf, "\" DISALLOW_REUSE @10004:c3\n"));
+      set_time(10000 * 30);
+      response = old_response;
+    }
+
     // Test the RATE_LIMIT option
     puts("Testing RATE_LIMIT option");
     assert(!chmod(fn, 0600));
     assert((fd = open(fn, O_APPEND | O_WRONLY)) >= 0);
     assert(write(fd, "\" RATE_LIMIT 4 120\n", 19) == 19);
     close(fd);
+    targv[targc] = "rate_limit_ring";
     for (int *tm  = (int []){ 20000, 20001, 20002, 20003, 20004, 20006, -1 },
              *res = (int []){ PAM_SUCCESS, PAM_SUCCESS, PAM_SUCCESS,
                               PAM_SUCCESS, PAM_AUTH_ERR, PAM_SUCCESS, -1 };
@@ -484,11 +953,12 @@ int main(int argc, char *argv[]) {
       response = buf;
       sprintf(response, "%06d",
               compute_code(binary_secret, binary_secret_len, *tm++));
-      assert(pam_sm_authenticate(NULL, 0, targc, targv) == *res);
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == *res);
       verify_prompts_shown(
           *res != PAM_SUCCESS ? 0 : expected_good_prompts_shown);
       ++res;
     }
+    targv[targc] = NULL;
     set_time(10000 * 30);
     response = old_response;
     assert(!chmod(fn, 0600));
@@ -498,7 +968,7 @@ int main(int argc, char *argv[]) {
     const char *rate_limit = strstr(state_file_buf, "\" RATE_LIMIT ");
     assert(rate_limit);
     assert(!memcmp(rate_limit + 13,
-                   "4 120 600060 600090 600120 600180\n", 35));
+                   "4 120 @2:0009283800092874000927fc0009281a\n", 42));
 
     // Test trailing space in RATE_LIMIT. This is considered a file format
     // error.
@@ -519,6 +989,94 @@ int main(int argc, char *argv[]) {
            strlen(state_file_buf));
     close(fd);
 
+    // Test that the older list of time stamps is still understood, even if
+    // it is not sorted. It is only converted with the "rate_limit_ring"
+    // option, as older versions cannot read the ring.
+    if (otp_mode == 0) {
+      puts("Testing RATE_LIMIT migration");
+      static const char old_list[] =
+        "\" RATE_LIMIT 4 120 600180 600060 600120 600090\n";
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, state_file_buf, rate_limit - state_file_buf) ==
+             rate_limit - state_file_buf);
+      assert(write(fd, old_list, sizeof(old_list)-1) == sizeof(old_list)-1);
+      assert(write(fd, eol + 1, strlen(eol + 1)) == strlen(eol + 1));
+      close(fd);
+      char buf[7];
+      response = buf;
+      set_time(20007 * 30);
+      sprintf(response, "%06d",
+              compute_code(binary_secret, binary_secret_len, 20007));
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf,
+                    "\" RATE_LIMIT 4 120 600090 600120 600180 600210\n"));
+      set_time(20008 * 30);
+      sprintf(response, "%06d",
+              compute_code(binary_secret, binary_secret_len, 20008));
+      targv[targc] = "rate_limit_ring";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf, "\" RATE_LIMIT 4 120 "
+                    "@1:000928b0000928380009287400092892\n"));
+      targv[targc] = NULL;
+      set_time(10000 * 30);
+      response = old_response;
+    }
+
+    // Test keeping RATE_LIMIT and DISALLOW_REUSE state in shared memory
+    if (otp_mode == 0) {
+      puts("Testing rate_limit_store option");
+      char shm_fn[] = "/tmp/.google_authenticator_shm_XXXXXX";
+      assert((fd = mkstemp(shm_fn)) >= 0);
+      close(fd);
+      char *shm_arg = malloc(strlen(shm_fn) + 22);
+      strcat(strcpy(shm_arg, "rate_limit_store=shm:"), shm_fn);
+      targv[targc] = shm_arg;
+      struct stat orig_sb;
+      assert(!stat(fn, &orig_sb));
+      char buf[7];
+      response = buf;
+      for (int *tm  = (int []){ 30000, 30001, 30002, 30003, 30004, 30006, -1 },
+               *res = (int []){ PAM_SUCCESS, PAM_SUCCESS, PAM_SUCCESS,
+                                PAM_SUCCESS, PAM_AUTH_ERR, PAM_SUCCESS, -1 };
+           *tm >= 0;) {
+        set_time(*tm * 30);
+        sprintf(response, "%06d",
+                compute_code(binary_secret, binary_secret_len, *tm++));
+        assert(pam_sm_authenticate(NULL, 0, targc + 1, targv) == *res);
+        verify_prompts_shown(
+            *res != PAM_SUCCESS ? 0 : expected_good_prompts_shown);
+        ++res;
+      }
+
+      // Replaying the last code is caught by the shared table, even though
+      // the DISALLOW_REUSE list in the secret file does not know about it.
+      set_time(30006 * 30 + 10);
+      assert(pam_sm_authenticate(NULL, 0, targc + 1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_good_prompts_shown);
+
+      // None of these attempts rewrote the secret file.
+      struct stat sb;
+      assert(!stat(fn, &sb));
+      assert(sb.st_ino == orig_sb.st_ino);
+      assert(sb.st_mtime == orig_sb.st_mtime);
+      targv[targc] = NULL;
+      free(shm_arg);
+      unlink(shm_fn);
+      set_time(10000 * 30);
+      response = old_response;
+    }
+
     // Test TIME_SKEW option
     puts("Testing TIME_SKEW");
     for (int i = 0; i < 4; ++i) {
@@ -542,6 +1100,49 @@ int main(int argc, char *argv[]) {
     assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
     targv[targc] = NULL;
     verify_prompts_shown(expected_bad_prompts_shown);
+
+    // Test reusing the time skew candidates within the same time step
+    if (otp_mode == 0) {
+      puts("Testing skew_cache option");
+      const char *(*module_error_msg)(void) =
+        (const char *(*)(void))dlsym(pam_module, "get_error_msg");
+      void (*reset_error_msg)(void) =
+        (void (*)(void))dlsym(pam_module, "reset_error_msg");
+      targv[targc] = "skew_cache=4";
+      targv[targc+1] = "debug";
+      set_time(12040 * 30);
+      for (int i = 0; i < 4; ++i) {
+        // Two codes far from the current time, a valid code, which wipes
+        // the candidates, and then another code far away.
+        const int tm = i == 2 ? 12040 - 1000 : 11240 + i;
+        sprintf(response, "%06d",
+                compute_code(binary_secret, binary_secret_len, tm));
+        reset_error_msg();
+        assert(pam_sm_authenticate(NULL, 0, targc+2, targv) ==
+               (i == 2 ? PAM_SUCCESS : PAM_AUTH_ERR));
+        verify_prompts_shown(expected_good_prompts_shown);
+        assert(!strstr(module_error_msg(), "candidates cached") == (i != 1));
+      }
+      reset_error_msg();
+      targv[targc] = targv[targc+1] = NULL;
+
+      // Clocks that are off by more than the default search range are only
+      // detected with a larger range. This is searched by several threads.
+      puts("Testing skew_search_steps option");
+      set_time(13000 * 30);
+      sprintf(response, "%06d",
+              compute_code(binary_secret, binary_secret_len, 13000 - 5000));
+      targv[targc] = "debug";
+      targv[targc+1] = "skew_search_steps=6000";
+      for (int i = 1; i <= 2; ++i) {
+        reset_error_msg();
+        assert(pam_sm_authenticate(NULL, 0, targc+i, targv) == PAM_AUTH_ERR);
+        verify_prompts_shown(expected_good_prompts_shown);
+        assert(!strstr(module_error_msg(), "time skew adjusted") == (i == 1));
+      }
+      reset_error_msg();
+      targv[targc] = targv[targc+1] = NULL;
+    }
     set_time(10000*30);
 
     // Test scratch codes
@@ -558,6 +1159,395 @@ int main(int argc, char *argv[]) {
     assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_AUTH_ERR);
     verify_prompts_shown(expected_bad_prompts_shown);
 
+    // Test hashed scratch codes
+    if (otp_mode == 0) {
+      puts("Testing hashed scratch codes");
+      static const int codes[] = { 23456789, 34567890, 45678901 };
+      const int num_codes = sizeof(codes)/sizeof(*codes);
+      HMAC_SHA1_CTX hmac;
+      hmac_sha1_init(&hmac, binary_secret, binary_secret_len);
+      char line[32 + SCRATCH_CODE_SLOT*3];
+      strcpy(line, "\" SCRATCH_CODES ");
+      scratch_codes_format(&hmac, codes, num_codes, strchr(line, '\000'));
+      strcat(line, "\n");
+      char hash[SCRATCH_HASH_DIGITS + 1];
+      scratch_code_hash(&hmac, codes[1], hash);
+      hmac_sha1_clear(&hmac);
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_APPEND | O_WRONLY)) >= 0);
+      assert(write(fd, line, strlen(line)) == strlen(line));
+      close(fd);
+      set_time(10050*30);
+      response = "34567890";
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+
+      // The code has been replaced by a tombstone
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      char *used = strstr(state_file_buf, hash);
+      assert(used && used[-1] == '-');
+      used[-1] = '+';
+      assert(strstr(state_file_buf, line));
+      set_time(10000*30);
+      response = old_response;
+    }
+
+    // Test the RFC 6238 algorithms and eight digit codes. Time based codes
+    // can then start with a '0', which scratch codes never do.
+    {
+      puts("Testing HASH_ALGORITHM and CODE_DIGITS options");
+      static const struct {
+        const char *options;
+        time_t     tm;
+        char       *code;
+      } tests[] = {
+        { "\" HASH_ALGORITHM SHA256\n\" CODE_DIGITS 8\n",  59,   "46119246" },
+        { "\" CODE_DIGITS 8\n",                       1111111109, "07081804" },
+        { "\" HASH_ALGORITHM SHA512\n\" CODE_DIGITS 8\n", 1234567890,
+          "93441116" },
+        { "\" HASH_ALGORITHM SHA256\n",               1111111109, "084774" },
+      };
+      static const uint8_t key[] =
+        "1234567890123456789012345678901234567890123456789012345678901234";
+      char saved[4096] = { 0 };
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      assert(read(fd, saved, sizeof(saved)-1) > 0);
+      close(fd);
+      char *old_response = response;
+      for (int i = 0; i < sizeof(tests)/sizeof(*tests); ++i) {
+        const int key_len = strstr(tests[i].options, "SHA512") ? 64 :
+                            strstr(tests[i].options, "SHA256") ? 32 : 20;
+        char buf[256];
+        assert(base32_encode(key, key_len, (uint8_t *)buf, sizeof(buf)) > 0);
+        strcat(strcat(strcat(buf, "\n\" TOTP_AUTH\n"), tests[i].options),
+               "\" WINDOW_SIZE 1\n");
+        assert(!chmod(fn, 0600));
+        assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+        assert(write(fd, buf, strlen(buf)) == strlen(buf));
+        close(fd);
+        set_time(tests[i].tm);
+        response = tests[i].code;
+        assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
+        verify_prompts_shown(expected_good_prompts_shown);
+        // A six digit suffix of an eight digit code is not good enough.
+        if (strlen(tests[i].code) == 8) {
+          response = tests[i].code + 2;
+          assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_AUTH_ERR);
+          verify_prompts_shown(expected_bad_prompts_shown);
+        }
+      }
+
+      // Unsupported options are rejected. Without a usable secret, the number
+      // of prompts depends on the mode, so it is not checked.
+      assert((fd = open(fn, O_APPEND | O_WRONLY)) >= 0);
+      assert(write(fd, "\" CODE_DIGITS 7\n", 16) == 16);
+      close(fd);
+      response = tests[0].code;
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_AUTH_ERR);
+      num_prompts_shown = 0;
+
+      fd = open(fn, O_TRUNC | O_WRONLY);
+      assert(fd >= 0);
+      assert(write(fd, saved, strlen(saved)) == strlen(saved));
+      close(fd);
+      response = old_response;
+      set_time(10000*30);
+    }
+
+    // Test updating the secret file without switching users
+    if (otp_mode == 0) {
+      puts("Testing reentrant option");
+      set_time(10100*30);
+      response = "87654321";
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_APPEND | O_WRONLY)) >= 0);
+      assert(write(fd, "87654321\n", 9) == 9);
+      close(fd);
+      targv[targc] = "reentrant";
+      targv[targc+1] = "no_strict_owner";
+      assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_AUTH_ERR);
+      targv[targc+1] = NULL;
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      struct stat sb;
+      assert(!stat(fn, &sb));
+      assert(sb.st_uid == getuid() && (sb.st_mode & 0777) == 0400);
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      targv[targc] = NULL;
+      set_time(10000*30);
+    }
+
+    // Test remembering logins from more than one host
+    if (otp_mode == 0) {
+      puts("Testing grace_period option");
+      static const char old_list[] =
+        "\n\" TOTP_AUTH\n\" LAST0 10.0.0.1 329000\n";
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+      assert(write(fd, old_list, sizeof(old_list)-1) == sizeof(old_list)-1);
+      close(fd);
+      targv[targc] = "grace_period=3600";
+      targv[targc+1] = "grace_hosts=2";
+      char buf[7];
+      response = buf;
+      static const char *expected[] = {
+        "\" LAST0 10.0.0.1 329000\n",
+        "\" LAST_LOGINS 10.0.0.2 330000 10.0.0.1 329000\n",
+        "\" LAST_LOGINS 10.0.0.3 330030 10.0.0.2 330000\n",
+      };
+      for (int i = 0; i < 3; ++i) {
+        // The first host is still within its grace period.
+        const int tm = 11000 + (i == 2);
+        set_time(tm * 30);
+        sprintf(response, "%06d",
+                i ? compute_code(binary_secret, binary_secret_len, tm) : 0);
+        rhost = (const char *[]){ "10.0.0.1", "10.0.0.2", "10.0.0.3" }[i];
+        assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_SUCCESS);
+        verify_prompts_shown(i ? expected_good_prompts_shown : 0);
+        assert((fd = open(fn, O_RDONLY)) >= 0);
+        memset(state_file_buf, 0, sizeof(state_file_buf));
+        assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+        close(fd);
+        assert(strstr(state_file_buf, expected[i]));
+        assert(!strstr(state_file_buf, "LAST0") == (i > 0));
+      }
+      rhost = "::1";
+      targv[targc] = targv[targc+1] = NULL;
+      set_time(10000 * 30);
+      response = old_response;
+    }
+
+    // Test journaling of volatile keys
+    if (otp_mode == 0) {
+      puts("Testing volatile_keys option");
+      static const char state[] =
+        "\n\" TOTP_AUTH\n\" LAST0 10.0.0.1 329000\n12345678\n";
+      char journal_fn[sizeof(fn) + 8], stale_fn[sizeof(fn) + 8];
+      snprintf(journal_fn, sizeof(journal_fn), "%s.journal", fn);
+      snprintf(stale_fn, sizeof(stale_fn), "%s.stale", fn);
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+      assert(write(fd, state, sizeof(state)-1) == sizeof(state)-1);
+      close(fd);
+      targv[targc] = "volatile_keys=RESETTING_TIME_SKEW,LAST*";
+      targv[targc+1] = "grace_period=3600";
+      targv[targc+2] = "grace_hosts=2";
+      char buf[7];
+      response = buf;
+      sprintf(response, "%06d",
+              compute_code(binary_secret, binary_secret_len, 11000));
+      rhost = "10.0.0.2";
+      set_time(11000 * 30);
+
+      // Merging the legacy login history only changes volatile keys, so the
+      // secret file is left alone.
+      struct stat orig_sb, sb;
+      assert(!stat(fn, &orig_sb));
+      assert(pam_sm_authenticate(NULL, 0, targc+3, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(!stat(fn, &sb));
+      assert(sb.st_ino == orig_sb.st_ino);
+      assert(!link(journal_fn, stale_fn));
+
+      // Using a scratch code rewrites the secret file, which absorbs the
+      // journal. The deleted LAST0 line must not come back.
+      response = "12345678";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(!stat(fn, &sb));
+      assert(sb.st_ino != orig_sb.st_ino);
+      assert(access(journal_fn, F_OK));
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf,
+                    "\" LAST_LOGINS 10.0.0.2 330000 10.0.0.1 329000\n"));
+      assert(!strstr(state_file_buf, "LAST0"));
+
+      // A journal that was written for the replaced file is ignored. The
+      // stale login history would otherwise skip the prompt.
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+      assert(write(fd, "\n\" TOTP_AUTH\n", 13) == 13);
+      close(fd);
+      assert(!rename(stale_fn, journal_fn));
+      response = buf;
+      assert(pam_sm_authenticate(NULL, 0, targc+3, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      rhost = "::1";
+      targv[targc] = targv[targc+1] = targv[targc+2] = NULL;
+      set_time(10000 * 30);
+      response = old_response;
+    }
+
+    // Test merging the changes of concurrent logins
+    if (otp_mode == 0) {
+      puts("Testing update_retries option");
+      const char *(*module_error_msg)(void) =
+        (const char *(*)(void))dlsym(pam_module, "get_error_msg");
+      void (*reset_error_msg)(void) =
+        (void (*)(void))dlsym(pam_module, "reset_error_msg");
+      char buf[7];
+      response = buf;
+      char versions[4][sizeof(secret) + 128];
+      static const char *states[] = {
+        "\n\" TOTP_AUTH\n\" DISALLOW_REUSE\n\" RATE_LIMIT 3 30\n",
+        "\n\" TOTP_AUTH\n\" DISALLOW_REUSE\n\" RATE_LIMIT 3 30 359990\n",
+        "\n\" TOTP_AUTH\n\" DISALLOW_REUSE\n"
+        "\" RATE_LIMIT 3 30 359990 359995\n",
+        "\n\" TOTP_AUTH\n\" DISALLOW_REUSE 12001\n",
+      };
+      for (int i = 0; i < 4; ++i) {
+        snprintf(versions[i], sizeof(versions[i]), "%s%s", secret, states[i]);
+      }
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, versions[0], strlen(versions[0])) ==
+             strlen(versions[0]));
+      close(fd);
+      for (int i = 0; i < 3; ++i) {
+        // Without retries, the concurrent change fails the login. With
+        // retries, it is merged, unless it used up the same code.
+        const int tm = 12000 + (i == 2);
+        set_time(tm * 30);
+        sprintf(response, "%06d",
+                compute_code(binary_secret, binary_secret_len, tm));
+        targv[targc] = i ? "update_retries=2" : NULL;
+        concurrent_fn = fn;
+        concurrent_data = versions[i + 1];
+        reset_error_msg();
+        assert(pam_sm_authenticate(NULL, 0, targc+!!i, targv) ==
+               (i == 1 ? PAM_SUCCESS : PAM_AUTH_ERR));
+        verify_prompts_shown(expected_good_prompts_shown);
+        assert(!concurrent_fn);
+        assert((fd = open(fn, O_RDONLY)) >= 0);
+        memset(state_file_buf, 0, sizeof(state_file_buf));
+        assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+        close(fd);
+        switch (i) {
+        case 0:
+          assert(!strcmp(state_file_buf, versions[1]));
+          break;
+        case 1:
+          assert(strstr(state_file_buf,
+                        "\" RATE_LIMIT 3 30 359990 359995 360000\n"));
+          assert(strstr(state_file_buf, "\" DISALLOW_REUSE 12000\n"));
+          break;
+        case 2:
+          assert(strstr(module_error_msg(), "Trying to reuse"));
+          break;
+        }
+      }
+      reset_error_msg();
+      targv[targc] = NULL;
+      set_time(10000 * 30);
+      response = old_response;
+    }
+
+    // Test handing verification to google-authenticatord
+    if (otp_mode == 0) {
+      puts("Testing daemon option");
+      const char *(*module_error_msg)(void) =
+        (const char *(*)(void))dlsym(pam_module, "get_error_msg");
+      void (*reset_error_msg)(void) =
+        (void (*)(void))dlsym(pam_module, "reset_error_msg");
+      char dir[] = "/tmp/.google_authenticator_daemon_XXXXXX";
+      assert(mkdtemp(dir));
+      char socket_fn[sizeof(dir) + 8], daemon_arg[sizeof(dir) + 16];
+      snprintf(socket_fn, sizeof(socket_fn), "%s/socket", dir);
+      snprintf(daemon_arg, sizeof(daemon_arg), "daemon=%s", socket_fn);
+      char journal_fn[sizeof(fn) + 8];
+      snprintf(journal_fn, sizeof(journal_fn), "%s.journal", fn);
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
+      assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+      assert(write(fd, "\n\" TOTP_AUTH\n", 13) == 13);
+      close(fd);
+      assert(!chmod(fn, 0400));
+
+      const pid_t pid = fork();
+      assert(pid >= 0);
+      if (!pid) {
+        execl("./google-authenticatord", "google-authenticatord",
+              "-s", socket_fn, (char *)NULL);
+        _exit(1);
+      }
+      struct sockaddr_un sun = { .sun_family = AF_UNIX };
+      strcpy(sun.sun_path, socket_fn);
+      for (int i = 0; ; ++i) {
+        assert(i < 500);
+        const int conn = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        assert(conn >= 0);
+        const int err = connect(conn, (struct sockaddr *)&sun, sizeof(sun));
+        close(conn);
+        if (!err) {
+          break;
+        }
+        usleep(10000);
+      }
+
+      // The daemon runs on the real clock, whereas the module in this
+      // process uses the fake one. Only the daemon accepts this code.
+      char buf[7];
+      response = buf;
+      sprintf(response, "%06d", compute_code(binary_secret, binary_secret_len,
+                                             time(NULL) / 30));
+      targv[targc] = daemon_arg;
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      response = "123456";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+
+      // With forward_pass, the daemon splits off the password, and returns
+      // it for the next module. pam_set_item() only accepts "pw".
+      conv_mode = COMBINED_PROMPT;
+      response = buf;
+      targv[targc+1] = "forward_pass";
+      assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_SUCCESS);
+      verify_prompts_shown(1);
+      conv_mode = TWO_PROMPTS;
+
+      // The daemon journals the login history, instead of rewriting the
+      // secret file.
+      struct stat orig_sb, sb;
+      assert(!stat(fn, &orig_sb));
+      targv[targc+1] = "grace_period=3600";
+      assert(pam_sm_authenticate(NULL, 0, targc+2, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(!stat(fn, &sb));
+      assert(sb.st_ino == orig_sb.st_ino);
+      assert(!access(journal_fn, F_OK));
+      targv[targc+1] = NULL;
+
+      // Without a daemon, the module verifies the code itself.
+      assert(!kill(pid, SIGTERM));
+      assert(waitpid(pid, NULL, 0) == pid);
+      unlink(socket_fn);
+      assert(!rmdir(dir));
+      reset_error_msg();
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      assert(strstr(module_error_msg(), "Failed to connect"));
+      response = "050548";
+      assert(pam_sm_authenticate(NULL, 0, targc+1, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      reset_error_msg();
+      unlink(journal_fn);
+      targv[targc] = NULL;
+      response = old_response;
+    }
+
     // Set up secret file for counter-based codes.
     assert(!chmod(fn, 0600));
     assert((fd = open(fn, O_TRUNC | O_WRONLY)) >= 0);
@@ -613,6 +1603,131 @@ int main(int argc, char *argv[]) {
     assert(hotp_counter);
     assert(!memcmp(hotp_counter + 15, "6\n", 2));
 
+    // Check that large windows find codes that are far ahead.
+    if (otp_mode == 0) {
+      puts("Testing large counter-based window");
+      assert(!chmod(fn, 0600));
+      assert((fd = open(fn, O_APPEND | O_WRONLY)) >= 0);
+      assert(write(fd, "\" WINDOW_SIZE 100\n", 18) == 18);
+      close(fd);
+      char buf[7];
+      char *old_response = response;
+      response = buf;
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 6 + 90));
+      assert(pam_sm_authenticate(NULL, 0, targc, targv) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert((fd = open(fn, O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      hotp_counter = strstr(state_file_buf, "\" HOTP_COUNTER ");
+      assert(hotp_counter);
+      assert(!memcmp(hotp_counter + 15, "97\n", 3));
+      response = old_response;
+    }
+
+    // Test sharing the used codes and the HOTP counter between two hosts
+    if (otp_mode == 0) {
+      puts("Testing state_store option");
+      char dir[] = "/tmp/.google_authenticator_state_XXXXXX";
+      assert(mkdtemp(dir));
+      char sock_fn[sizeof(dir) + 8], host_fn[2][sizeof(dir) + 8];
+      char store_arg[sizeof(dir) + 28], secret_arg[2][sizeof(host_fn[0]) + 8];
+      snprintf(sock_fn, sizeof(sock_fn), "%s/socket", dir);
+      snprintf(store_arg, sizeof(store_arg), "state_store=redis:%s", sock_fn);
+      const char *host_argv[2][3];
+      for (int i = 0; i < 2; ++i) {
+        snprintf(host_fn[i], sizeof(host_fn[i]), "%s/host%d", dir, i);
+        snprintf(secret_arg[i], sizeof(secret_arg[i]), "secret=%s",
+                 host_fn[i]);
+        host_argv[i][0] = secret_arg[i];
+        host_argv[i][1] = store_arg;
+        host_argv[i][2] = "state_store_fallback=deny";
+      }
+      start_fake_redis(sock_fn);
+
+      // A time-based code that one host accepted cannot be replayed on the
+      // other one, and neither of them rewrites its secret file.
+      static const char totp[] = "\n\" TOTP_AUTH\n\" DISALLOW_REUSE\n";
+      for (int i = 0; i < 2; ++i) {
+        assert((fd = open(host_fn[i], O_CREAT | O_WRONLY, 0600)) >= 0);
+        assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+        assert(write(fd, totp, sizeof(totp)-1) == sizeof(totp)-1);
+        close(fd);
+      }
+      char buf[7];
+      char *old_response = response;
+      response = buf;
+      set_time(50000 * 30);
+      sprintf(response, "%06d",
+              compute_code(binary_secret, binary_secret_len, 50000));
+      assert(pam_sm_authenticate(NULL, 0, 2, host_argv[0]) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(pam_sm_authenticate(NULL, 0, 2, host_argv[1]) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+      for (int i = 0; i < 2; ++i) {
+        assert((fd = open(host_fn[i], O_RDONLY)) >= 0);
+        memset(state_file_buf, 0, sizeof(state_file_buf));
+        assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+        close(fd);
+        assert(strstr(state_file_buf, "\" DISALLOW_REUSE\n"));
+      }
+
+      // A counter value can only be used once, no matter on which host.
+      static const char hotp[] = "\n\" HOTP_COUNTER 1\n";
+      for (int i = 0; i < 2; ++i) {
+        assert(!unlink(host_fn[i]));
+        assert((fd = open(host_fn[i], O_CREAT | O_WRONLY, 0600)) >= 0);
+        assert(write(fd, secret, sizeof(secret)-1) == sizeof(secret)-1);
+        assert(write(fd, hotp, sizeof(hotp)-1) == sizeof(hotp)-1);
+        close(fd);
+      }
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 1));
+      assert(pam_sm_authenticate(NULL, 0, 2, host_argv[0]) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert(pam_sm_authenticate(NULL, 0, 2, host_argv[1]) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+
+      // A host that fell behind by more than the window catches up.
+      assert(!chmod(host_fn[0], 0600));
+      assert((fd = open(host_fn[0], O_APPEND | O_WRONLY)) >= 0);
+      assert(write(fd, "\" WINDOW_SIZE 20\n", 17) == 17);
+      close(fd);
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 10));
+      assert(pam_sm_authenticate(NULL, 0, 2, host_argv[0]) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 11));
+      assert(pam_sm_authenticate(NULL, 0, 2, host_argv[1]) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      assert((fd = open(host_fn[1], O_RDONLY)) >= 0);
+      memset(state_file_buf, 0, sizeof(state_file_buf));
+      assert(read(fd, state_file_buf, sizeof(state_file_buf)-1) > 0);
+      close(fd);
+      assert(strstr(state_file_buf, "\" HOTP_COUNTER 12\n"));
+
+      // Without the server, the secret file has the final say, unless the
+      // store is told to deny logins instead.
+      stop_fake_redis(sock_fn);
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 12));
+      assert(pam_sm_authenticate(NULL, 0, 2, host_argv[1]) == PAM_SUCCESS);
+      verify_prompts_shown(expected_good_prompts_shown);
+      sprintf(response, "%06d", compute_code(binary_secret,
+                                             binary_secret_len, 13));
+      assert(pam_sm_authenticate(NULL, 0, 3, host_argv[1]) == PAM_AUTH_ERR);
+      verify_prompts_shown(expected_bad_prompts_shown);
+
+      for (int i = 0; i < 2; ++i) {
+        unlink(host_fn[i]);
+      }
+      rmdir(dir);
+      response = old_response;
+    }
+
     // Remove the temporarily created secret file
     unlink(fn);
 